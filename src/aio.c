@@ -24,6 +24,7 @@
 #include <inttypes.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "kio.h"
 #include "ktli.h"
@@ -31,6 +32,10 @@
 #include "kinetic_internal.h"
 #include "protocol_interface.h"
 
+#define KI_CBBATCH	32	/* KIOs a completion thread reaps at once */
+#define KI_CBWAIT	100000	/* Reap wait in us, bounds ki_aio_callback */
+#define KI_CBMAXTHR	64
+
 kstatus_t g_get_aio_complete(int ktd,   struct kio *kio, void **cctx);
 kstatus_t p_put_aio_complete(int ktd,   struct kio *kio, void **cctx);
 kstatus_t d_del_aio_complete(int ktd,   struct kio *kio, void **cctx);
@@ -88,8 +93,217 @@ ki_aio_complete(int ktd, kio_t *ckio, void **cctx)
 	return(ks);
 }
 
+/**
+ * ki_aio_reap(int ktd, kio_t **kio, int max, int timeout)
+ *
+ * Collects up to max completed aio requests, whichever they are, in the
+ * order they completed. Requests made through the synchronous calls are
+ * never collected. Waits up to timeout micro seconds for the first
+ * one, 0 does not wait and less than 0 waits forever. Each returned kio
+ * must still be passed to ki_aio_complete to get its status and results
+ * and to release it, which will not block. ki_aio_cctx gives the caller
+ * context of a returned kio, for finding what it was issued for.
+ * Returns the number of kios collected, 0 if none completed in time, or
+ * -1 on error.
+ *
+ * @param ktd     A connected kinetic session descriptor.
+ * @param kio     An ARRAY[] of at least max kio PTRs, filled from the front.
+ * @param max     Maximum number of kios to collect.
+ * @param timeout Micro seconds to wait for the first completion.
+ */
+int
+ki_aio_reap(int ktd, kio_t **ckio, int max, int timeout)
+{
+	int n;
+
+	n = ktli_reap(ktd, (struct kio **)ckio, max, timeout);
+	if (n < 0)
+		debug_printf("aio_reap: ktli reap failed\n");
+
+	return(n);
+}
+
+/**
+ * ki_aio_cctx(kio_t *kio)
+ *
+ * Returns the caller context an aio request was issued with.
+ *
+ * @param kio  A kio returned by one of the ki_aio_* calls.
+ */
+void *
+ki_aio_cctx(kio_t *ckio)
+{
+	struct kio *kio = (struct kio *)ckio;
+
+	if (!kio || (kio->kio_magic != KIO_MAGIC))
+		return(NULL);
+
+	return(kio->kio_cctx);
+}
+
+/*
+ * Completion thread, reaps completed aio requests, completes them and
+ * hands the result to the caller's callback. Runs until told to stop or
+ * until the session goes away.
+ */
+static void *
+ki_aio_cbthread(void *p)
+{
+	kcbpool_t *cp = (kcbpool_t *)p;
+	kio_t *kio[KI_CBBATCH];
+	kstatus_t ks;
+	void *cctx;
+	int i, n;
+
+	while (!__atomic_load_n(&cp->kcp_stop, __ATOMIC_ACQUIRE)) {
+		n = ki_aio_reap(cp->kcp_ktd, kio, KI_CBBATCH, KI_CBWAIT);
+		if (n < 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			/* complete releases the KIO, get the cctx first */
+			cctx = ki_aio_cctx(kio[i]);
+			ks = ki_aio_complete(cp->kcp_ktd, kio[i], NULL);
+			cp->kcp_cb(cp->kcp_ktd, ks, cctx);
+		}
+	}
+
+	return(NULL);
+}
+
+/* Retire a completion thread pool, the first n threads were started */
+static void
+ki_aio_cbstop(kcbpool_t *cp, int n)
+{
+	int i;
+
+	__atomic_store_n(&cp->kcp_stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n; i++)
+		pthread_join(cp->kcp_tid[i], NULL);
+	KI_FREE(cp);
+}
+
+/**
+ * ki_aio_callback(int ktd, kaio_cb_t cb, int nthreads)
+ *
+ * Switches the session to callback completion. nthreads library owned
+ * completion threads collect completed aio requests as ki_aio_reap does,
+ * complete them as ki_aio_complete does and call cb with the status and
+ * the caller context of each. So response decoding runs on nthreads
+ * cores rather than in the caller's own poll loop. Callbacks run
+ * concurrently and must not block for long, they may issue new aio
+ * requests. A request completed by callback must not be passed to
+ * ki_aio_complete again. Synchronous calls are unaffected.
+ *
+ * Calling again replaces the threads, a NULL cb or 0 nthreads stops
+ * them. Either waits up to KI_CBWAIT us for running callbacks to return
+ * and must not be called from a callback or concurrently for the same
+ * session. Stop the threads before closing the session.
+ *
+ * @param ktd      A connected kinetic session descriptor.
+ * @param cb       Completion callback, NULL to stop callback completion.
+ * @param nthreads Number of completion threads, 1 to KI_CBMAXTHR.
+ */
+kstatus_t
+ki_aio_callback(int ktd, kaio_cb_t cb, int nthreads)
+{
+	int rc, n;
+	ksession_t *ses;		/* KTLI Session info */
+	kcbpool_t *cp;			/* The new pool */
+	struct ktli_config *cf;		/* KTLI configuration info */
+
+	if (cb && (nthreads < 0 || nthreads > KI_CBMAXTHR)) {
+		debug_printf("aio_callback: bad thread count\n");
+		return(K_EINVAL);
+	}
+
+	rc = ktli_config(ktd, &cf);
+	if (rc < 0) {
+		debug_printf("aio_callback: ktli config\n");
+		return(K_EBADSESS);
+	}
+	ses = (ksession_t *) cf->kcfg_pconf;
+
+	/* Retire the current threads, if any */
+	if (ses->ks_cbp) {
+		ki_aio_cbstop(ses->ks_cbp, ses->ks_cbp->kcp_nthr);
+		ses->ks_cbp = NULL;
+	}
+
+	if (!cb || !nthreads)
+		return(K_OK);
+
+	cp = (kcbpool_t *)KI_MALLOC(sizeof(kcbpool_t) +
+				    nthreads * sizeof(pthread_t));
+	if (!cp) {
+		debug_printf("aio_callback: pool alloc\n");
+		return(K_ENOMEM);
+	}
+	cp->kcp_ktd  = ktd;
+	cp->kcp_cb   = cb;
+	cp->kcp_stop = 0;
+	cp->kcp_nthr = nthreads;
+
+	for (n = 0; n < nthreads; n++) {
+		if (pthread_create(&cp->kcp_tid[n], NULL,
+				   ki_aio_cbthread, cp)) {
+			debug_printf("aio_callback: thread create\n");
+			ki_aio_cbstop(cp, n);
+			return(K_EINTERNAL);
+		}
+	}
+
+	ses->ks_cbp = cp;
+	return(K_OK);
+}
+
+/**
+ * ki_aio_settimeout(int ktd, kio_t *kio, uint32_t ms)
+ *
+ * Sets how long to wait for the response to an outstanding aio request
+ * before completing it with K_ETIMEDOUT, overriding the session default.
+ * The deadline is ms from this call, or from when the request is sent if
+ * it is still queued. Has no effect on a request that already completed.
+ *
+ * @param ktd  A connected kinetic session descriptor.
+ * @param kio  A kio returned by one of the ki_aio_* calls.
+ * @param ms   Timeout in milliseconds, 0 restores the default.
+ */
+kstatus_t
+ki_aio_settimeout(int ktd, kio_t *ckio, uint32_t ms)
+{
+	struct kio *kio = (struct kio *)ckio;
+
+	if (!kio)
+		return(K_EINVAL);
+
+	if (ktli_settimeout(ktd, kio, ms) < 0) {
+		debug_printf("aio_settimeout: ktli settimeout failed\n");
+		return(K_EBADSESS);
+	}
+
+	return(K_OK);
+}
+
 int
 ki_poll(int ktd, int timeout)
 {
 	return(ktli_poll(ktd, timeout));
 }
+
+/**
+ * ki_pollfd(int ktd)
+ *
+ * Returns a file descriptor that is readable while the session has
+ * completed aio requests waiting for ki_aio_complete, so that sessions
+ * can be added to an existing poll(2) or epoll(7) loop. The descriptor
+ * belongs to the session and is closed by ki_close, do not read from or
+ * close it. Returns -1 on error.
+ *
+ * @param ktd  A connected kinetic session descriptor.
+ */
+int
+ki_pollfd(int ktd)
+{
+	return(ktli_pollfd(ktd));
+}
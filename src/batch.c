@@ -83,7 +83,7 @@ b_atom_inc(uint32_t *p, uint32_t *v, int32_t i)
 
 kstatus_t
 b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
-		    void *cctx, kio_t **ckio)
+		    int aio, void *cctx, kio_t **ckio)
 {
 	int rc, n;			/* return code, temps */
 	kstatus_t krc;			/* Kinetic return code */
@@ -93,8 +93,7 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	kmsghdr_t msg_hdr;		/* Unpacked message header */
 	kcmdhdr_t cmd_hdr;		/* Unpacked Command header */
 	struct ktli_config *cf;		/* KTLI configuration info */
-	struct kresult_message kmreq;	/* Intermediate resp representation */
-	kpdu_t pdu;			/* Unpacked PDU structure */
+	int kts;			/* KTLI session to send on */
 
 	if (!ckio) {
 		debug_printf("batch: kio ptr required");
@@ -151,6 +150,7 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 		kb->kb_ops   = 0;
 		kb->kb_dels  = 0;
 		kb->kb_bytes = 0;
+		kb->kb_conn  = -1;
 		pthread_mutex_init(&kb->kb_m, NULL);
 
 #ifdef KBATCH_SEQTRACKING
@@ -190,11 +190,6 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * be used later on to calculate the actual HMAC which will then
 	 * replace the HMAC key on the kmh_hmac field.
-	 *
-	 * A reference is made to the kcfg_hkey ptr in the kmreq. This
-	 * reference needs to be removed before destroying kmreq.  The
-	 * protobuf code will try to clean up this ptr which is an outside
-	 * unfreeable ptr.  See below at bex_kmreq:
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -205,20 +200,22 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type = msg_type;
 
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, kb, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
+
 	/* Set the command batchid before creating the mesg */
 	cmd_hdr.kch_bid = kb->kb_bid;
 
-	kmreq = create_batch_message(&msg_hdr, &cmd_hdr, kb->kb_ops);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("batch: request message create");
-		krc = K_EINTERNAL;
-		goto bex_kio;
-	}
-
 	/* Setup the KIO */
 	kio->kio_magic	= KIO_MAGIC;
 	kio->kio_cmd	= msg_type;
+	kio->kio_pri	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
+	if (aio)
+		KIOF_SET(kio, KIOF_REAP);	/* ki_aio_reap may take it */
 	KIOF_SET(kio, KIOF_REQRESP); // Normal RPC
 
 	kio->kio_ckb	= kb;		/* Hang the callers kb, if any */
@@ -236,43 +233,23 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("batch: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto bex_kmreq;
-	}
-
-	/* Hang the PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
-
-	if (!kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base) {
-		debug_printf("batch: sendmesg PDU alloc");
-		krc = K_ENOMEM;
-		goto bex_kmmsg;
+		goto bex_kio;
 	}
 
-	/* pack the message and hang it on the kio */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("batch: sendmesg msg pack");
+	/*
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_batch(cf, kio, &msg_hdr, &cmd_hdr, kb->kb_ops) < 0) {
+		debug_printf("batch: request encode");
 		krc = K_EINTERNAL;
-		goto bex_kmmsg_pdu;
+		goto bex_kmmsg;
 	}
-
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-	PACK_PDU(&pdu,  (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	debug_printf("batch: PDU(x%2x, %d, %d)\n",
-		     pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
+	debug_printf("batch: PDU(x%2x, %lu, 0)\n",
+		     KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	/* Send the request */
-	if (ktli_send(ktd, kio) < 0) {
+	if (ktli_send(kts, kio) < 0) {
 		debug_printf("batch: kio send");
 		krc = K_EINTERNAL;
 		goto bex_kmmsg_msg;
@@ -282,20 +259,9 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	/*
 	 * Successful Exit.
 	 * Return the kio.
-	 * Cleanup before return, the only thing that needs to go
-	 * is the unpacked protobuf request message kmreq.
-	 *
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
 	 */
 	*ckio = kio;
 
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
-
 	return(K_OK);
 
 	/* Error Exit. */
@@ -305,25 +271,11 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 	 */
 
  bex_kmmsg_msg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-
- bex_kmmsg_pdu:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
  bex_kmmsg:
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
- bex_kmreq:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len  = 0;
-
-	destroy_message(kmreq.result_message);
-
  bex_kio:
 	kio->kio_magic = 0; /* clear the kio magic  in case this lives on */
 	KI_FREE(kio);
@@ -353,7 +305,7 @@ b_batch_aio_generic(int ktd, kb_t *kb, kmtype_t msg_type,
 kstatus_t
 b_batch_aio_complete(int ktd, struct kio *kio, void **cctx)
 {
-	int rc, i;			/* return code, temps */
+	int rc;				/* return code */
 	uint32_t batcnt;		/* Temp batch count */
 	kb_t *kb;			/* Set to KB passed in orig aio call */
 	kpdu_t pdu;			/* Unpacked PDU Structure */
@@ -441,8 +393,7 @@ b_batch_aio_complete(int ktd, struct kio *kio, void **cctx)
 	}
 
 	/* Now unpack the message */
-	kmresp = unpack_kinetic_message(kiov[KIOV_MSG].kiov_base,
-					kiov[KIOV_MSG].kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("batch: msg unpack");
 		krc = K_EINTERNAL;
@@ -520,20 +471,14 @@ b_batch_aio_complete(int ktd, struct kio *kio, void **cctx)
 
 
 	/* clean up */
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  bex:
 	/* depending on errors the recvmsg may or may not exist */
-	if (kio->kio_recvmsg.km_msg) {
-		for (i=0; i < kio->kio_recvmsg.km_cnt; i++) {
-			KI_FREE(kio->kio_recvmsg.km_msg[i].kiov_base);
-		}
-		KI_FREE(kio->kio_recvmsg.km_msg);
-	}
+	ktli_recvmsg_free(kio, 0);
 
 	/* sendmsg always exists here but doesn't have a PDU_VAL */
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
 	memset(kio, 0, sizeof(struct kio));
@@ -549,7 +494,7 @@ b_batch_generic(int ktd, kb_t *kb, kmtype_t msg_type)
 	kstatus_t ks;
 	kio_t *kio;
 
-	ks = b_batch_aio_generic(ktd, kb, msg_type, NULL, &kio);
+	ks = b_batch_aio_generic(ktd, kb, msg_type, 0, NULL, &kio);
 	if (ks != K_OK) {
 		return(ks);
 	}
@@ -614,7 +559,7 @@ b_startbatch(int ktd, kbatch_t *kb)
 kstatus_t
 ki_aio_submitbatch(int ktd, kbatch_t *kb, void *cctx, kio_t **kio)
 {
-	return (b_batch_aio_generic(ktd, (kb_t *)kb, KMT_ENDBAT, cctx, kio));
+	return (b_batch_aio_generic(ktd, (kb_t *)kb, KMT_ENDBAT, 1, cctx, kio));
 }
 
 
@@ -636,7 +581,7 @@ ki_submitbatch(int ktd, kbatch_t *kb)
 kstatus_t
 ki_aio_abortbatch(int ktd, kbatch_t *kb,void *cctx, kio_t **kio)
 {
-	return (b_batch_aio_generic(ktd, (kb_t *)kb, KMT_ABORTBAT, cctx, kio));
+	return (b_batch_aio_generic(ktd, (kb_t *)kb, KMT_ABORTBAT, 1, cctx, kio));
 }
 
 
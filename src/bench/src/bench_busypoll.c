@@ -0,0 +1,265 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Busy poll latency microbenchmark.
+ *
+ * Runs a full KTLI session against an echo thread on a loopback TCP
+ * socket and times one request at a time, send to ktli_poll() and
+ * ktli_receive(). The session PDU is a bare 8 byte header, message and
+ * value lengths, and an 8 byte message holding the sequence number, which
+ * the echo thread sends straight back as the response. Run once in the
+ * default mode, where the receiver and the waiter sleep, and once with
+ * KCFF_BUSYPOLL, pinning the sender and receiver threads when CPUs are
+ * given. Reports round trip percentiles in microseconds. Busy polling
+ * gives a core each to the spinning receiver and waiter, with fewer than
+ * three CPUs they fight the echo thread and it loses. No server is
+ * needed.
+ *
+ * Usage: bench_busypoll [requests [sendcpu recvcpu]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "ktli.h"
+
+#define BENCH_REQS	50000
+#define BENCH_WARM	1000	/* Untimed requests first */
+#define BENCH_HDRLEN	8
+#define BENCH_MSGLEN	8
+
+/* Echo thread, reads a request and writes it back as the response */
+static int
+bench_readn(int fd, void *buf, int len)
+{
+	int n, got = 0;
+
+	while (got < len) {
+		n = read(fd, (char *)buf + got, len - got);
+		if (n <= 0)
+			return(-1);
+		got += n;
+	}
+	return(got);
+}
+
+static void *
+bench_echo(void *p)
+{
+	int lfd = *(int *)p, fd, on = 1;
+	char buf[BENCH_HDRLEN + BENCH_MSGLEN];
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0)
+		return(NULL);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	while (bench_readn(fd, buf, sizeof(buf)) == sizeof(buf))
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			break;
+	close(fd);
+	return(NULL);
+}
+
+/* Session helpers for the bench PDU */
+static uint64_t
+bench_getaseq(struct kiovec *msg, int msgcnt, struct kio_rscan *rs)
+{
+	uint64_t seq;
+
+	memcpy(&seq, msg[1].kiov_base, sizeof(seq));
+	return(seq);
+}
+
+static void
+bench_setseq(struct kiovec *msg, int msgcnt, uint64_t seq)
+{
+	memcpy(msg[1].kiov_base, &seq, sizeof(seq));
+}
+
+static int32_t
+bench_msglen(struct kiovec *hdr)
+{
+	uint32_t len;
+
+	memcpy(&len, hdr->kiov_base, sizeof(len));
+	return(len);
+}
+
+static int32_t
+bench_vallen(struct kiovec *hdr)
+{
+	uint32_t len;
+
+	memcpy(&len, (char *)hdr->kiov_base + 4, sizeof(len));
+	return(len);
+}
+
+static struct ktli_helpers bench_kh = {
+	.kh_recvhdr_len	= BENCH_HDRLEN,
+	.kh_getaseq_fn	= bench_getaseq,
+	.kh_setseq_fn	= bench_setseq,
+	.kh_msglen_fn	= bench_msglen,
+	.kh_vallen_fn	= bench_vallen,
+};
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return((x > y) - (x < y));
+}
+
+/* Fills lat with reqs round trip times, in us */
+static void
+bench_run(struct ktli_config *cf, double *lat, long reqs)
+{
+	static uint32_t hdr[2] = { BENCH_MSGLEN, 0 };
+	static char msg[BENCH_MSGLEN];
+	struct kiovec iov[2];
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	struct timespec s, e;
+	struct kio kio;
+	pthread_t tid;
+	char port[16];
+	int lfd, kts;
+	long i;
+
+	/* Loopback listener on an ephemeral port */
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&sa, &salen)) {
+		perror("listen");
+		exit(1);
+	}
+	snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+	pthread_create(&tid, NULL, bench_echo, &lfd);
+
+	cf->kcfg_host = "127.0.0.1";
+	cf->kcfg_port = port;
+	kts = ktli_open(KTLI_DRIVER_SOCKET, cf, &bench_kh);
+	if (kts < 0 || ktli_connect(kts) < 0) {
+		perror("ktli");
+		exit(1);
+	}
+
+	iov[0].kiov_base = hdr;
+	iov[0].kiov_len  = BENCH_HDRLEN;
+	iov[1].kiov_base = msg;
+	iov[1].kiov_len  = BENCH_MSGLEN;
+
+	for (i = -BENCH_WARM; i < reqs; i++) {
+		memset(&kio, 0, sizeof(kio));
+		kio.kio_magic = KIO_MAGIC;
+		kio.kio_flags = KIOF_REQRESP;
+		kio.kio_sendmsg.km_msg = iov;
+		kio.kio_sendmsg.km_cnt = 2;
+
+		clock_gettime(CLOCK_MONOTONIC, &s);
+		if (ktli_send(kts, &kio) < 0) {
+			perror("ktli_send");
+			exit(1);
+		}
+		while (ktli_receive(kts, &kio) < 0) {
+			if (errno != ENOENT) {
+				perror("ktli_receive");
+				exit(1);
+			}
+			if (ktli_poll(kts, 0) < 0 && errno != ETIMEDOUT) {
+				perror("ktli_poll");
+				exit(1);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &e);
+
+		if (i >= 0)
+			lat[i] = (e.tv_sec - s.tv_sec) * 1e6 +
+				(e.tv_nsec - s.tv_nsec) / 1e3;
+		ktli_recvmsg_free(&kio, 0);
+	}
+
+	ktli_disconnect(kts);
+	ktli_close(kts);
+	pthread_join(tid, NULL);
+	close(lfd);
+
+	qsort(lat, reqs, sizeof(*lat), bench_cmp);
+}
+
+static void
+bench_report(const char *mode, double *lat, long reqs)
+{
+	printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", mode,
+	       lat[reqs / 2], lat[reqs * 99 / 100], lat[reqs * 999 / 1000],
+	       lat[reqs - 1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ktli_config cf;
+	long reqs = BENCH_REQS;
+	double *lat;
+
+	if (argc > 1)
+		reqs = atol(argv[1]);
+	if (reqs < 1)
+		reqs = 1;
+
+	lat = malloc(reqs * sizeof(*lat));
+	if (!lat) {
+		perror("malloc");
+		return(1);
+	}
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 3)
+		printf("Note: fewer than 3 CPUs, busy poll will lose\n");
+
+	printf("%-10s %10s %10s %10s %10s\n",
+	       "mode", "p50 us", "p99 us", "p99.9 us", "max us");
+
+	memset(&cf, 0, sizeof(cf));
+	bench_run(&cf, lat, reqs);
+	bench_report("default", lat, reqs);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.kcfg_flags = KCFF_BUSYPOLL;
+	if (argc > 3) {
+		cf.kcfg_flags |= KCFF_PINCPU;
+		cf.kcfg_sendcpu = atoi(argv[2]);
+		cf.kcfg_recvcpu = atoi(argv[3]);
+	}
+	bench_run(&cf, lat, reqs);
+	bench_report(argc > 3 ? "busy,pin" : "busy", lat, reqs);
+
+	free(lat);
+	return(0);
+}
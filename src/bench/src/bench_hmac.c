@@ -0,0 +1,192 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Request HMAC microbenchmark.
+ *
+ * Encodes GET requests with a reserved seq slot for keys of 16 bytes up to
+ * the 4KiB Kinetic maximum, and measures the CPU per op spent on the HMAC
+ * against the size of the command bytes:
+ *	new    - HMAC_CTX_new(), key, digest, HMAC_CTX_free(), as
+ *		 compute_hmac() used to
+ *	rekey  - ki_stampseq() without a pre-keyed session, the thread's
+ *		 context is keyed from the HMAC key per op
+ *	prekey - ki_stampseq() with the session key pre-keyed by
+ *		 ki_hmac_prekey(), the keyed state is copied per op
+ * All digest the same bytes. No server is needed.
+ *
+ * Usage: bench_hmac [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include "kio.h"
+#include "ktli.h"
+#include "kinetic.h"
+#include "kinetic_internal.h"
+#include "protocol_interface.h"
+
+#define BENCH_ITERS	500000
+#define BENCH_HKEY	"asdfasdf"
+#define BENCH_MAXKEY	4096
+
+/* Encode a GET for a klen byte key on kio, with a reserved seq slot */
+static int
+bench_build(struct ktli_config *cf, struct kio *kio, struct kiovec *msgv,
+	    char *kbuf, size_t klen)
+{
+	kmsghdr_t mh;
+	kcmdhdr_t ch;
+	kv_t kv;
+	struct kiovec key;
+
+	key.kiov_base = kbuf;
+	key.kiov_len  = klen;
+
+	memset(&kv, 0, sizeof(kv));
+	kv.kv_key    = &key;
+	kv.kv_keycnt = 1;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.kmh_atype = KAT_HMAC;
+	mh.kmh_id    = cf->kcfg_id;
+	mh.kmh_hmac  = cf->kcfg_hkey;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.kch_connid = 1171500672;
+	ch.kch_type   = KMT_GET;
+	ch.kch_pri    = NORMAL;
+
+	ki_seqslot_reserve(cf, &mh, &ch);
+
+	memset(kio, 0, sizeof(struct kio));
+	kio->kio_magic = KIO_MAGIC;
+	kio->kio_cmd   = KMT_GET;
+	kio->kio_sendmsg.km_cnt = KM_CNT_NOVAL;
+	kio->kio_sendmsg.km_msg = msgv;
+
+	if (ki_encode_kv(cf, kio, &mh, &ch, &kv, 0) < 0)
+		return(-1);
+	return(KIOF_ISSET(kio, KIOF_SEQSLOT) ? 0 : -1);
+}
+
+/* HMAC the command bytes with a context of its own, per op */
+static int
+bench_new(struct kio *kio)
+{
+	struct kio_seqslot *ss = &kio->kio_ss;
+	uint8_t *msg = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base;
+	uint32_t cmdlen_be = htonl(ss->kss_cmdlen);
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned int dlen;
+	HMAC_CTX *hctx;
+	int rc;
+
+	if (!(hctx = HMAC_CTX_new()))
+		return(-1);
+	rc = HMAC_Init_ex(hctx, ss->kss_hkey, ss->kss_hkeylen,
+			  EVP_sha1(), NULL) &&
+	     HMAC_Update(hctx, (unsigned char *)&cmdlen_be, sizeof(uint32_t)) &&
+	     HMAC_Update(hctx, msg + ss->kss_cmdoff, ss->kss_cmdlen) &&
+	     HMAC_Final(hctx, digest, &dlen);
+	HMAC_CTX_free(hctx);
+	return(rc ? 0 : -1);
+}
+
+static double
+bench_elapsed(struct timespec *s, struct timespec *e)
+{
+	return((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static size_t klens[] = { 16, 256, 1024, 2048, BENCH_MAXKEY };
+	static char kbuf[BENCH_MAXKEY];
+	struct kiovec msgv[KM_CNT_NOVAL];
+	struct ktli_config cf;
+	struct timespec s, e;
+	struct kio kio;
+	double nns, rns, pns;
+	long i, iters = BENCH_ITERS;
+	size_t k;
+
+	if (argc > 1)
+		iters = atol(argv[1]);
+	if (iters <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return(1);
+	}
+
+	memset(kbuf, 'k', sizeof(kbuf));
+
+	memset(&cf, 0, sizeof(cf));
+	cf.kcfg_id    = 1;
+	cf.kcfg_hkey  = BENCH_HKEY;
+	cf.kcfg_flags = KCFF_SEQSLOT;
+	cf.kcfg_hctx  = ki_hmac_prekey(cf.kcfg_hkey, strlen(cf.kcfg_hkey));
+	if (!cf.kcfg_hctx) {
+		fprintf(stderr, "failed to pre-key HMAC\n");
+		return(1);
+	}
+
+	printf("%-6s %7s %10s %10s %10s %8s\n",
+	       "keylen", "cmdlen", "new ns", "rekey ns", "prekey ns", "speedup");
+
+	for (k = 0; k < sizeof(klens) / sizeof(klens[0]); k++) {
+		if (bench_build(&cf, &kio, msgv, kbuf, klens[k]) < 0) {
+			fprintf(stderr, "failed to build request\n");
+			return(1);
+		}
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s);
+		for (i = 0; i < iters; i++)
+			if (bench_new(&kio) < 0) {
+				fprintf(stderr, "HMAC failed\n");
+				return(1);
+			}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+		nns = bench_elapsed(&s, &e) / iters;
+
+		kio.kio_ss.kss_hctx = NULL;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s);
+		for (i = 0; i < iters; i++)
+			ki_stampseq(&kio, i);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+		rns = bench_elapsed(&s, &e) / iters;
+
+		kio.kio_ss.kss_hctx = cf.kcfg_hctx;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s);
+		for (i = 0; i < iters; i++)
+			ki_stampseq(&kio, i);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+		pns = bench_elapsed(&s, &e) / iters;
+
+		printf("%-6lu %7u %10.1f %10.1f %10.1f %7.2fx\n",
+		       klens[k], kio.kio_ss.kss_cmdlen, nns, rns, pns,
+		       nns / pns);
+
+		ki_encode_free(kio.kio_sendmsg.km_msg);
+	}
+
+	return(0);
+}
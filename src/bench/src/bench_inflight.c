@@ -0,0 +1,148 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Response matching microbenchmark, queue depth sweep.
+ *
+ * Keeps a steady state of depth outstanding KIOs, the way the sender and
+ * receiver threads do. Each round a response arrives for a random
+ * outstanding KIO, it is matched and dequeued, and a new KIO with the next
+ * sequence is queued. Reports the average cost per response of:
+ *	list - list_traverse() of the recv queue, the old matcher
+ *	ift  - ktli_ift_lookup() plus back pointer dequeue, the new matcher
+ * No server is needed.
+ *
+ * Usage: bench_inflight [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_ift.h"
+
+#define BENCH_ROUNDS	100000
+#define BENCH_MAXDEPTH	16384
+
+static list_boolean_t
+bench_seqmatch(void *data, void *ldata)
+{
+	int64_t *aseq = (int64_t *)data;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	return ((*aseq == lkio->kio_seq) ? LIST_FALSE : LIST_TRUE);
+}
+
+static void
+bench_enqueue(struct ktli_queue *q, struct kio *kio, int useift)
+{
+	(void)list_mvrear(q->ktq_list);
+	list_insert_after(q->ktq_list, &kio, sizeof(struct kio *));
+	kio->kio_qbp = list_element_curr(q->ktq_list);
+	if (useift)
+		ktli_ift_insert(&q->ktq_ift, kio);
+}
+
+/* Returns ns per matched response */
+static double
+bench_run(int depth, long rounds, int useift)
+{
+	struct ktli_queue q;
+	struct kio *kios, **out, *kio, *spare, **lkio;
+	struct timespec s, e;
+	int64_t seq = 100, aseq;
+	long r;
+	int i, rc;
+
+	kios = calloc(depth + 1, sizeof(struct kio));
+	out  = calloc(depth, sizeof(struct kio *));
+	q.ktq_list = list_create();
+	if (!kios || !out || !q.ktq_list || ktli_ift_init(&q.ktq_ift) < 0) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	/* Fill the recv queue to depth, keep one spare KIO */
+	for (i = 0; i < depth; i++) {
+		out[i] = &kios[i];
+		out[i]->kio_seq = seq++;
+		bench_enqueue(&q, out[i], useift);
+	}
+	kio = &kios[depth];
+
+	srandom(depth);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (r = 0; r < rounds; r++) {
+		i = random() % depth;
+		aseq = out[i]->kio_seq;
+
+		if (useift) {
+			out[i] = ktli_ift_lookup(&q.ktq_ift, aseq);
+			ktli_ift_remove(&q.ktq_ift, out[i]);
+			(void)list_setcurr(q.ktq_list, out[i]->kio_qbp);
+		} else {
+			rc = list_traverse(q.ktq_list, &aseq,
+					   bench_seqmatch, LIST_ALTR);
+			if (rc == LIST_EXTENT || rc == LIST_EMPTY) {
+				fprintf(stderr, "lost seq %ld\n", aseq);
+				exit(1);
+			}
+		}
+		lkio = (struct kio **)list_remove_curr(q.ktq_list);
+		free(lkio);
+
+		/* The spare is sent with the next seq, the matched one is spare */
+		kio->kio_seq = seq++;
+		bench_enqueue(&q, kio, useift);
+		spare  = out[i];
+		out[i] = kio;
+		kio    = spare;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	while (list_size(q.ktq_list))
+		free(list_remove_rear(q.ktq_list));
+	list_destroy(q.ktq_list, (void *)LIST_NODEALLOC);
+	ktli_ift_destroy(&q.ktq_ift);
+	free(out);
+	free(kios);
+
+	return(((e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec)) / rounds);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long rounds = BENCH_ROUNDS;
+	int depth;
+
+	if (argc > 1)
+		rounds = atol(argv[1]);
+	if (rounds <= 0) {
+		fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+		return(1);
+	}
+
+	printf("%8s %14s %14s\n", "depth", "list ns/resp", "ift ns/resp");
+	for (depth = 1; depth <= BENCH_MAXDEPTH; depth <<= 1) {
+		printf("%8d %14.1f %14.1f\n", depth,
+		       bench_run(depth, rounds, 0), bench_run(depth, rounds, 1));
+	}
+
+	return(0);
+}
@@ -0,0 +1,204 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Request key encoding microbenchmark.
+ *
+ * Builds a GET request for a composite key, split into 1, 4 and 6
+ * fragments, and measures the CPU per request:
+ *	create - create_getkey_message(), keyname_to_proto() gathers the key
+ *		 into a buffer of its own, then pack_kinetic_message() and
+ *		 a separate PDU, as the ops used to
+ *	encode - ki_encode_kv(), the fragments are gathered straight into
+ *		 the one pooled send buffer
+ * Both include releasing what they built. No server is needed.
+ *
+ * Usage: bench_keyenc [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "kio.h"
+#include "ktli.h"
+#include "kinetic.h"
+#include "kinetic_internal.h"
+#include "protocol_interface.h"
+
+#define BENCH_ITERS	1000000
+#define BENCH_HKEY	"asdfasdf"
+#define BENCH_FRAGS	6
+
+struct kresult_message
+create_getkey_message(kmsghdr_t *, kcmdhdr_t *, kv_t *);
+
+/* A composite tuple key, bench/keyenc/<table>/<shard>/<row>/<col> */
+static char *bench_key[BENCH_FRAGS] = {
+	"bench", "/keyenc", "/customers", "/0017", "/00000000000042", "/name",
+};
+
+/* Fill key with the composite key in frags fragments */
+static size_t
+bench_keyset(struct kiovec *key, int frags, char *flat)
+{
+	size_t i, len, off;
+	int f;
+
+	for (off = 0, i = 0; i < BENCH_FRAGS; i++) {
+		len = strlen(bench_key[i]);
+		memcpy(flat + off, bench_key[i], len);
+		off += len;
+	}
+
+	/* Split the flat key into frags near equal pieces */
+	for (len = 0, f = 0; f < frags; f++) {
+		key[f].kiov_base = flat + len;
+		key[f].kiov_len  = (off * (f + 1)) / frags - len;
+		len += key[f].kiov_len;
+	}
+	return(off);
+}
+
+static int
+bench_create(kmsghdr_t *mh, kcmdhdr_t *ch, kv_t *kv, struct kio *kio)
+{
+	struct kresult_message kmreq;
+	kproto_msg_t *msg;
+	kpdu_t pdu;
+	int rc = 0;
+
+	kmreq = create_getkey_message(mh, ch, kv);
+	if (kmreq.result_code == FAILURE)
+		return(-1);
+	msg = (kproto_msg_t *) kmreq.result_message;
+
+	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
+	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
+	if (pack_kinetic_message(msg,
+				 &(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
+				 &(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len))
+	    == FAILURE) {
+		rc = -1;
+	} else {
+		pdu.kp_magic  = KP_MAGIC;
+		pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
+		pdu.kp_vallen = 0;
+		PACK_PDU(&pdu,
+			 (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+		KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
+	}
+	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+
+	msg->hmacauth->hmac.data = NULL;
+	msg->hmacauth->hmac.len  = 0;
+	destroy_message(msg);
+	return(rc);
+}
+
+static int
+bench_encode(struct ktli_config *cf, kmsghdr_t *mh, kcmdhdr_t *ch, kv_t *kv,
+	     struct kio *kio)
+{
+	if (ki_encode_kv(cf, kio, mh, ch, kv, 0) < 0)
+		return(-1);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
+	return(0);
+}
+
+static double
+bench_elapsed(struct timespec *s, struct timespec *e)
+{
+	return((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static int frags[] = { 1, 4, 6 };
+	struct kiovec key[BENCH_FRAGS], msgv[KM_CNT_NOVAL];
+	char flat[128];
+	struct ktli_config cf;
+	struct timespec s, e;
+	struct kio kio;
+	kmsghdr_t mh;
+	kcmdhdr_t ch;
+	kv_t kv;
+	double cns, ens;
+	long i, iters = BENCH_ITERS;
+	size_t klen, f;
+
+	if (argc > 1)
+		iters = atol(argv[1]);
+	if (iters <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return(1);
+	}
+
+	memset(&cf, 0, sizeof(cf));
+	cf.kcfg_id   = 1;
+	cf.kcfg_hkey = BENCH_HKEY;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.kmh_atype = KAT_HMAC;
+	mh.kmh_id    = cf.kcfg_id;
+	mh.kmh_hmac  = cf.kcfg_hkey;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.kch_connid = 1171500672;
+	ch.kch_seq    = 1;
+	ch.kch_type   = KMT_GET;
+	ch.kch_pri    = NORMAL;
+
+	memset(&kio, 0, sizeof(kio));
+	kio.kio_sendmsg.km_cnt = KM_CNT_NOVAL;
+	kio.kio_sendmsg.km_msg = msgv;
+
+	printf("%-6s %6s %12s %12s %8s\n",
+	       "frags", "keylen", "create ns", "encode ns", "speedup");
+
+	for (f = 0; f < sizeof(frags) / sizeof(frags[0]); f++) {
+		klen = bench_keyset(key, frags[f], flat);
+
+		memset(&kv, 0, sizeof(kv));
+		kv.kv_key    = key;
+		kv.kv_keycnt = frags[f];
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s);
+		for (i = 0; i < iters; i++)
+			if (bench_create(&mh, &ch, &kv, &kio) < 0) {
+				fprintf(stderr, "create failed\n");
+				return(1);
+			}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+		cns = bench_elapsed(&s, &e) / iters;
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s);
+		for (i = 0; i < iters; i++)
+			if (bench_encode(&cf, &mh, &ch, &kv, &kio) < 0) {
+				fprintf(stderr, "encode failed\n");
+				return(1);
+			}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+		ens = bench_elapsed(&s, &e) / iters;
+
+		printf("%-6d %6lu %12.1f %12.1f %7.2fx\n",
+		       frags[f], klen, cns, ens, cns / ens);
+	}
+
+	return(0);
+}
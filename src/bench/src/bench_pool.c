@@ -0,0 +1,172 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Object pool microbenchmark.
+ *
+ * Each thread repeatedly allocates a window of objects in the sizes an RPC
+ * uses (KIO, kiovec array, PDU, packed message), frees them, and then frees
+ * the window a neighbouring thread allocated, the way the receiver frees
+ * what application threads allocated. Run once with malloc(3)/free(3) and
+ * once with ktli_pool_alloc()/ktli_pool_free(). Reports allocations per
+ * second for each. No server is needed.
+ *
+ * Usage: bench_pool [threads [rounds]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ktli_pool.h"
+
+#define BENCH_THREADS	4
+#define BENCH_ROUNDS	200000
+#define BENCH_WINDOW	16		/* Objects per window */
+#define BENCH_MAXTHR	64
+
+static const size_t bench_sizes[] = { 256, 48, 9, 160, 1024, 32, 4096, 96 };
+#define BENCH_NSIZES	(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+struct bench_thr {
+	pthread_t		 bt_tid;
+	int			 bt_pool;
+	long			 bt_rounds;
+	struct bench_thr	*bt_next;	/* Neighbour, frees our windows */
+	void * volatile		 bt_slot;	/* Window handed to bt_next */
+};
+
+static void *
+bench_alloc(int pool, size_t len)
+{
+	return(pool ? ktli_pool_alloc(len) : malloc(len));
+}
+
+static void
+bench_free(int pool, void *p)
+{
+	if (pool)
+		ktli_pool_free(p);
+	else
+		free(p);
+}
+
+static void *
+bench_thread(void *p)
+{
+	struct bench_thr *bt = (struct bench_thr *)p, *prev;
+	void *w[BENCH_WINDOW], **hand, **got;
+	long r;
+	int i;
+
+	/* Our neighbour's bt_next is us, find it by walking the ring */
+	for (prev = bt->bt_next; prev->bt_next != bt; prev = prev->bt_next)
+		;
+
+	for (r = 0; r < bt->bt_rounds; r++) {
+		/* A local window, allocated and freed on this thread */
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			w[i] = bench_alloc(bt->bt_pool,
+					   bench_sizes[(r + i) % BENCH_NSIZES]);
+			memset(w[i], 0, 8);
+		}
+		for (i = 0; i < BENCH_WINDOW; i++)
+			bench_free(bt->bt_pool, w[i]);
+
+		/* A window handed to the neighbour to free */
+		if (!bt->bt_slot) {
+			hand = bench_alloc(bt->bt_pool,
+					   BENCH_WINDOW * sizeof(void *));
+			for (i = 0; i < BENCH_WINDOW; i++)
+				hand[i] = bench_alloc(bt->bt_pool,
+					bench_sizes[(r + i) % BENCH_NSIZES]);
+			__atomic_store_n(&bt->bt_slot, hand, __ATOMIC_RELEASE);
+		}
+
+		/* Free whatever the other neighbour handed over */
+		got = __atomic_exchange_n(&prev->bt_slot, NULL, __ATOMIC_ACQUIRE);
+		if (got) {
+			for (i = 0; i < BENCH_WINDOW; i++)
+				bench_free(bt->bt_pool, got[i]);
+			bench_free(bt->bt_pool, got);
+		}
+	}
+
+	return(NULL);
+}
+
+/* Returns allocations per second */
+static double
+bench_run(int pool, int nthr, long rounds)
+{
+	struct bench_thr bt[BENCH_MAXTHR];
+	struct timespec s, e;
+	void **got;
+	int t, i;
+
+	memset(bt, 0, sizeof(bt));
+	for (t = 0; t < nthr; t++) {
+		bt[t].bt_pool   = pool;
+		bt[t].bt_rounds = rounds;
+		bt[t].bt_next   = &bt[(t + 1) % nthr];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (t = 0; t < nthr; t++)
+		pthread_create(&bt[t].bt_tid, NULL, bench_thread, &bt[t]);
+	for (t = 0; t < nthr; t++)
+		pthread_join(bt[t].bt_tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	/* Windows nobody got around to */
+	for (t = 0; t < nthr; t++) {
+		got = bt[t].bt_slot;
+		if (!got)
+			continue;
+		for (i = 0; i < BENCH_WINDOW; i++)
+			bench_free(pool, got[i]);
+		bench_free(pool, got);
+	}
+
+	/* Counts the local windows only, handed windows vary with timing */
+	return((double)nthr * rounds * BENCH_WINDOW /
+	       ((e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	long rounds = BENCH_ROUNDS;
+	int nthr = BENCH_THREADS;
+	double base, r;
+
+	if (argc > 1)
+		nthr = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atol(argv[2]);
+	if (nthr < 2 || nthr > BENCH_MAXTHR) {
+		fprintf(stderr, "threads must be 2 to %d\n", BENCH_MAXTHR);
+		return(1);
+	}
+
+	printf("%8s %8s %14s %8s\n", "alloc", "threads", "allocs/s", "speedup");
+	base = bench_run(0, nthr, rounds);
+	printf("%8s %8d %14.0f %8.2f\n", "malloc", nthr, base, 1.0);
+	r = bench_run(1, nthr, rounds);
+	printf("%8s %8d %14.0f %8.2f\n", "pool", nthr, r, r / base);
+	return(0);
+}
@@ -0,0 +1,217 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Receive buffer microbenchmark.
+ *
+ * A writer thread streams small GET sized responses (PDU, message, value)
+ * into a connected AF_UNIX stream. The other end is parsed with
+ * ktli_rbuf_next() over the socket driver, once with its recvsome, the
+ * buffered receive path, and once without it, which reads each response
+ * with a receive for the PDU and another for the message and value, as
+ * the receiver did before. Reports responses per second and driver receive
+ * calls per response. No server is needed.
+ *
+ * Usage: bench_recvbuf [responses]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "ktli.h"
+#include "ktli_socket.h"
+#include "ktli_rbuf.h"
+
+#define BENCH_MSGS	200000
+#define BENCH_PDULEN	9
+#define BENCH_MSGLEN	96
+#define BENCH_VALLEN	32
+#define BENCH_RESPLEN	(BENCH_PDULEN + BENCH_MSGLEN + BENCH_VALLEN)
+#define BENCH_WRITE	(64 * 1024)	/* Bytes per writer write */
+
+static long bench_calls;
+
+/* Big endian message and value lengths follow a 1 byte magic */
+static int32_t
+bench_msglen(struct kiovec *hdr)
+{
+	unsigned char *p = hdr->kiov_base;
+
+	return((p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4]);
+}
+
+static int32_t
+bench_vallen(struct kiovec *hdr)
+{
+	unsigned char *p = hdr->kiov_base;
+
+	return((p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8]);
+}
+
+static int
+bench_receive(void *dh, struct kiovec *msg, int msgcnt)
+{
+	bench_calls++;
+	return((socket_fns.ktli_dfns_receive)(dh, msg, msgcnt));
+}
+
+static int
+bench_recvsome(void *dh, void *buf, size_t len)
+{
+	bench_calls++;
+	return((socket_fns.ktli_dfns_recvsome)(dh, buf, len));
+}
+
+struct bench_writer {
+	int	bw_fd;
+	long	bw_msgs;
+};
+
+static void *
+bench_writer(void *p)
+{
+	struct bench_writer *bw = (struct bench_writer *)p;
+	char *buf, *r;
+	long m, n;
+	ssize_t w;
+	size_t len, off;
+
+	/* A write worth of identical responses */
+	n   = BENCH_WRITE / BENCH_RESPLEN;
+	buf = calloc(n, BENCH_RESPLEN);
+	for (m = 0, r = buf; m < n; m++, r += BENCH_RESPLEN) {
+		r[0] = 'F';
+		r[4] = BENCH_MSGLEN;
+		r[8] = BENCH_VALLEN;
+	}
+
+	for (m = 0; m < bw->bw_msgs; m += n) {
+		if (n > bw->bw_msgs - m)
+			n = bw->bw_msgs - m;
+		len = n * BENCH_RESPLEN;
+		for (off = 0; off < len; off += w) {
+			w = write(bw->bw_fd, buf + off, len - off);
+			if (w < 0) {
+				perror("write");
+				exit(1);
+			}
+		}
+	}
+
+	free(buf);
+	return(NULL);
+}
+
+/* Returns responses per second, *calls gets receive calls per response */
+static double
+bench_run(int buffered, long msgs, double *calls)
+{
+	struct ktli_driver_fns fns;
+	struct ktli_helpers kh;
+	struct bench_writer bw;
+	struct ktli_rbuf rb;
+	struct ktli_sock sk;
+	struct kiovec msg[KM_CNT_WITHVAL];
+	struct pollfd pfd;
+	struct timespec s, e;
+	pthread_t tid;
+	void *chunk;
+	int sv[2], rc;
+	long m;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+	/* A hand built socket driver handle, default tuning */
+	memset(&sk, 0, sizeof(sk));
+	sk.ksk_fd    = sv[1];
+	sk.ksk_spin  = 8;
+	sk.ksk_wait  = 10;
+	sk.ksk_stall = 30000;
+
+	memset(&fns, 0, sizeof(fns));
+	fns.ktli_dfns_receive  = bench_receive;
+	fns.ktli_dfns_recvsome = buffered ? bench_recvsome : NULL;
+
+	memset(&kh, 0, sizeof(kh));
+	kh.kh_recvhdr_len = BENCH_PDULEN;
+	kh.kh_msglen_fn   = bench_msglen;
+	kh.kh_vallen_fn   = bench_vallen;
+
+	ktli_rbuf_init(&rb);
+	bench_calls = 0;
+	bw.bw_fd   = sv[0];
+	bw.bw_msgs = msgs;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	pthread_create(&tid, NULL, bench_writer, &bw);
+
+	for (m = 0; m < msgs; ) {
+		rc = ktli_rbuf_next(&rb, &fns, &sk, &kh, msg, &chunk);
+		if (rc < 0) {
+			perror("ktli_rbuf_next");
+			exit(1);
+		}
+
+		/* Nothing complete buffered, wait like the receiver does */
+		if (!rc) {
+			pfd.fd = sv[1];
+			pfd.events = POLLIN;
+			(void)poll(&pfd, 1, 10);
+			continue;
+		}
+
+		free(msg[KIOV_VAL].kiov_base);
+		ktli_rbuf_put(chunk);
+		m++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	pthread_join(tid, NULL);
+	ktli_rbuf_destroy(&rb);
+	close(sv[0]);
+	close(sv[1]);
+
+	*calls = (double)bench_calls / msgs;
+	return(msgs / ((e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	long msgs = BENCH_MSGS;
+	double base, r, calls;
+
+	if (argc > 1)
+		msgs = atol(argv[1]);
+
+	printf("%10s %14s %12s %8s\n", "path", "resps/s", "recvs/resp",
+	       "speedup");
+	base = bench_run(0, msgs, &calls);
+	printf("%10s %14.0f %12.3f %8.2f\n", "per-msg", base, calls, 1.0);
+	r = bench_run(1, msgs, &calls);
+	printf("%10s %14.0f %12.3f %8.2f\n", "buffered", r, calls, r / base);
+	return(0);
+}
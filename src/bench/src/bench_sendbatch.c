@@ -0,0 +1,136 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Sender coalescing microbenchmark, batch size sweep.
+ *
+ * Pushes small PUT sized messages (PDU, message, value kiovecs) through
+ * the socket driver send into a connected AF_UNIX stream whose other end
+ * is drained by a reader thread. Batch 1 is one driver send per message,
+ * the old sender. Larger batches gather that many messages into one
+ * vector and one driver send, as ktli_sender now does. Reports messages
+ * per second for each batch size. No server is needed.
+ *
+ * Usage: bench_sendbatch [messages]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "ktli.h"
+#include "ktli_socket.h"
+
+#define BENCH_MSGS	200000
+#define BENCH_MAXBATCH	64
+#define BENCH_PDULEN	9
+#define BENCH_MSGLEN	96
+#define BENCH_VALLEN	32
+#define BENCH_MSGCNT	3	/* kiovecs per message */
+
+static int bench_done;
+
+static void *
+bench_reader(void *p)
+{
+	int fd = *(int *)p;
+	char buf[64 * 1024];
+
+	while (read(fd, buf, sizeof(buf)) > 0 || !bench_done)
+		;
+	return(NULL);
+}
+
+/* Returns messages per second */
+static double
+bench_run(int batch, long msgs)
+{
+	static char pdu[BENCH_PDULEN], msg[BENCH_MSGLEN], val[BENCH_VALLEN];
+	struct kiovec iov[BENCH_MAXBATCH * BENCH_MSGCNT];
+	struct ktli_sock sk;
+	struct timespec s, e;
+	pthread_t tid;
+	int sv[2], i, n;
+	long m;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	/* A hand built socket driver handle, default tuning */
+	memset(&sk, 0, sizeof(sk));
+	sk.ksk_fd    = sv[0];
+	sk.ksk_spin  = 8;
+	sk.ksk_wait  = 10;
+	sk.ksk_stall = 30000;
+
+	for (i = 0; i < batch; i++) {
+		iov[i * BENCH_MSGCNT + 0].kiov_base = pdu;
+		iov[i * BENCH_MSGCNT + 0].kiov_len  = BENCH_PDULEN;
+		iov[i * BENCH_MSGCNT + 1].kiov_base = msg;
+		iov[i * BENCH_MSGCNT + 1].kiov_len  = BENCH_MSGLEN;
+		iov[i * BENCH_MSGCNT + 2].kiov_base = val;
+		iov[i * BENCH_MSGCNT + 2].kiov_len  = BENCH_VALLEN;
+	}
+
+	bench_done = 0;
+	pthread_create(&tid, NULL, bench_reader, &sv[1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (m = 0; m < msgs; m += n) {
+		n = (msgs - m < batch) ? msgs - m : batch;
+		if ((socket_fns.ktli_dfns_send)(&sk, iov,
+						n * BENCH_MSGCNT) < 0) {
+			fprintf(stderr, "send failed\n");
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	bench_done = 1;
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(tid, NULL);
+	close(sv[0]);
+	close(sv[1]);
+
+	return(msgs / ((e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	long msgs = BENCH_MSGS;
+	double base, r;
+	int batch;
+
+	if (argc > 1)
+		msgs = atol(argv[1]);
+
+	printf("%8s %14s %8s\n", "batch", "msgs/s", "speedup");
+	base = bench_run(1, msgs);
+	printf("%8d %14.0f %8.2f\n", 1, base, 1.0);
+	for (batch = 2; batch <= BENCH_MAXBATCH; batch *= 2) {
+		r = bench_run(batch, msgs);
+		printf("%8d %14.0f %8.2f\n", batch, r, r / base);
+	}
+	return(0);
+}
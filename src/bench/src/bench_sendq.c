@@ -0,0 +1,223 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Send queue microbenchmark.
+ *
+ * Many producer threads queue KIOs for one consumer thread, which takes
+ * them off in batches the way ktli_sender() does. Run once with the old
+ * send queue, a mutex protected list with an allocated element per KIO
+ * and a condvar signal per queued KIO, and once with the lock-free
+ * ktli_mpsc queue and its idle flag wakeup. Reports KIOs per second and
+ * how many producers had to signal the consumer. No server is needed.
+ *
+ * Usage: bench_sendq [producers [kios per producer]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_mpsc.h"
+
+#define BENCH_PRODUCERS	32
+#define BENCH_KIOS	200000
+#define BENCH_RING	64		/* KIOs in flight per producer */
+#define BENCH_BATCH	64		/* KIOs per consumer pass */
+
+/* The old send queue, a locked list with an element per KIO */
+struct bench_elem {
+	struct bench_elem	*be_next;
+	struct kio		*be_kio;
+};
+
+struct bench_q {
+	int			 bq_mpsc;	/* Which queue to use */
+	pthread_mutex_t		 bq_m;
+	pthread_cond_t		 bq_cv;
+	struct bench_elem	*bq_head, *bq_tail;
+	struct ktli_mpsc	 bq_q;
+	int			 bq_idle;
+	long			 bq_left;	/* KIOs left to consume */
+	long			 bq_signals;	/* Consumer wakeups sent */
+};
+
+static struct bench_q bq;
+static long bench_kios = BENCH_KIOS;
+
+static void
+bench_push(struct kio *kio)
+{
+	struct bench_elem *e;
+
+	if (bq.bq_mpsc) {
+		ktli_mpsc_push(&bq.bq_q, kio);
+		if (__atomic_load_n(&bq.bq_idle, __ATOMIC_SEQ_CST) &&
+		    __atomic_exchange_n(&bq.bq_idle, 0, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&bq.bq_m);
+			pthread_cond_signal(&bq.bq_cv);
+			pthread_mutex_unlock(&bq.bq_m);
+			__sync_add_and_fetch(&bq.bq_signals, 1);
+		}
+		return;
+	}
+
+	e = malloc(sizeof(struct bench_elem));
+	e->be_next = NULL;
+	e->be_kio  = kio;
+
+	pthread_mutex_lock(&bq.bq_m);
+	if (bq.bq_tail)
+		bq.bq_tail->be_next = e;
+	else
+		bq.bq_head = e;
+	bq.bq_tail = e;
+	pthread_cond_signal(&bq.bq_cv);
+	bq.bq_signals++;
+	pthread_mutex_unlock(&bq.bq_m);
+}
+
+static void *
+bench_producer(void *p)
+{
+	struct kio *ring;
+	long n;
+	int r;
+
+	/* kio_state doubles as an in flight flag */
+	ring = calloc(BENCH_RING, sizeof(struct kio));
+	for (n = 0; n < bench_kios; n++) {
+		r = n % BENCH_RING;
+		while (__atomic_load_n(&ring[r].kio_state, __ATOMIC_ACQUIRE))
+			sched_yield();
+		ring[r].kio_state = 1;
+		bench_push(&ring[r]);
+	}
+
+	/* Wait for the consumer to be done with the ring */
+	for (r = 0; r < BENCH_RING; r++)
+		while (__atomic_load_n(&ring[r].kio_state, __ATOMIC_ACQUIRE))
+			sched_yield();
+	free(ring);
+	return(NULL);
+}
+
+/* Takes up to BENCH_BATCH KIOs, waiting while there are none */
+static int
+bench_take(struct kio **batch)
+{
+	struct bench_elem *e;
+	struct kio *kio;
+	int n = 0;
+
+	pthread_mutex_lock(&bq.bq_m);
+	if (bq.bq_mpsc) {
+		__atomic_store_n(&bq.bq_idle, 1, __ATOMIC_SEQ_CST);
+		if (ktli_mpsc_empty(&bq.bq_q))
+			pthread_cond_wait(&bq.bq_cv, &bq.bq_m);
+		__atomic_store_n(&bq.bq_idle, 0, __ATOMIC_SEQ_CST);
+		while (n < BENCH_BATCH && (kio = ktli_mpsc_pop(&bq.bq_q)))
+			batch[n++] = kio;
+	} else {
+		if (!bq.bq_head)
+			pthread_cond_wait(&bq.bq_cv, &bq.bq_m);
+		while (n < BENCH_BATCH && (e = bq.bq_head)) {
+			bq.bq_head = e->be_next;
+			if (!bq.bq_head)
+				bq.bq_tail = NULL;
+			batch[n++] = e->be_kio;
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&bq.bq_m);
+	return(n);
+}
+
+static void *
+bench_consumer(void *p)
+{
+	struct kio *batch[BENCH_BATCH];
+	int i, n;
+
+	while (bq.bq_left) {
+		n = bench_take(batch);
+		for (i = 0; i < n; i++)
+			__atomic_store_n(&batch[i]->kio_state, 0,
+					 __ATOMIC_RELEASE);
+		bq.bq_left -= n;
+	}
+	return(NULL);
+}
+
+/* Returns KIOs per second */
+static double
+bench_run(int mpsc, int nprod, long *signals)
+{
+	pthread_t *tid, ctid;
+	struct timespec s, e;
+	int t;
+
+	memset(&bq, 0, sizeof(bq));
+	bq.bq_mpsc = mpsc;
+	bq.bq_left = nprod * bench_kios;
+	pthread_mutex_init(&bq.bq_m, NULL);
+	pthread_cond_init(&bq.bq_cv, NULL);
+	ktli_mpsc_init(&bq.bq_q);
+
+	tid = calloc(nprod, sizeof(pthread_t));
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	pthread_create(&ctid, NULL, bench_consumer, NULL);
+	for (t = 0; t < nprod; t++)
+		pthread_create(&tid[t], NULL, bench_producer, NULL);
+	for (t = 0; t < nprod; t++)
+		pthread_join(tid[t], NULL);
+	pthread_join(ctid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	free(tid);
+
+	*signals = bq.bq_signals;
+	return(nprod * bench_kios /
+	       ((e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nprod = BENCH_PRODUCERS;
+	double base, r;
+	long sig;
+
+	if (argc > 1)
+		nprod = atoi(argv[1]);
+	if (argc > 2)
+		bench_kios = atol(argv[2]);
+	if (nprod < 1) {
+		fprintf(stderr, "need at least 1 producer\n");
+		return(1);
+	}
+
+	printf("%8s %10s %14s %12s %8s\n", "queue", "producers", "kios/s",
+	       "signals", "speedup");
+	base = bench_run(0, nprod, &sig);
+	printf("%8s %10d %14.0f %12ld %8.2f\n", "locked", nprod, base, sig, 1.0);
+	r = bench_run(1, nprod, &sig);
+	printf("%8s %10d %14.0f %12ld %8.2f\n", "mpsc", nprod, r, sig,
+	       r / base);
+	return(0);
+}
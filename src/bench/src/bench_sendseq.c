@@ -0,0 +1,280 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Submission side sequencing microbenchmark.
+ *
+ * Runs a full KTLI session with the libkinetic helpers against a sink
+ * thread on a loopback TCP socket that reads and discards everything.
+ * Submitting threads encode request only GETs for a 1KiB key, with a
+ * reserved seq slot, and keep BENCH_WINDOW of them in flight each. Run
+ * once in the default mode, where the sender thread sequences and HMACs
+ * every request, and once with KCFF_SENDSEQ, where each submitter does
+ * its own. Reports requests per second for 1, 2, 4 and 8 submitters,
+ * or just the count given. No server is needed.
+ *
+ * Usage: bench_sendseq [requests [threads]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "kio.h"
+#include "ktli.h"
+#include "kinetic.h"
+#include "kinetic_internal.h"
+#include "protocol_interface.h"
+
+#define BENCH_REQS	200000	/* Per submitter */
+#define BENCH_WINDOW	32	/* Requests in flight per submitter */
+#define BENCH_KEYLEN	1024
+#define BENCH_HKEY	"asdfasdf"
+
+static char bench_key[BENCH_KEYLEN];
+
+/* Sink thread, reads requests and drops them */
+static void *
+bench_sink(void *p)
+{
+	int lfd = *(int *)p, fd;
+	static char buf[64 * 1024];
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0)
+		return(NULL);
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+	return(NULL);
+}
+
+/* Session helpers, requests only so the receive side never runs */
+static int32_t
+bench_msglen(struct kiovec *hdr)
+{
+	kpdu_t pdu;
+
+	UNPACK_PDU(&pdu, (unsigned char *)hdr->kiov_base);
+	return(pdu.kp_msglen);
+}
+
+static int32_t
+bench_vallen(struct kiovec *hdr)
+{
+	kpdu_t pdu;
+
+	UNPACK_PDU(&pdu, (unsigned char *)hdr->kiov_base);
+	return(pdu.kp_vallen);
+}
+
+static struct ktli_helpers bench_kh = {
+	.kh_recvhdr_len	= KP_PLENGTH,
+	.kh_getaseq_fn	= ki_getaseq,
+	.kh_setseq_fn	= ki_setseq,
+	.kh_stampseq_fn	= ki_stampseq,
+	.kh_msglen_fn	= bench_msglen,
+	.kh_vallen_fn	= bench_vallen,
+};
+
+struct bench_sub {
+	int			 bs_kts;
+	long			 bs_reqs;
+	struct ktli_config	*bs_cf;
+	pthread_t		 bs_tid;
+};
+
+/* Submitter, keeps BENCH_WINDOW requests in flight until done */
+static void *
+bench_submit(void *p)
+{
+	struct bench_sub *bs = p;
+	struct kio kio[BENCH_WINDOW];
+	struct kiovec msgv[BENCH_WINDOW][KM_CNT_NOVAL];
+	struct kiovec key;
+	kmsghdr_t mh;
+	kcmdhdr_t ch;
+	kv_t kv;
+	long sent, done;
+	struct kio *k;
+
+	key.kiov_base = bench_key;
+	key.kiov_len  = sizeof(bench_key);
+
+	memset(&kv, 0, sizeof(kv));
+	kv.kv_key    = &key;
+	kv.kv_keycnt = 1;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.kmh_atype = KAT_HMAC;
+	mh.kmh_id    = bs->bs_cf->kcfg_id;
+	mh.kmh_hmac  = bs->bs_cf->kcfg_hkey;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.kch_connid = 1171500672;
+	ch.kch_type   = KMT_GET;
+	ch.kch_pri    = NORMAL;
+	ki_seqslot_reserve(bs->bs_cf, &mh, &ch);
+
+	for (sent = 0, done = 0; done < bs->bs_reqs; ) {
+		while ((sent - done < BENCH_WINDOW) && (sent < bs->bs_reqs)) {
+			k = &kio[sent % BENCH_WINDOW];
+			memset(k, 0, sizeof(*k));
+			k->kio_magic = KIO_MAGIC;
+			k->kio_cmd   = KMT_GET;
+			k->kio_flags = KIOF_REQONLY;
+			k->kio_sendmsg.km_cnt = KM_CNT_NOVAL;
+			k->kio_sendmsg.km_msg = msgv[sent % BENCH_WINDOW];
+
+			if ((ki_encode_kv(bs->bs_cf, k, &mh, &ch, &kv, 0) < 0) ||
+			    (ktli_send(bs->bs_kts, k) < 0)) {
+				perror("send");
+				exit(1);
+			}
+			sent++;
+		}
+
+		k = &kio[done % BENCH_WINDOW];
+		while (ktli_receive(bs->bs_kts, k) < 0) {
+			if (errno != ENOENT) {
+				perror("ktli_receive");
+				exit(1);
+			}
+			if (ktli_poll(bs->bs_kts, 0) < 0 && errno != ETIMEDOUT) {
+				perror("ktli_poll");
+				exit(1);
+			}
+		}
+		ki_encode_free(k->kio_sendmsg.km_msg);
+		done++;
+	}
+
+	return(NULL);
+}
+
+/* Returns requests per second for nsub submitters of reqs requests */
+static double
+bench_run(struct ktli_config *cf, int nsub, long reqs)
+{
+	struct bench_sub bs[nsub];
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	struct timespec s, e;
+	pthread_t tid;
+	char port[16];
+	int lfd, kts, i;
+
+	/* Loopback listener on an ephemeral port */
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&sa, &salen)) {
+		perror("listen");
+		exit(1);
+	}
+	snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+	pthread_create(&tid, NULL, bench_sink, &lfd);
+
+	cf->kcfg_host = "127.0.0.1";
+	cf->kcfg_port = port;
+	kts = ktli_open(KTLI_DRIVER_SOCKET, cf, &bench_kh);
+	if (kts < 0 || ktli_connect(kts) < 0) {
+		perror("ktli");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < nsub; i++) {
+		bs[i].bs_kts  = kts;
+		bs[i].bs_reqs = reqs;
+		bs[i].bs_cf   = cf;
+		pthread_create(&bs[i].bs_tid, NULL, bench_submit, &bs[i]);
+	}
+	for (i = 0; i < nsub; i++)
+		pthread_join(bs[i].bs_tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	ktli_disconnect(kts);
+	ktli_close(kts);
+	pthread_join(tid, NULL);
+	close(lfd);
+
+	return((nsub * reqs) /
+	       ((e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static int subs[] = { 1, 2, 4, 8 };
+	struct ktli_config cf;
+	long reqs = BENCH_REQS;
+	int nsub = 0, i, n;
+	void *hctx;
+	double d, q;
+
+	if (argc > 1)
+		reqs = atol(argv[1]);
+	if (argc > 2)
+		nsub = atoi(argv[2]);
+	if ((reqs <= 0) || (nsub < 0)) {
+		fprintf(stderr, "usage: %s [requests [threads]]\n", argv[0]);
+		return(1);
+	}
+
+	memset(bench_key, 'k', sizeof(bench_key));
+
+	hctx = ki_hmac_prekey(BENCH_HKEY, strlen(BENCH_HKEY));
+	if (!hctx) {
+		fprintf(stderr, "failed to pre-key HMAC\n");
+		return(1);
+	}
+
+	printf("%-8s %12s %12s %8s\n",
+	       "threads", "default/s", "sendseq/s", "speedup");
+
+	for (i = 0; i < (int)(sizeof(subs) / sizeof(subs[0])); i++) {
+		n = nsub ? nsub : subs[i];
+
+		memset(&cf, 0, sizeof(cf));
+		cf.kcfg_id    = 1;
+		cf.kcfg_hkey  = BENCH_HKEY;
+		cf.kcfg_hctx  = hctx;
+		cf.kcfg_flags = KCFF_SEQSLOT;
+		d = bench_run(&cf, n, reqs);
+
+		cf.kcfg_flags = KCFF_SEQSLOT | KCFF_SENDSEQ;
+		q = bench_run(&cf, n, reqs);
+
+		printf("%-8d %12.0f %12.0f %7.2fx\n", n, d, q, q / d);
+
+		if (nsub)
+			break;
+	}
+
+	return(0);
+}
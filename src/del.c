@@ -40,7 +40,7 @@ create_delkey_message(kmsghdr_t *, kcmdhdr_t *, kv_t *, int);
 
 kstatus_t
 d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
-		  void *cctx, kio_t **ckio)
+		  int aio, void *cctx, kio_t **ckio)
 {
 	int rc, n, valck;		/* return code, temps */
 	kstatus_t krc;			/* Kinetic return code */
@@ -50,7 +50,7 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	kmsghdr_t msg_hdr;		/* Unpacked message header */
 	kcmdhdr_t cmd_hdr;		/* Unpacked Command header */
 	struct ktli_config *cf;		/* KTLI configuration info */
-	struct kresult_message kmreq;	/* Intermediate resp representation */
+	int kts;			/* KTLI session to send on */
 	kpdu_t pdu;			/* Unpacked PDU structure */
 
 	struct timespec	start;		/* Temp start timestamp */
@@ -120,11 +120,6 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * be used later on to calculate the actual HMAC which will then
 	 * replace the HMAC key on the kmh_hmac field.
-	 *
-	 * A reference is made to the kcfg_hkey ptr in the kmreq. This
-	 * reference needs to be removed before destroying kmreq.  The
-	 * protobuf code will try to clean up this ptr which is an outside
-	 * unfreeable ptr.  See below at dex_kmreq:
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -135,34 +130,40 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type = KMT_DEL;
 
+	/*
+	 * A request may carry its own priority, see kv_pri. Batch ops
+	 * keep the session's, they must reach the server in order.
+	 */
+	if (kv->kv_pri && !kb)
+		cmd_hdr.kch_pri = kv->kv_pri;
+
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, kb, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
+
 	/* if necessary setup the batchid before creating the mesg */
 	if (kb) {
 		cmd_hdr.kch_bid = kb->kb_bid;
 	}
 
-	/* 
-	 * Default del checks the version strings, if they don't match
-	 * del fails.  Forcing the del avoids the version check. So if 
-	 * checking the version, no forced del.
-	 */
-	kmreq = create_delkey_message(&msg_hdr, &cmd_hdr, kv, (verck?0:1));
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("del: request message create");
-		krc = K_EINTERNAL;
-		goto dex_kio;
-	}
-
 	/* Setup the KIO */
 	kio->kio_magic	= KIO_MAGIC;
 	kio->kio_cmd	= KMT_DEL;
+	kio->kio_pri	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
+	if (aio)
+		KIOF_SET(kio, KIOF_REAP);	/* ki_aio_reap may take it */
 
-	if (kb)
+	if (kb) {
 		/* This is a batch del, there is no response */
 		KIOF_SET(kio, KIOF_REQONLY);
-	else
+	} else {
 		/* This is a normal del, there is a response */
 		KIOF_SET(kio, KIOF_REQRESP);
+		KIOF_SET(kio, KIOF_CRWRITE);	/* See ki_admission */
+	}
 
 	/* If timestamp tracking is enabled for this op set it in the KIO */
 	if (KIOP_ISSET((&kst->kst_dels), KOPF_TSTAT)) {
@@ -187,38 +188,23 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("del: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto dex_kmreq;
-	}
-
-	/* Hang the PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
-
-	if (!kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base) {
-		debug_printf("del: sendmesg PDU alloc");
-		krc = K_ENOMEM;
-		goto dex_kmmsg;
+		goto dex_kio;
 	}
 
-	/* pack the message and hang it on the kio */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("del: sendmesg msg pack");
+	/*
+	 * Default del checks the version strings, if they don't match
+	 * del fails.  Forcing the del avoids the version check. So if 
+	 * checking the version, no forced del.
+	 *
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_kv(cf, kio, &msg_hdr, &cmd_hdr, kv, (verck?0:1)) < 0) {
+		debug_printf("del: request encode");
 		krc = K_EINTERNAL;
-		goto dex_kmmsg_pdu;
+		goto dex_kmmsg;
 	}
-
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-	PACK_PDU(&pdu,  (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+	UNPACK_PDU(&pdu, (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
 	debug_printf("del: PDU(x%2x, %d, %d)\n",
 		     pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
 
@@ -259,9 +245,10 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	}
 
 	/* Send the request */
-	if (ktli_send(ktd, kio) < 0) {
+	if (ktli_send(kts, kio) < 0) {
+		/* Past the server's pending limit, see ki_admission */
+		krc = (errno == EAGAIN) ? K_EAGAIN : K_EINTERNAL;
 		debug_printf("del: kio send");
-		krc = K_EINTERNAL;
 		goto dex_kmmsg_msg;
 	}
 	debug_printf("Sent Kio: %p\n", kio);
@@ -269,20 +256,9 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	/*
 	 * Successful Exit.
 	 * Return the kio.
-	 * Cleanup before return, the only thing that needs to go
-	 * is the unpacked protobuf request message kmreq.
-	 *
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
 	 */
 	*ckio = kio;
 
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
-
 	return(K_OK);
 
 	/* Error Exit. */
@@ -292,25 +268,11 @@ d_del_aio_generic(int ktd, kv_t *kv, kb_t *kb, int verck,
 	 */
 
  dex_kmmsg_msg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-
- dex_kmmsg_pdu:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
  dex_kmmsg:
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
- dex_kmreq:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len  = 0;
-
-	destroy_message(kmreq.result_message);
-
  dex_kio:
 	kio->kio_magic = 0; /* clear the kio magic  in case this lives on */
 	KI_FREE(kio);
@@ -438,7 +400,7 @@ d_del_aio_complete(int ktd, struct kio *kio, void **cctx)
 			b_batch_addop(kb, &cmd_hdr);
 		}
 		
-		destroy_message(kmbat.result_message);
+		destroy_unpacked_message(kmbat.result_message);
 #endif /* KBATCH_SEQTRACKING */
 
 		/* normal exit, jump past all response handling */
@@ -467,8 +429,7 @@ d_del_aio_complete(int ktd, struct kio *kio, void **cctx)
 	}
 
 	/* Now unpack the message */
-	kmresp = unpack_kinetic_message(kiov[KIOV_MSG].kiov_base,
-					kiov[KIOV_MSG].kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("del: msg unpack");
 		krc = K_EINTERNAL;
@@ -478,23 +439,21 @@ d_del_aio_complete(int ktd, struct kio *kio, void **cctx)
 	krc = extract_delkey(&kmresp, kv);
 
 	/* clean up */
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  dex:
 	/* depending on errors the recvmsg may or may not exist */
 	if (kio->kio_recvmsg.km_msg) {
 		for (i=0; i < kio->kio_recvmsg.km_cnt; i++) {
 			rl += kio->kio_recvmsg.km_msg[i].kiov_len; /* Stats */
-			KI_FREE(kio->kio_recvmsg.km_msg[i].kiov_base);
 		}
-		KI_FREE(kio->kio_recvmsg.km_msg);
+		ktli_recvmsg_free(kio, 0);
 	}
 
 	/* sendmsg always exists here but doesn't have a PDU_VAL */
-	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++) {
+	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++)
 		sl += kio->kio_sendmsg.km_msg[i].kiov_len; /* Stats */
-		KI_FREE(kio->kio_sendmsg.km_msg[i].kiov_base);
-	}
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
 	if (krc == K_OK) {
@@ -561,7 +520,7 @@ d_del_generic(int ktd, kv_t *kv, kb_t *kb, int verck)
 	kstatus_t ks;
 	kio_t *kio;
 
-	ks = d_del_aio_generic(ktd, kv, kb, verck, NULL, &kio);
+	ks = d_del_aio_generic(ktd, kv, kb, verck, 0, NULL, &kio);
 	if (ks != K_OK) {
 		return(ks);
 	}
@@ -611,7 +570,7 @@ kstatus_t
 ki_aio_del(int ktd, kbatch_t *kb, kv_t *kv, void *cctx, kio_t **kio)
 {
 	int verck;
-	return(d_del_aio_generic(ktd, kv, (kb_t *)kb, verck=0, cctx, kio));
+	return(d_del_aio_generic(ktd, kv, (kb_t *)kb, verck=0, 1, cctx, kio));
 }
 
 
@@ -659,7 +618,7 @@ kstatus_t
 ki_aio_cad(int ktd, kbatch_t *kb, kv_t *kv, void *cctx, kio_t **kio)
 {
 	int verck;
-	return(d_del_aio_generic(ktd, kv, (kb_t *)kb, verck=1, cctx, kio));
+	return(d_del_aio_generic(ktd, kv, (kb_t *)kb, verck=1, 1, cctx, kio));
 }
 
 
@@ -40,9 +40,14 @@ create_exec_message(kmsghdr_t *, kcmdhdr_t *, kapplet_t *);
 kstatus_t
 extract_exec_response(struct kresult_message *resp_msg, kapplet_t *app);
 
+static int  exec_body(kproto_kapplet_t *body, kapplet_t *app);
+static void exec_body_free(kproto_kapplet_t *body);
+
+/* Shorten this behemoth */
+#define mapplet_init com__seagate__kinetic__proto__command__manage_applet__init
 
 kstatus_t
-e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
+e_exec_aio_generic(int ktd, kapplet_t *app, int aio, void *cctx, kio_t **ckio)
 {
 	int rc, n;			/* return code, temps */
 	kstatus_t krc;			/* Kinetic return code */
@@ -52,8 +57,8 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
 	kmsghdr_t msg_hdr;		/* Unpacked message header */ 
 	kcmdhdr_t cmd_hdr;		/* Unpacked Command header */
 	struct ktli_config *cf;		/* KTLI configuration info */
-	struct kresult_message kmreq;	/* Intermediate resp representation */
-	kpdu_t pdu;			/* Unpacked PDU structure */
+	int kts;			/* KTLI session to send on */
+	kproto_kapplet_t body;		/* Unpacked applet request body */
 	struct timespec	start;		/* Temp start timestamp */
 
 	/*
@@ -113,11 +118,6 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * be used later on to calculate the actual HMAC which will then 
 	 * replace the HMAC key on the kmh_hmac field. 
-	 *
-	 * A reference is made to the kcfg_hkey ptr in the kmreq. This 
-	 * reference needs to be removed before destroying kmreq.  The
-	 * protobuf code will try to clean up this ptr which is an outside
-	 * unfreeable ptr.  See below at eex_req:
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -128,22 +128,19 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type = KMT_APPLET;
 
-	/* 
-	 * Default exec checks the version strings, if they don't match
-	 * exec fails.  Forcing the exec avoids the version check. So if 
-	 * checking the version, no forced exec.
-	 */
-	kmreq = create_exec_message(&msg_hdr, &cmd_hdr, app);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("exec: request message create");
-		krc = K_EINTERNAL;
-		goto eex_kio;
-	}
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, NULL, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
 
 	/* Setup the KIO */
 	kio->kio_magic	= KIO_MAGIC;
 	kio->kio_cmd	= KMT_APPLET;
+	kio->kio_pri	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
+	if (aio)
+		KIOF_SET(kio, KIOF_REAP);	/* ki_aio_reap may take it */
 	
 	/* KMT_APPLET is a REQRESP */
 	KIOF_SET(kio, KIOF_REQRESP);
@@ -172,44 +169,38 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("exec: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto eex_kmreq;
+		goto eex_kio;
 	}
 
-	/* Hang the PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
-
-	if (!kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base) {
-		debug_printf("exec: sendmesg PDU alloc");
+	/*
+	 * Default exec checks the version strings, if they don't match
+	 * exec fails.  Forcing the exec avoids the version check. So if 
+	 * checking the version, no forced exec.
+	 *
+	 * Build the applet body, then encode the PDU and message into one
+	 * buffer hung on the PDU and msg vectors, recording any reserved
+	 * slots. The body's gathered keys go once it is encoded.
+	 */
+	mapplet_init(&body);
+	if (exec_body(&body, app) < 0) {
+		debug_printf("exec: request body");
+		exec_body_free(&body);
 		krc = K_ENOMEM;
 		goto eex_kmmsg;
 	}
 
-	/* pack the message and hang it on the kio */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("exec: sendmesg msg pack");
+	rc = ki_encode_applet(cf, kio, &msg_hdr, &cmd_hdr, &body);
+	exec_body_free(&body);
+	if (rc < 0) {
+		debug_printf("exec: request encode");
 		krc = K_EINTERNAL;
-		goto eex_kmmsg_pdu;
+		goto eex_kmmsg;
 	}
-
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-
-	PACK_PDU(&pdu, (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	debug_printf("exec: PDU(x%2x, %d, %d)\n",
-		     pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
+	debug_printf("exec: PDU(x%2x, %lu, 0)\n",
+		     KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	/* Send the request */
-	if (ktli_send(ktd, kio) < 0) {
+	if (ktli_send(kts, kio) < 0) {
 		debug_printf("exec: kio send");
 		krc = K_EINTERNAL;
 		goto eex_kmmsg_msg;
@@ -219,19 +210,8 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
  	/*
 	 * Successful Exit.
 	 * Return the kio.
-	 * Cleanup before return, the only thing that needs to go 
-	 * is the unpacked protobuf request message kmreq.
-	 *
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
 	 */
 	*ckio = kio;
-	
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
 
 	return(K_OK);
 
@@ -243,25 +223,11 @@ e_exec_aio_generic(int ktd, kapplet_t *app, void *cctx, kio_t **ckio)
 	 */
 
  eex_kmmsg_msg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-
- eex_kmmsg_pdu:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
  eex_kmmsg:
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
- eex_kmreq:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len  = 0;
-
-	destroy_message(kmreq.result_message);
-
  eex_kio:
 	kio->kio_magic = 0; /* clear the kio magic  in case this lives on */
 	KI_FREE(kio);
@@ -377,8 +343,7 @@ e_exec_aio_complete(int ktd, struct kio *kio, void **cctx)
 	}
 
 	/* Now unpack the message */
-	kmresp = unpack_kinetic_message(kiov[KIOV_MSG].kiov_base,
-					kiov[KIOV_MSG].kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("exec: msg unpack");
 		krc = K_EINTERNAL;
@@ -395,39 +360,30 @@ e_exec_aio_complete(int ktd, struct kio *kio, void **cctx)
 	krc = extract_exec_response(&kmresp, app);
 
 	/* clean up */
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
 eex:
 	/* depending on errors the recvmsg may or may not exist */
 	if (kio->kio_recvmsg.km_msg) {
 		for (rl=0, i=0; i < kio->kio_recvmsg.km_cnt; i++) {
 			rl += kio->kio_recvmsg.km_msg[i].kiov_len; /* Stats */
-
-			/* 
-			 * Free recvmsg vectors
-			 * if there is a kiov_base ptr then
-			 * PDU and MSG vectors get freed (i<KM_CNT_NOVAl)
-			 * VAL vectors only get freed if there is an error
-			 * Otherwise VAL vectors are returned to caller
-			 * Caller is then responsible
-			 */
-			if (((i < KM_CNT_NOVAL) || (krc != K_OK)) &&
-			    (kio->kio_recvmsg.km_msg[i].kiov_base)){
-				KI_FREE(kio->kio_recvmsg.km_msg[i].kiov_base);
-			} 
-
 		}
-		KI_FREE(kio->kio_recvmsg.km_msg);
+
+		/* 
+		 * Free recvmsg vectors
+		 * VAL vectors only get freed if there is an error
+		 * Otherwise VAL vectors are returned to caller
+		 * Caller is then responsible
+		 */
+		ktli_recvmsg_free(kio, (krc == K_OK));
 	}
 
 	/*
 	 * sendmsg always exists here and has 0 KIOV_VAL vectors
 	 */
-	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++) {
+	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++)
 		sl += kio->kio_sendmsg.km_msg[i].kiov_len; /* Stats */
-		if (kio->kio_sendmsg.km_msg[i].kiov_base)
-			KI_FREE(kio->kio_sendmsg.km_msg[i].kiov_base);
-	}
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
 	if (krc == K_OK) {
@@ -478,7 +434,7 @@ e_exec_generic(int ktd, kapplet_t *app)
 	kstatus_t ks;
 	kio_t *kio;
 			
-	ks = e_exec_aio_generic(ktd, app, NULL, &kio);
+	ks = e_exec_aio_generic(ktd, app, 0, NULL, &kio);
 	if (ks != K_OK) {
 		return(ks);
 	}
@@ -520,7 +476,7 @@ e_exec_generic(int ktd, kapplet_t *app)
 kstatus_t
 ki_aio_exec(int ktd, kapplet_t *app, void *cctx, kio_t **kio)
 {
-	return(e_exec_aio_generic(ktd, app, cctx, kio));
+	return(e_exec_aio_generic(ktd, app, 1, cctx, kio));
 }
 
 
@@ -544,81 +500,86 @@ ki_exec(int ktd, kapplet_t *app)
  * Helper functions
  */
 
-/* Shorten this behemoth */
-#define mapplet_init com__seagate__kinetic__proto__command__manage_applet__init
-
-struct kresult_message
-create_exec_message(kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kapplet_t *app)
+/* Gathered length of an applet key, 0 if it is used in place */
+static size_t
+exec_keylen(kv_t *key)
 {
-	int i, j, len;
-	kv_t *key;
-	ProtobufCBinaryData *progkey = NULL;
-	ProtobufCBinaryData outkey = {.data=NULL, .len=0,};
-	kproto_kapplet_t proto_cmd_body;
-	ProtobufCBinaryData command_bytes = {.data=NULL, .len=0,};
+	size_t j, len = 0;
 
-	mapplet_init(&proto_cmd_body);
+	if (key->kv_keycnt < 2)
+		return(0);
 
-	/* 
-	 * consolidate and copy app fnkeys to the cmd body
-	 * But first need an appropriately sized vector
-	 */
-	if (app->ka_fnkeycnt) {
-		len = sizeof(ProtobufCBinaryData) * app->ka_fnkeycnt;
-		progkey = (ProtobufCBinaryData *)KI_MALLOC(len);
-		if (!progkey) {
-			goto cb_ex;
-		}
-		memset(progkey, 0, len);
-	}
+	for (j=0; j<key->kv_keycnt; j++)
+		len += key->kv_key[j].kiov_len;
+	return(len);
+}
 
-	/* Now copy the keys, first the function keys */
-	for (i=0; i<app->ka_fnkeycnt; i++) {
-		if (!(key = app->ka_fnkey[i])) {
-			goto cb_ex;
-		}
+/*
+ * Point kb at an applet key. A key in one fragment is used where it is,
+ * a fragmented key is gathered at *p, which is advanced past it.
+ */
+static void
+exec_key(ProtobufCBinaryData *kb, kv_t *key, uint8_t **p)
+{
+	size_t j;
 
-		/* Get the length */
-		for (progkey[i].len=0, j=0; j< key->kv_keycnt; j++)
-			progkey[i].len += key->kv_key[j].kiov_len;
+	if (key->kv_keycnt < 2) {
+		kb->data = (key->kv_keycnt ? key->kv_key[0].kiov_base : NULL);
+		kb->len  = (key->kv_keycnt ? key->kv_key[0].kiov_len : 0);
+		return;
+	}
 
-		/* Allocate the vector element */
-		progkey[i].data = (uint8_t *)KI_MALLOC(progkey[i].len);
-		if (!progkey[i].data) {
-			goto cb_ex;
-		};
+	kb->data = *p;
+	kb->len  = 0;
+	for (j=0; j<key->kv_keycnt; j++) {
+		memcpy(*p, key->kv_key[j].kiov_base, key->kv_key[j].kiov_len);
+		*p      += key->kv_key[j].kiov_len;
+		kb->len += key->kv_key[j].kiov_len;
+	}
+}
+
+/*
+ * Fill an initialized ManageApplet body from the applet. The program key
+ * vector and any fragmented keys gathered for it share one allocation
+ * hung on the body, release it with exec_body_free() whether or not this
+ * succeeds.
+ */
+static int
+exec_body(kproto_kapplet_t *body, kapplet_t *app)
+{
+	int i;
+	size_t len, glen;
+	uint8_t *p;
+	ProtobufCBinaryData *progkey;
+	ProtobufCBinaryData outkey = {.data=NULL, .len=0,};
 
-		/* Copy key vector into it */
-		for (len=0, j=0; j<key->kv_keycnt; j++) {
-			strncpy((char *)&progkey[i].data[len],
-				key->kv_key[j].kiov_base,
-				key->kv_key[j].kiov_len);
-			len += key->kv_key[j].kiov_len;
+	/* Size the program key vector and the keys that need gathering */
+	for (glen=0, i=0; i<app->ka_fnkeycnt; i++) {
+		if (!app->ka_fnkey[i]) {
+			return(-1);
 		}
+		glen += exec_keylen(app->ka_fnkey[i]);
 	}
+	if (app->ka_outkey)
+		glen += exec_keylen(app->ka_outkey);
 
-	/* Now the outkey if necessary */
-	if (app->ka_outkey) {
-		key = app->ka_outkey;
-		
-		/* Get the length */
-		for (outkey.len=0, j=0; j<key->kv_keycnt; j++)
-			outkey.len += key->kv_key[j].kiov_len;
-
-		/* Allocate the outkey */
-		outkey.data = (uint8_t *)KI_MALLOC(outkey.len);
-		if (!outkey.data) {
-			goto cb_ex;
-		};
-
-		/* Copy key vector into it */
-		for (len=0, j=0; j<key->kv_keycnt; j++) {
-			strncpy((char *)&outkey.data[len],
-				key->kv_key[j].kiov_base,
-				key->kv_key[j].kiov_len);
-			len += key->kv_key[j].kiov_len;
+	len = sizeof(ProtobufCBinaryData) * app->ka_fnkeycnt;
+	if (len + glen) {
+		progkey = (ProtobufCBinaryData *)KI_MALLOC(len + glen);
+		if (!progkey) {
+			return(-1);
 		}
+		body->programkey = progkey;
 	}
+	body->n_programkey = app->ka_fnkeycnt;
+
+	/* Now the keys, first the function keys then the outkey if any */
+	p = (uint8_t *)body->programkey + len;
+	for (i=0; i<app->ka_fnkeycnt; i++)
+		exec_key(&body->programkey[i], app->ka_fnkey[i], &p);
+
+	if (app->ka_outkey)
+		exec_key(&outkey, app->ka_outkey, &p);
 		
 	/* 
 	 * Manage applet names in the proto are weird. 
@@ -637,55 +598,62 @@ create_exec_message(kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kapplet_t *app)
 	 *	(optional) setValueInResponse = 1
 	 */
 
-	set_primitive_optional(&proto_cmd_body,
-			       manageapplettype, CSMAT(EXECUTE));
-
-	set_primitive_optional(&proto_cmd_body, lang, app->ka_fntype);
+	set_primitive_optional(body, manageapplettype, CSMAT(EXECUTE));
 
-	proto_cmd_body.programkey = progkey;
-	proto_cmd_body.n_programkey = app->ka_fnkeycnt;
+	set_primitive_optional(body, lang, app->ka_fntype);
 
 	/* maxruntime unused */
-	/* set_primitive_optional(&proto_cmd_body, maxruntime, 0); */
+	/* set_primitive_optional(body, maxruntime, 0); */
 
 	/* processstatus unused */
 	
 	/* watchscope unused */
 		
-	proto_cmd_body.programparam   = app->ka_argv;
-	proto_cmd_body.n_programparam = app->ka_argc;
+	body->programparam   = app->ka_argv;
+	body->n_programparam = app->ka_argc;
 
-	set_primitive_optional(&proto_cmd_body,
-			       acknowledgemode, CSMAAM(ON_COMPLETION));
+	set_primitive_optional(body, acknowledgemode, CSMAAM(ON_COMPLETION));
 
 	/* notification unused */
 	
-	/* set_primitive_optional(&proto_cmd_body, notifyoncompletion, 1); */
+	/* set_primitive_optional(body, notifyoncompletion, 1); */
 
-	if (outkey.data) {
-		set_primitive_optional(&proto_cmd_body, outputkey, outkey);
-		set_primitive_optional(&proto_cmd_body, setvalueinresponse, 1);
+	if (app->ka_outkey) {
+		set_primitive_optional(body, outputkey, outkey);
+		set_primitive_optional(body, setvalueinresponse, 1);
 	}
-	
+
+	return(0);
+}
+
+/* Free the program key vector and keys exec_body() gathered */
+static void
+exec_body_free(kproto_kapplet_t *body)
+{
+	if (body->programkey)
+		KI_FREE(body->programkey);
+}
+
+struct kresult_message
+create_exec_message(kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kapplet_t *app)
+{
+	kproto_kapplet_t proto_cmd_body;
+	ProtobufCBinaryData command_bytes = {.data=NULL, .len=0,};
+
+	mapplet_init(&proto_cmd_body);
+
 	/*
 	 * Time to construct the command bytes to place into message
 	 */
-	command_bytes = create_command_bytes(cmd_hdr, (void *) &proto_cmd_body);
+	if (exec_body(&proto_cmd_body, app) == 0)
+		command_bytes = create_command_bytes(cmd_hdr,
+						     (void *) &proto_cmd_body);
 
 	/* 
 	 * since the cmd_body now is in command bytes, 
 	 * programkey and outkey can be freed
 	 */
- cb_ex:
-	for (i=0;i<app->ka_fnkeycnt; i++) {
-		if (progkey[i].data)
-			KI_FREE(progkey[i].data);
-	}
-	if (progkey)
-		KI_FREE(progkey);
-
-	if (outkey.data)
-		KI_FREE(outkey.data);
+	exec_body_free(&proto_cmd_body);
 
 	/* This is the exit for allocation errs above and cmd bytes failures */
 	if (!command_bytes.data) {
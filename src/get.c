@@ -40,7 +40,7 @@ create_getkey_message(kmsghdr_t *, kcmdhdr_t *, kv_t *);
 
 kstatus_t
 g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
-		  void *cctx, kio_t **ckio)
+		  int aio, void *cctx, kio_t **ckio)
 {
 	int rc, n, verck, valck;	/* return code, temp, vers/val check */
 	kstatus_t krc;			/* Kinetic return code */
@@ -50,8 +50,7 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	kmsghdr_t msg_hdr;		/* Unpacked message header */ 
 	kcmdhdr_t cmd_hdr;		/* Unpacked Command header */
 	struct ktli_config *cf;		/* KTLI configuration info */
-	struct kresult_message kmreq;	/* Intermediate req representation */
-	kpdu_t pdu;			/* Unpacked PDU structure */
+	int kts;			/* KTLI session to send on */
 	struct timespec	start;		/* Temp start timestamp */
 	
 	/*
@@ -149,11 +148,6 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * be used later on to calculate the actual HMAC which will then 
 	 * replace the HMAC key on the kmh_hmac field. 
-	 * 
-	 * A reference is made to the kcfg_hkey ptr in the kmreq. This 
-	 * reference needs to be removed before destroying kmreq.  The
-	 * protobuf code will try to clean up this ptr which is an outside
-	 * unfreeable ptr.  See below at gex_req:
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -164,19 +158,26 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type  = msg_type;
 
-	kmreq = create_getkey_message(&msg_hdr, &cmd_hdr, kv);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("get: request message create");
-		krc = K_ENOMEM;
-		goto gex_kio;
-	}
+	/* A request may carry its own priority, see kv_pri */
+	if (kv->kv_pri)
+		cmd_hdr.kch_pri = kv->kv_pri;
+
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, NULL, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
 
 	/* Setup the KIO */
 	kio->kio_magic	= KIO_MAGIC;
 	kio->kio_cmd	= msg_type;
+	kio->kio_pri	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
+	if (aio)
+		KIOF_SET(kio, KIOF_REAP);	/* ki_aio_reap may take it */
 
 	KIOF_SET(kio, KIOF_REQRESP);	/* Normal RPC KIO */
+	KIOF_SET(kio, KIOF_CRREAD);	/* Pending read, see ki_admission */
 
 	/* If timestamp tracking is enabled for this op set it in the KIO */
 	if (KIOP_ISSET((&kst->kst_gets), KOPF_TSTAT)) {
@@ -201,45 +202,26 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("get: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto gex_kmreq;
-	}
-
-	/* Allocate the Packed PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len = KP_PLENGTH;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
-
-	if (!kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base) {
-		debug_printf("get: sendmesg PDU alloc");
-		krc = K_ENOMEM;
-		goto gex_kmmsg;
+		goto gex_kio;
 	}
 
-	/* pack the message and hang it on the kio */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("get: sendmesg msg pack");
+	/*
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_kv(cf, kio, &msg_hdr, &cmd_hdr, kv, 0) < 0) {
+		debug_printf("get: request encode");
 		krc = K_EINTERNAL;
-		goto gex_kmmsg_pdu;
+		goto gex_kmmsg;
 	}
-
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-	PACK_PDU(&pdu, (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	debug_printf("get: PDU(x%2x, %d, %d)\n",
-		     pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
+	debug_printf("get: PDU(x%2x, %lu, 0)\n",
+		     KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	/* Send the request */
-	if (ktli_send(ktd, kio) < 0) {
+	if (ktli_send(kts, kio) < 0) {
+		/* Past the server's pending limit, see ki_admission */
+		krc = (errno == EAGAIN) ? K_EAGAIN : K_EINTERNAL;
 		debug_printf("get: kio send");
-		krc = K_EINTERNAL;
 		goto gex_kmmsg_msg;
 	}
 	debug_printf("Sent Kio: %p\n", kio);
@@ -247,19 +229,8 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	/*
 	 * Successful Exit.
 	 * Return the kio.
-	 * Cleanup before return, the only thing that needs to go 
-	 * is the unpacked protobuf request message kmreq.
-	 *
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
 	 */
 	*ckio = kio;
-	
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
 
 	return(K_OK);
 
@@ -270,25 +241,11 @@ g_get_aio_generic(int ktd, kv_t *kv, kv_t *altkv, kmtype_t msg_type,
 	 */
 
  gex_kmmsg_msg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
- gex_kmmsg_pdu:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	
  gex_kmmsg:
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
- gex_kmreq:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
-
  gex_kio:
 	kio->kio_magic = 0; /* clear the kio magic  in case this lives on */
 	KI_FREE(kio);
@@ -404,8 +361,7 @@ g_get_aio_complete(int ktd, struct kio *kio, void **cctx)
 	}
 
 	// unpack the message; 
-	kmresp = unpack_kinetic_message(kiov[KIOV_MSG].kiov_base,
-					kiov[KIOV_MSG].kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("get: msg unpack");
 		krc = K_EINTERNAL;
@@ -450,7 +406,7 @@ g_get_aio_complete(int ktd, struct kio *kio, void **cctx)
 		*cctx = kio->kio_cctx;
 
 	/* clean up */
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  gex:
 	/* depending on errors the recvmsg may or may not exist */
@@ -462,13 +418,11 @@ g_get_aio_complete(int ktd, struct kio *kio, void **cctx)
 		if ((kio->kio_recvmsg.km_cnt > KIOV_PDU) &&
 		    kio->kio_recvmsg.km_msg[KIOV_PDU].kiov_base) {
 			rl += kio->kio_recvmsg.km_msg[KIOV_PDU].kiov_len; /* Stats */
-			KI_FREE(kio->kio_recvmsg.km_msg[KIOV_PDU].kiov_base);
 		}
 
 		if ((kio->kio_recvmsg.km_cnt >= KIOV_MSG) &&
 		    kio->kio_recvmsg.km_msg[KIOV_MSG].kiov_base) {
 			rl += kio->kio_recvmsg.km_msg[KIOV_MSG].kiov_len; /* Stats */
-			KI_FREE(kio->kio_recvmsg.km_msg[KIOV_MSG].kiov_base);
 		}
 
 		if ((kio->kio_recvmsg.km_cnt >= KIOV_VAL) &&
@@ -480,23 +434,17 @@ g_get_aio_complete(int ktd, struct kio *kio, void **cctx)
 		 * In most cases leave the value buffer for the caller.
 		 * Free it if: there was an error or the command was GETVERS 
 		 */
-		if ((kio->kio_recvmsg.km_cnt > KIOV_VAL) &&
-		    kio->kio_recvmsg.km_msg[KIOV_VAL].kiov_base &&
-		    ((krc != K_OK) ||
-		     (kio->kio_cmd == KMT_GETVERS) ||
-		     (kv->kv_metaonly)))
-			KI_FREE(kio->kio_recvmsg.km_msg[KIOV_VAL].kiov_base);
-
-		KI_FREE(kio->kio_recvmsg.km_msg);
+		ktli_recvmsg_free(kio, !((krc != K_OK) ||
+					 (kio->kio_cmd == KMT_GETVERS) ||
+					 (kv->kv_metaonly)));
 	}
 
 	/*
 	 * sendmsg always exists here and there is not KIOV_VAL
 	 */
-	for (i=0; i < kio->kio_sendmsg.km_cnt; i++) {
+	for (i=0; i < kio->kio_sendmsg.km_cnt; i++)
 		sl += kio->kio_sendmsg.km_msg[i].kiov_len; /* Stats */
-		KI_FREE(kio->kio_sendmsg.km_msg[i].kiov_base);
-	}
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
 	if (krc == K_OK) {
@@ -574,7 +522,7 @@ g_get_generic(int ktd, kv_t *kv,  kv_t *altkv, kmtype_t msg_type)
 	kstatus_t ks;
 	kio_t *kio;
 			
-	ks = g_get_aio_generic(ktd, kv, altkv, msg_type, NULL, &kio);
+	ks = g_get_aio_generic(ktd, kv, altkv, msg_type, 0, NULL, &kio);
 	if (ks != K_OK) {
 		return(ks);
 	}
@@ -624,7 +572,7 @@ g_get_generic(int ktd, kv_t *kv,  kv_t *altkv, kmtype_t msg_type)
 kstatus_t
 ki_aio_get(int ktd, kv_t *key, void *cctx, kio_t **ckio)
 {
-	return(g_get_aio_generic(ktd, key, NULL, KMT_GET, cctx, ckio));
+	return(g_get_aio_generic(ktd, key, NULL, KMT_GET, 1, cctx, ckio));
 }
 
 
@@ -669,7 +617,7 @@ ki_get(int ktd, kv_t *key)
 kstatus_t
 ki_aio_getnext(int ktd, kv_t *key, kv_t *next, void *cctx, kio_t **ckio)
 {
-	return(g_get_aio_generic(ktd, key, next, KMT_GET, cctx, ckio));
+	return(g_get_aio_generic(ktd, key, next, KMT_GET, 1, cctx, ckio));
 }
 
 
@@ -717,7 +665,7 @@ ki_getnext(int ktd, kv_t *key, kv_t *next)
 kstatus_t
 ki_aio_getprev(int ktd, kv_t *key, kv_t *prev, void *cctx, kio_t **ckio)
 {
-	return(g_get_aio_generic(ktd, key, prev, KMT_GET, cctx, ckio));
+	return(g_get_aio_generic(ktd, key, prev, KMT_GET, 1, cctx, ckio));
 }
 
 
@@ -765,7 +713,7 @@ ki_getprev(int ktd, kv_t *key, kv_t *prev)
 kstatus_t
 ki_aio_getvers(int ktd, kv_t *key, void *cctx, kio_t **ckio)
 {
-	return(g_get_aio_generic(ktd, key, NULL, KMT_GET, cctx, ckio));
+	return(g_get_aio_generic(ktd, key, NULL, KMT_GET, 1, cctx, ckio));
 }
 
 
@@ -48,14 +48,13 @@ ki_getlog(int ktd, kgetlog_t *glog)
 	struct kio *kio;
 	struct kiovec *kiov;
 	struct ktli_config *cf;
-	uint8_t ppdu[KP_PLENGTH];
-	kpdu_t pdu;
+	int kts;
 	kpdu_t rpdu;
 	kmsghdr_t msg_hdr;
 	kcmdhdr_t cmd_hdr;
 	kgetlog_t glog2;
 	ksession_t *ses;
-	struct kresult_message kmreq, kmresp;
+	struct kresult_message kmresp;
 
 	/* Get KTLI config */ 
 	rc = ktli_config(ktd, &cf);
@@ -90,9 +89,7 @@ ki_getlog(int ktd, kgetlog_t *glog)
 	 * bytes don't actually get finalized until a ktli_send is initiated.
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * used later on to calculate the actual HMAC which will then be hung
-	 * of the kmh_hmac field.  A reference is made to the kcfg_hkey ptr 
-	 * in the kmreq. This reference needs to be removed before freeing 
-	 * kmreq. See below at glex_req:
+	 * of the kmh_hmac field.
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -103,15 +100,15 @@ ki_getlog(int ktd, kgetlog_t *glog)
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type      = KMT_GETLOG;
 
-	kmreq = create_getlog_message(&msg_hdr, &cmd_hdr, glog);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("getlog: request message create");
-		krc = K_EINTERNAL;
-		goto glex_kio;
-	}
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, NULL, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
 
 	/* Setup the KIO */
 	kio->kio_cmd            = KMT_GETLOG;
+	kio->kio_pri            = ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags		= KIOF_INIT;
 	KIOF_SET(kio, KIOF_REQRESP);		/* Normal RPC */
 
@@ -126,38 +123,23 @@ ki_getlog(int ktd, kgetlog_t *glog)
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("getlog: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto glex_req;
+		goto glex_kio;
 	}
 
-	/* Hang the Packed PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = (void *) ppdu;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-
-	/* pack the message and hang it on the kio */
-	/* PAK: Error handling */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("getlog: sendmesg msg pack");
+	/*
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_getlog(cf, kio, &msg_hdr, &cmd_hdr, glog) < 0) {
+		debug_printf("getlog: request encode");
 		krc = K_EINTERNAL;
-		goto glex_sendmsg;
+		goto glex_kmmsg;
 	}
-	
-	/* Now that the message length is known, setup the PDU and pack it */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[1].kiov_len;
-	pdu.kp_vallen = 0;
-	PACK_PDU(&pdu, ppdu);
-	debug_printf("getlog: PDU(x%2x, %d, %d)\n",
-	       pdu.kp_magic, pdu.kp_msglen ,pdu.kp_vallen);
+	debug_printf("getlog: PDU(x%2x, %lu, 0)\n",
+	       KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	/* Send the request */
-	ktli_send(ktd, kio);
+	ktli_send(kts, kio);
 	debug_printf ("Sent Kio: %p\n", kio);
 
 	/* Wait for the response */
@@ -217,7 +199,7 @@ ki_getlog(int ktd, kgetlog_t *glog)
 
     // End: Added PDU checking code based on src/batch.c
 
-	kmresp = unpack_kinetic_message(kiov->kiov_base, kiov->kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("getlog: msg unpack");
 		krc = K_EINTERNAL;
@@ -244,28 +226,16 @@ ki_getlog(int ktd, kgetlog_t *glog)
 
 	/* clean up */
  glex_resp:
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  glex_recvmsg:
-	KI_FREE(kio->kio_recvmsg.km_msg[KIOV_PDU].kiov_base);
-	KI_FREE(kio->kio_recvmsg.km_msg[KIOV_MSG].kiov_base);
-	KI_FREE(kio->kio_recvmsg.km_msg);
+	ktli_recvmsg_free(kio, 0);
 
  glex_sendmsg:
-	/* sendmsg.km_msg[0] Not allocated, static */
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-	KI_FREE(kio->kio_sendmsg.km_msg);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
- glex_req:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that 
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-	
-	destroy_message(kmreq.result_message);
+ glex_kmmsg:
+	KI_FREE(kio->kio_sendmsg.km_msg);
 
 glex_kio:
 	KI_FREE(kio);
@@ -60,7 +60,17 @@ extern "C" {
 
 /* Connection mgt */
 int ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *pass);
+int ki_open_conns(char *host, char *port, uint32_t usetls, int64_t id,
+		  char *pass, int nconn);
 int ki_close(int ktd);
+kstatus_t ki_reactors(int nthreads);
+kstatus_t ki_busypoll(int enable, uint32_t spinus, int sendcpu, int recvcpu);
+kstatus_t ki_sendseq(int enable);
+kstatus_t ki_zerocopy(int enable);
+kstatus_t ki_iotune(uint32_t spins, uint32_t waitms, uint32_t stallms);
+kstatus_t ki_priorities(int strict, uint32_t high, uint32_t normal,
+			uint32_t low);
+kstatus_t ki_admission(int ktd, kadmit_t policy);
 
 /* Kinetic type interfaces */
 void *ki_create(int ktd, ktype_t kt);
@@ -123,8 +133,17 @@ kstatus_t ki_aio_exec(int ktd, kapplet_t *app, void *cctx, kio_t **kio);
 /* Kinetic asynchronous common complete interface */
 kstatus_t ki_aio_complete(int ktd, kio_t *kio, void **cctx);
 
-/* Kinetic poll interface */
+/* Kinetic asynchronous batch completion interfaces */
+int ki_aio_reap(int ktd, kio_t **kio, int max, int timeout);
+void *ki_aio_cctx(kio_t *kio);
+kstatus_t ki_aio_callback(int ktd, kaio_cb_t cb, int nthreads);
+
+/* Kinetic asynchronous per KIO response timeout, in milliseconds */
+kstatus_t ki_aio_settimeout(int ktd, kio_t *kio, uint32_t ms);
+
+/* Kinetic poll interfaces */
 int ki_poll(int ktd, int timeout);
+int ki_pollfd(int ktd);
 
 /* Kinetic key iterator interfaces */
 struct kiovec *ki_start(kiter_t *kit, krange_t *kr);
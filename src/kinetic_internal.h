@@ -22,20 +22,26 @@
 #include "kinetic_types.h"
 #include "session.h"
 #include "list.h"
+#include "ktli_pool.h"
 
 /* ------------------------------
  * Constants
  */
 
-/* Abstracting malloc and free, permits testing  */ 
+/*
+ * Abstracting malloc and free, permits testing. Allocations come from the
+ * object pools, see ktli_pool.c. KI_FREE also takes malloc(3) memory, but
+ * memory from KI_MALLOC must never reach free(3): anything that protobuf-c
+ * will free, or that callers free themselves, must come from malloc(3).
+ */ 
 #define UNALLOC_VAL ((void *) 0xDEADCAFE)
 
-#define KI_MALLOC(_l)     malloc((_l))
-#define KI_REALLOC(_p,_l) realloc((_p),(_l))
+#define KI_MALLOC(_l)     ktli_pool_alloc((_l))
+#define KI_REALLOC(_p,_l) ktli_pool_realloc((_p),(_l))
 //	debug_printf("KI_FREE(%p)\n", (_p));
 #define KI_FREE(_p) {	    \
-	free((_p));         \
-	(_p) = UNALLOC_VAL; \
+	ktli_pool_free((_p)); \
+	(_p) = UNALLOC_VAL;   \
 }
 
 /* ------------------------------
@@ -121,6 +127,8 @@ typedef struct kb {
 	uint32_t	kb_ops;		/* Batch Ops count */
 	uint32_t	kb_dels;	/* Batch Delete Ops count */
 	uint32_t	kb_bytes;	/* Batch total bytes */ 
+	int		kb_conn;	/* Connection the batch is pinned to,
+					   -1 until the start is sent */
 	pthread_mutex_t	kb_m;		/* Mutex protecting this structure */
 #ifdef KBATCH_SEQTRACKING
 	LIST		*kb_seqs;	/* the batch ops, perserved as seq# */
@@ -150,6 +158,9 @@ int ki_validate_glog2(kgetlog_t *glrq, kgetlog_t *glrsp);
 int ki_validate_kstats(kstats_t *kst);
 int ki_validate_kapplet(kapplet_t *app, klimits_t *lim);
 
+int ki_conn(int ktd, ksession_t *ses, kb_t *kb, kcmdhdr_t *ch);
+int ki_sendpri(kpriority_t pri);
+
 int b_batch_addop(kb_t *kb, kcmdhdr_t *kc);
 kstatus_t b_startbatch(int ktd, kbatch_t *kb);
 
@@ -187,6 +187,9 @@ typedef struct kgetlog {
  * kv_cpolicy	This specifies the caching policy for this key value. It must
  * 		be specified on each operation. Can be write through,
  * 		write back or flush.
+ * kv_pri	Optional priority of the operation, LOWEST to HIGHEST, 0 uses
+ *		the session's. It is sent to the server and orders the
+ *		client send queue, ignored for batch operations.
  */
 typedef struct kv {
 	struct kiovec  *kv_key;
@@ -206,6 +209,9 @@ typedef struct kv {
 	/* NOTE: currently, this also frees kv_data */
 	void        *kv_protobuf;
 	void        (*destroy_protobuf)(struct kv *kv_data);
+
+	/* Appended, keeps the layout of the fields above */
+	kpriority_t	kv_pri;
 } kv_t;
 
 /**
@@ -307,6 +313,16 @@ typedef void kbatch_t;
 typedef void kio_t;
 
 
+/**
+ * AIO completion callback type
+ *
+ * Called on a completion thread, see ki_aio_callback, with the status
+ * ki_aio_complete returned for a request and the request's caller context.
+ *
+ */
+typedef void (*kaio_cb_t)(int ktd, kstatus_t ks, void *cctx);
+
+
 /**
  * Kinetic Applet types
  */
@@ -400,6 +416,20 @@ typedef struct kapplet {
 } kapplet_t;
 
 
+/*
+ * Admission control policies, see ki_admission(). Requests past the
+ * server's pending read or write limits are either held on the client
+ * until earlier ones complete or failed with K_EAGAIN. An adaptive
+ * window holds requests past a depth tuned to the measured latency.
+ */
+typedef enum kadmit {
+	KADM_NONE	= 0,	/* No client side limits */
+	KADM_QUEUE,		/* Hold requests past the limits */
+	KADM_REJECT,		/* Fail requests past the limits */
+	KADM_ADAPT,		/* Hold requests past an adaptive window */
+} kadmit_t;
+
+
 /*
  * Kinetic Operation Statistic Structures
  *
@@ -488,6 +518,24 @@ typedef struct  kstats {
 	kopstat_t 	kst_flushs;
 	kopstat_t 	kst_execs;
 
+	/*
+	 * Admission control, see ki_admission(). Kept by KTLI over all
+	 * connections, ki_putstats does not reset them. Times in usecs.
+	 */
+	uint64_t	kst_crwaits;	/* Requests held for a credit */
+	uint64_t	kst_crrejects;	/* Requests failed with K_EAGAIN */
+	uint64_t	kst_crwaitus;	/* Total time held for credits */
+	uint64_t	kst_crwaitmax;	/* Longest time held for a credit */
+
+	/*
+	 * Adaptive windows, KADM_ADAPT only. Windows are summed and round
+	 * trips averaged over the connections, in usecs, 0 until measured.
+	 */
+	uint32_t	kst_rdwin;	/* Reads allowed outstanding */
+	uint32_t	kst_wrwin;	/* Writes allowed outstanding */
+	uint64_t	kst_rdrtt;	/* Smoothed read round trip */
+	uint64_t	kst_wrrtt;	/* Smoothed write round trip */
+
 #if 0
 	kopstat_t 	kst_cbats;	/* Create Batch */
 	kopstat_t 	kst_sbats;	/* Submit Batch */
@@ -32,6 +32,30 @@ enum kio_state {
 	KIO_TIMEDOUT	,
 };
 
+/*
+ * This library uses KIO vectors using the following convention.
+ * Out bound messages:
+ * 	Vector	Contents
+ * 	  0	The Kinetic PDU
+ *	  1	The packed Kinetic request message
+ *	  2	(optional)The value,
+ * 		It may occupy multiple elements starting at 2, which permits
+ *		API callers to build up a value without copying it into a
+ *		single contiguous buffer.
+ * In bound messages:
+ *	  0	The Kinetic PDU
+ *	  1	The packed Kinetic response message 
+ * 	  2	An optional value
+ */
+enum kio_index {
+	KIOV_PDU	= 0,
+	KIOV_MSG	= 1,
+	KIOV_VAL	= 2,
+};
+
+#define KM_CNT_NOVAL   2
+#define KM_CNT_WITHVAL 3
+
 struct kio_msg {
 	struct kiovec *km_msg;  /* Ptr to an ARRAY[] of kiovecs that
 				   contain the header (PDU), message
@@ -39,6 +63,13 @@ struct kio_msg {
 	int km_cnt;             /* number of kiovecs in km_msg ARRAY */
 	int km_status;
 	int km_errno;
+	void *km_rbuf;		/* Recv chunk backing a received PDU and
+				   message, see ktli_recvmsg_free() */
+};
+
+/* Intrusive queue link, see ktli_mpsc.c */
+struct kio_link {
+	struct kio_link	*kl_next;
 };
 
 /*
@@ -51,6 +82,14 @@ enum kio_flags {
 					/* mutually exclusive wrt normal case */
 	KIOF_RESPONLY	= 0x0004,	/* Unsolicited Repsponses */
 	KIOF_TSTAMP	= 0x0008,	/* Enable Time stamp collection */
+	KIOF_SEQSLOT	= 0x0010,	/* Seq slot reserved, see kio_seqslot */
+	KIOF_RSCAN	= 0x0020,	/* Resp scanned, see kio_rscan */
+	KIOF_REAP	= 0x0040,	/* May be taken by ktli_reap */
+	KIOF_REAPED	= 0x0080,	/* Taken off the compq, see ktli_reap */
+	KIOF_CRREAD	= 0x0100,	/* Takes a read credit, see ktli_credits */
+	KIOF_CRWRITE	= 0x0200,	/* Takes a write credit */
+	KIOF_CREDIT	= 0x0400,	/* Holds its credit, KTLI internal */
+	KIOF_RTT	= 0x0800,	/* Round trip sampled, KTLI internal */
 
 #define KIOF_SET(_kio, _kiof)	((_kio)->kio_flags |= (_kiof))
 #define KIOF_CLR(_kio, _kiof)	((_kio)->kio_flags &= ~(_kiof))
@@ -64,11 +103,12 @@ enum kio_flags {
  * response never arrives the req can languish forever on the receive Q. So
  * a timeout mechanism is implemented.  Prior to sending the req, the current
  * time is read, a timeout is calculated into the future by adding
- * KIO_TIMEOUT_S to it. This timeout is set on the KIO.  The receive loop
- * then scans for KIOs who's timeout value is older than the current time. Those
- * KIOs are marked as timedout and moved to the completeion Q.
+ * kio_tmo_ms, or KIO_TIMEOUT_S if that is unset, to it. This timeout is set
+ * on the KIO and the KIO is hung on the receive Q timing wheel. The receive
+ * loop then expires the wheel slots that are due. Those KIOs are marked
+ * as timedout and moved to the completeion Q.
  *
- * This is the number of seconds to wait for a response
+ * This is the default number of seconds to wait for a response
  */
 #define KIO_TIMEOUT_S 30
 #define KIO_CLOCK CLOCK_MONOTONIC
@@ -81,6 +121,37 @@ struct kio_tstamps {
 	struct timespec	kiot_comp;	/* KIO RPC completed */
 };
 
+/*
+ * Reserved sequence slot.  A request can be encoded with a fixed width
+ * sequence field and a fixed size HMAC field.  The sender can then stamp the
+ * sequence directly into the packed message and compute the HMAC in place,
+ * without unpacking and repacking it. Message lengths do not change so the
+ * PDU is untouched. All offsets are relative to the start of KIOV_MSG.
+ */
+struct kio_seqslot {
+	uint32_t	kss_seqoff;	/* Offset of the sequence slot */
+	uint32_t	kss_cmdoff;	/* Offset of the command bytes */
+	uint32_t	kss_cmdlen;	/* Length of the command bytes */
+	uint32_t	kss_hmacoff;	/* Offset of the HMAC */
+	char		*kss_hkey;	/* HMAC key */
+	uint32_t	kss_hkeylen;	/* HMAC key length */
+	void		*kss_hctx;	/* Pre-keyed HMAC state, or NULL */
+};
+
+/*
+ * Received message scan results.  The receiver thread walks the wire bytes
+ * of each response to find its ackSequence and records what it learned
+ * along the way, so that the completion path does not have to decode the
+ * outer message again. krs_msg is a shell message whose commandbytes refer
+ * directly into KIOV_MSG, see unpack_response_message().
+ */
+struct kio_rscan {
+	uint32_t	krs_cmdoff;	/* Offset of the command bytes, 0 if
+					   not found */
+	uint32_t	krs_cmdlen;	/* Length of the command bytes */
+	kproto_msg_t	krs_msg;	/* Shell message for the completion */
+};
+
 /**
  * This is a client lib and the majority of exchanges in kinetic are RPCs,
  * ie. req then resp. (there are unsolicited responses and some some req only
@@ -93,6 +164,13 @@ struct kio_tstamps {
  * Receive msg kiovec buffers are allocated by the lower receive layers.
  * All kiovec buffers in the kio structure are the responsibility of the
  * caller to free, including buffers allocated by lower level receive code.
+ * The received PDU and message are slices of a shared receive buffer, they
+ * must be released with ktli_recvmsg_free(), which frees the value too
+ * unless the caller keeps it.
+ * On a session with zero copy sends (KCFF_ZEROCOPY) the kernel may still be
+ * transmitting from the send buffers after the response is in. Such a KIO
+ * is held back and only completed once the kernel is done with them too,
+ * so send buffers may always be reused once their KIO completes.
  *
  * Timeout value should be set by the KTLI send processing and periodically
  * checked by the receiver thread.
@@ -119,11 +197,28 @@ struct kio {
 	struct kio_msg	kio_recvmsg;	/* passed in empty to be filled
 					   by the receive code. Caller
 					   responsible to free msg buffers
-					   within. */
+					   within, see ktli_recvmsg_free() */
+	struct kiovec	kio_rvec[KM_CNT_WITHVAL]; /* recvmsg kiovecs */
 
 	struct timespec	kio_timeout;	/* Timestamp when msg should be failed*/
+	uint32_t	kio_tmo_ms;	/* Timeout in ms, 0 is KIO_TIMEOUT_S */
+	uint64_t	kio_twexp;	/* Timing wheel deadline, in ms */
+	struct kio	*kio_twnext;	/* Timing wheel chain */
+	struct kio	**kio_twpprev;	/* NULL when not on the wheel */
 
 	void 		*kio_qbp;	/* Queue element back pointer */ 
+	struct kio	*kio_ifnext;	/* In-flight table chain */
+	struct kio_link	kio_sqlink;	/* Send queue link */
+
+	uint64_t	kio_zct;	/* Zero copy token, 0 if none, see
+					   ktli_zcheld() */
+	struct kio	*kio_zcnext;	/* Zero copy wait chain */
+
+	int		kio_stripe;	/* Stripe member sent on + 1, 0 if
+					   none, see ktli_stripe() */
+	struct kio	*kio_crnext;	/* Credit wait chain */
+	int		kio_pri;	/* Send priority, enum ktli_pri */
+	struct timespec	kio_crts;	/* When it started waiting */
 
 	/* Saved caller params and context for aio */
 	void 		*kio_cctx;
@@ -134,33 +229,12 @@ struct kio {
 
 	struct kio_tstamps kio_ts;	/* Time Stamps, used only when enabled
 					   via kio_flags */
-};
 
+	struct kio_seqslot kio_ss;	/* Seq slot, valid only when
+					   KIOF_SEQSLOT is set */
 
-/*
- * This library uses KIO vectors using the following convention.
- * Out bound messages:
- * 	Vector	Contents
- * 	  0	The Kinetic PDU
- *	  1	The packed Kinetic request message
- *	  2	(optional)The value,
- * 		It may occupy multiple elements starting at 2, which permits
- *		API callers to build up a value without copying it into a
- *		single contiguous buffer.
- * In bound messages:
- *	  0	The Kinetic PDU
- *	  1	The packed Kinetic response message 
- * 	  2	An optional value
- */
-enum kio_index {
-	KIOV_PDU	= 0,
-	KIOV_MSG	= 1,
-	KIOV_VAL	= 2,
+	struct kio_rscan kio_rs;	/* Resp scan, valid only when
+					   KIOF_RSCAN is set */
 };
 
-#define KM_CNT_NOVAL   2
-#define KM_CNT_WITHVAL 3
-
-
-
 #endif /* _KIO_H */
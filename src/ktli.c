@@ -21,10 +21,19 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 
 #include "ktli.h"
 #include "ktli_session.h"
+#include "ktli_ift.h"
+#include "ktli_twheel.h"
+#include "ktli_rbuf.h"
+#include "ktli_pool.h"
+#include "ktli_mpsc.h"
+#include "ktli_reactor.h"
 
 /*
  * KTLI - Kinetic Transport Layer Interface
@@ -32,6 +41,72 @@
 
 #define KTLI_POLLINTERVAL (10 * 1000) /* 10 uS, needed locally only  */
 
+/*
+ * Sender coalescing limits. The sender drains up to KTLI_SENDBATCH KIOs
+ * per pass of the send Q and hands them to the driver as one vector,
+ * bounded by IOV_MAX vectors and KTLI_SENDBYTES bytes. A single KIO that
+ * exceeds either bound is still sent, on its own.
+ */
+#define KTLI_SENDBATCH	64
+#define KTLI_SENDBYTES	(1024 * 1024)
+
+/*
+ * Receiver batching limit. The receiver hands out at most KTLI_RECVBATCH
+ * buffered responses per pass before it goes back to check timeouts.
+ */
+#define KTLI_RECVBATCH	64
+
+/*
+ * Send priority scheduling, see ktli_sq_next(). A weighted round sends
+ * up to ktli_priw[] KIOs of each priority, unless overridden with
+ * kcfg_priw. Strict scheduling lets a priority that has been passed over
+ * KTLI_PRIAGE times in a row go next.
+ */
+#define KTLI_PRIAGE	32
+static const uint32_t ktli_priw[KTLI_NPRI] = { 8, 4, 1 };
+
+/*
+ * Adaptive credit windows, see ktli_crsample(). A window starts at
+ * KTLI_CRWINIT and stays between 1 and the class limit, KTLI_CRWMAX if
+ * the class has none. A smoothed round trip over KTLI_CRWTOL times the
+ * least of the last KTLI_CRWEPOCH samples, plus KTLI_CRWSLACK us of
+ * scheduling noise, means the device is queueing. Samples over
+ * KTLI_CRWRTTMAX us are discarded as bogus.
+ */
+#define KTLI_CRWINIT	4
+#define KTLI_CRWMAX	256
+#define KTLI_CRWTOL	2
+#define KTLI_CRWEPOCH	1024
+#define KTLI_CRWSLACK	100
+#define KTLI_CRWRTTMAX	(60 * 1000000)
+
+/*
+ * Busy poll, see KCFF_BUSYPOLL. The receiver polls the driver without
+ * sleeping and only runs its timeout pass every KTLI_SPINTMO empty polls.
+ * ktli_poll() waiters spin up to KTLI_SPINUS, or kcfg_spinus, for a
+ * completion, looking at the clock every KTLI_SPINCLK spins. Both yield
+ * the CPU every KTLI_SPINCLK spins so that an oversubscribed CPU still
+ * gets to run whoever they are waiting on.
+ */
+#define KTLI_SPINTMO	1024
+#define KTLI_SPINUS	1000
+#define KTLI_SPINCLK	64
+
+/*
+ * Submission side sequencing, see KCFF_SENDSEQ and ktli_sq_order(). Up to
+ * KTLI_ROBSIZE KIOs can be sequenced ahead of the oldest one still being
+ * stamped, the next waits for it. Must be a power of 2.
+ */
+#define KTLI_ROBSIZE	256
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ktli_cpu_relax()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ktli_cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define ktli_cpu_relax()	do { } while (0)
+#endif
+
 /*
  * *******  KTLI DRIVER TABLE *******
  * The driver table is where backend drivers register themselves.  Currently,
@@ -47,7 +122,9 @@
  */
 extern struct ktli_driver_fns socket_fns;
 //extern struct ktli_driver_fns dpdk_fns;
-//extern struct ktli_driver_fns uring_fns;
+#ifdef KTLI_URING
+extern struct ktli_driver_fns uring_fns;
+#endif
 
 struct ktli_driver {
 	enum ktli_driver_id	ktlid_id; 	/* driver id */
@@ -61,7 +138,9 @@ struct ktli_driver {
 static struct ktli_driver ktlid_table[] = {
 	{ KTLI_DRIVER_SOCKET, "ktli_socket", "Linux socket driver", &socket_fns },
 //	{ KTLI_DRIVER_DPDK,   "ktli_dpdk",   "Linux dpdk driver",   &dpdk_fns },
-//	{ KTLI_DRIVER_URING,  "ktli_uring",  "Linux io_uring driver", &uring_fns },
+#ifdef KTLI_URING
+	{ KTLI_DRIVER_URING,  "ktli_uring",  "Linux io_uring driver", &uring_fns },
+#endif
 
 	/* Must be Last */
 	{ KTLI_DRIVER_NONE,   "EOT", "End of Table", NULL },
@@ -71,11 +150,55 @@ static struct ktli_driver ktlid_table[] = {
 static void *ktli_sender(void *p);
 static void *ktli_receiver(void *p);
 
+/*
+ * Sessions are serviced by a shared reactor rather than their own
+ * threads when asked to and when the driver has a descriptor to poll.
+ */
+static inline int
+ktli_reactive(struct ktli_driver *de, struct ktli_config *cf)
+{
+	return((cf->kcfg_flags & KCFF_REACTOR) && de->ktlid_fns->ktli_dfns_fd);
+}
+
+/* The sendq is empty when all of its priority queues are */
+static inline int
+ktli_sq_empty(struct ktli_queue *sq)
+{
+	int p;
+
+	for (p = 0; p < KTLI_NPRI; p++)
+		if (!ktli_mpsc_empty(&sq->ktq_mpsc[p]))
+			return(0);
+	return(1);
+}
+
+/* Pin a session thread to one CPU, see KCFF_PINCPU */
+static void
+ktli_pin(pthread_t tid, int cpu)
+{
+	cpu_set_t cs;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return;
+
+	CPU_ZERO(&cs);
+	CPU_SET(cpu, &cs);
+	if (pthread_setaffinity_np(tid, sizeof(cs), &cs))
+		debug_printf("ktli: can not pin to cpu %d\n", cpu);
+}
+
+static void ktli_zcrelease(int kts, int all);
+static void ktli_sq_push(int kts, struct kio *kio);
+static int  ktli_sq_order(int kts, struct ktli_queue *sq, struct kio *kio);
+static int  ktli_cradmit(int kts, struct kio *kio);
+static void ktli_crflush(int kts);
+static void ktli_handback(int kts, struct kio *kio);
+
 static int ktli_up = 0; /* global used to lazy init KTLI */
 
-/* Abstracting malloc and free, permits testing  */
-#define KTLI_MALLOC(_l) malloc((_l))
-#define KTLI_FREE(_p) free((_p))
+/* Abstracting malloc and free, permits testing, see ktli_pool.c */
+#define KTLI_MALLOC(_l) ktli_pool_alloc((_l))
+#define KTLI_FREE(_p) ktli_pool_free((_p))
 
 
 /*
@@ -151,33 +274,74 @@ ktli_open(enum ktli_driver_id did,
 	rq = (struct ktli_queue *)KTLI_MALLOC(sizeof(struct ktli_queue));
 	cq = (struct ktli_queue *)KTLI_MALLOC(sizeof(struct ktli_queue));
 
+	/*
+	 * Only the recvq is indexed by sequence and deadline,
+	 * see ktli_ift.c and ktli_twheel.c. The sendq is a lock-free
+	 * queue instead of a list, see ktli_mpsc.c
+	 */
 	if (sq) {
-		sq->ktq_list = list_create();
+		sq->ktq_list = NULL;
+		for (i = 0; i < KTLI_NPRI; i++) {
+			ktli_mpsc_init(&sq->ktq_mpsc[i]);
+			sq->ktq_wrr[i]  = 0;
+			sq->ktq_skip[i] = 0;
+		}
+		sq->ktq_idle = 0;
 		pthread_mutex_init(&sq->ktq_m, NULL);
 		pthread_cond_init(&sq->ktq_cv, NULL);
+
+		/* Submission side sequencing needs a reorder buffer */
+		sq->ktq_rob = NULL;
+		sq->ktq_robseq = 0;
+		pthread_mutex_init(&sq->ktq_robm, NULL);
+		if (cf->kcfg_flags & KCFF_SENDSEQ) {
+			sq->ktq_rob = KTLI_MALLOC(sizeof(struct kio *) *
+						  KTLI_ROBSIZE);
+			if (sq->ktq_rob)
+				memset(sq->ktq_rob, 0,
+				       sizeof(struct kio *) * KTLI_ROBSIZE);
+		}
+		memset(&sq->ktq_ift, 0, sizeof(struct ktli_ift));
+		memset(&sq->ktq_tw, 0, sizeof(struct ktli_twheel));
 	}
 
 	if (rq) {
 		rq->ktq_list = list_create();
 		pthread_mutex_init(&rq->ktq_m, NULL);
 		pthread_cond_init(&rq->ktq_cv, NULL);
+		(void)ktli_ift_init(&rq->ktq_ift);
+		(void)ktli_tw_init(&rq->ktq_tw);
 	}
 
 	if (cq) {
+		pthread_condattr_t ca;
+
 		cq->ktq_list = list_create();
 		pthread_mutex_init(&cq->ktq_m, NULL);
-		pthread_cond_init(&cq->ktq_cv, NULL );
+
+		/* ktli_poll waits on the cq with KIO_CLOCK deadlines */
+		pthread_condattr_init(&ca);
+		pthread_condattr_setclock(&ca, KIO_CLOCK);
+		pthread_cond_init(&cq->ktq_cv, &ca);
+		pthread_condattr_destroy(&ca);
+		memset(&cq->ktq_ift, 0, sizeof(struct ktli_ift));
+		memset(&cq->ktq_tw, 0, sizeof(struct ktli_twheel));
 	}
 
 	if (!kts || !sq || !rq || !cq ||
-	    !sq->ktq_list || !rq->ktq_list || !cq->ktq_list) {
+	    ((cf->kcfg_flags & KCFF_SENDSEQ) && !sq->ktq_rob) ||
+	    !rq->ktq_list || !cq->ktq_list ||
+	    !rq->ktq_ift.kif_bkts || !rq->ktq_tw.ktw_slots) {
 		/* undo any successful allocations */
-		(void)(sq->ktq_list?
-		       list_destroy(sq->ktq_list, (void *)LIST_NODEALLOC):0);
-		(void)(rq->ktq_list?
+		(void)((rq && rq->ktq_list)?
 		       list_destroy(rq->ktq_list, (void *)LIST_NODEALLOC):0);
-		(void)(cq->ktq_list?
+		(void)((cq && cq->ktq_list)?
 		       list_destroy(cq->ktq_list, (void *)LIST_NODEALLOC):0);
+		if (rq) {
+			ktli_ift_destroy(&rq->ktq_ift);
+			ktli_tw_destroy(&rq->ktq_tw);
+		}
+		(void)((sq && sq->ktq_rob)?KTLI_FREE(sq->ktq_rob):0);
 		(void)(sq?KTLI_FREE(sq):0);
 		(void)(rq?KTLI_FREE(rq):0);
 		(void)(cq?KTLI_FREE(cq):0);
@@ -190,6 +354,18 @@ ktli_open(enum ktli_driver_id did,
 	rq->ktq_exit = 0;
 	cq->ktq_exit = 0;
 
+	/* Completion eventfd is created on demand by ktli_pollfd */
+	sq->ktq_efd = rq->ktq_efd = cq->ktq_efd = -1;
+	sq->ktq_efdset = rq->ktq_efdset = cq->ktq_efdset = 0;
+
+	/* Nothing waiting on zero copy sends */
+	sq->ktq_zcwait = rq->ktq_zcwait = cq->ktq_zcwait = NULL;
+	sq->ktq_zcdone = rq->ktq_zcdone = cq->ktq_zcdone = 0;
+
+	/* The compq is this session's alone, until ktli_stripe() */
+	sq->ktq_refs = rq->ktq_refs = cq->ktq_refs = 1;
+	sq->ktq_posts = rq->ktq_posts = cq->ktq_posts = 0;
+
 	/* Now allocate a session slot, alloc sets driver */
 	*kts = kts_alloc_slot();
 	if (*kts < 0) {
@@ -217,6 +393,18 @@ ktli_open(enum ktli_driver_id did,
 	kts_set_recvq(*kts, rq);
 	kts_set_compq(*kts, cq);
 
+	/* New session, start the message sequence number at 0 */
+	kts_set_sequence(*kts, 100);
+	sq->ktq_robseq = kts_sequence(*kts);
+
+	/* A reactor takes the session on at connect, no threads needed */
+	if (ktli_reactive(de, cf)) {
+		kts_set_state(*kts, KTLI_SSTATE_OPENED);
+		rc = *kts;
+		KTLI_FREE(kts);
+		return(rc);
+	}
+
 	/* start the sender and receiver threads */
 	rc = pthread_create(&stid, NULL, ktli_sender, kts);
 	if (rc) {
@@ -238,8 +426,11 @@ ktli_open(enum ktli_driver_id did,
 	}
 	kts_set_receiver(*kts, rtid);
 
-	/* New session, start the message sequence number at 0 */
-	kts_set_sequence(*kts, 100);
+	/* Pinning is best effort, a bad CPU leaves the thread where it is */
+	if (cf->kcfg_flags & KCFF_PINCPU) {
+		ktli_pin(stid, cf->kcfg_sendcpu);
+		ktli_pin(rtid, cf->kcfg_recvcpu);
+	}
 
 	/* We're open for business */
 	kts_set_state(*kts, KTLI_SSTATE_OPENED);
@@ -248,9 +439,12 @@ ktli_open(enum ktli_driver_id did,
 
  open_err:
 	/* free the list, no elements yet so set LIST_NODEALLOC */
-	list_destroy(sq->ktq_list, (void *)LIST_NODEALLOC);
 	list_destroy(rq->ktq_list, (void *)LIST_NODEALLOC);
 	list_destroy(cq->ktq_list, (void *)LIST_NODEALLOC);
+	ktli_ift_destroy(&rq->ktq_ift);
+	ktli_tw_destroy(&rq->ktq_tw);
+	if (sq->ktq_rob)
+		KTLI_FREE(sq->ktq_rob);
 	KTLI_FREE(sq);
 	KTLI_FREE(rq);
 	KTLI_FREE(cq);
@@ -274,11 +468,13 @@ ktli_open(enum ktli_driver_id did,
 int
 ktli_close(int kts)
 {
-	int rc;
-	void *res;
+	int i, rc, reactive;
+	void *res = NULL;
 	void *dh; 			/* driver handle */
 	struct ktli_driver *de; 	/* driver entry */
 	struct ktli_queue *q;
+	struct ktli_stripe *stp;
+	struct ktli_credits *kcr;
 	enum ktli_sstate st;
 	pthread_t tid;
 
@@ -315,14 +511,26 @@ ktli_close(int kts)
 		return(-1);
 	}
 
+	/* The first member of a stripe owns it, it goes last */
+	stp = kts_stripe(kts);
+	if (stp && (stp->kst_kts[0] == kts)) {
+		for (i = 1; i < stp->kst_n; i++) {
+			if (stp->kst_kts[i] >= 0) {
+				errno = EBUSY;
+				return(-1);
+			}
+		}
+	}
+
 	/*
 	 * PAK: need to implement a ktli_drain API to drain the queues
 	 * Can't free the kio with out endandering the caller, caller
-	 * must do this
+	 * must do this. A shared compq is left to its last session.
 	 */
-	if (list_size((kts_sendq(kts))->ktq_list) ||
+	q = kts_compq(kts);
+	if (!ktli_sq_empty(kts_sendq(kts)) ||
 	    list_size((kts_recvq(kts))->ktq_list) ||
-	    list_size((kts_compq(kts))->ktq_list))  {
+	    ((q->ktq_refs == 1) && list_size(q->ktq_list)))  {
 		    errno = ENOTEMPTY;
 		    return(-1);
 	}
@@ -340,43 +548,42 @@ ktli_close(int kts)
 	assert(de->ktlid_fns->ktli_dfns_close);
 
 	/* call the corresponding driver close */
+	reactive = ktli_reactive(de, kts_config(kts));
 	rc = (de->ktlid_fns->ktli_dfns_close)(dh);
 	if (rc == -1) {
 		return(-1);
 	}
 
-	/* close down the sender thread */
+	/* close down the sender thread, reactor sessions have none */
 	q = kts_sendq(kts);
 	tid = kts_sender(kts);
 
-	pthread_mutex_lock(&q->ktq_m);
-	q->ktq_exit = 1;
-	pthread_cond_signal(&q->ktq_cv);
-	pthread_mutex_unlock(&q->ktq_m);
-	pthread_join(tid, &res);
-	debug_printf("Sender: %p\n",res);
-
-	/* free the sender list and queue */
-	/* Pull any kio's off the list and free them */
-	/* PAK : this is unecessary code */
-	while (list_size(q->ktq_list)) {
-		KTLI_FREE(list_remove_rear(q->ktq_list));
+	if (!reactive) {
+		pthread_mutex_lock(&q->ktq_m);
+		q->ktq_exit = 1;
+		pthread_cond_signal(&q->ktq_cv);
+		pthread_mutex_unlock(&q->ktq_m);
+		pthread_join(tid, &res);
+		debug_printf("Sender: %p\n",res);
 	}
 
-	/* free the list and the queue */
-	list_destroy(q->ktq_list, (void *)LIST_NODEALLOC);
+	/* free the sender queue, it is empty, and its reorder buffer */
+	if (q->ktq_rob)
+		KTLI_FREE(q->ktq_rob);
 	KTLI_FREE(q);
 
 	/* close down the receiver thread */
 	q = kts_recvq(kts);
 	tid = kts_receiver(kts);
 
-	pthread_mutex_lock(&q->ktq_m);
-	q->ktq_exit = 1;
-	pthread_cond_signal(&q->ktq_cv);
-	pthread_mutex_unlock(&q->ktq_m);
-	pthread_join(tid, &res);
-	debug_printf("Receiver: %p\n",res);
+	if (!reactive) {
+		pthread_mutex_lock(&q->ktq_m);
+		q->ktq_exit = 1;
+		pthread_cond_signal(&q->ktq_cv);
+		pthread_mutex_unlock(&q->ktq_m);
+		pthread_join(tid, &res);
+		debug_printf("Receiver: %p\n",res);
+	}
 
 	/* free the receiver list and queue*/
 	/* Pull any kio's off the list and free them */
@@ -385,15 +592,38 @@ ktli_close(int kts)
 		KTLI_FREE(list_remove_rear(q->ktq_list));
 	}
 
-	/* free the list and the queue */
+	/* free the list, the in-flight table, the wheel and the queue */
 	list_destroy(q->ktq_list, (void *)LIST_NODEALLOC);
+	ktli_ift_destroy(&q->ktq_ift);
+	ktli_tw_destroy(&q->ktq_tw);
 	KTLI_FREE(q);
 
-	/* Free up the completion queue */
+	/* Nothing waits for credits once the session has drained */
+	kcr = kts_credits(kts);
+	if (kcr) {
+		pthread_mutex_destroy(&kcr->kcr_m);
+		KTLI_FREE(kcr);
+	}
+
+	/* Leave the stripe, the first member is the last and frees it */
+	if (stp && (stp->kst_kts[0] == kts)) {
+		KTLI_FREE(stp);
+	} else if (stp) {
+		for (i = 1; i < stp->kst_n; i++)
+			if (stp->kst_kts[i] == kts)
+				stp->kst_kts[i] = -1;
+	}
+
+	/* Free up the completion queue, unless other members share it */
 	q = kts_compq(kts);
+	if (__atomic_sub_fetch(&q->ktq_refs, 1, __ATOMIC_SEQ_CST))
+		goto close_slot;
 
 	/* Signal ktli_polls to exit */
-	q->ktq_exit = 1; 
+	pthread_mutex_lock(&q->ktq_m);
+	q->ktq_exit = 1;
+	pthread_cond_broadcast(&q->ktq_cv);
+	pthread_mutex_unlock(&q->ktq_m);
 
 	/* Pull any kio's off the list and free them */
 	/* PAK: Unecessary code */
@@ -404,18 +634,22 @@ ktli_close(int kts)
 	/* pause to allow any miscreant ktli_polls to exit */
 	usleep((KTLI_POLLINTERVAL * 5));
 
-	/* free the list and the queue */
+	/* free the list, the eventfd and the queue */
 	list_destroy(q->ktq_list, (void *)LIST_NODEALLOC);
+	if (q->ktq_efd >= 0)
+		close(q->ktq_efd);
 	KTLI_FREE(q);
 
+ close_slot:
 	/*
 	 * res is the original argument to the threads, a ptr to the
 	 * the session descriptor, kts. Both receiver and sender use
 	 * the same ptr. Allocated in ktli_open() so free it here in
 	 * ktli_close(). Equivalent to the free(kts) in ktli_open()
-	 * at open_err:
+	 * at open_err: Reactor sessions freed it at open.
 	 */
-	KTLI_FREE(res);
+	if (res)
+		KTLI_FREE(res);
 
 	/* free the session slot */
 	kts_free_slot(kts);
@@ -476,6 +710,15 @@ ktli_connect(int kts)
 	assert(de->ktlid_fns);
 	assert(de->ktlid_fns->ktli_dfns_connect);
 
+	/* hand the driver its tuning, if it takes any */
+	if (de->ktlid_fns->ktli_dfns_tune) {
+		rc = (de->ktlid_fns->ktli_dfns_tune)(dh, cf);
+		if (rc == -1) {
+			/* driver tune sets errno */
+			return(-1);
+		}
+	}
+
 	/* call the corresponding driver connect */
 	rc = (de->ktlid_fns->ktli_dfns_connect)(dh, cf->kcfg_host,
 						cf->kcfg_port,
@@ -485,6 +728,15 @@ ktli_connect(int kts)
 		return(-1);
 	}
 
+	/* Hand the session to a reactor before anything can be sent */
+	if (ktli_reactive(de, cf) &&
+	    ktli_reactor_attach(kts, de->ktlid_fns, dh) < 0) {
+		rc = errno;
+		(void)(de->ktlid_fns->ktli_dfns_disconnect)(dh);
+		errno = rc;
+		return(-1);
+	}
+
 	kts_set_state(kts, KTLI_SSTATE_CONNECTED);
 
 	/*
@@ -540,6 +792,9 @@ ktli_disconnect(int kts)
 	assert(de->ktlid_fns);
 	assert(de->ktlid_fns->ktli_dfns_disconnect);
 
+	/* Stop any reactor from servicing the session, no-op otherwise */
+	ktli_reactor_detach(kts);
+
 	/* call the corresponding driver disconnect */
 	rc = (de->ktlid_fns->ktli_dfns_disconnect)(dh);
 	if (rc == -1) {
@@ -548,6 +803,16 @@ ktli_disconnect(int kts)
 
 	kts_set_state(kts, KTLI_SSTATE_DRAINING);
 
+	/*
+	 * KIOs held for zero copy would be invisible to drain, complete
+	 * them now. The connection is gone, whatever the kernel still
+	 * transmits from their buffers no longer matters.
+	 */
+	ktli_zcrelease(kts, 1);
+
+	/* Neither will KIOs still waiting for a credit ever be sent */
+	ktli_crflush(kts);
+
 	/* If anyone is polling wake them up */
 	cq = kts_compq(kts);
 	pthread_mutex_lock(&cq->ktq_m);
@@ -564,7 +829,10 @@ ktli_disconnect(int kts)
  * request, to the connected kinetic server. The kio provides enough
  * information for the complete send receive processing nof the kinetic
  * request. The function returns once the the request has been validated
- * and queued for send service.
+ * and queued for send service. A kio past its session's credit limit,
+ * see ktli_credits(), is either failed with EAGAIN or held back until a
+ * credit is returned. On a KCFF_SENDSEQ session the kio is sequenced and
+ * stamped here, by the caller, see ktli_sq_order().
  *
  * @param kts An opened and connected kinetic session descriptor.
  * @param kio A filled in kio structure that contains a servicable
@@ -573,7 +841,9 @@ ktli_disconnect(int kts)
 int
 ktli_send(int kts, struct kio *kio)
 {
+	int i, rc;
 	struct ktli_queue *sq;
+	struct ktli_stripe *stp;
 	enum ktli_sstate st;
 
 	if (!kts_isvalid(kts)) {
@@ -589,7 +859,8 @@ ktli_send(int kts, struct kio *kio)
 	}
 
 	/* Validate kio - Send msg is mandatory */
-	if (!kio->kio_sendmsg.km_cnt || !kio->kio_sendmsg.km_msg) {
+	if (!kio->kio_sendmsg.km_cnt || !kio->kio_sendmsg.km_msg ||
+	    (kio->kio_pri < 0) || (kio->kio_pri >= KTLI_NPRI)) {
 		errno = EINVAL;
 		return(-1);
 	}
@@ -599,6 +870,8 @@ ktli_send(int kts, struct kio *kio)
 	kio->kio_sendmsg.km_status = 0;
 	kio->kio_sendmsg.km_errno = 0;
 	memset(&kio->kio_recvmsg, 0, sizeof(struct kio_msg));
+	kio->kio_zct = 0;
+	kio->kio_zcnext = NULL;
 
 	/* grab the sendq */
 	sq = kts_sendq(kts);
@@ -608,510 +881,2303 @@ ktli_send(int kts, struct kio *kio)
 		return(-1);
 	}
 
-	pthread_mutex_lock(&sq->ktq_m);
+	/*
+	 * queue it on the end, lock-free. The sendq is intrusive so
+	 * there is no list element and no Q back pointer.
+	 */
+	kio->kio_qbp = NULL;
+	kio->kio_state = KIO_NEW;
 
-	/* queue it on the end */
-	(void)list_mvrear(sq->ktq_list);
-	if (!list_insert_after(sq->ktq_list, &kio, sizeof(struct kio *))) {
-		errno = ENOMEM;
-		pthread_mutex_unlock(&sq->ktq_m);
-		return(-1);
+	/* Count it against its stripe member until it is handed back */
+	kio->kio_stripe = 0;
+	stp = kts_stripe(kts);
+	for (i = 0; stp && (i < stp->kst_n); i++) {
+		if (stp->kst_kts[i] == kts) {
+			__atomic_add_fetch(&stp->kst_out[i], 1,
+					   __ATOMIC_RELAXED);
+			kio->kio_stripe = i + 1;
+			break;
+		}
 	}
 
-	/* preserve the Q back pointer  */
-	kio->kio_qbp = list_element_curr(sq->ktq_list);
-	kio->kio_state = KIO_NEW;
-
-	/* wake up the sender */
-	pthread_cond_signal(&sq->ktq_cv);
+	/* Past its credit limit it waits or fails, see ktli_credits() */
+	rc = ktli_cradmit(kts, kio);
+	if (rc < 0) {
+		ktli_handback(kts, kio);
+		return(-1);
+	}
 
-	pthread_mutex_unlock(&sq->ktq_m);
+	if (rc)
+		ktli_sq_push(kts, kio);
 
 	return(0);
 }
 
 /*
- * List helper function to find a matching kio given a seq number
- * If no match return LIST_TRUE to continue searching
- * Once a match is found return FALSE to terminate search 
+ * Stamps seq into a KIO's message. KIOs encoded with a reserved seq slot
+ * can be stamped in place, everything else goes through the full setseq
+ * helper. A KIO that can not be stamped must not be sent, it is marked
+ * failed and the sender fails it in place of sending it.
  */
-static list_boolean_t
-ktli_kiomatch(void *data, void *ldata)
+static void
+ktli_setseq(struct ktli_helpers *kh, struct kio *kio, uint64_t seq)
 {
-	list_boolean_t match = LIST_TRUE;
-	struct kio *kio = (struct kio *)data;
-	struct kio *lkio = *(struct kio **)ldata;
-
-	if (kio == lkio)
-		match = LIST_FALSE;  /* See comment above */
-	return (match);
+	if (KIOF_ISSET(kio, KIOF_SEQSLOT) && kh->kh_stampseq_fn) {
+		if ((kh->kh_stampseq_fn)(kio, seq) < 0) {
+			kio->kio_state = KIO_FAILED;
+			kio->kio_errno = EIO;
+		}
+	} else {
+		(kh->kh_setseq_fn)(kio->kio_sendmsg.km_msg,
+				   kio->kio_sendmsg.km_cnt, seq);
+	}
 }
 
 /*
- * List helper function to find a kio with no req sendmsg
- * If no match return LIST_TRUE to continue searching
- * Once a match is found return FALSE to terminate search 
+ * Submission side sequencing, see KCFF_SENDSEQ. The seq is inside the
+ * HMAC'd command bytes, so whoever picks the seq pays for the HMAC. By
+ * default that is the sender thread, for every KIO of the session. Here
+ * the submitting thread takes the next seq and stamps the KIO itself,
+ * so the crypto runs on as many cores as there are submitters.
+ *
+ * Stamped KIOs can finish out of seq order, the server wants them in
+ * order. Each is parked in the reorder buffer slot of its seq and the
+ * thread that fills the oldest slot moves the run of stamped KIOs that
+ * follows it to the sendq, in order. They all go on one priority queue,
+ * priorities would reorder them. Returns the number of KIOs queued, 0
+ * if this one waits on an earlier seq, whose thread will queue it.
  */
-static list_boolean_t
-ktli_kionoreq(void *data, void *ldata)
+static int
+ktli_sq_order(int kts, struct ktli_queue *sq, struct kio *kio)
 {
-	list_boolean_t match = LIST_TRUE;
-	struct kio *lkio = *(struct kio **)ldata;
+	int64_t seq;
+	int n = 0;
+
+	seq = kts_take_sequence(kts);
+	kio->kio_seq = seq;
+	ktli_setseq(kts_helpers(kts), kio, seq);
+
+	/* A full buffer waits on the oldest seqs, they are being stamped */
+	while ((seq - __atomic_load_n(&sq->ktq_robseq, __ATOMIC_ACQUIRE)) >=
+	       KTLI_ROBSIZE)
+		sched_yield();
+
+	pthread_mutex_lock(&sq->ktq_robm);
+	sq->ktq_rob[seq & (KTLI_ROBSIZE - 1)] = kio;
+	while ((kio = sq->ktq_rob[sq->ktq_robseq & (KTLI_ROBSIZE - 1)])) {
+		sq->ktq_rob[sq->ktq_robseq & (KTLI_ROBSIZE - 1)] = NULL;
+		ktli_mpsc_push(&sq->ktq_mpsc[KTLI_PRI_HIGH], kio);
+		__atomic_store_n(&sq->ktq_robseq, sq->ktq_robseq + 1,
+				 __ATOMIC_RELEASE);
+		n++;
+	}
+	pthread_mutex_unlock(&sq->ktq_robm);
 
-	if (lkio->kio_sendmsg.km_cnt == 0) /* sendmsg vector - no req */
-		match = LIST_FALSE;  /* See comment above */
-	return (match);
+	return(n);
 }
 
-/**
- * int ktli_receive(int kts, struct kio *kio)
- *
- * This function receives any completed kio. If no kio are completed it
- * immediately returns back to the caller. A received kio is hung on
- * the caller provided kio ptr.
- *
- * @param kts An opened and connected kinetic session descriptor.
- * @param kio A kio ptr. The completed queue is searched for the passed in kio
- *            if found, it is removed and success returned, failure otherwise.
- *
- * Error means that the KIO was never found or possibly doesn't exist
- * Success means that a KIO was located and removed from KTLI's control.
+/*
+ * Queues a KIO on the sendq of kts and makes sure it is serviced.
  */
-int
-ktli_receive(int kts, struct kio *kio)
+static void
+ktli_sq_push(int kts, struct kio *kio)
 {
-	int rc = 0;
-	enum ktli_sstate st;
-	struct ktli_queue *cq;
-	struct kio **lkio;
+	struct ktli_queue *sq;
+	struct ktli_reactor *kr;
 
-	errno = 0;
-	
-	if (!kts_isvalid(kts)) {
-		errno = EBADF;
-		return(-1);
+	sq = kts_sendq(kts);
+	if (!sq->ktq_rob)
+		ktli_mpsc_push(&sq->ktq_mpsc[kio->kio_pri], kio);
+	else if (!ktli_sq_order(kts, sq, kio))
+		return;
+
+	/* Sessions on a reactor are marked for it instead, same idea */
+	kr = kts_reactor(kts);
+	if (kr) {
+		ktli_reactor_kick(kr, kts);
+		return;
 	}
 
 	/*
-	 * verify kts is connected or in draining, receives can drain
-	 * as well as ktli_drain, the difference is that the receive must
-	 * match a kio to drain and since we are unconnected a draining
-	 * receive can receive from all queues in compq, recvq, sendq order.
+	 * wake up the sender, only if it is idle. The sender raises
+	 * ktq_idle before it makes a last check of the queue and waits,
+	 * so either it sees this KIO or this sees the flag. The first
+	 * producer to see the flag clears it and does the signal.
 	 */
-	st = kts_state(kts);
-	if ((st != KTLI_SSTATE_CONNECTED) && (st != KTLI_SSTATE_DRAINING)) {
-		errno = ENOTCONN;
-		return(-1);
+	if (__atomic_load_n(&sq->ktq_idle, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&sq->ktq_idle, 0, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&sq->ktq_m);
+		pthread_cond_signal(&sq->ktq_cv);
+		pthread_mutex_unlock(&sq->ktq_m);
 	}
+}
 
-	/*
-	 * This is a special case, the connection is gone and we need to
-	 * receive all the failed incomplete requests.
-	 */
-	if ((st == KTLI_SSTATE_DRAINING)) {
-		rc = ktli_drain_match(kts, kio);
-		return(rc);
-	}
+/*
+ * Completion Q notification helpers, caller holds the queue mutex.
+ * ktli_cq_post wakes the ktli_poll waiters after KIOs are added and, if
+ * a ktli_pollfd eventfd exists, makes it readable. ktli_cq_reset makes
+ * the eventfd unreadable again once the Q is empty, it is a no-op on the
+ * other Qs. The eventfd is only written on the empty to non-empty edge.
+ */
+static void
+ktli_cq_post(struct ktli_queue *cq)
+{
+	uint64_t one = 1;
 
-	cq = kts_compq(kts);
+	__atomic_add_fetch(&cq->ktq_posts, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&cq->ktq_cv);
 
-	pthread_mutex_lock(&cq->ktq_m);
+	if (cq->ktq_efd >= 0 && !cq->ktq_efdset && list_size(cq->ktq_list)) {
+		if (write(cq->ktq_efd, &one, sizeof(one)) == sizeof(one))
+			cq->ktq_efdset = 1;
+	}
+}
 
-	/*
-	 * if the KIO has been received then the KIO has a back pointer
-	 * into the CQ. So set the CQ curr to that back pointer and pop
-	 * it off the list.
-	 */
-	if ((kio->kio_state == KIO_RECEIVED) ||
-	    (kio->kio_state == KIO_TIMEDOUT) ||
-	    (kio->kio_state == KIO_FAILED))     {
-		/*
-		 * check for a NULL as a safety check that the back pointer
-		 * is valid for the CQ
-		 */
-		if (list_setcurr(cq->ktq_list, kio->kio_qbp)) {
-			lkio = (struct kio **)list_remove_curr(cq->ktq_list);
-			assert(kio == *lkio);
-			KTLI_FREE(lkio);
+static void
+ktli_cq_reset(struct ktli_queue *q)
+{
+	uint64_t cnt;
 
-			kio->kio_qbp = NULL; /* no longer on a q */
+	if (q->ktq_efd >= 0 && q->ktq_efdset && !list_size(q->ktq_list)) {
+		/* Non-blocking, reading zeroes the eventfd counter */
+		(void)read(q->ktq_efd, &cnt, sizeof(cnt));
+		q->ktq_efdset = 0;
+	}
+}
 
-			/* 
-			 * Could be receiving a KIO in any state:
-			 *	KIO_RECEIVED
-			 *	KIO_FAILED
-			 *	KIO_TIMEDOUT
-			 * That is still a successful receive of a valid KIO. 
-			 * Caller can use KIO state to determine what to do.
-			 */
-			rc = 0;
-		        if (kio->kio_state == KIO_TIMEDOUT) {
-				errno = kio->kio_errno = ETIMEDOUT;
-			} else if (kio->kio_state == KIO_FAILED) {
-				errno = kio->kio_errno = ENOMSG;
-			}
+/*
+ * Fails every KIO still on the sendq, moving them to the cq. Caller holds
+ * the sendq mutex, which makes it the sendq's single consumer, and the cq
+ * mutex. err, if set, is the errno given to the KIOs.
+ */
+static void
+ktli_sq_flush(struct ktli_queue *sq, struct ktli_queue *cq, int err)
+{
+	struct kio *kio;
+	int p, posted = 0;
 
-		} else {
-			/* Getting here is a bug */
-			assert(0);
+	(void)list_mvrear(cq->ktq_list);
+	for (p = 0; p < KTLI_NPRI; p++) {
+		while ((kio = ktli_mpsc_pop(&sq->ktq_mpsc[p]))) {
+			kio->kio_state = KIO_FAILED;
+			if (err)
+				kio->kio_errno = err;
+			list_insert_after(cq->ktq_list, &kio,
+					  sizeof(struct kio *));
+
+			/* preserve the Q back pointer  */
+			kio->kio_qbp = list_element_curr(cq->ktq_list);
+			posted = 1;
 		}
-	} else {
-		errno = ENOENT;
-		debug_printf("Attempted receveive on a non ready KIO\n");
-		rc = -1;
 	}
 
-	/* leave the list ready for an insert */
-	(void)list_mvrear(cq->ktq_list);
+	if (posted)
+		ktli_cq_post(cq);
+}
+
+/*
+ * Send scheduler, caller holds the sendq mutex. ktli_sq_next returns the
+ * priority queue the next KIO to send comes off, -1 if all are empty,
+ * and ktli_sq_took accounts for taking it.
+ *
+ * Weighted, the default, serves the priorities highest first in rounds,
+ * each sends up to its weight in KIOs per round. A round ends when no
+ * queued priority has any of its weight left, so low priority work
+ * always gets its share and idle priorities give up theirs.
+ * Strict always serves the highest priority queued, except that one
+ * passed over KTLI_PRIAGE times in a row goes next, so bulk work keeps
+ * moving under a steady stream of urgent requests.
+ */
+static int
+ktli_sq_next(struct ktli_queue *sq, struct ktli_config *cf)
+{
+	int p, r, pick = -1;
+
+	if (cf->kcfg_flags & KCFF_STRICTPRI) {
+		for (p = 0; p < KTLI_NPRI; p++) {
+			if (ktli_mpsc_empty(&sq->ktq_mpsc[p]))
+				continue;
+			if ((pick < 0) || (sq->ktq_skip[p] >= KTLI_PRIAGE))
+				pick = p;
+		}
+		return(pick);
+	}
+
+	for (r = 0; r < 2; r++) {
+		for (p = 0; p < KTLI_NPRI; p++) {
+			if (sq->ktq_wrr[p] &&
+			    !ktli_mpsc_empty(&sq->ktq_mpsc[p]))
+				return(p);
+		}
+
+		/* Start the next round */
+		for (p = 0; p < KTLI_NPRI; p++)
+			sq->ktq_wrr[p] = cf->kcfg_priw[p] ?
+				cf->kcfg_priw[p] : ktli_priw[p];
+	}
+
+	return(-1);
+}
+
+static void
+ktli_sq_took(struct ktli_queue *sq, struct ktli_config *cf, int pick)
+{
+	int p;
+
+	if (!(cf->kcfg_flags & KCFF_STRICTPRI)) {
+		sq->ktq_wrr[pick]--;
+		return;
+	}
+
+	for (p = 0; p < KTLI_NPRI; p++) {
+		if ((p == pick) || ktli_mpsc_empty(&sq->ktq_mpsc[p]))
+			sq->ktq_skip[p] = 0;
+		else
+			sq->ktq_skip[p]++;
+	}
+}
+
+/*
+ * Receive Q tracking helpers, caller holds the queue mutex.
+ * A KIO on the recvq is indexed in the in-flight table by seq and hung
+ * on the timing wheel by deadline. Untracking is a no-op on the other Qs.
+ */
+static void
+ktli_arm(struct ktli_queue *rq, struct kio *kio)
+{
+	struct timespec *to = &kio->kio_timeout;
+	uint32_t ms;
+
+	ms = kio->kio_tmo_ms ? kio->kio_tmo_ms : KIO_TIMEOUT_S * 1000;
+
+	/* Set the timeout time, now + ms */
+	clock_gettime(KIO_CLOCK, to);
+	to->tv_sec  += ms / 1000;
+	to->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (to->tv_nsec >= 1000000000) {
+		to->tv_sec++;
+		to->tv_nsec -= 1000000000;
+	}
+
+	/* (Re)hang it on the wheel */
+	ktli_tw_insert(&rq->ktq_tw, kio, KTW_TS2MS(to));
+}
+
+static void
+ktli_track(struct ktli_queue *rq, struct kio *kio)
+{
+	ktli_ift_insert(&rq->ktq_ift, kio);
+	ktli_arm(rq, kio);
+}
+
+static void
+ktli_untrack(struct ktli_queue *q, struct kio *kio)
+{
+	ktli_ift_remove(&q->ktq_ift, kio);
+	ktli_tw_cancel(&q->ktq_tw, kio);
+}
+
+/*
+ * Zero copy helpers. A KIO sent with zero copy carries the token of its
+ * send in kio_zct, KTLI_ZCPEND while the send is still in progress. When
+ * the KIO would otherwise complete, ktli_zcheld() checks the token against
+ * the last one the driver reported done. If the kernel may still be using
+ * the KIO's buffers, the KIO is given its final state and held on the rq
+ * zcwait chain instead of going to the cq, and ktli_zcrelease() completes
+ * it later. Caller of ktli_zcheld() holds the rq mutex.
+ */
+#define KTLI_ZCPEND	UINT64_MAX
+
+static int
+ktli_zcheld(struct ktli_queue *rq, struct kio *kio, enum kio_state state)
+{
+	if (!kio->kio_zct || (kio->kio_zct <= rq->ktq_zcdone)) {
+		kio->kio_zct = 0;
+		return(0);
+	}
+
+	kio->kio_state = state;
+	kio->kio_zcnext = rq->ktq_zcwait;
+	rq->ktq_zcwait = kio;
+	return(1);
+}
+
+/*
+ * Collect the driver's zero copy notifications and move every held KIO
+ * whose buffers are free to the cq, all of them if all is set.
+ */
+static void
+ktli_zcrelease(int kts, int all)
+{
+	struct ktli_driver *de;
+	struct ktli_queue *rq;
+	struct ktli_queue *cq;
+	struct kio *kio, **pkio;
+	uint64_t done;
+	int posted = 0;
+
+	de = kts_driver(kts);
+	rq = kts_recvq(kts);
+	cq = kts_compq(kts);
+
+	if (!de->ktlid_fns->ktli_dfns_zcdone)
+		return;
+	done = (de->ktlid_fns->ktli_dfns_zcdone)(kts_dhandle(kts));
+
+	/* This is the correct lock order rq, cq */
+	pthread_mutex_lock(&rq->ktq_m);
+	pthread_mutex_lock(&cq->ktq_m);
+
+	if (done > rq->ktq_zcdone)
+		rq->ktq_zcdone = done;
+
+	(void)list_mvrear(cq->ktq_list);
+	for (pkio = &rq->ktq_zcwait; (kio = *pkio); ) {
+		if (!all && (kio->kio_zct > rq->ktq_zcdone)) {
+			pkio = &kio->kio_zcnext;
+			continue;
+		}
+
+		/* Unhook it and complete it with the state it was held in */
+		*pkio = kio->kio_zcnext;
+		kio->kio_zcnext = NULL;
+		kio->kio_zct = 0;
+
+		list_insert_after(cq->ktq_list, &kio, sizeof(struct kio *));
+
+		/* preserve the Q back pointer  */
+		kio->kio_qbp = list_element_curr(cq->ktq_list);
+		posted = 1;
+	}
+
+	if (posted)
+		ktli_cq_post(cq);
+
+	pthread_mutex_unlock(&cq->ktq_m);
+	pthread_mutex_unlock(&rq->ktq_m);
+}
+
+/*
+ * List helper function to find a matching kio given a seq number
+ * If no match return LIST_TRUE to continue searching
+ * Once a match is found return FALSE to terminate search 
+ */
+static list_boolean_t
+ktli_kiomatch(void *data, void *ldata)
+{
+	list_boolean_t match = LIST_TRUE;
+	struct kio *kio = (struct kio *)data;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	if (kio == lkio)
+		match = LIST_FALSE;  /* See comment above */
+	return (match);
+}
+
+/*
+ * List helper function to find a kio with no req sendmsg
+ * If no match return LIST_TRUE to continue searching
+ * Once a match is found return FALSE to terminate search 
+ */
+static list_boolean_t
+ktli_kionoreq(void *data, void *ldata)
+{
+	list_boolean_t match = LIST_TRUE;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	if (lkio->kio_sendmsg.km_cnt == 0) /* sendmsg vector - no req */
+		match = LIST_FALSE;  /* See comment above */
+	return (match);
+}
+
+/*
+ * List helper function to find a kio that ktli_reap may take
+ * If no match return LIST_TRUE to continue searching
+ * Once a match is found return FALSE to terminate search 
+ */
+static list_boolean_t
+ktli_kioreap(void *data, void *ldata)
+{
+	list_boolean_t match = LIST_TRUE;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	if (KIOF_ISSET(lkio, KIOF_REAP))
+		match = LIST_FALSE;  /* See comment above */
+	return (match);
+}
+
+/*
+ * Stripe member helpers, see ktli_stripe(). Members share the first
+ * member's cq, a KIO on it belongs to the member it was sent on, or the
+ * first member if it was sent before the stripe was made. ktli_stripe_tag
+ * returns kts's kio_stripe tag, 0 if its cq is its own and every KIO on
+ * it is kts's. ktli_kiomember and ktli_kiocount match and count a
+ * member's KIOs on a list.
+ */
+struct ktli_kiocnt {
+	int		 kc_tag;	/* Member's kio_stripe tag */
+	uint32_t	 kc_n;		/* Its KIOs seen */
+};
+
+static int
+ktli_stripe_tag(int kts)
+{
+	struct ktli_stripe *stp;
+	struct ktli_queue *cq;
+	int i;
+
+	cq = kts_compq(kts);
+	stp = kts_stripe(kts);
+	if (!stp || (__atomic_load_n(&cq->ktq_refs, __ATOMIC_SEQ_CST) < 2))
+		return(0);
+
+	for (i = 0; i < stp->kst_n; i++)
+		if (stp->kst_kts[i] == kts)
+			return(i + 1);
+	return(0);
+}
+
+static int
+ktli_kioowned(struct kio *kio, int tag)
+{
+	return(!tag || ((kio->kio_stripe ? kio->kio_stripe : 1) == tag));
+}
+
+static list_boolean_t
+ktli_kiomember(void *data, void *ldata)
+{
+	list_boolean_t match = LIST_TRUE;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	if (ktli_kioowned(lkio, *(int *)data))
+		match = LIST_FALSE;  /* See ktli_kiomatch */
+	return (match);
+}
+
+static list_boolean_t
+ktli_kiocount(void *data, void *ldata)
+{
+	struct ktli_kiocnt *kc = (struct ktli_kiocnt *)data;
+	struct kio *lkio = *(struct kio **)ldata;
+
+	if (ktli_kioowned(lkio, kc->kc_tag))
+		kc->kc_n++;
+	return (LIST_TRUE);
+}
+
+/*
+ * Admission control helpers, see ktli_credits(). A KIO's credit class
+ * comes from its flags, -1 if it takes no credit. A class is held to its
+ * adaptive window if it has one, its limit otherwise. Callers of the
+ * helpers taking a struct ktli_credits hold kcr_m.
+ */
+static inline int
+ktli_crclass(struct kio *kio)
+{
+	if (KIOF_ISSET(kio, KIOF_CRREAD))
+		return(KTLI_CR_READ);
+	if (KIOF_ISSET(kio, KIOF_CRWRITE))
+		return(KTLI_CR_WRITE);
+	return(-1);
+}
+
+static inline uint32_t
+ktli_crlimit(struct ktli_credits *kcr, int c)
+{
+	if (kcr->kcr_flags & KTLI_CRADAPT)
+		return(kcr->kcr_win[c].kcw_win);
+	return(kcr->kcr_max[c]);
+}
+
+static inline int
+ktli_crfree(struct ktli_credits *kcr, int c)
+{
+	uint32_t lim = ktli_crlimit(kcr, c);
+
+	return(!lim || (kcr->kcr_out[c] < lim));
+}
+
+static inline uint32_t
+ktli_crwmax(struct ktli_credits *kcr, int c)
+{
+	return(kcr->kcr_max[c] ? kcr->kcr_max[c] : KTLI_CRWMAX);
+}
+
+/* Back to a small window in slow start */
+static void
+ktli_crwreset(struct ktli_credits *kcr, int c)
+{
+	struct ktli_crwin *w = &kcr->kcr_win[c];
+
+	memset(w, 0, sizeof(*w));
+	w->kcw_win = KTLI_CRWINIT;
+	if (w->kcw_win > ktli_crwmax(kcr, c))
+		w->kcw_win = ktli_crwmax(kcr, c);
+	w->kcw_ss = 1;
+}
+
+/* Multiplicative decrease, at most once per window's worth of samples */
+static void
+ktli_crwcut(struct ktli_crwin *w)
+{
+	if (w->kcw_hold)
+		return;
+
+	w->kcw_win = (w->kcw_win * 3) / 4;
+	if (!w->kcw_win)
+		w->kcw_win = 1;
+	w->kcw_hold = w->kcw_win;
+	w->kcw_acc  = 0;
+	w->kcw_ss   = 0;
+}
+
+/* KIOs let go by ktli_crdispatch, chained via kio_crnext in send order */
+struct ktli_crgo {
+	struct kio	*kcg_head;
+	struct kio	*kcg_tail;
+};
+
+/*
+ * Hands the free credits of class c to the KIOs waiting for one, oldest
+ * first, and chains them on go. Called with kcr_m held, the caller queues
+ * them for send with ktli_crsend once it has dropped kcr_m: on a
+ * KCFF_SENDSEQ session each is stamped as it is queued, see
+ * ktli_sq_order(), which is no work to do under a lock every admission
+ * takes.
+ */
+static void
+ktli_crdispatch(struct ktli_credits *kcr, int c, struct ktli_crgo *go)
+{
+	struct kio *kio;
+	struct timespec now;
+	int64_t us;
+
+	if (!kcr->kcr_head[c])
+		return;
+
+	ktli_gettime(&now);
+	while ((kio = kcr->kcr_head[c]) && ktli_crfree(kcr, c)) {
+		kcr->kcr_head[c] = kio->kio_crnext;
+		if (!kcr->kcr_head[c])
+			kcr->kcr_tail[c] = NULL;
+		kio->kio_crnext = NULL;
+		kcr->kcr_out[c]++;
+		KIOF_SET(kio, KIOF_CREDIT);
+
+		us = (now.tv_sec - kio->kio_crts.tv_sec) * 1000000 +
+		     (now.tv_nsec - kio->kio_crts.tv_nsec) / 1000;
+		if (us < 0)
+			us = 0;
+		kcr->kcr_st.kcs_waitus += us;
+		if ((uint64_t)us > kcr->kcr_st.kcs_waitmax)
+			kcr->kcr_st.kcs_waitmax = us;
+
+		if (go->kcg_tail)
+			go->kcg_tail->kio_crnext = kio;
+		else
+			go->kcg_head = kio;
+		go->kcg_tail = kio;
+	}
+}
+
+/* Queues the KIOs ktli_crdispatch let go for send, without kcr_m */
+static void
+ktli_crsend(int kts, struct ktli_crgo *go)
+{
+	struct kio *kio;
+
+	while ((kio = go->kcg_head)) {
+		go->kcg_head = kio->kio_crnext;
+		kio->kio_crnext = NULL;
+		ktli_sq_push(kts, kio);
+	}
+	go->kcg_tail = NULL;
+}
+
+/*
+ * Takes a credit for a KIO being sent on kts. Returns 1 if the KIO can
+ * be queued for send now, 0 if it was chained to wait for a credit and
+ * -1, with errno set, if it cannot be sent. KIOs wait behind those of
+ * their class already waiting, so a class goes out in send order.
+ */
+static int
+ktli_cradmit(int kts, struct kio *kio)
+{
+	struct ktli_credits *kcr;
+	int c, rc = 1;
+
+	kio->kio_crnext = NULL;
+	KIOF_CLR(kio, KIOF_CREDIT);
+	KIOF_CLR(kio, KIOF_RTT);
+
+	c = ktli_crclass(kio);
+	kcr = kts_credits(kts);
+	if (!kcr || (c < 0))
+		return(1);
+
+	pthread_mutex_lock(&kcr->kcr_m);
+	if (kts_state(kts) != KTLI_SSTATE_CONNECTED) {
+		/* Lost a race with ktli_disconnect, see ktli_crflush */
+		errno = ENOTCONN;
+		rc = -1;
+		goto admitted;
+	}
+
+	/* Its round trip feeds the window, see ktli_crsample */
+	if (kcr->kcr_flags & KTLI_CRADAPT)
+		KIOF_SET(kio, KIOF_RTT);
+
+	if (!kcr->kcr_head[c] && ktli_crfree(kcr, c)) {
+		kcr->kcr_out[c]++;
+		KIOF_SET(kio, KIOF_CREDIT);
+	} else if (kcr->kcr_flags & KTLI_CRQUEUE) {
+		ktli_gettime(&kio->kio_crts);
+		if (kcr->kcr_tail[c])
+			kcr->kcr_tail[c]->kio_crnext = kio;
+		else
+			kcr->kcr_head[c] = kio;
+		kcr->kcr_tail[c] = kio;
+		kcr->kcr_st.kcs_waits++;
+		rc = 0;
+	} else {
+		kcr->kcr_st.kcs_rejects++;
+		errno = EAGAIN;
+		rc = -1;
+	}
+
+ admitted:
+	pthread_mutex_unlock(&kcr->kcr_m);
+
+	return(rc);
+}
+
+/*
+ * Adaptive window, AIMD on the round trip of each response, from the
+ * send, kiot_sent, to the start of its receive, kiot_recvs. The unloaded
+ * round trip is the least one of the last epoch, relearned every epoch
+ * as devices slow down when they fill. While the smoothed round trip
+ * stays within KTLI_CRWTOL of it and the window is in use, the window
+ * grows, by one per response in slow start and by one per window of
+ * responses after. Beyond it the device is queueing and the window is
+ * cut by a quarter, see ktli_crwcut. Timeouts cut it as well.
+ */
+static void
+ktli_crsample(int kts, struct kio *kio)
+{
+	struct ktli_credits *kcr;
+	struct ktli_crwin *w;
+	struct ktli_crgo go = { NULL, NULL };
+	int64_t rtt;
+	int c;
+
+	c = ktli_crclass(kio);
+	kcr = kts_credits(kts);
+	if (!kcr || (c < 0))
+		return;
+
+	rtt = (kio->kio_ts.kiot_recvs.tv_sec -
+	       kio->kio_ts.kiot_sent.tv_sec) * 1000000 +
+	      (kio->kio_ts.kiot_recvs.tv_nsec -
+	       kio->kio_ts.kiot_sent.tv_nsec) / 1000;
+	if ((rtt < 0) || (rtt > KTLI_CRWRTTMAX))
+		return;
+	if (!rtt)
+		rtt = 1;
+
+	pthread_mutex_lock(&kcr->kcr_m);
+	if (!(kcr->kcr_flags & KTLI_CRADAPT))
+		goto sampled;
+
+	w = &kcr->kcr_win[c];
+	if (w->kcw_srtt)
+		w->kcw_srtt += (rtt - (int64_t)w->kcw_srtt) / 8;
+	else
+		w->kcw_srtt = rtt;
+
+	if (!w->kcw_minrtt || ((uint64_t)rtt < w->kcw_minrtt))
+		w->kcw_minrtt = rtt;
+	if (!w->kcw_nextmin || ((uint64_t)rtt < w->kcw_nextmin))
+		w->kcw_nextmin = rtt;
+	if (++w->kcw_n >= KTLI_CRWEPOCH) {
+		w->kcw_minrtt  = w->kcw_nextmin;
+		w->kcw_nextmin = 0;
+		w->kcw_n       = 0;
+	}
+
+	if (w->kcw_hold)
+		w->kcw_hold--;
+
+	if (w->kcw_srtt > (w->kcw_minrtt * KTLI_CRWTOL) + KTLI_CRWSLACK) {
+		ktli_crwcut(w);
+	} else if ((w->kcw_win < ktli_crwmax(kcr, c)) &&
+		   (kcr->kcr_head[c] || (kcr->kcr_out[c] >= w->kcw_win))) {
+		if (w->kcw_ss || (++w->kcw_acc >= w->kcw_win)) {
+			w->kcw_acc = 0;
+			w->kcw_win++;
+			if (kts_state(kts) == KTLI_SSTATE_CONNECTED)
+				ktli_crdispatch(kcr, c, &go);
+		}
+	}
+
+ sampled:
+	pthread_mutex_unlock(&kcr->kcr_m);
+
+	ktli_crsend(kts, &go);
+}
+
+/*
+ * Returns the credit of a KIO handed back to the caller and lets the
+ * next KIO waiting for one go. Waiters only go out while kts is still
+ * connected, after that ktli_crflush fails them.
+ */
+static void
+ktli_crrelease(int kts, struct kio *kio)
+{
+	struct ktli_credits *kcr;
+	struct ktli_crgo go = { NULL, NULL };
+	int c;
+
+	if (!KIOF_ISSET(kio, KIOF_CREDIT))
+		return;
+	KIOF_CLR(kio, KIOF_CREDIT);
+
+	c = ktli_crclass(kio);
+	kcr = kts_credits(kts);
+	if (!kcr || (c < 0))
+		return;
+
+	pthread_mutex_lock(&kcr->kcr_m);
+	kcr->kcr_out[c]--;
+	if ((kcr->kcr_flags & KTLI_CRADAPT) &&
+	    (kio->kio_state == KIO_TIMEDOUT))
+		ktli_crwcut(&kcr->kcr_win[c]);
+	if (kts_state(kts) == KTLI_SSTATE_CONNECTED)
+		ktli_crdispatch(kcr, c, &go);
+	pthread_mutex_unlock(&kcr->kcr_m);
+
+	ktli_crsend(kts, &go);
+}
+
+/*
+ * Fails the KIOs of a disconnecting session that are still waiting for
+ * a credit onto the cq, where they are drained like any other.
+ */
+static void
+ktli_crflush(int kts)
+{
+	struct ktli_credits *kcr;
+	struct ktli_queue *cq;
+	struct kio *kio;
+	int c, posted = 0;
+
+	kcr = kts_credits(kts);
+	if (!kcr)
+		return;
+
+	cq = kts_compq(kts);
+	pthread_mutex_lock(&kcr->kcr_m);
+	pthread_mutex_lock(&cq->ktq_m);
+	(void)list_mvrear(cq->ktq_list);
+	for (c = 0; c < KTLI_CR_MAX; c++) {
+		while ((kio = kcr->kcr_head[c])) {
+			kcr->kcr_head[c] = kio->kio_crnext;
+			kio->kio_crnext = NULL;
+			kio->kio_state = KIO_FAILED;
+			list_insert_after(cq->ktq_list, &kio,
+					  sizeof(struct kio *));
+
+			/* preserve the Q back pointer  */
+			kio->kio_qbp = list_element_curr(cq->ktq_list);
+			posted = 1;
+		}
+		kcr->kcr_tail[c] = NULL;
+	}
+
+	if (posted)
+		ktli_cq_post(cq);
+	pthread_mutex_unlock(&cq->ktq_m);
+	pthread_mutex_unlock(&kcr->kcr_m);
+}
+
+/*
+ * A KIO is handed back to the caller, it gives back what it held: its
+ * count against the stripe member it was sent on, see ktli_stripe_pick(),
+ * and its credit on that member. kts is the member or the stripe's first.
+ */
+static void
+ktli_handback(int kts, struct kio *kio)
+{
+	struct ktli_stripe *stp;
+	int m = kts;
+
+	stp = kts_stripe(kts);
+	if (kio->kio_stripe && stp) {
+		m = stp->kst_kts[kio->kio_stripe - 1];
+		__atomic_sub_fetch(&stp->kst_out[kio->kio_stripe - 1], 1,
+				   __ATOMIC_RELAXED);
+	}
+	kio->kio_stripe = 0;
+
+	if (m >= 0)
+		ktli_crrelease(m, kio);
+}
+
+/**
+ * int ktli_receive(int kts, struct kio *kio)
+ *
+ * This function receives any completed kio. If no kio are completed it
+ * immediately returns back to the caller. A received kio is hung on
+ * the caller provided kio ptr.
+ *
+ * @param kts An opened and connected kinetic session descriptor.
+ * @param kio A kio ptr. The completed queue is searched for the passed in kio
+ *            if found, it is removed and success returned, failure otherwise.
+ *
+ * Error means that the KIO was never found or possibly doesn't exist
+ * Success means that a KIO was located and removed from KTLI's control.
+ */
+int
+ktli_receive(int kts, struct kio *kio)
+{
+	int rc = 0;
+	enum ktli_sstate st;
+	struct ktli_queue *cq;
+	struct kio **lkio;
+
+	errno = 0;
+	
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	/*
+	 * A KIO taken off the CQ by ktli_reap already belongs to the
+	 * caller, whatever the session state. Receiving it only hands
+	 * back its status.
+	 */
+	if (KIOF_ISSET(kio, KIOF_REAPED)) {
+		KIOF_CLR(kio, KIOF_REAPED);
+		ktli_handback(kts, kio);
+		if ((kio->kio_state == KIO_TIMEDOUT) ||
+		    (kio->kio_state == KIO_FAILED))
+			errno = kio->kio_errno;
+		return(0);
+	}
+
+	/*
+	 * verify kts is connected or in draining, receives can drain
+	 * as well as ktli_drain, the difference is that the receive must
+	 * match a kio to drain and since we are unconnected a draining
+	 * receive can receive from all queues in compq, recvq, sendq order.
+	 */
+	st = kts_state(kts);
+	if ((st != KTLI_SSTATE_CONNECTED) && (st != KTLI_SSTATE_DRAINING)) {
+		errno = ENOTCONN;
+		return(-1);
+	}
+
+	/*
+	 * This is a special case, the connection is gone and we need to
+	 * receive all the failed incomplete requests.
+	 */
+	if ((st == KTLI_SSTATE_DRAINING)) {
+		rc = ktli_drain_match(kts, kio);
+		if (!rc)
+			ktli_handback(kts, kio);
+		return(rc);
+	}
+
+	cq = kts_compq(kts);
+
+	pthread_mutex_lock(&cq->ktq_m);
+
+	/*
+	 * if the KIO has been received then the KIO has a back pointer
+	 * into the CQ. So set the CQ curr to that back pointer and pop
+	 * it off the list.
+	 */
+	if ((kio->kio_state == KIO_RECEIVED) ||
+	    (kio->kio_state == KIO_TIMEDOUT) ||
+	    (kio->kio_state == KIO_FAILED))     {
+		/*
+		 * check for a NULL as a safety check that the back pointer
+		 * is valid for the CQ
+		 */
+		if (list_setcurr(cq->ktq_list, kio->kio_qbp)) {
+			lkio = (struct kio **)list_remove_curr(cq->ktq_list);
+			assert(kio == *lkio);
+			KTLI_FREE(lkio);
+
+			kio->kio_qbp = NULL; /* no longer on a q */
+
+			/* 
+			 * Could be receiving a KIO in any state:
+			 *	KIO_RECEIVED
+			 *	KIO_FAILED
+			 *	KIO_TIMEDOUT
+			 * That is still a successful receive of a valid KIO. 
+			 * Caller can use KIO state to determine what to do.
+			 */
+			rc = 0;
+		        if (kio->kio_state == KIO_TIMEDOUT) {
+				errno = kio->kio_errno = ETIMEDOUT;
+			} else if (kio->kio_state == KIO_FAILED) {
+				errno = kio->kio_errno = ENOMSG;
+			}
+
+		} else {
+			/* Getting here is a bug */
+			assert(0);
+		}
+	} else {
+		errno = ENOENT;
+		debug_printf("Attempted receveive on a non ready KIO\n");
+		rc = -1;
+	}
+
+	/* leave the list ready for an insert */
+	(void)list_mvrear(cq->ktq_list);
+
+	/* if there are still messages wakeup the next */
+	if (list_size(cq->ktq_list)) {
+		pthread_cond_broadcast(&cq->ktq_cv);
+	} else {
+		ktli_cq_reset(cq);
+	}
+
+	pthread_mutex_unlock(&cq->ktq_m);
+
+	/* Outside the cq mutex, returning a credit can queue a send */
+	if (!rc)
+		ktli_handback(kts, kio);
+
+	return(rc);
+}
+
+/**
+ * int ktli_receive(int kts, struct kio *kio)
+ *
+ * This function receives any completed kio. If no kio are completed it
+ * immediately returns back to the caller. A received kio is hung on
+ * the caller provided kio ptr.
+ *
+ * @param kts An opened and connected kinetic session descriptor.
+ * @param kio A kio ptr. The completed queue is searched for the passed in kio
+ *            if found, it is removed and success returned, failure otherwise.
+ *
+ */
+int
+ktli_receive_unsolicited(int kts, struct kio **kio)
+{
+	int rc = 0;
+	enum ktli_sstate st;
+	struct ktli_queue *cq;
+	struct kio **lkio;
+
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	/*
+	 * verify kts is connected or in draining, receives can drain
+	 * as well as ktli_drain, the difference is that the receive must
+	 * match a kio to drain and since we are unconnected a draining
+	 * receive can receive from all queues in compq, recvq, sendq order.
+	 */
+	st = kts_state(kts);
+	if ((st != KTLI_SSTATE_CONNECTED) && (st != KTLI_SSTATE_DRAINING)) {
+		errno = ENOTCONN;
+		return(-1);
+	}
+
+	cq = kts_compq(kts);
+
+	pthread_mutex_lock(&cq->ktq_m);
+
+	/* list_traverse defaults to starting the traverse at the front */
+	rc = list_traverse(cq->ktq_list, kio, ktli_kionoreq, LIST_ALTR);
+	if (rc == LIST_EXTENT || rc == LIST_EMPTY) {
+		errno = ENOENT;
+		rc = -1;
+	} else {
+		/* Found the requested kio */
+		lkio = (struct kio **)list_remove_curr(cq->ktq_list);
+		*kio = *lkio;
+		KTLI_FREE(lkio);
+		rc = 0;
+
+		(*kio)->kio_qbp = NULL;  /* No longer on a Q */
+	}
+	/* leave the list ready for an insert */
+	(void)list_mvrear(cq->ktq_list);
+
+	/* if there are still messages wakeup the next */
+	if (list_size(cq->ktq_list)) {
+		pthread_cond_broadcast(&cq->ktq_cv);
+	} else {
+		ktli_cq_reset(cq);
+	}
+
+	pthread_mutex_unlock(&cq->ktq_m);
+
+	return(rc);
+}
+
+/*
+ * Busy poll wait for ktli_poll(). Spins until a post to the completion Q
+ * finds it non-empty, for at most kcfg_spinus or the caller's timeout if
+ * shorter. Returns 0 when a completion is ready and 1 when the caller
+ * should go on and sleep, which also sorts out exits and timeouts.
+ */
+static int
+ktli_poll_spin(struct ktli_queue *cq, struct ktli_config *cf, int timeout)
+{
+	struct timespec start, now;
+	uint32_t posts, seen, n;
+	long spinus, us;
+	int rc;
+
+	spinus = cf->kcfg_spinus ? cf->kcfg_spinus : KTLI_SPINUS;
+	if (timeout > 0 && timeout < spinus)
+		spinus = timeout;
+
+	clock_gettime(KIO_CLOCK, &start);
+	seen = __atomic_load_n(&cq->ktq_posts, __ATOMIC_ACQUIRE) - 1;
+	for (n = 1; ; n++) {
+		/* Only look under the lock when something was posted */
+		posts = __atomic_load_n(&cq->ktq_posts, __ATOMIC_ACQUIRE);
+		if (posts != seen) {
+			seen = posts;
+			pthread_mutex_lock(&cq->ktq_m);
+			rc = list_size(cq->ktq_list) ? 0 : cq->ktq_exit ? 1 : -1;
+			pthread_mutex_unlock(&cq->ktq_m);
+			if (rc >= 0)
+				return(rc);
+		}
+
+		if (!(n % KTLI_SPINCLK)) {
+			clock_gettime(KIO_CLOCK, &now);
+			us = (now.tv_sec - start.tv_sec) * 1000000 +
+				(now.tv_nsec - start.tv_nsec) / 1000;
+			if (us >= spinus)
+				return(1);
+			sched_yield();
+		}
+		ktli_cpu_relax();
+	}
+}
+
+/**
+ * int ktli_poll(int kts, int timeout)
+ *
+ * This function polls a connected session to see if there are any
+ * completed and receivable kios.  Will block till either a kio
+ * becomes ready, a timeout occurs or until the session is disconnected.
+ * Waiters sleep on the completion Q condition variable, every KIO added
+ * to the completion Q wakes them. With KCFF_BUSYPOLL a waiter first spins
+ * on the completion Q post count, see ktli_poll_spin().
+ *
+ * @param kts A connected kinetic session descriptor.
+ * @param timeout Number of micro seconds to wait, 0 waits forever
+ *
+ */
+int
+ktli_poll(int kts, int timeout)
+{
+	enum ktli_sstate st;
+	struct ktli_queue *cq;
+	struct ktli_config *cf;
+	struct timespec deadline;
+	int rc, expired = 0;
+
+	errno = 0;
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	/* verify kts is connected */
+	st = kts_state(kts);
+	if ((st != KTLI_SSTATE_CONNECTED)) {
+		errno = ENOTCONN;
+		return(-1);
+	}
+
+	cq = kts_compq(kts);
+
+	cf = kts_config(kts);
+	if ((cf->kcfg_flags & KCFF_BUSYPOLL) && !ktli_poll_spin(cq, cf, timeout))
+		return(0);
+
+	/* Absolute deadline, if caller passed a timeout */
+	if (timeout > 0) {
+		clock_gettime(KIO_CLOCK, &deadline);
+		deadline.tv_sec  += timeout / 1000000;
+		deadline.tv_nsec += (long)(timeout % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&cq->ktq_m);
+	do {
+		/* Check the for completed items */
+		if (list_size(cq->ktq_list)) {
+			rc = 0;
+			break;
+		}
+
+		/* see if someone pulled the rug out from under us */
+		if (cq->ktq_exit) {
+			errno = ECONNABORTED;
+			rc = -1;
+			break;
+		}
+
+		/* disconnected while we slept */
+		if (kts_state(kts) != KTLI_SSTATE_CONNECTED) {
+			errno = ENOTCONN;
+			rc = -1;
+			break;
+		}
+
+		if (expired) {
+			errno = ETIMEDOUT;
+			rc = -1;
+			break;
+		}
+
+		if (timeout > 0) {
+			if (pthread_cond_timedwait(&cq->ktq_cv, &cq->ktq_m,
+						   &deadline) == ETIMEDOUT)
+				expired = 1; /* one last check */
+		} else {
+			pthread_cond_wait(&cq->ktq_cv, &cq->ktq_m);
+		}
+	} while(1);
+	pthread_mutex_unlock(&cq->ktq_m);
+
+	return(rc);
+}
+
+/**
+ * int ktli_reap(int kts, struct kio **kio, int max, int timeout)
+ *
+ * This function receives up to max completed kios in one go, in the
+ * order they completed, without the caller naming them. Only kios sent
+ * with KIOF_REAP set are taken, others, like unsolicited responses or
+ * kios a synchronous caller is polling for, are left where they are
+ * for ktli_receive and ktli_receive_unsolicited. Reaped kios are
+ * marked KIOF_REAPED, they are no longer on any queue and a later
+ * ktli_receive of one succeeds immediately. Like ktli_receive, a reaped
+ * kio may be KIO_RECEIVED, KIO_FAILED or KIO_TIMEDOUT.
+ *
+ * Returns the number of kios reaped, 0 if none completed in time, or -1
+ * with errno set.
+ *
+ * @param kts A connected kinetic session descriptor.
+ * @param kio An ARRAY[] of at least max kio PTRs, filled from the front.
+ * @param max Maximum number of kios to reap.
+ * @param timeout Number of micro seconds to wait for the first kio, 0
+ *		  does not wait and less than 0 waits forever.
+ */
+int
+ktli_reap(int kts, struct kio **kio, int max, int timeout)
+{
+	enum ktli_sstate st;
+	struct ktli_queue *cq;
+	struct timespec deadline;
+	struct kio **lkio;
+	int rc, n = 0, expired = 0;
+
+	errno = 0;
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	if (!kio || max <= 0) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	/* verify kts is connected */
+	st = kts_state(kts);
+	if ((st != KTLI_SSTATE_CONNECTED)) {
+		errno = ENOTCONN;
+		return(-1);
+	}
+
+	cq = kts_compq(kts);
+
+	/* Absolute deadline, if caller passed a timeout */
+	if (timeout > 0) {
+		clock_gettime(KIO_CLOCK, &deadline);
+		deadline.tv_sec  += timeout / 1000000;
+		deadline.tv_nsec += (long)(timeout % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&cq->ktq_m);
+	do {
+		/* Take what is there, skipping kios others are waiting on */
+		while (n < max) {
+			/* list_traverse defaults to starting at the front */
+			rc = list_traverse(cq->ktq_list, NULL, ktli_kioreap,
+					   LIST_ALTR);
+			if (rc == LIST_EXTENT || rc == LIST_EMPTY)
+				break;
+
+			lkio = (struct kio **)list_remove_curr(cq->ktq_list);
+			kio[n] = *lkio;
+			KTLI_FREE(lkio);
+
+			kio[n]->kio_qbp = NULL; /* no longer on a q */
+			KIOF_SET(kio[n], KIOF_REAPED);
+		        if (kio[n]->kio_state == KIO_TIMEDOUT) {
+				kio[n]->kio_errno = ETIMEDOUT;
+			} else if (kio[n]->kio_state == KIO_FAILED) {
+				kio[n]->kio_errno = ENOMSG;
+			}
+			n++;
+		}
+
+		if (n || !timeout)
+			break;
+
+		/* see if someone pulled the rug out from under us */
+		if (cq->ktq_exit) {
+			errno = ECONNABORTED;
+			n = -1;
+			break;
+		}
+
+		/* disconnected while we slept */
+		if (kts_state(kts) != KTLI_SSTATE_CONNECTED) {
+			errno = ENOTCONN;
+			n = -1;
+			break;
+		}
+
+		if (expired)
+			break;
+
+		if (timeout > 0) {
+			if (pthread_cond_timedwait(&cq->ktq_cv, &cq->ktq_m,
+						   &deadline) == ETIMEDOUT)
+				expired = 1; /* one last check */
+		} else {
+			pthread_cond_wait(&cq->ktq_cv, &cq->ktq_m);
+		}
+	} while(1);
+
+	/* leave the list ready for an insert */
+	(void)list_mvrear(cq->ktq_list);
 
 	/* if there are still messages wakeup the next */
 	if (list_size(cq->ktq_list)) {
 		pthread_cond_broadcast(&cq->ktq_cv);
+	} else {
+		ktli_cq_reset(cq);
+	}
+
+	pthread_mutex_unlock(&cq->ktq_m);
+
+	return(n);
+}
+
+/**
+ * int ktli_pollfd(int kts)
+ *
+ * This function returns a file descriptor that is readable whenever the
+ * session has completed and receivable kios, for use with poll(2),
+ * epoll(7) and the like. The descriptor is owned by the session and is
+ * closed by ktli_close. Callers must not read from it, it becomes
+ * unreadable again once every completed kio has been received.
+ *
+ * @param kts A connected kinetic session descriptor.
+ */
+int
+ktli_pollfd(int kts)
+{
+	enum ktli_sstate st;
+	struct ktli_queue *cq;
+	int efd;
+
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	/* verify kts is connected */
+	st = kts_state(kts);
+	if ((st != KTLI_SSTATE_CONNECTED)) {
+		errno = ENOTCONN;
+		return(-1);
 	}
 
+	cq = kts_compq(kts);
+
+	pthread_mutex_lock(&cq->ktq_m);
+	if (cq->ktq_efd < 0) {
+		cq->ktq_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (cq->ktq_efd >= 0) {
+			/* Completions may already be waiting */
+			ktli_cq_post(cq);
+		}
+	}
+	efd = cq->ktq_efd;
 	pthread_mutex_unlock(&cq->ktq_m);
 
-	return(rc);
+	return(efd);
 }
 
 /**
- * int ktli_receive(int kts, struct kio *kio)
- *
- * This function receives any completed kio. If no kio are completed it
- * immediately returns back to the caller. A received kio is hung on
- * the caller provided kio ptr.
+ * int ktli_drain(int kts, struct kio **kio)
  *
- * @param kts An opened and connected kinetic session descriptor.
- * @param kio A kio ptr. The completed queue is searched for the passed in kio
- *            if found, it is removed and success returned, failure otherwise.
+ * This function drains adraining session of queued kio's.
+ * This must be done to successfully close a session.  Each call to drain
+ * will return a single previously queued kio.  Once the queues are empty
+ * it will return a NULL kio. Unsent kio's are failed onto the completion
+ * queue, which is drained first, then the receive queue. A striped
+ * session only drains its own kio's off the shared completion queue, the
+ * other members' stay put for them.
  *
+ * @param kts A connected kinetic session descriptor.
+ * @param kio A PTR to a kio PTR. drain will return a single dequeued kio
+ *	      on this ptr.
  */
 int
-ktli_receive_unsolicited(int kts, struct kio **kio)
+ktli_drain(int kts, struct kio **kio)
 {
-	int rc = 0;
+	int rc, i, tag, lrc;
 	enum ktli_sstate st;
-	struct ktli_queue *cq;
 	struct kio **lkio;
+	struct ktli_queue *q, *sq, *cq;
 
 	if (!kts_isvalid(kts)) {
 		errno = EBADF;
 		return(-1);
 	}
 
-	/*
-	 * verify kts is connected or in draining, receives can drain
-	 * as well as ktli_drain, the difference is that the receive must
-	 * match a kio to drain and since we are unconnected a draining
-	 * receive can receive from all queues in compq, recvq, sendq order.
-	 */
+	/* verify kts is set to drain */
 	st = kts_state(kts);
-	if ((st != KTLI_SSTATE_CONNECTED) && (st != KTLI_SSTATE_DRAINING)) {
-		errno = ENOTCONN;
+	if ((st != KTLI_SSTATE_DRAINING)) {
+		errno = EBADFD;
 		return(-1);
 	}
 
+	/*
+	 * The sendq can only be taken from the front, so whatever is
+	 * left on it is failed onto the cq first and drained from there
+	 */
+	sq = kts_sendq(kts);
 	cq = kts_compq(kts);
-
+	pthread_mutex_lock(&sq->ktq_m);
 	pthread_mutex_lock(&cq->ktq_m);
+	ktli_sq_flush(sq, cq, 0);
+	pthread_mutex_unlock(&cq->ktq_m);
+	pthread_mutex_unlock(&sq->ktq_m);
 
-	/* list_traverse defaults to starting the traverse at the front */
-	rc = list_traverse(cq->ktq_list, kio, ktli_kionoreq, LIST_ALTR);
-	if (rc == LIST_EXTENT || rc == LIST_EMPTY) {
-		errno = ENOENT;
-		rc = -1;
-	} else {
-		/* Found the requested kio */
-		lkio = (struct kio **)list_remove_curr(cq->ktq_list);
-		*kio = *lkio;
-		KTLI_FREE(lkio);
-		rc = 0;
+	rc = 0;
+	*kio = NULL;
+	tag = ktli_stripe_tag(kts);
+	for (i=0; i<2; i++) {
+		switch (i) {
+		case 0: q = cq; break;
+		case 1: q = kts_recvq(kts); break;
+		}
 
-		(*kio)->kio_qbp = NULL;  /* No longer on a Q */
-	}
-	/* leave the list ready for an insert */
-	(void)list_mvrear(cq->ktq_list);
+		pthread_mutex_lock(&q->ktq_m);
+		lkio = NULL;
+		if (list_size(q->ktq_list) && (q == cq) && tag) {
+			/* A shared cq, only this member's KIOs */
+			lrc = list_traverse(q->ktq_list, &tag, ktli_kiomember,
+					    LIST_ALTR);
+			if (lrc != LIST_EXTENT && lrc != LIST_EMPTY)
+				lkio = (struct kio **)
+					list_remove_curr(q->ktq_list);
+			(void)list_mvrear(q->ktq_list);
+		} else if (list_size(q->ktq_list)) {
+			lkio = (struct kio **)list_remove_front(q->ktq_list);
+		}
 
-	/* if there are still messages wakeup the next */
-	if (list_size(cq->ktq_list)) {
-		pthread_cond_broadcast(&cq->ktq_cv);
+		if (lkio) {
+			*kio = *lkio;
+			KTLI_FREE(lkio);
+			rc = 1;
+
+			/* A no-op on all but the recvq */
+			ktli_untrack(q, *kio);
+
+			/* A no-op on all but the compq */
+			ktli_cq_reset(q);
+
+			(*kio)->kio_qbp = NULL; /* No longer on a Q */
+			(*kio)->kio_state = KIO_FAILED;
+
+		}
+		pthread_mutex_unlock(&q->ktq_m);
+
+		if (*kio) break; /* De-queued a kio, so return */
 	}
 
-	pthread_mutex_unlock(&cq->ktq_m);
+	/* if queues are empty move to opened */
+	if (!(*kio))
+		kts_set_state(kts,  KTLI_SSTATE_OPENED);
+	else
+		ktli_handback(kts, *kio);
 
 	return(rc);
 }
 
 /**
- * int ktli_poll(int kts, int timeout)
+ * int ktli_drain_match(int kts, struct kio *kio)
  *
- * This function polls a connected session to see if there are any
- * completed and receivable kios.  Will block till either a kio
- * becomes ready, a timeout occurs or until the session is disconnected.
+ * This function drains a draining session of queued kio's.
+ * This must be done to successfully close a session.  Each call to drain
+ * match will locate a provided kio in one of the three queues, dequeue it
+ * and return success that it was found and dequeued. Unsent kio's are
+ * failed onto the compq first, then the search order is compq and recvq.
+ * A striped session only matches and counts its own kio's on the shared
+ * compq, see ktli_drain().
  *
  * @param kts A connected kinetic session descriptor.
- * @param timeout Number of micro seconds to wait, approximate
- *
+ * @param kio A kio PTR. drain match will match the provided kio to onea kio
+ *        in either the compq , recvq or sendq.
  */
 int
-ktli_poll(int kts, int timeout)
+ktli_drain_match(int kts, struct kio *kio)
 {
+	int rc, i, tag;
+	uint32_t tqlen; /* sum of all q sizes */
+	struct ktli_kiocnt kc;
 	enum ktli_sstate st;
-	struct ktli_queue *cq;
-	int timeleft;
-	struct timespec interval, remain;
+	struct kio **lkio;
+	struct ktli_queue *q, *sq, *cq;
 
 	errno = 0;
+	
 	if (!kts_isvalid(kts)) {
 		errno = EBADF;
 		return(-1);
 	}
 
-	/* verify kts is connected */
+	/* verify kts is set to drain */
 	st = kts_state(kts);
-	if ((st != KTLI_SSTATE_CONNECTED)) {
-		errno = ENOTCONN;
+	if ((st != KTLI_SSTATE_DRAINING)) {
+		errno = EBADFD;
 		return(-1);
 	}
 
+	/*
+	 * This loop does 2 things: first  it looks for a specific
+	 * named kio to drain across the q's.  If found, it dequeues
+	 * it, and sets a successful return code. Second it determines the
+	 * total number of kio's remaining across the q's. If no
+	 * KIOs left, then move the session state to OPENED.
+	 */
+	sq = kts_sendq(kts);
 	cq = kts_compq(kts);
+	pthread_mutex_lock(&sq->ktq_m);
+	pthread_mutex_lock(&cq->ktq_m);
+	ktli_sq_flush(sq, cq, 0);
+	pthread_mutex_unlock(&cq->ktq_m);
+	pthread_mutex_unlock(&sq->ktq_m);
 
-	interval.tv_sec		= 0;
-	interval.tv_nsec	= KTLI_POLLINTERVAL;
-	remain.tv_sec 		= 0;
-	remain.tv_nsec		= 0;
-	timeleft		= timeout * 1000;	/* uS -> nS */
+	tqlen = 0;
+	rc = -1;
+	tag = ktli_stripe_tag(kts);
+	for (i=0; i<2; i++) {
+		switch (i) {
+		case 0: q = cq; break;
+		case 1: q = kts_recvq(kts); break;
+		}
 
-	do {
-		nanosleep(&interval, &remain);
+		pthread_mutex_lock(&q->ktq_m);
 
-		pthread_mutex_lock(&cq->ktq_m);
+		/*
+		 * list_traverse defaults to starting at the front. Another
+		 * member's KIO on a shared cq is left for it.
+		 */
+		if ((q == cq) && !ktli_kioowned(kio, tag))
+			rc = LIST_EXTENT;
+		else
+			rc = list_traverse(q->ktq_list, kio, ktli_kiomatch,
+					   LIST_ALTR);
 
-		/* Check the for completed items */
-		if (list_size(cq->ktq_list)) {
-			pthread_mutex_unlock(&cq->ktq_m);
-			return(0);
+		if (rc != LIST_EXTENT && rc != LIST_EMPTY) {
+			/* Found the requested kio */
+			lkio = (struct kio **) list_remove_curr(q->ktq_list);
+			assert(kio == *lkio);
+			KTLI_FREE(lkio);
+			rc = 0;
+
+			/* A no-op on all but the recvq */
+			ktli_untrack(q, kio);
+
+			/* A no-op on all but the compq */
+			ktli_cq_reset(q);
+
+			kio->kio_qbp = NULL; /* No longer on a Q */
+			kio->kio_state = KIO_FAILED;
+		}
+
+		if ((q == cq) && tag) {
+			kc.kc_tag = tag;
+			kc.kc_n = 0;
+			(void)list_traverse(q->ktq_list, &kc, ktli_kiocount,
+					    LIST_ALTR);
+			tqlen += kc.kc_n;
+		} else {
+			tqlen += list_size(q->ktq_list);
+		}
+
+		/* leave the list ready in a nominal position */
+		(void)list_mvrear(q->ktq_list);
+
+		pthread_mutex_unlock(&q->ktq_m);
+	}
+
+	/* if queues are empty move to opened */
+	if (!tqlen)
+		kts_set_state(kts,  KTLI_SSTATE_OPENED);
+
+	return(rc);
+}
+
+/**
+ * int ktli_settimeout(int kts, struct kio *kio, uint32_t ms)
+ *
+ * This function sets the time KTLI waits for the response to a kio before
+ * failing it as KIO_TIMEDOUT. If the kio has not been sent yet, the time
+ * starts when it is sent. If it is already waiting on a response, its
+ * deadline is moved to ms from now. A kio that has already completed is
+ * left alone.
+ *
+ * @param kts An opened kinetic session descriptor.
+ * @param kio A kio previously passed to ktli_send.
+ * @param ms  Timeout in milliseconds, 0 restores the KIO_TIMEOUT_S default.
+ */
+int
+ktli_settimeout(int kts, struct kio *kio, uint32_t ms)
+{
+	struct ktli_queue *rq;
+	struct ktli_stripe *stp;
+	int m = kts;
+
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	if (!kio) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	/*
+	 * A striped kio waits on the wheel of the member it was sent on,
+	 * see ktli_handback(). A closed member has nothing in flight.
+	 */
+	stp = kts_stripe(kts);
+	if (kio->kio_stripe && stp)
+		m = stp->kst_kts[kio->kio_stripe - 1];
+	if (m < 0) {
+		kio->kio_tmo_ms = ms;
+		return(0);
+	}
+	rq = kts_recvq(m);
+
+	/*
+	 * The sender reads kio_tmo_ms under the rq lock when it places the
+	 * kio on the rq, so either it sees the new value or the kio is
+	 * already on the wheel and is rearmed here.
+	 */
+	pthread_mutex_lock(&rq->ktq_m);
+	kio->kio_tmo_ms = ms;
+	if (kio->kio_twpprev)
+		ktli_arm(rq, kio);
+	pthread_mutex_unlock(&rq->ktq_m);
+
+	return(0);
+}
+
+/**
+ * int ktli_config (int kts, struct ktli_config *cf)
+ *
+ * This function returns the session config structure
+ *
+ * @param kts A connected kinetic session descriptor.
+ *
+*/
+int
+ktli_config(int kts, struct ktli_config **cf)
+{
+	if (!kts_isvalid(kts)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	*cf = kts_config(kts);
+	return(0);
+}
+
+/**
+ * int ktli_stripe(int kts, int member)
+ *
+ * This function stripes an opened session behind another, so that one
+ * descriptor can spread its requests over several connections to the
+ * same server. The member keeps its own queues, driver handle, threads
+ * and sequence numbers but its completions land on the completion queue
+ * of kts. Receives, polls and reaps on kts see the KIOs of all members.
+ * Requests are sent on a member directly, ktli_stripe_pick() tells which.
+ * Members must be closed before kts.
+ *
+ * @param kts	  An opened or connected KTLI session id, the first member.
+ * @param member  An opened KTLI session id, not yet connected.
+ */
+int
+ktli_stripe(int kts, int member)
+{
+	struct ktli_stripe *stp;
+	struct ktli_queue *cq, *mcq;
+	enum ktli_sstate st;
+
+	if (!kts_isvalid(kts) || !kts_isvalid(member) || (kts == member)) {
+		errno = EBADF;
+		return(-1);
+	}
+
+	st = kts_state(kts);
+	if (((st != KTLI_SSTATE_OPENED) && (st != KTLI_SSTATE_CONNECTED)) ||
+	    (kts_state(member) != KTLI_SSTATE_OPENED) ||
+	    kts_stripe(member)) {
+		errno = EBADFD;
+		return(-1);
+	}
+
+	mcq = kts_compq(member);
+	if (list_size(mcq->ktq_list)) {
+		errno = ENOTEMPTY;
+		return(-1);
+	}
+
+	/* The first join creates the stripe, kts is always its first */
+	stp = kts_stripe(kts);
+	if (!stp) {
+		stp = (struct ktli_stripe *)KTLI_MALLOC(sizeof(*stp));
+		if (!stp) {
+			errno = ENOMEM;
+			return(-1);
 		}
+		memset(stp, 0, sizeof(*stp));
+		stp->kst_kts[0] = kts;
+		stp->kst_n = 1;
+		kts_set_stripe(kts, stp);
+	} else if (stp->kst_kts[0] != kts) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if (stp->kst_n == KTLI_MAXSTRIPE) {
+		errno = ENOSPC;
+		return(-1);
+	}
+
+	/* Swap the member's completion queue for the shared one */
+	cq = kts_compq(kts);
+	__atomic_add_fetch(&cq->ktq_refs, 1, __ATOMIC_SEQ_CST);
+	kts_set_compq(member, cq);
+
+	list_destroy(mcq->ktq_list, (void *)LIST_NODEALLOC);
+	if (mcq->ktq_efd >= 0)
+		close(mcq->ktq_efd);
+	KTLI_FREE(mcq);
+
+	stp->kst_kts[stp->kst_n] = member;
+	stp->kst_out[stp->kst_n] = 0;
+	__atomic_add_fetch(&stp->kst_n, 1, __ATOMIC_RELEASE);
+	kts_set_stripe(member, stp);
+
+	return(0);
+}
+
+/**
+ * int ktli_stripe_pick(int kts)
+ *
+ * This function returns the connected member of kts's stripe with the
+ * fewest KIOs sent and not yet handed back, kts itself if it has no
+ * stripe or no member is connected.
+ *
+ * @param kts	The first member of a stripe, see ktli_stripe().
+ */
+int
+ktli_stripe_pick(int kts)
+{
+	struct ktli_stripe *stp;
+	int i, n, m, out, best = -1, pick = kts;
+
+	if (!kts_isvalid(kts))
+		return(kts);
+
+	stp = kts_stripe(kts);
+	if (!stp)
+		return(kts);
 
-		/* see if someone pulled the rug out from under us */
-		if (cq->ktq_exit) {
-			pthread_mutex_unlock(&cq->ktq_m);
-			errno = ECONNABORTED;
-			return(-1);
-		}
-		
-		pthread_mutex_unlock(&cq->ktq_m);
+	n = __atomic_load_n(&stp->kst_n, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		m = stp->kst_kts[i];
+		if ((m < 0) || (kts_state(m) != KTLI_SSTATE_CONNECTED))
+			continue;
 
-		/* Update the timeleft, if caller passed a timeout */
-		if (timeout) {
-			timeleft =- (interval.tv_nsec - remain.tv_nsec);
-			if (timeleft <= 0) {
-				errno = ETIMEDOUT;
-				return(-1);
-			}
+		out = __atomic_load_n(&stp->kst_out[i], __ATOMIC_RELAXED);
+		if ((best < 0) || (out < best)) {
+			best = out;
+			pick = m;
 		}
-	} while(1);
+	}
+
+	return(pick);
 }
 
 /**
- * int ktli_drain(int kts, struct kio **kio)
+ * int ktli_credits(int kts, uint32_t rdmax, uint32_t wrmax, int flags)
  *
- * This function drains adraining session of queued kio's.
- * This must be done to successfully close a session.  Each call to drain
- * will return a single previously queued kio.  Once the queues are empty
- * it will return a NULL kio. Completed queues are drained first, then
- * the receive queue and then the send queue.
+ * This function sets up admission control on a session, so that no more
+ * requests are outstanding than the server accepts. At most rdmax kios
+ * flagged KIOF_CRREAD and wrmax flagged KIOF_CRWRITE are outstanding at
+ * once, a kio counts from ktli_send() until the caller receives or drains
+ * it. A limit of 0 is no limit. Past a limit ktli_send() fails the kio
+ * with EAGAIN or, with KTLI_CRQUEUE, holds it back until a kio of its
+ * class is handed back. Held kios go out in send order, callers that wait
+ * on one must keep receiving the others. With KTLI_CRADAPT each class is
+ * instead held to a window that adapts to the measured round trip, see
+ * ktli_crsample(), bounded by its limit. Can be called again to change
+ * the limits or the policy, but not concurrently.
  *
- * @param kts A connected kinetic session descriptor.
- * @param kio A PTR to a kio PTR. drain will return a single dequeued kio
- *	      on this ptr.
+ * @param kts	 An opened or connected KTLI session id.
+ * @param rdmax	 Read credits, 0 if unlimited.
+ * @param wrmax	 Write credits, 0 if unlimited.
+ * @param flags	 KTLI_CRQUEUE and KTLI_CRADAPT.
  */
 int
-ktli_drain(int kts, struct kio **kio)
+ktli_credits(int kts, uint32_t rdmax, uint32_t wrmax, int flags)
 {
-	int rc, i;
+	struct ktli_credits *kcr;
+	struct ktli_crgo go = { NULL, NULL };
 	enum ktli_sstate st;
-	struct kio **lkio;
-	struct ktli_queue *q;
+	int c;
 
 	if (!kts_isvalid(kts)) {
 		errno = EBADF;
 		return(-1);
 	}
 
-	/* verify kts is set to drain */
 	st = kts_state(kts);
-	if ((st != KTLI_SSTATE_DRAINING)) {
+	if ((st != KTLI_SSTATE_OPENED) && (st != KTLI_SSTATE_CONNECTED)) {
 		errno = EBADFD;
 		return(-1);
 	}
 
-	rc = 0;
-	*kio = NULL;
-	for (i=0; i<3; i++) {
-		switch (i) {
-		case 0: q = kts_compq(kts); break;
-		case 1: q = kts_recvq(kts); break;
-		case 2: q = kts_sendq(kts); break;
+	kcr = kts_credits(kts);
+	if (!kcr) {
+		kcr = (struct ktli_credits *)KTLI_MALLOC(sizeof(*kcr));
+		if (!kcr) {
+			errno = ENOMEM;
+			return(-1);
 		}
+		memset(kcr, 0, sizeof(*kcr));
+		pthread_mutex_init(&kcr->kcr_m, NULL);
+		kts_set_credits(kts, kcr);
+	}
 
-		pthread_mutex_lock(&q->ktq_m);
-		if (list_size(q->ktq_list)) {
-			lkio = (struct kio **)list_remove_front(q->ktq_list);
-			*kio = *lkio;
-			KTLI_FREE(lkio);
-			rc = 1;
-
-			(*kio)->kio_qbp = NULL; /* No longer on a Q */
-			(*kio)->kio_state = KIO_FAILED;
-
-		}
-		pthread_mutex_unlock(&q->ktq_m);
+	pthread_mutex_lock(&kcr->kcr_m);
+	kcr->kcr_max[KTLI_CR_READ]  = rdmax;
+	kcr->kcr_max[KTLI_CR_WRITE] = wrmax;
 
-		if (*kio) break; /* De-queued a kio, so return */
+	/* Windows start over when turned on and fit in new limits */
+	for (c = 0; c < KTLI_CR_MAX; c++) {
+		if (!(kcr->kcr_flags & KTLI_CRADAPT) ||
+		    (kcr->kcr_win[c].kcw_win > ktli_crwmax(kcr, c)))
+			ktli_crwreset(kcr, c);
 	}
+	kcr->kcr_flags = flags;
 
-	/* if queues are empty move to opened */
-	if (!(*kio))
-		kts_set_state(kts,  KTLI_SSTATE_OPENED);
+	/* Raised limits let waiters go */
+	for (c = 0; (st == KTLI_SSTATE_CONNECTED) && (c < KTLI_CR_MAX); c++)
+		ktli_crdispatch(kcr, c, &go);
+	pthread_mutex_unlock(&kcr->kcr_m);
 
-	return(rc);
+	ktli_crsend(kts, &go);
+
+	return(0);
 }
 
 /**
- * int ktli_drain_match(int kts, struct kio *kio)
+ * int ktli_crstats(int kts, struct ktli_crstats *cs)
  *
- * This function drains a draining session of queued kio's.
- * This must be done to successfully close a session.  Each call to drain
- * match will locate a provided kio in one of the three queues, dequeue it
- * and return success that it was found and dequeued. Search order
- * is compq, recvq, and then sendq.
+ * This function returns the admission control counters of a session,
+ * all zero if it has never had credits, see ktli_credits(), and the
+ * state of its adaptive windows, zero if it has none.
  *
- * @param kts A connected kinetic session descriptor.
- * @param kio A kio PTR. drain match will match the provided kio to onea kio
- *        in either the compq , recvq or sendq.
+ * @param kts	An opened KTLI session id.
+ * @param cs	Filled in with the counters.
  */
 int
-ktli_drain_match(int kts, struct kio *kio)
+ktli_crstats(int kts, struct ktli_crstats *cs)
 {
-	int rc, i;
-	uint32_t tqlen; /* sum of all q sizes */
-	enum ktli_sstate st;
-	struct kio **lkio;
-	struct ktli_queue *q;
+	struct ktli_credits *kcr;
+	int c;
 
-	errno = 0;
-	
 	if (!kts_isvalid(kts)) {
 		errno = EBADF;
 		return(-1);
 	}
 
-	/* verify kts is set to drain */
-	st = kts_state(kts);
-	if ((st != KTLI_SSTATE_DRAINING)) {
-		errno = EBADFD;
-		return(-1);
+	memset(cs, 0, sizeof(*cs));
+	kcr = kts_credits(kts);
+	if (kcr) {
+		pthread_mutex_lock(&kcr->kcr_m);
+		*cs = kcr->kcr_st;
+		for (c = 0; (kcr->kcr_flags & KTLI_CRADAPT) &&
+			    (c < KTLI_CR_MAX); c++) {
+			cs->kcs_win[c]    = kcr->kcr_win[c].kcw_win;
+			cs->kcs_rtt[c]    = kcr->kcr_win[c].kcw_srtt;
+			cs->kcs_minrtt[c] = kcr->kcr_win[c].kcw_minrtt;
+		}
+		pthread_mutex_unlock(&kcr->kcr_m);
 	}
 
+	return(0);
+}
+
+/*
+ * Session thread functions
+ */
+/*
+ * Sender helper, completes the send of one KIO. rc and err are the
+ * result of the driver send that carried it.
+ */
+static void
+ktli_send_complete(struct ktli_queue *rq, struct ktli_queue *cq,
+		   struct kio *kio, int rc, int err)
+{
+	struct kio **lkio;
+	enum kio_state state;	 	/* Temp state var */
+	size_t len;
+	int i, held = 0;
+
 	/*
-	 * This loop does 2 things: first  it looks for a specific
-	 * named kio to drain across all three q's.  If found, it dequeues
-	 * it, and sets a successful return code. Second it determines the
-	 * total number of kio's remaining across all three q's. If no
-	 * KIOs left, then move the session state to OPENED.
+	 * A failed batch may have put some of its KIOs on the wire before
+	 * the driver gave up, and their responses, or their timeouts, may
+	 * have beaten the failure here. A KIO the receiver or the timeout
+	 * pass already took off the rq belongs to them, leave it be. A
+	 * failed KIO still tracked on the rq is pulled off it, see
+	 * PREEMPIVELY Q in ktli_send_pass().
 	 */
-	tqlen = 0;
-	rc = -1;
-	for (i=0; i<3; i++) {
-		switch (i) {
-		case 0: q = kts_compq(kts); break;
-		case 1: q = kts_recvq(kts); break;
-		case 2: q = kts_sendq(kts); break;
+	if (rc < 0 && !KIOF_ISSET(kio, KIOF_REQONLY)) {
+		pthread_mutex_lock(&rq->ktq_m);
+		if (ktli_ift_lookup(&rq->ktq_ift, kio->kio_seq) != kio) {
+			pthread_mutex_unlock(&rq->ktq_m);
+			return;
 		}
 
-		pthread_mutex_lock(&q->ktq_m);
+		(void)list_setcurr(rq->ktq_list, kio->kio_qbp);
+		lkio = (struct kio **)list_remove_curr(rq->ktq_list);
+		KTLI_FREE(lkio);
+		ktli_untrack(rq, kio);
 
-		/* list_traverse defaults to starting at the front */
-		rc = list_traverse(q->ktq_list, kio, ktli_kiomatch, LIST_ALTR);
+		/* no longer on a Q, clear the Q back pointer  */
+		kio->kio_qbp = NULL;
 
-		if (rc != LIST_EXTENT && rc != LIST_EMPTY) {
-			/* Found the requested kio */
-			lkio = (struct kio **) list_remove_curr(q->ktq_list);
-			assert(kio == *lkio);
-			KTLI_FREE(lkio);
-			rc = 0;
+		/* leave the list ready for an insert */
+		(void)list_mvrear(rq->ktq_list);
+		pthread_mutex_unlock(&rq->ktq_m);
+	}
 
-			kio->kio_qbp = NULL; /* No longer on a Q */
-			kio->kio_state = KIO_FAILED;
+	/*
+	 * Although on the rq, setting the state outside of
+	 * rq lock is probably OK as the receiver code
+	 * only looks for its existence on the rq to match
+	 * with inbound KIO.  The SENT state is really for
+	 * debugging and completeness.
+	 *
+	 * Since it is only used for completeness, setting
+	 * the SENT state is not strictly necessary, but
+	 * setting it could race qwith the recveiver
+	 * potentially overwriting the RECEIVED state
+	 * set by the receiver.  So here we only set SENT
+	 * if the previous state is NEW otherwise we leave
+	 * it alone. So this compare and swap may succeed
+	 * or fail, but it doesn't matter.
+	 */
+	SBCAS(&(kio->kio_state), KIO_NEW, KIO_SENT);
+
+	/* Per KIO status, the bytes of this KIO on success */
+	if (rc < 0) {
+		kio->kio_sendmsg.km_status = rc;
+	} else {
+		for (len=0,i=0; i<kio->kio_sendmsg.km_cnt; i++)
+			len += kio->kio_sendmsg.km_msg[i].kiov_len;
+		kio->kio_sendmsg.km_status = len;
+	}
+	kio->kio_sendmsg.km_errno = err;
+
+	debug_printf("ktli: Sent Kio: %p: Seq %ld\n",
+		     kio, kio->kio_seq);
+
+	/* Handle the REQONLY case with the error case */
+	if (rc < 0 || KIOF_ISSET(kio, KIOF_REQONLY)) {
+		/*
+		 * Tortured logic here.
+		 * Three possible KIOs can get here:
+		 *    1. Failed REQUEST
+		 *    2. Failed REQONLY
+		 *    3. Successful REQONLY
+		 * A Failed REQUEST is already off the rq, see above.
+		 */
+		if (rc < 0) {
+			debug_printf("KTLI Send Error\n");
+			state = KIO_FAILED;
+		} else {
+			/* This is the Successful REQONLY */
+			state = KIO_RECEIVED;
+		}
+
+		/*
+		 * An ok zero copy REQONLY is done with once the
+		 * kernel no longer needs its buffers, it may have
+		 * to wait for that.
+		 */
+		if (kio->kio_zct) {
+			pthread_mutex_lock(&rq->ktq_m);
+			held = ktli_zcheld(rq, kio, state);
+			pthread_mutex_unlock(&rq->ktq_m);
 		}
 
-		tqlen += list_size(q->ktq_list);
+		/*
+		 * In any case: error REQONLY/REQRESP or
+		 * ok REQONLY, hang it on the completed Q
+		 */
+		if (!held) {
+			pthread_mutex_lock(&cq->ktq_m);
+			(void)list_mvrear(cq->ktq_list);
+			list_insert_after(cq->ktq_list,
+					  &kio, sizeof(struct kio *));
 
-		/* leave the list ready in a nominal position */
-		(void)list_mvrear(q->ktq_list);
+			/* preserve the Q back pointer  */
+			kio->kio_qbp = list_element_curr(cq->ktq_list);
+			kio->kio_state = state;
 
-		pthread_mutex_unlock(&q->ktq_m);
+			ktli_cq_post(cq);
+			pthread_mutex_unlock(&cq->ktq_m);
+		}
+
+		/* Completed the send set the TS if necessary */
+		if (KIOF_ISSET(kio, KIOF_TSTAMP)) {
+			/*
+			 * Stats
+			 * Mark the KIO Sent. REQONLY/Error
+			 * It might be an err, but who cares
+			 * Get current clock,
+			 * vdso(7) makes this fast
+			 */
+			ktli_gettime(&kio->kio_ts.kiot_sent);
+		}
+
+		return;
 	}
 
-	/* if queues are empty move to opened */
-	if (!tqlen)
-		kts_set_state(kts,  KTLI_SSTATE_OPENED);
+	/* Normal send complete, set the TS if necessary */
+	if (KIOF_ISSET(kio, KIOF_TSTAMP)) {
+		/*
+		 * Stats
+		 * Mark the KIO Sent.  REQRESP
+		 * Get current clock, vdso(7) makes this fast
+		 */
+		ktli_gettime(&kio->kio_ts.kiot_sent);
 
-	return(rc);
+	}
 }
-/**
- * int ktli_config (int kts, struct ktli_config *cf)
- *
- * This function returns the session config structure
- *
- * @param kts A connected kinetic session descriptor.
- *
-*/
-int
-ktli_config(int kts, struct ktli_config **cf)
+
+/*
+ * Sender helper, fails a KIO that was never sent. It is not on the rq,
+ * so it goes straight to the cq.
+ */
+static void
+ktli_send_fail(struct ktli_queue *cq, struct kio *kio)
 {
-	if (!kts_isvalid(kts)) {
-		errno = EBADF;
-		return(-1);
-	}
+	kio->kio_sendmsg.km_status = -1;
+	kio->kio_sendmsg.km_errno = kio->kio_errno;
 
-	*cf = kts_config(kts);
-	return(0);
+	pthread_mutex_lock(&cq->ktq_m);
+	(void)list_mvrear(cq->ktq_list);
+	list_insert_after(cq->ktq_list, &kio, sizeof(struct kio *));
+
+	/* preserve the Q back pointer  */
+	kio->kio_qbp = list_element_curr(cq->ktq_list);
+	kio->kio_state = KIO_FAILED;
+
+	ktli_cq_post(cq);
+	pthread_mutex_unlock(&cq->ktq_m);
 }
 
 /*
- * Session thread functions
+ * Sends everything on a session's send queue, in coalesced batches. biov
+ * is scratch space for gathering a batch, IOV_MAX kiovecs, or NULL to
+ * send one KIO at a time. Only one thread at a time may send for a
+ * session, its sender thread or its reactor, see ktli_reactor.c.
  */
+void
+ktli_send_pass(int kts, struct kiovec *biov)
+{
+	int rc;
+	void *dh; 			/* driver handle */
+	struct ktli_driver *de; 	/* driver entry */
+	struct ktli_helpers *kh;
+	struct ktli_config *cf;
+	struct ktli_queue *sq;
+	struct ktli_queue *rq;
+	struct ktli_queue *cq;
+	struct kio *kio;
+	struct kio *batch[KTLI_SENDBATCH];	/* KIOs of one coalesced send */
+	struct kiovec *v;		/* What goes to the driver */
+	int i, b, n, p, bmax, nkio, niov, nv, err, zc, rtt, seqd;
+	struct timespec rtts;		/* Round trip start of a batch */
+	size_t len, nbytes;
+	uint64_t zct;			/* Zero copy token of a send */
+
+	dh = kts_dhandle(kts);
+	de = kts_driver(kts);
+	kh = kts_helpers(kts);
+	cf = kts_config(kts);
+	sq = kts_sendq(kts);
+	rq = kts_recvq(kts);
+	cq = kts_compq(kts);
+
+	/* Zero copy sends when asked for and the driver has them */
+	zc = ((cf->kcfg_flags & KCFF_ZEROCOPY) &&
+	      de->ktlid_fns->ktli_dfns_sendzc);
+
+	/* Without a gather vector, fall back to one KIO per send */
+	bmax = biov ? KTLI_SENDBATCH : 1;
+
+	/* KIOs come already sequenced, see ktli_sq_order() */
+	seqd = (sq->ktq_rob != NULL);
+
+	while (!ktli_sq_empty(sq)) {
+
+		/*
+		 * Drain a batch in one go: as many KIOs as fit the
+		 * KIO, vector and byte limits, at least one, in the
+		 * order the priorities are scheduled. The mutex keeps
+		 * ktli_drain from consuming the sendq at the same time
+		 * and covers the scheduler, producers never take it.
+		 */
+		pthread_mutex_lock(&sq->ktq_m);
+		for (nkio=0,niov=0,nbytes=0;
+		     nkio < bmax &&
+		     ((p = ktli_sq_next(sq, cf)) >= 0) &&
+		     (kio = ktli_mpsc_peek(&sq->ktq_mpsc[p]));
+		     nkio++) {
+
+			for (len=0,i=0; i<kio->kio_sendmsg.km_cnt; i++)
+				len += kio->kio_sendmsg.km_msg[i].kiov_len;
+
+			if (nkio &&
+			    ((niov + kio->kio_sendmsg.km_cnt > IOV_MAX) ||
+			     (nbytes + len > KTLI_SENDBYTES)))
+				break;
+
+			(void)ktli_mpsc_pop(&sq->ktq_mpsc[p]);
+			ktli_sq_took(sq, cf, p);
+
+			batch[nkio] = kio;
+			niov   += kio->kio_sendmsg.km_cnt;
+			nbytes += len;
+		}
+		pthread_mutex_unlock(&sq->ktq_m);
+
+		/* Drained from under us */
+		if (!nkio)
+			break;
+
+		/* Sequence every KIO in send order */
+		for (rtt=0,n=0,b=0; b<nkio; b++) {
+			kio = batch[b];
+
+			/*
+			 * Use current session seq for this kio, then
+			 * inc. This increment is unprotected but
+			 * should be OK. Only this thread reads/writes
+			 * the sequence.
+			 */
+			if (!seqd) {
+				kio->kio_seq = kts_sequence(kts);
+
+				/* bump the session seq for the next message */
+				kts_set_sequence(kts, kio->kio_seq + 1);
+
+				ktli_setseq(kh, kio, kio->kio_seq);
+			}
+
+			/* Not stamped, here or by its submitter */
+			if (kio->kio_state == KIO_FAILED) {
+				ktli_send_fail(cq, kio);
+				continue;
+			}
+
+			/* Round trips start here, see ktli_crsample() */
+			if (KIOF_ISSET(kio, KIOF_RTT)) {
+				if (!rtt++)
+					ktli_gettime(&rtts);
+				kio->kio_ts.kiot_sent = rtts;
+			}
+
+			batch[n++] = kio;
+		}
+
+		/* Nothing left to send */
+		nkio = n;
+		if (!nkio)
+			continue;
+
+		/*
+		 * Gather a batch into a single vector. Only the first
+		 * KIO of a batch may exceed IOV_MAX on its own, so only
+		 * a batch of more than one is bound to fit biov, a
+		 * lone KIO is sent from its own vector.
+		 */
+		if (nkio > 1) {
+			for (niov=0,b=0; b<nkio; b++) {
+				kio = batch[b];
+				memcpy(&biov[niov],
+				       kio->kio_sendmsg.km_msg,
+				       sizeof(struct kiovec) *
+				       kio->kio_sendmsg.km_cnt);
+				niov += kio->kio_sendmsg.km_cnt;
+			}
+		}
+
+		/*
+		 * PREEMPIVELY Q
+		 * If a response is needed, pre-emptively place
+		 * each KIO on the rq to avoid a race with the
+		 * receiver. Of course if there is an error I will
+		 * have to dequeue it before moving the failed kio
+		 * to the cq. One rq lock covers the whole batch.
+		 * With zero copy, mark them as sending so that
+		 * a response that beats the send token does not
+		 * complete them early, see ktli_zcheld().
+		 */
+		pthread_mutex_lock(&rq->ktq_m);
+		(void)list_mvrear(rq->ktq_list);
+		for (b=0; b<nkio; b++) {
+			kio = batch[b];
+			if (zc)
+				kio->kio_zct = KTLI_ZCPEND;
+			if (KIOF_ISSET(kio, KIOF_REQONLY))
+				continue;
+
+			list_insert_after(rq->ktq_list,
+					  &kio, sizeof(struct kio *));
+			/* preserve the Q back pointer  */
+			kio->kio_qbp = list_element_curr(rq->ktq_list);
+
+			/*
+			 * index it for the receiver and set its
+			 * timeout, both before the receiver can
+			 * see it
+			 */
+			ktli_track(rq, kio);
+		}
+		pthread_mutex_unlock(&rq->ktq_m);
+
+		/*
+		 * call the corresponding driver send fn
+		 * lower driver is concerned with ensuring all
+		 * bytes are sent.
+		 */
+		if (nkio > 1) {
+			v  = biov;
+			nv = niov;
+		} else {
+			v  = batch[0]->kio_sendmsg.km_msg;
+			nv = batch[0]->kio_sendmsg.km_cnt;
+		}
+
+		zct = 0;
+		if (zc)
+			rc = (de->ktlid_fns->ktli_dfns_sendzc)(dh, v, nv,
+							       &zct);
+		else
+			rc = (de->ktlid_fns->ktli_dfns_send)(dh, v, nv);
+		err = errno;
+
+		/*
+		 * Hand the batch its zero copy token. A failed or
+		 * copied send leaves the KIOs nothing to wait for.
+		 */
+		if (zc) {
+			pthread_mutex_lock(&rq->ktq_m);
+			for (b=0; b<nkio; b++)
+				batch[b]->kio_zct = (rc < 0) ? 0 : zct;
+			pthread_mutex_unlock(&rq->ktq_m);
+		}
+
+		/*
+		 * Complete the send of every KIO in the batch. The
+		 * batch went out as one stream write, so it either
+		 * all made it or the session is broken and all of
+		 * it is failed.
+		 */
+		for (b=0; b<nkio; b++)
+			ktli_send_complete(rq, cq, batch[b], rc, err);
+
+		/* Responses may have been held for this token */
+		if (zc && rq->ktq_zcwait)
+			ktli_zcrelease(kts, 0);
+
+		/* Success, signal the receiver once per batch */
+		if (rc >= 0) {
+			pthread_mutex_lock(&rq->ktq_m);
+			pthread_cond_signal(&rq->ktq_cv);
+			pthread_mutex_unlock(&rq->ktq_m);
+		}
+	}
+}
+
 static void *
 ktli_sender(void *p)
 {
-	int rc;
 	int kts;
 	void *dh; 			/* driver handle */
 	struct ktli_driver *de; 	/* driver entry */
-	struct ktli_helpers *kh;
 	struct ktli_queue *sq;
-	struct ktli_queue *rq;
-	struct ktli_queue *cq;
-	struct kio *kio, **lkio;
-	enum kio_state state;	 	/* Temp state var */
+	struct kiovec *biov;		/* Gather vector for batches */
 
 	assert(p);
 
 	kts = *(int *)p;
 	dh = kts_dhandle(kts);
 	de = kts_driver(kts);
-	kh = kts_helpers(kts);
 	sq = kts_sendq(kts);
-	rq = kts_recvq(kts);
-	cq = kts_compq(kts);
 
 	assert(dh);
 	assert(de);
 	assert(de->ktlid_fns);
 	assert(de->ktlid_fns->ktli_dfns_send);
 
+	/* Without a gather vector, fall back to one KIO per send */
+	biov = KTLI_MALLOC(sizeof(struct kiovec) * IOV_MAX);
+
 	debug_printf("Sender: starting %d (%p)\n", kts, p);
 
 	/* Main processing loop, continue until told to leave */
@@ -1123,11 +3189,15 @@ ktli_sender(void *p)
 		 * a kio could be added after the while loop below terminated
 		 * and this point. Also the exit flag could have
 		 * been raised. So only if the send queue is empty and no
-		 * exit is signalled, should we wait
+		 * exit is signalled, should we wait. Producers only signal
+		 * an idle sender, so raise ktq_idle before the last look at
+		 * the queue, see ktli_send().
 		 */
-		if (!list_size(sq->ktq_list) && !sq->ktq_exit)
+		__atomic_store_n(&sq->ktq_idle, 1, __ATOMIC_SEQ_CST);
+		if (ktli_sq_empty(sq) && !sq->ktq_exit)
 			/* Empty Q, need to wait. */
 			pthread_cond_wait(&sq->ktq_cv, &sq->ktq_m);
+		__atomic_store_n(&sq->ktq_idle, 0, __ATOMIC_SEQ_CST);
 
 		pthread_mutex_unlock(&sq->ktq_m);
 
@@ -1136,366 +3206,87 @@ ktli_sender(void *p)
 		if (sq->ktq_exit) break;
 
 		/* Process the send queue */
-		while (list_size(sq->ktq_list)) {
-
-			pthread_mutex_lock(&sq->ktq_m);
-			lkio = (struct kio **)list_remove_front(sq->ktq_list);
-			kio = *lkio;
-			KTLI_FREE(lkio);
-
-			/* no longer on a Q, clear the Q back pointer  */
-			kio->kio_qbp = NULL;
-
-			pthread_mutex_unlock(&sq->ktq_m);
-
-			/*
-			 * Use current session seq for this kio, then inc.
-			 * This increment is unprotected but should be
-			 * OK. Only this thread reads/writes the sequence.
-			 */
-		        kio->kio_seq = kts_sequence(kts);
-
-			/* bump the session seq for the next message */
-			kts_set_sequence(kts, kio->kio_seq + 1);
-
-			(kh->kh_setseq_fn)(kio->kio_sendmsg.km_msg,
-					   kio->kio_sendmsg.km_cnt,
-					   kio->kio_seq);
-
-			/*
-			 * PREEMPIVELY Q
-			 * If a response is needed, pre-emptively place
-			 * this KIO on the rq to avoid a race with the
-			 * receiver. Of course if there is an error I will
-			 * have to dequeue it before moving the failed kio
-			 * to the cq.
-			 */
-			if (!KIOF_ISSET(kio, KIOF_REQONLY)) {
-				pthread_mutex_lock(&rq->ktq_m);
-				(void)list_mvrear(rq->ktq_list);
-				list_insert_after(rq->ktq_list,
-						   &kio, sizeof(struct kio *));
-				/* preserve the Q back pointer  */
-				kio->kio_qbp = list_element_curr(rq->ktq_list);
-				pthread_mutex_unlock(&rq->ktq_m);
-			}
-
-
-			/* Set timeout time */
-			clock_gettime(KIO_CLOCK, &kio->kio_timeout);
-
-			/* Incrment the current time to be the timeout time */
-			kio->kio_timeout.tv_sec += KIO_TIMEOUT_S;
-
-			/*
-			 * call the corresponding driver send fn
-			 * lower driver is concerned with ensuring all
-			 * bytes are sent
-			 */
-			rc = (de->ktlid_fns->ktli_dfns_send)(dh,
-						       kio->kio_sendmsg.km_msg,
-						       kio->kio_sendmsg.km_cnt);
-			/*
-			 * Although on the rq, setting the state outside of
-			 * rq lock is probably OK as the receiver code
-			 * only looks for its existence on the rq to match
-			 * with inbound KIO.  The SENT state is really for
-			 * debugging and completeness.
-			 *
-			 * Since it is only used for completeness, setting
-			 * the SENT state is not strictly necessary, but
-			 * setting it could race qwith the recveiver
-			 * potentially overwriting the RECEIVED state
-			 * set by the receiver.  So here we only set SENT
-			 * if the previous state is NEW otherwise we leave
-			 * it alone. So this compare and swap may succeed
-			 * or fail, but it doesn't matter.
-			 */
-			SBCAS(&(kio->kio_state), KIO_NEW, KIO_SENT);
-
-			kio->kio_sendmsg.km_status = rc;
-			kio->kio_sendmsg.km_errno = errno;
-
-			debug_printf("ktli: Sent Kio: %p: Seq %ld\n",
-				     kio, kio->kio_seq);
-
-			/* Handle the REQONLY case with the error case */
-			if (rc < 0 || KIOF_ISSET(kio, KIOF_REQONLY)) {
-				/*
-				 * Tortured logic here.
-				 * Three possible KIOs can get here:
-				 *    1. Failed REQUEST
-				 *    2. Failed REQONLY
-				 *    3. Successful REQONLY
-				 * First handle both Failed REQUEST & REQONLY
-				 */
-				if (rc < 0) {
-					debug_printf("KTLI Send Error\n");
-					state = KIO_FAILED;
-				}
-
-				/*
-				 * Since REQONLY are not queued on rq
-				 * pop the Failed REQUEST kio off the rq.
-				 */
-				if (!KIOF_ISSET(kio, KIOF_REQONLY)) {
-					/*
-					 * Why is it on the rq? See
-					 * PREEMPIVELY Q comment above.
-					 */
-					pthread_mutex_lock(&rq->ktq_m);
-					(void)list_setcurr(rq->ktq_list,
-							   kio->kio_qbp);
-					lkio = (struct kio **)list_remove_curr(rq->ktq_list);
-					KTLI_FREE(lkio);
-
-					/* no longer on a Q,
-					   clear the Q back pointer  */
-					kio->kio_qbp = NULL;
-					
-					/* leave the list ready for an insert */
-					(void)list_mvrear(rq->ktq_list);
-					pthread_mutex_unlock(&rq->ktq_m);
-				} else if (rc >= 0) {
-					/* This is the Successful REQONLY */
-					state = KIO_RECEIVED;
-				}
-
-				/*
-				 * In any case: error REQONLY/REQRESP or
-				 * ok REQONLY, hang it on the completed Q
-				 */
-				pthread_mutex_lock(&cq->ktq_m);
-				(void)list_mvrear(cq->ktq_list);
-				list_insert_after(cq->ktq_list,
-						  &kio, sizeof(struct kio *));
-
-				/* preserve the Q back pointer  */
-				kio->kio_qbp = list_element_curr(cq->ktq_list);
-				kio->kio_state = state;
-
-				pthread_cond_broadcast(&cq->ktq_cv);
-				pthread_mutex_unlock(&cq->ktq_m);
-
-				/* Completed the send set the TS if necessary */
-				if (KIOF_ISSET(kio, KIOF_TSTAMP)) {
-					/*
-					 * Stats
-					 * Mark the KIO Sent. REQONLY/Error
-					 * It might be an err, but who cares
-					 * Get current clock,
-					 * vdso(7) makes this fast
-					 */
-					ktli_gettime(&kio->kio_ts.kiot_sent);
-				}
-
-				continue;
-			}
-
-			/* Success  signal the receiver */
-			pthread_mutex_lock(&rq->ktq_m);
-			pthread_cond_signal(&rq->ktq_cv);
-			pthread_mutex_unlock(&rq->ktq_m);
-
-			/* Normal send complete, set the TS if necessary */
-			if (KIOF_ISSET(kio, KIOF_TSTAMP)) {
-				/*
-				 * Stats
-				 * Mark the KIO Sent.  REQRESP
-				 * Get current clock, vdso(7) makes this fast
-				 */
-				ktli_gettime(&kio->kio_ts.kiot_sent);
-
-			}
-		}
+		ktli_send_pass(kts, biov);
 
 	} while (1); /* forever */
 
+	if (biov)
+		KTLI_FREE(biov);
+
 	debug_printf("Sender: exiting\n");
 
 	pthread_exit(p);
 }
 
-/*
- * List helper function to find a kio that should be timed out
- * If no match, return LIST_TRUE to continue searching
- * Once a match is found return FALSE to terminate search
+/**
+ * ktli_recvmsg_free(struct kio *kio, int keepval)
+ *
+ * Releases a received message hung on a KIO. The PDU and message are
+ * slices of a receive chunk shared with other responses, so they are
+ * never freed directly, the chunk reference is dropped instead. The value
+ * is a buffer of its own which is freed as well unless keepval is set, in
+ * which case it now belongs to the caller.
+ *
+ * @param kio A completed KIO, without a received message this is a no-op
+ * @param keepval Do not free the value
  */
-static list_boolean_t
-ktli_timechk(void *data, void *ldata)
+void
+ktli_recvmsg_free(struct kio *kio, int keepval)
 {
-	list_boolean_t match = LIST_TRUE;
-	struct timespec *currtime = (struct timespec *)data;
-	struct kio *lkio = *(struct kio **)ldata;
+	struct kio_msg *km = &kio->kio_recvmsg;
 
-	/*
-	 * If current time secs is greater than
-	 * KIO timeout secs we have a KIO with exhausted
-	 * wait time
-	 */
-	if (currtime->tv_sec > lkio->kio_timeout.tv_sec) {
-		match = LIST_FALSE;  /* See comment above */
-	}
-	return (match);
-}
+	if (!km->km_msg)
+		return;
 
-/*
- * List helper function to find a matching kio given a seq number
- * If no match, return LIST_TRUE to continue searching
- * Once a match is found return FALSE to terminate search
- */
-static list_boolean_t
-ktli_seqmatch(void *data, void *ldata)
-{
-	list_boolean_t match = LIST_TRUE;
-	int64_t *aseq = (int64_t *)data;
-	struct kio *lkio = *(struct kio **)ldata;
+	if (!keepval && (km->km_cnt > KIOV_VAL) &&
+	    km->km_msg[KIOV_VAL].kiov_base)
+		KTLI_FREE(km->km_msg[KIOV_VAL].kiov_base);
 
-	if (*aseq == lkio->kio_seq)
-		match = LIST_FALSE;  /* See comment above */
-	return (match);
+	ktli_rbuf_put(km->km_rbuf);
+
+	km->km_msg  = NULL;
+	km->km_cnt  = 0;
+	km->km_rbuf = NULL;
 }
 
-/**
- * ktli_recvmsg(int kts)
- *
- * This is helper function for the main receiver loop. It does all the
- * work to detect and receive a message. It matches up the received
- * message with a pending request.  Successful results are placed
- * on the completion queue. This is only called by the receiver thread.
- *
- * ERRORS: Since the response message stream is a byte stream, errors
- * in this routine can be viewed as catastrophic. One out of sync with
- * the server due to a failed KTLI_MALLOC or receive the entire connection is
- * compromised.  Although you may be able to recover from a failed
- * read by scanning for the next magic number of a header, the other reasons
- * for a failing, like KTLI_MALLOC, are most likely unrecoverable.
- * So error recovery here is to set the session state to ABORTED
- * disconnect and let the client cleanup.
- * Need to handle EAGAIN, EWOULDBLOCK, EINTR
- *
- * @param kts An opened and connected kinetic session descriptor.
+/*
+ * Hands a received message to its KIO and posts the KIO on the completion
+ * queue. The msg kiovecs are copied into the KIO, rbuf is the chunk
+ * reference backing them. Responses for KIOs that already timed out are
+ * tossed. Returns 0, or -1 if an unsolicited response could not be given
+ * a KIO, in which case the message has been released.
  */
-
 static int
-ktli_recvmsg(int kts)
+ktli_recvdone(int kts, struct kiovec *msg, void *rbuf,
+	      struct timespec *recvs)
 {
-	int rc, i;
 	int64_t aseq;
-	void *dh; 			/* driver handle */
-	struct ktli_driver *de; 	/* driver entry */
 	struct ktli_helpers *kh;
-	struct ktli_queue *sq;
 	struct ktli_queue *rq;
 	struct ktli_queue *cq;
 	struct kio *kio, **lkio;
-	struct kio_msg msg;
-	struct timespec	recvs;		/* Temp recv start timestamp */
+	struct kio_rscan rs;		/* Temp resp scan results */
+	int held;
 
-	/*
-	 * Received a mesg, record the clock. The KIO is not known yet.
-	 * This is the begining on the receive and the natural spot to
-	 * start the clock on receive processing time. Without knowing
-	 * the KIO it is not known if the code should be recording
-	 * timestamps. So this maybe wasted code. However vdso(7) makes
-	 * this fast, Not going to worry about this.
-	 */
-	ktli_gettime(&recvs);
-
-	dh = kts_dhandle(kts);
-	de = kts_driver(kts);
 	kh = kts_helpers(kts);
-	sq = kts_recvq(kts);
 	rq = kts_recvq(kts);
 	cq = kts_compq(kts);
 
-	/*
-	 * We have a message, time to receive it.
-	 * Need to allocate a kiovec array,
-	 * one kiovec for the PDU[0], one kiovec for the MSG[1]
-	 * and another for the potential VAL[2], so 3 elements. 
-	 */
-	msg.km_msg = KTLI_MALLOC(sizeof(struct kiovec) * KM_CNT_WITHVAL);
-	if (!msg.km_msg) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_fprintf(stderr, "%s:%d: KTLI_MALLOC failed\n",
-			      __FILE__, __LINE__);
-		goto recvmsgerr;
-	}
-
-	/* Allocate the header buffer */
-	msg.km_msg[KIOV_PDU].kiov_base = KTLI_MALLOC(kh->kh_recvhdr_len);
-	if (!msg.km_msg[KIOV_PDU].kiov_base) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_fprintf(stderr, "%s:%d: KTLI_MALLOC failed\n",
-			      __FILE__, __LINE__);
-		goto recvmsgerr;
-	}
-	msg.km_msg[KIOV_PDU].kiov_len = kh->kh_recvhdr_len;
-
-	/* call the corresponding driver receive to receive the PDU */
-	rc = (de->ktlid_fns->ktli_dfns_receive)(dh, &msg.km_msg[KIOV_PDU], 1);
-	if (rc == -1) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_fprintf(stderr, "%s:%d: receive failed %d\n",
-			      __FILE__, __LINE__, rc);
-		goto recvmsgerr;
-	}
-
-	/* With the PDU, call helper fn to get the msg and val lengths */
-	msg.km_msg[KIOV_MSG].kiov_len =	(kh->kh_msglen_fn)(&msg.km_msg[KIOV_PDU]);
-	msg.km_msg[KIOV_VAL].kiov_len =	(kh->kh_vallen_fn)(&msg.km_msg[KIOV_PDU]);
-
-	if ((msg.km_msg[KIOV_MSG].kiov_len < 0) ||
-	    (msg.km_msg[KIOV_VAL].kiov_len < 0)) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_printf("%s:%d: Helper msglen failed failed\n",
-		       __FILE__, __LINE__);
-		goto recvmsgerr;
-	}
-
-	/* Allocate the message and value buffers buffer */
-	msg.km_msg[KIOV_MSG].kiov_base = KTLI_MALLOC(msg.km_msg[KIOV_MSG].kiov_len);
-	if (!msg.km_msg[KIOV_MSG].kiov_base) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_fprintf(stderr, "%s:%d: KTLI_MALLOC failed\n",
-			      __FILE__, __LINE__);
-		goto recvmsgerr;
-	}
-
-	msg.km_msg[KIOV_VAL].kiov_base = KTLI_MALLOC(msg.km_msg[KIOV_VAL].kiov_len);
-	if (!msg.km_msg[KIOV_VAL].kiov_base) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_fprintf(stderr, "%s:%d: KTLI_MALLOC failed\n",
-			      __FILE__, __LINE__);
-		goto recvmsgerr;
-	}
-
-	/* call the corresponding driver receive to get the message */
-	rc = (de->ktlid_fns->ktli_dfns_receive)(dh, &msg.km_msg[KIOV_MSG], 2);
-	if (rc == -1) {
-		/* PAK: HANDLE - Yikes, errors down here suck */
-		debug_printf("%s:%d: receive failed %d\n",
-			     __FILE__, __LINE__, errno);
-		perror("");
-		goto recvmsgerr;
-		assert(0);
-	}
-
 	/* We have the message. Find its matching request */
-	aseq = (kh->kh_getaseq_fn)(msg.km_msg, KM_CNT_WITHVAL);
+	memset(&rs, 0, sizeof(rs));
+	aseq = (kh->kh_getaseq_fn)(msg, KM_CNT_WITHVAL, &rs);
 	debug_printf("KTLI Received ASeq: %ld\n", aseq);
 
 	/* search through the recvq if necessary, need the mutex */
 	pthread_mutex_lock(&rq->ktq_m);
 
+	kio = NULL;
 	if (aseq > 0) {
-		/* Have a valid aseq, look for it on the RQ */
-		rc = list_traverse(rq->ktq_list,
-				   &aseq, ktli_seqmatch, LIST_ALTR);
+		/* Have a valid aseq, look it up in the in-flight table */
+		kio = ktli_ift_lookup(&rq->ktq_ift, aseq);
 	}
 
-	if ((aseq == -1) || (rc == LIST_EXTENT) || (rc == LIST_EMPTY)) {
+	if (!kio) {
 		/*
 		 * No aseq (aseq==-1) or no matching kio. If a valid aseq
 		 * but no matching KIO, it must be a delayed reponse for
@@ -1508,13 +3299,12 @@ ktli_recvmsg(int kts)
 			/* Valid aseq but no matching KIO, free up the msg */
 			debug_printf("KTLI Tossing Delinquent ASeq: %lu\n",
 				    aseq);
-			for (i=0;i<KM_CNT_WITHVAL; i++) {
-				KTLI_FREE(msg.km_msg[i].kiov_base);
-			}
-			KTLI_FREE(msg.km_msg);
-
 			pthread_mutex_unlock(&rq->ktq_m);
-			return(0);;
+
+			if (msg[KIOV_VAL].kiov_base)
+				KTLI_FREE(msg[KIOV_VAL].kiov_base);
+			ktli_rbuf_put(rbuf);
+			return(0);
 		}
 
 		/* Not a valid aseq means a RESPONLY message received */
@@ -1523,7 +3313,11 @@ ktli_recvmsg(int kts)
 		if (!kio) {
 			debug_fprintf(stderr, "RESPONLY KTLI_MALLOC failed\n");
 			pthread_mutex_unlock(&rq->ktq_m);
-			goto recvmsgerr;
+
+			if (msg[KIOV_VAL].kiov_base)
+				KTLI_FREE(msg[KIOV_VAL].kiov_base);
+			ktli_rbuf_put(rbuf);
+			return(-1);
 		}
 
 		memset((void *)kio, 0, sizeof(struct kio));
@@ -1532,8 +3326,12 @@ ktli_recvmsg(int kts)
 		KIOF_SET(kio, KIOF_RESPONLY);
 	} else {
 		debug_printf("KTLI Received Matched KIO\n");
+		ktli_untrack(rq, kio);
+
+		/* The back pointer takes us straight to its list element */
+		(void)list_setcurr(rq->ktq_list, kio->kio_qbp);
 		lkio = (struct kio **) list_remove_curr(rq->ktq_list);
-		kio  = *lkio;
+		assert(kio == *lkio);
 		KTLI_FREE(lkio);
 
 		/* Not on a Q, clear the back pointer */
@@ -1546,18 +3344,39 @@ ktli_recvmsg(int kts)
 	/* Should be here without a KIO in hand */
 	assert (kio!=NULL);
 
-	if (KIOF_ISSET(kio, KIOF_TSTAMP)) {
+	if (KIOF_ISSET(kio, KIOF_TSTAMP | KIOF_RTT)) {
 		/*
 		 * Now that the KIO is known Save recv start clock,
 		 */
-		kio->kio_ts.kiot_recvs = recvs;
+		kio->kio_ts.kiot_recvs = *recvs;
+	}
+
+	/* Before the caller can have it, see ktli_crsample() */
+	if (KIOF_ISSET(kio, KIOF_RTT))
+		ktli_crsample(kts, kio);
+
+	/* Preserve the scan so the completion need not repeat it */
+	if (rs.krs_cmdoff) {
+		kio->kio_rs = rs;
+		KIOF_SET(kio, KIOF_RSCAN);
 	}
 
 	/* hang response onto the kio */
+	memcpy(kio->kio_rvec, msg, sizeof(struct kiovec) * KM_CNT_WITHVAL);
 	kio->kio_recvmsg.km_status = 0;
 	kio->kio_recvmsg.km_errno = 0;
 	kio->kio_recvmsg.km_cnt = KM_CNT_WITHVAL;
-	kio->kio_recvmsg.km_msg = msg.km_msg;
+	kio->kio_recvmsg.km_msg = kio->kio_rvec;
+	kio->kio_recvmsg.km_rbuf = rbuf;
+
+	/* Hold it while the kernel may still be sending from its buffers */
+	if (kio->kio_zct) {
+		pthread_mutex_lock(&rq->ktq_m);
+		held = ktli_zcheld(rq, kio, KIO_RECEIVED);
+		pthread_mutex_unlock(&rq->ktq_m);
+		if (held)
+			return(0);
+	}
 
 	/* Add to completion queue */
 	pthread_mutex_lock(&cq->ktq_m);
@@ -1570,10 +3389,97 @@ ktli_recvmsg(int kts)
 	assert(kio->kio_qbp);
 
 	/* Let everyone know there is a new completed  kio */
-	pthread_cond_broadcast(&cq->ktq_cv);
+	ktli_cq_post(cq);
 
 	pthread_mutex_unlock(&cq->ktq_m);
 	return(0);
+}
+
+/**
+ * ktli_recvmsg(int kts, struct ktli_rbuf *rb)
+ *
+ * This is helper function for the main receiver loop. It does all the
+ * work to detect and receive messages. Whatever the driver has waiting
+ * is read into the receive buffer and every complete message found there
+ * is matched up with its pending request, see ktli_rbuf.c.  Successful
+ * results are placed on the completion queue. At most KTLI_RECVBATCH
+ * messages are handed out per call so that KIO timeouts are still
+ * processed under a steady stream of responses. This is only called by
+ * the session's receiver thread or its reactor.
+ *
+ * ERRORS: Since the response message stream is a byte stream, errors
+ * in this routine can be viewed as catastrophic. One out of sync with
+ * the server due to a failed KTLI_MALLOC or receive the entire connection is
+ * compromised.  Although you may be able to recover from a failed
+ * read by scanning for the next magic number of a header, the other reasons
+ * for a failing, like KTLI_MALLOC, are most likely unrecoverable.
+ * So error recovery here is to set the session state to ABORTED
+ * disconnect and let the client cleanup.
+ *
+ * @param kts An opened and connected kinetic session descriptor.
+ * @param rb  The receiver's receive buffer
+ *
+ * Returns 1 if it stopped at KTLI_RECVBATCH, more messages may be
+ * buffered, 0 when nothing complete is left and -1 on error.
+ */
+int
+ktli_recvmsg(int kts, struct ktli_rbuf *rb)
+{
+	int rc, n;
+	void *dh; 			/* driver handle */
+	struct ktli_driver *de; 	/* driver entry */
+	struct ktli_helpers *kh;
+	struct ktli_queue *sq;
+	struct ktli_queue *rq;
+	struct ktli_queue *cq;
+	struct kio *kio, **lkio;
+	struct kiovec msg[KM_CNT_WITHVAL];
+	void *rbuf;			/* Chunk backing msg */
+	struct timespec	recvs;		/* Temp recv start timestamp */
+
+	dh = kts_dhandle(kts);
+	de = kts_driver(kts);
+	kh = kts_helpers(kts);
+	sq = kts_sendq(kts);
+	rq = kts_recvq(kts);
+	cq = kts_compq(kts);
+
+	for (n=0; n<KTLI_RECVBATCH; n++) {
+		/*
+		 * Record the clock, the KIO is not known yet. This is the
+		 * begining on the receive and the natural spot to start
+		 * the clock on receive processing time. Without knowing
+		 * the KIO it is not known if the code should be recording
+		 * timestamps. So this maybe wasted code. However vdso(7)
+		 * makes this fast, Not going to worry about this.
+		 */
+		ktli_gettime(&recvs);
+
+		rc = ktli_rbuf_next(rb, de->ktlid_fns, dh, kh, msg, &rbuf);
+		if (rc < 0) {
+			/* PAK: HANDLE - Yikes, errors down here suck */
+			debug_printf("%s:%d: receive failed %d\n",
+				     __FILE__, __LINE__, errno);
+			goto recvmsgerr;
+		}
+
+		/* Nothing complete left */
+		if (!rc)
+			return(0);
+
+		if (ktli_recvdone(kts, msg, rbuf, &recvs) < 0)
+			goto recvmsgerr;
+
+		/*
+		 * Without recvsome the driver is read exactly one message
+		 * at a time, nothing else is buffered. Another pass would
+		 * block waiting for the next message.
+		 */
+		if (!de->ktlid_fns->ktli_dfns_recvsome)
+			return(0);
+	}
+
+	return(1);
 
  recvmsgerr:
 	/*
@@ -1600,6 +3506,8 @@ ktli_recvmsg(int kts)
 	/* set the cq so that we add to the rear */
 	(void)list_mvrear(cq->ktq_list);
 
+	ktli_ift_clear(&rq->ktq_ift);
+	ktli_tw_clear(&rq->ktq_tw);
 	while (list_size(rq->ktq_list)) {
 		lkio = (struct kio **)list_remove_front(rq->ktq_list);
 		kio = *lkio;
@@ -1616,42 +3524,116 @@ ktli_recvmsg(int kts)
 		kio->kio_qbp = list_element_curr(cq->ktq_list);
 	}
 
-	while (list_size(sq->ktq_list)) {
-		lkio = (struct kio **)list_remove_front(sq->ktq_list);
-		kio = *lkio;
-		KTLI_FREE(lkio); /* created by the list */
+	ktli_sq_flush(sq, cq, ECONNABORTED);
+
+	/* notify anyone sleeping on the completion queue */
+	ktli_cq_post(cq);
+	pthread_mutex_unlock(&cq->ktq_m);
+	pthread_mutex_unlock(&rq->ktq_m);
+	pthread_mutex_unlock(&sq->ktq_m);
+
+	/* The stream is lost, toss whatever was buffered */
+	ktli_rbuf_destroy(rb);
+
+	return(-1);
+}
+
+
+/*
+ * Fails the KIOs on a session's receive queue whose deadlines have passed
+ * and completes those held for zero copy sends that are now done. Only
+ * one thread at a time may do this for a session, its receiver thread or
+ * its reactor. Returns how many ms, at most maxms, until the next KIO
+ * deadline is due.
+ */
+int
+ktli_timeout_pass(int kts, int maxms)
+{
+	struct ktli_queue *rq;
+	struct ktli_queue *cq;
+	struct kio *kio, *next, **lkio;
+	struct timespec currtime;
+	int tmo;
+
+	rq = kts_recvq(kts);
+	cq = kts_compq(kts);
+
+	/*
+	 * KIO timeout check code:
+	 * Expire the rq timing wheel up to now. Only the wheel
+	 * slots that are due are visited, the expired KIOs come
+	 * back chained through kio_twnext.
+	 */
+	pthread_mutex_lock(&rq->ktq_m);
+
+	/* Get the current clock, vdso(7) makes this fast */
+	clock_gettime(KIO_CLOCK, &currtime);
+
+	kio = ktli_tw_expire(&rq->ktq_tw, KTW_TS2MS(&currtime));
+	for (; kio; kio = next) {
+		next = kio->kio_twnext;
+		kio->kio_twnext = NULL;
+
+		/*
+		 * Pull the KIO off the receive Q, the back
+		 * pointer takes us straight to its list element,
+		 * and mark it timedout
+		 */
+		ktli_ift_remove(&rq->ktq_ift, kio);
+		(void)list_setcurr(rq->ktq_list, kio->kio_qbp);
+		lkio = (struct kio **)list_remove_curr(rq->ktq_list);
+		assert(kio == *lkio);
+		KTLI_FREE(lkio);  /* created by the list */
+		kio->kio_errno = ETIMEDOUT;
 
 		/* Not on a Q, clear the back pointer */
 		kio->kio_qbp = NULL;
 
-		kio->kio_state = KIO_FAILED;
-		kio->kio_errno = ECONNABORTED;
-		list_insert_after(cq->ktq_list, &kio, sizeof(struct kio *));
+		debug_printf("KIO Timeout seq: %ld\n", kio->kio_seq);
+
+		printf("KIO Timeout seq: %ld, toq: %lu - %lu = %lu\n",
+		       kio->kio_seq,
+		       currtime.tv_sec, kio->kio_timeout.tv_sec,
+		       currtime.tv_sec - kio->kio_timeout.tv_sec
+		       );
+
+		/* Still sending from its buffers, complete it later */
+		if (ktli_zcheld(rq, kio, KIO_TIMEDOUT))
+			continue;
+
+		/*
+		 * Add the found KIO to the completed Q.
+		 * Remember we have the recev Q locks,
+		 * This is the correct lock order sq, rq, cq
+		 */
+		pthread_mutex_lock(&cq->ktq_m);
+		(void)list_mvrear(cq->ktq_list);
+
+		list_insert_after(cq->ktq_list, &kio,
+				  sizeof(struct kio *));
 
 		/* preserve the Q back pointer  */
 		kio->kio_qbp = list_element_curr(cq->ktq_list);
+		kio->kio_state = KIO_TIMEDOUT;
+
+		ktli_cq_post(cq);
+		pthread_mutex_unlock(&cq->ktq_m);
 	}
 
-	/* notify anyone sleeping on the completion queue */
-	pthread_cond_broadcast(&cq->ktq_cv);
-	pthread_mutex_unlock(&cq->ktq_m);
+	/* Sleep no longer than the next deadline */
+	tmo = ktli_tw_next(&rq->ktq_tw, maxms);
+
+	/* KIO timeout check finished, reset and release the rq */
+	(void)list_mvrear(rq->ktq_list);
 	pthread_mutex_unlock(&rq->ktq_m);
-	pthread_mutex_unlock(&sq->ktq_m);
 
-	/* free any buffers allocated */
-	if (msg.km_msg[KIOV_PDU].kiov_base)
-		KTLI_FREE(msg.km_msg[KIOV_PDU].kiov_base);
-	if (msg.km_msg[KIOV_MSG].kiov_base)
-		KTLI_FREE(msg.km_msg[KIOV_MSG].kiov_base);
-	if (msg.km_msg[KIOV_VAL].kiov_base)
-		KTLI_FREE(msg.km_msg[KIOV_VAL].kiov_base);
-	if (msg.km_msg)
-		KTLI_FREE(msg.km_msg);
+	/* Complete held KIOs whose zero copy sends are done */
+	if (rq->ktq_zcwait)
+		ktli_zcrelease(kts, 0);
 
-	return(-1);
+	return(tmo);
 }
 
-
 static void *
 ktli_receiver(void *p)
 {
@@ -1660,11 +3642,12 @@ ktli_receiver(void *p)
 	void *dh; 			/* driver handle */
 	struct ktli_driver *de; 	/* driver entry */
 	struct ktli_queue *rq;
-	struct ktli_queue *cq;
 	enum ktli_sstate st;
-	struct kio *kio, **lkio;
-	struct timespec currtime;
-	struct timespec lastcheck = {0,0};
+	struct ktli_rbuf rb;		/* Receive buffer, see ktli_rbuf.c */
+	int more = 0;			/* Responses may be left in rb */
+	int tmo = 10;
+	int busy;			/* Spin rather than sleep */
+	uint32_t idle = 0;		/* Empty busy polls */
 
 	assert(p);
 
@@ -1672,7 +3655,7 @@ ktli_receiver(void *p)
 	dh = kts_dhandle(kts);
 	de = kts_driver(kts);
 	rq = kts_recvq(kts);
-	cq = kts_compq(kts);
+	busy = !!(kts_config(kts)->kcfg_flags & KCFF_BUSYPOLL);
 
 	assert(dh);
 	assert(de);
@@ -1700,13 +3683,22 @@ ktli_receiver(void *p)
 
 	debug_printf("Receiver: starting %d (%p)\n", kts, p);
 
+	ktli_rbuf_init(&rb);
+
 	/* main forever loop */
 	do {
 		/*
 		 * call the corresponding driver poll fn,
-		 * wait for 10ms, arbitrary delay
+		 * wait for at most 10ms, arbitrary delay, or less if a
+		 * KIO deadline is due sooner. Skip it if the last pass
+		 * left responses in the receive buffer, the driver may
+		 * have nothing more to say about them. Busy polling never
+		 * waits, it trades the CPU for the wakeup latency.
 		 */
-		rc = (de->ktlid_fns->ktli_dfns_poll)(dh, 10);
+		if (more)
+			rc = 1;
+		else
+			rc = (de->ktlid_fns->ktli_dfns_poll)(dh, busy ? 0 : tmo);
 		//debug_printf("Receiver: BE Poll returned: %d\n", rc);
 
 		/* -1 error, 0 timeout, 1 need to receive data */
@@ -1718,103 +3710,37 @@ ktli_receiver(void *p)
 			continue;
 		}
 
+		more = 0;
 		if (rc == 1) {
 			/* Must be something waiting */
 			debug_printf("calling ktli_recvmsg\n");
-			ktli_recvmsg(kts);
-		}
-
-		/*
-		 * Poll timeouts (rc == 0) fall through,
-		 * completing the time out check
-		 */
-
-		/*
-		 * KIO timeout check code:
-		 * Check the rq for KIOs that need to be timed out.
-		 */
-		pthread_mutex_lock(&rq->ktq_m);
-
-		/* Get the current clock, vdso(7) makes this fast */
-		clock_gettime(KIO_CLOCK, &currtime);
-
-		/*
-		 * Timeouts are done on a second granularity,
-		 * If the last checks seconds equal current seconds
-		 * no need to check
-		 */
-		if (lastcheck.tv_sec == currtime.tv_sec) {
-			goto skip_timeout_check;
+			more = (ktli_recvmsg(kts, &rb) == 1);
 		}
 
 		/*
-		 * Traverse the Q to see if anything should be timed out
-		 * Traverse defaults to starting at the front. Use LIST_ALTR
-		 * so that curr points to matched KIO if any.
+		 * Poll timeouts (rc == 0) fall through, completing the
+		 * time out check and sleeping no longer than the next
+		 * deadline. Busy polls only check every KTLI_SPINTMO
+		 * empty polls.
 		 */
-		rc = list_traverse(rq->ktq_list, &currtime,
-				   ktli_timechk, LIST_ALTR);
-		while (rc == LIST_OK) {
-			if (rc != LIST_EXTENT && rc != LIST_EMPTY) {
-				/*
-				 * Found one KIO to timeout. Pull it off the
-				 * receive Q and mark it timedout
-				 */
-				lkio = (struct kio **)list_remove_curr(rq->ktq_list);
-				kio = *lkio;
-				KTLI_FREE(lkio);  /* created by the list */
-				kio->kio_errno = ETIMEDOUT;
-
-				/* Not on a Q, clear the back pointer */
-				kio->kio_qbp = NULL;
-
-				debug_printf("KIO Timeout seq: %ld\n",
-					     kio->kio_seq);
-
-				printf("KIO Timeout seq: %ld, toq: %lu - %lu = %lu\n",
-				       kio->kio_seq,
-				       currtime.tv_sec, kio->kio_timeout.tv_sec,
-				       currtime.tv_sec - kio->kio_timeout.tv_sec
-				       );
-				       
-
-				/*
-				 * Add the found KIO to the completed Q.
-				 * Remember we have the recev Q locks,
-				 * This is the correct lock order sq, rq, cq
-				 */
-				pthread_mutex_lock(&cq->ktq_m);
-				(void)list_mvrear(cq->ktq_list);
-
-				list_insert_after(cq->ktq_list, &kio,
-						  sizeof(struct kio *));
-
-				/* preserve the Q back pointer  */
-				kio->kio_qbp = list_element_curr(cq->ktq_list);
-				kio->kio_state = KIO_TIMEDOUT;
-
-				pthread_cond_broadcast(&cq->ktq_cv);
-				pthread_mutex_unlock(&cq->ktq_m);
-
-				/* Continue the search at the curr list ptr */
-				rc = list_traverse(rq->ktq_list,
-						   &currtime, ktli_timechk,
-						   (LIST_CURR|LIST_ALTR));
+		if (busy && rc == 0) {
+			if (++idle % KTLI_SPINTMO) {
+				if (idle % KTLI_SPINCLK)
+					ktli_cpu_relax();
+				else
+					sched_yield();
+				if (rq->ktq_exit) break;
+				continue;
 			}
 		}
-
-		/* Finished a check, set the last check var */
-		lastcheck = currtime;
-
-	skip_timeout_check:
-		/* KIO timeout check finished, reset and release the rq */
-		(void)list_mvrear(rq->ktq_list);
-		pthread_mutex_unlock(&rq->ktq_m);
+		tmo = ktli_timeout_pass(kts, 10);
 
 		if (rq->ktq_exit) break;
 
 	} while (1);
 
+	ktli_rbuf_destroy(&rb);
+
 	debug_printf("Receiver: exiting\n");
 
 	pthread_exit(p);
@@ -111,6 +111,7 @@
 #define SBCAS __sync_bool_compare_and_swap
 
 struct ktli_driver;
+struct ktli_config;
 
 struct ktli_driver_fns {
 	void * (*ktli_dfns_open)();
@@ -123,6 +124,37 @@ struct ktli_driver_fns {
 	int (*ktli_dfns_receive)(void *dh, struct kiovec *msg, int msgcnt);
 
 	int (*ktli_dfns_poll)(void *dh, int timeout);
+
+	/* Optional, applies the session config tuning to the driver */
+	int (*ktli_dfns_tune)(void *dh, struct ktli_config *cf);
+
+	/*
+	 * Optional, receives whatever is waiting, at most len bytes,
+	 * without blocking. Returns the bytes received, 0 on EOF or -1
+	 * with errno set, EAGAIN when nothing is waiting.
+	 */
+	int (*ktli_dfns_recvsome)(void *dh, void *buf, size_t len);
+
+	/*
+	 * Optional, zero copy sends. ktli_dfns_sendzc sends like
+	 * ktli_dfns_send but the kernel may still reference the buffers
+	 * when it returns. *zct gets the send's zero copy token, 0 if the
+	 * data was copied and the buffers are free already.
+	 * ktli_dfns_zcdone collects completion notifications and returns
+	 * the token up to which all zero copy sends are done with their
+	 * buffers. Tokens only grow, zcdone may be called from any thread.
+	 */
+	int (*ktli_dfns_sendzc)(void *dh, struct kiovec *msg, int msgcnt,
+				uint64_t *zct);
+	uint64_t (*ktli_dfns_zcdone)(void *dh);
+
+	/*
+	 * Optional, returns a descriptor that polls readable, or with
+	 * an error, whenever ktli_dfns_poll would report an event. Sessions
+	 * are only serviced by shared reactors, see ktli_reactor.c, if
+	 * their driver has one.
+	 */
+	int (*ktli_dfns_fd)(void *dh);
 };
 
 enum ktli_driver_id {
@@ -134,11 +166,144 @@ enum ktli_driver_id {
 	/* ↑↑↑↑↑ add new driver id here */
 };
 
+/*
+ * In-flight table, see ktli_ift.c. Indexes the KIOs on the receive queue
+ * by sequence number so that responses can be matched in constant time.
+ */
+struct ktli_ift {
+	struct kio	**kif_bkts;	/* Buckets, chained via kio_ifnext */
+	uint32_t	 kif_mask;	/* Number of buckets - 1 */
+	uint32_t	 kif_cnt;	/* Number of KIOs in the table */
+};
+
+/*
+ * Timing wheel, see ktli_twheel.c. Holds the KIOs on the receive queue
+ * by deadline so that expiry only touches the slots that are due.
+ */
+struct ktli_twheel {
+	struct kio	**ktw_slots;	/* Slots, chained via kio_twnext */
+	uint64_t	 ktw_now;	/* Next tick to process, in ms */
+	uint32_t	 ktw_cnt;	/* Number of KIOs on the wheel */
+};
+
+/*
+ * Lock-free multi-producer single-consumer KIO queue, see ktli_mpsc.c.
+ * KIOs are linked through kio_sqlink, queueing does not allocate.
+ */
+struct ktli_mpsc {
+	struct kio_link	*kmq_head;	/* Last queued, moved by producers */
+	struct kio_link	*kmq_tail;	/* Next to dequeue, consumer only */
+	struct kio_link	 kmq_stub;	/* Placeholder keeping it non-empty */
+};
+
+/*
+ * Send priorities. The sendq keeps a queue per priority, a KIO goes on
+ * the one kio_pri names, see ktli_sq_next() for how they are served.
+ */
+enum ktli_pri {
+	KTLI_PRI_HIGH	= 0,
+	KTLI_PRI_NORMAL	= 1,
+	KTLI_PRI_LOW	= 2,
+	KTLI_NPRI	= 3,
+};
+
 struct ktli_queue {
-	LIST		*ktq_list;	/* the queue itself */
+	LIST		*ktq_list;	/* the queue itself, NULL on the sendq */
+	struct ktli_mpsc ktq_mpsc[KTLI_NPRI]; /* the queues, sendq only */
+	uint32_t	 ktq_wrr[KTLI_NPRI];  /* KIOs left this round */
+	uint32_t	 ktq_skip[KTLI_NPRI]; /* Times passed over */
+	int		 ktq_idle;	/* consumer is waiting, sendq only */
 	pthread_mutex_t  ktq_m;		/* mutex protecting the queue */
 	pthread_cond_t	 ktq_cv;	/* condition variable for waiting */
 	int		 ktq_exit;	/* queue exit flag */
+	struct ktli_ift	 ktq_ift;	/* seq index, only used on the recvq */
+	struct ktli_twheel ktq_tw;	/* deadlines, only used on the recvq */
+	int		 ktq_efd;	/* eventfd, -1 if unused, see ktli_pollfd */
+	int		 ktq_efdset;	/* ktq_efd has been signalled */
+	struct kio	*ktq_zcwait;	/* KIOs waiting on zero copy sends,
+					   chained via kio_zcnext, recvq only */
+	uint64_t	 ktq_zcdone;	/* Last zero copy token seen done */
+	int		 ktq_refs;	/* Sessions using it, compq only,
+					   see ktli_stripe() */
+	uint32_t	 ktq_posts;	/* Bumped on every post, compq only,
+					   spun on by busy poll waiters */
+	struct kio	**ktq_rob;	/* Reorder buffer, KTLI_ROBSIZE KIOs
+					   by seq, sendq with KCFF_SENDSEQ */
+	int64_t		 ktq_robseq;	/* Next seq to leave ktq_rob */
+	pthread_mutex_t	 ktq_robm;	/* mutex protecting ktq_rob */
+};
+
+/*
+ * Sessions striped behind one descriptor, see ktli_stripe(). All members
+ * share the first member's completion queue. kst_out counts the KIOs
+ * each member has been sent and not yet handed back.
+ */
+#define KTLI_MAXSTRIPE 16
+struct ktli_stripe {
+	int		 kst_n;			/* Members, kst_kts[0] first */
+	int		 kst_kts[KTLI_MAXSTRIPE];	/* -1 once closed */
+	int		 kst_out[KTLI_MAXSTRIPE];	/* Outstanding KIOs */
+};
+
+/*
+ * Credit classes, see ktli_credits(). A KIO flagged KIOF_CRREAD or
+ * KIOF_CRWRITE holds a credit of its class from ktli_send() until it is
+ * handed back.
+ */
+enum ktli_crclass {
+	KTLI_CR_READ	= 0,
+	KTLI_CR_WRITE	= 1,
+	KTLI_CR_MAX	= 2,
+};
+
+/* ktli_credits() flags */
+enum ktli_crflags {
+	KTLI_CRQUEUE	= 0x0001,	/* Hold KIOs past a limit, not EAGAIN */
+	KTLI_CRADAPT	= 0x0002,	/* Adaptive window, see ktli_crsample */
+};
+
+/*
+ * Admission control counters and adaptive window state, see ktli_credits()
+ * and ktli_crstats(). Times are in microseconds.
+ */
+struct ktli_crstats {
+	uint64_t	 kcs_waits;	/* KIOs that waited for a credit */
+	uint64_t	 kcs_rejects;	/* KIOs failed with EAGAIN */
+	uint64_t	 kcs_waitus;	/* Total time waited for credits */
+	uint64_t	 kcs_waitmax;	/* Longest wait for a credit */
+	uint32_t	 kcs_win[KTLI_CR_MAX];	/* Adaptive window, 0 if off */
+	uint64_t	 kcs_rtt[KTLI_CR_MAX];	/* Smoothed round trip */
+	uint64_t	 kcs_minrtt[KTLI_CR_MAX]; /* Unloaded round trip */
+};
+
+/*
+ * Adaptive window of a credit class, AIMD on round trip latency, see
+ * ktli_crsample() in ktli.c.
+ */
+struct ktli_crwin {
+	uint32_t	 kcw_win;	/* KIOs allowed outstanding */
+	uint32_t	 kcw_acc;	/* Samples toward the next increase */
+	uint32_t	 kcw_hold;	/* Samples before the next decrease */
+	int		 kcw_ss;	/* Still in slow start */
+	uint64_t	 kcw_srtt;	/* Smoothed round trip */
+	uint64_t	 kcw_minrtt;	/* Least round trip, this epoch */
+	uint64_t	 kcw_nextmin;	/* Least round trip, next epoch */
+	uint32_t	 kcw_n;		/* Samples this epoch */
+};
+
+/*
+ * Per session credits, see ktli_credits(). KIOs waiting for a credit
+ * are chained via kio_crnext in send order, kcr_m protects everything.
+ */
+struct ktli_credits {
+	pthread_mutex_t	 kcr_m;
+	int		 kcr_flags;		/* KTLI_CR* flags */
+	uint32_t	 kcr_max[KTLI_CR_MAX];	/* Limits, 0 if none */
+	uint32_t	 kcr_out[KTLI_CR_MAX];	/* Credits held */
+	struct kio	*kcr_head[KTLI_CR_MAX];	/* KIOs waiting */
+	struct kio	*kcr_tail[KTLI_CR_MAX];
+	struct ktli_crwin kcr_win[KTLI_CR_MAX];
+	struct ktli_crstats kcr_st;
 };
 
 /* 
@@ -174,6 +339,18 @@ enum ktli_sstate {
 enum ktli_config_flags {
 	KCFF_NOFLAGS	= 0x0000,
 	KCFF_TLS	= 0x0001,
+	KCFF_SEQSLOT	= 0x0002,	/* Encode reqs with a reserved seq slot */
+	KCFF_ZEROCOPY	= 0x0004,	/* Zero copy sends, if the driver can */
+	KCFF_REACTOR	= 0x0008,	/* Serviced by shared reactor threads */
+	KCFF_STRICTPRI	= 0x0010,	/* Strict rather than weighted send
+					   priorities, see ktli_sq_next() */
+	KCFF_BUSYPOLL	= 0x0020,	/* Spin for responses and completions
+					   rather than sleep, see ktli_poll() */
+	KCFF_PINCPU	= 0x0040,	/* Pin the session threads to
+					   kcfg_sendcpu and kcfg_recvcpu */
+	KCFF_SENDSEQ	= 0x0080,	/* Sequence and stamp KIOs in the
+					   submitting thread, see
+					   ktli_sq_order() */
 };
 
 /*
@@ -188,8 +365,37 @@ struct ktli_config {
 	char 			*kcfg_port;	/* Service name or number */
 	int64_t			 kcfg_id;	/* User ID */
 	char			*kcfg_hkey;	/* User HMAC key */
+	void			*kcfg_hctx;	/* kcfg_hkey pre-keyed, or NULL */
 	enum ktli_config_flags	 kcfg_flags;	/* Flags for the session */
 	void			*kcfg_pconf;	/* Private caller config */
+
+	/*
+	 * Driver I/O tuning, 0 uses the driver default. When a partial
+	 * send or receive can not make progress the driver retries
+	 * kcfg_iospin times before blocking for readiness, kcfg_iowait
+	 * ms at a time, failing after kcfg_iostall ms without progress.
+	 */
+	uint32_t		 kcfg_iospin;	/* Retries before blocking */
+	uint32_t		 kcfg_iowait;	/* ms per readiness wait */
+	uint32_t		 kcfg_iostall;	/* ms without progress, max */
+
+	/*
+	 * Weighted send priorities, KIOs of each priority sent per round,
+	 * 0 uses the default, see ktli_sq_next().
+	 */
+	uint32_t		 kcfg_priw[KTLI_NPRI];
+
+	/*
+	 * Low latency tuning. With KCFF_PINCPU the sender and receiver
+	 * threads run only on the given CPUs, -1 leaves one unpinned.
+	 * With KCFF_BUSYPOLL the receiver never sleeps in the driver and
+	 * ktli_poll() spins up to kcfg_spinus before sleeping, 0 uses
+	 * the default. Reactor serviced sessions have no threads of
+	 * their own, for them only the ktli_poll() spin applies.
+	 */
+	int			 kcfg_sendcpu;	/* CPU for the sender */
+	int			 kcfg_recvcpu;	/* CPU for the receiver */
+	uint32_t		 kcfg_spinus;	/* us ktli_poll() spins, max */
 };
 	
 /**
@@ -204,17 +410,31 @@ struct ktli_config {
  *	  message length
  *	o a function that given a header buffer, returns the expected
  *	  value length
+ * Optionally, a function that stamps the sequence number into an outbound
+ * request that was encoded with a reserved sequence slot may be provided.
  */
 struct ktli_helpers {
 	/* houses min recv necessary to determine full message length */
 	int kh_recvhdr_len;			
 
-	/* Extracts the ackSequence from a full message in a single kiovec */
-	uint64_t (*kh_getaseq_fn)(struct kiovec *msg, int msgcnt);
+	/*
+	 * Extracts the ackSequence from a full message in a single kiovec.
+	 * Anything learned about the message layout is left in rs, which
+	 * ktli hangs on the matching KIO.
+	 */
+	uint64_t (*kh_getaseq_fn)(struct kiovec *msg, int msgcnt,
+				  struct kio_rscan *rs);
 
 	/* Sets the sequence in a full message in a single kiovec */
 	void	(*kh_setseq_fn)(struct kiovec *msg, int msgcnt, uint64_t seq);
 
+	/*
+	 * Optional. Stamps the sequence into a KIO with KIOF_SEQSLOT set,
+	 * in place. When absent kh_setseq_fn is used for all KIOs. Returns
+	 * -1 if the KIO could not be stamped, it is then failed unsent.
+	 */
+	int	(*kh_stampseq_fn)(struct kio *kio, uint64_t seq);
+
 	/* Returns length of a message given a header in one kiovec */
 	int32_t (*kh_msglen_fn)(struct kiovec *msg_hdr);
 
@@ -232,9 +452,18 @@ extern int ktli_send(int ktd, struct kio *kio);
 extern int ktli_receive(int ktd, struct kio *kio);
 extern int ktli_receive_unsolicited(int ktd, struct kio **kio);
 extern int ktli_poll(int ktd, int timeout);
+extern int ktli_reap(int ktd, struct kio **kio, int max, int timeout);
+extern int ktli_pollfd(int ktd);
 extern int ktli_drain(int ktd, struct kio **kio);
 extern int ktli_drain_match(int ktd, struct kio *kio);
+extern int ktli_settimeout(int ktd, struct kio *kio, uint32_t ms);
 extern int ktli_config(int ktd, struct ktli_config **cf);
+extern void ktli_recvmsg_free(struct kio *kio, int keepval);
+extern int ktli_reactors(int nthreads);
+extern int ktli_stripe(int ktd, int member);
+extern int ktli_stripe_pick(int ktd);
+extern int ktli_credits(int ktd, uint32_t rdmax, uint32_t wrmax, int flags);
+extern int ktli_crstats(int ktd, struct ktli_crstats *cs);
 
 #define ktli_gettime(_ts) clock_gettime(KIO_CLOCK, (_ts));
 
@@ -0,0 +1,161 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface In-Flight Table
+ * Every KIO on a session's receive queue is awaiting a response carrying
+ * its sequence number as the ackSequence. Finding the KIO by walking the
+ * receive queue is linear in the queue depth, so the receive queue also
+ * keeps this table, a hash of the same KIOs keyed by kio_seq.
+ *
+ * Sequences are handed out monotonically by the sender thread, so the
+ * outstanding sequences form a sliding window and the low bits of the
+ * sequence make a perfect bucket index for as long as the window fits in
+ * the table. Buckets are chained through kio_ifnext to deal with the
+ * occasional long lived KIO that wraps around, and the table doubles when
+ * it holds more KIOs than buckets, keeping chains at about one entry.
+ *
+ * The table is not locked, the caller must hold the receive queue mutex.
+ * A KIO must be in the table if and only if it is on the receive queue.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_ift.h"
+
+#define KTLI_IFT_MINBKTS 256	/* Must be a power of 2 */
+
+#define KTLI_IFT_BKT(_ift, _seq) ((uint64_t)(_seq) & (_ift)->kif_mask)
+
+int
+ktli_ift_init(struct ktli_ift *ift)
+{
+	ift->kif_bkts = malloc(sizeof(struct kio *) * KTLI_IFT_MINBKTS);
+	if (!ift->kif_bkts) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	memset(ift->kif_bkts, 0, sizeof(struct kio *) * KTLI_IFT_MINBKTS);
+	ift->kif_mask = KTLI_IFT_MINBKTS - 1;
+	ift->kif_cnt  = 0;
+	return(0);
+}
+
+void
+ktli_ift_destroy(struct ktli_ift *ift)
+{
+	if (ift->kif_bkts)
+		free(ift->kif_bkts);
+	ift->kif_bkts = NULL;
+	ift->kif_mask = 0;
+	ift->kif_cnt  = 0;
+}
+
+/* Forget every KIO, used when the whole receive queue is flushed */
+void
+ktli_ift_clear(struct ktli_ift *ift)
+{
+	if (!ift->kif_bkts)
+		return;
+	memset(ift->kif_bkts, 0, sizeof(struct kio *) * (ift->kif_mask + 1));
+	ift->kif_cnt = 0;
+}
+
+/*
+ * Double the number of buckets and rehash. If the allocation fails the
+ * table keeps working with longer chains.
+ */
+static void
+ktli_ift_grow(struct ktli_ift *ift)
+{
+	struct kio **nbkts, *kio, *next;
+	uint32_t i, nmask;
+
+	nmask = (ift->kif_mask << 1) | 1;
+	nbkts = malloc(sizeof(struct kio *) * (nmask + 1));
+	if (!nbkts)
+		return;
+	memset(nbkts, 0, sizeof(struct kio *) * (nmask + 1));
+
+	for (i = 0; i <= ift->kif_mask; i++) {
+		for (kio = ift->kif_bkts[i]; kio; kio = next) {
+			next = kio->kio_ifnext;
+			kio->kio_ifnext = nbkts[(uint64_t)kio->kio_seq & nmask];
+			nbkts[(uint64_t)kio->kio_seq & nmask] = kio;
+		}
+	}
+
+	free(ift->kif_bkts);
+	ift->kif_bkts = nbkts;
+	ift->kif_mask = nmask;
+}
+
+void
+ktli_ift_insert(struct ktli_ift *ift, struct kio *kio)
+{
+	struct kio **bkt;
+
+	if (!ift->kif_bkts)
+		return;
+
+	if (ift->kif_cnt > ift->kif_mask)
+		ktli_ift_grow(ift);
+
+	bkt = &ift->kif_bkts[KTLI_IFT_BKT(ift, kio->kio_seq)];
+	kio->kio_ifnext = *bkt;
+	*bkt = kio;
+	ift->kif_cnt++;
+}
+
+/* Safe to call for a KIO that is not in the table, or on an unused table */
+void
+ktli_ift_remove(struct ktli_ift *ift, struct kio *kio)
+{
+	struct kio **pkio;
+
+	if (!ift->kif_bkts)
+		return;
+
+	pkio = &ift->kif_bkts[KTLI_IFT_BKT(ift, kio->kio_seq)];
+	for (; *pkio; pkio = &(*pkio)->kio_ifnext) {
+		if (*pkio == kio) {
+			*pkio = kio->kio_ifnext;
+			kio->kio_ifnext = NULL;
+			ift->kif_cnt--;
+			return;
+		}
+	}
+}
+
+struct kio *
+ktli_ift_lookup(struct ktli_ift *ift, int64_t seq)
+{
+	struct kio *kio;
+
+	if (!ift->kif_bkts)
+		return(NULL);
+
+	kio = ift->kif_bkts[KTLI_IFT_BKT(ift, seq)];
+	for (; kio; kio = kio->kio_ifnext) {
+		if (kio->kio_seq == seq)
+			return(kio);
+	}
+	return(NULL);
+}
@@ -0,0 +1,27 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_IFT_H
+#define _KTLI_IFT_H
+
+extern int  ktli_ift_init(struct ktli_ift *ift);
+extern void ktli_ift_destroy(struct ktli_ift *ift);
+extern void ktli_ift_clear(struct ktli_ift *ift);
+
+extern void ktli_ift_insert(struct ktli_ift *ift, struct kio *kio);
+extern void ktli_ift_remove(struct ktli_ift *ift, struct kio *kio);
+extern struct kio *ktli_ift_lookup(struct ktli_ift *ift, int64_t seq);
+
+#endif /* _KTLI_IFT_H */
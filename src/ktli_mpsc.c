@@ -0,0 +1,147 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface MPSC Queue
+ * Any number of application threads queue KIOs for a session's sender
+ * thread. Taking a mutex and allocating a list element for each KIO made
+ * the send queue the top contention point with many threads on a session.
+ * So the send queue is an intrusive queue, KIOs are chained through their
+ * kio_sqlink, and queueing is a single atomic exchange on the head:
+ *
+ *	push(n):  n->next = NULL; prev = XCHG(head, n); prev->next = n;
+ *
+ * Between the exchange and the link a producer has made the queue longer
+ * without linking its KIO in yet. The consumer sees that as a head that
+ * is ahead of the chain and waits for the link, it is a couple of
+ * instructions away unless the producer was preempted right there.
+ *
+ * The queue always holds at least one link, the stub when it is empty.
+ * The link at kmq_tail is handed out once there is a link after it, so
+ * the last KIO is handed out by queueing the stub behind it.
+ *
+ * Producers need no lock. There must only ever be a single consumer at a
+ * time, callers serialize ktli_mpsc_peek() and ktli_mpsc_pop(), KTLI does
+ * so with the send queue mutex.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_mpsc.h"
+
+#define KMQ_KIO(_l) \
+	((struct kio *)((char *)(_l) - offsetof(struct kio, kio_sqlink)))
+
+void
+ktli_mpsc_init(struct ktli_mpsc *q)
+{
+	q->kmq_stub.kl_next = NULL;
+	q->kmq_head = &q->kmq_stub;
+	q->kmq_tail = &q->kmq_stub;
+}
+
+/* Racy unless the producers are quiet, a hint for everyone else */
+int
+ktli_mpsc_empty(struct ktli_mpsc *q)
+{
+	return(__atomic_load_n(&q->kmq_head, __ATOMIC_SEQ_CST) == &q->kmq_stub);
+}
+
+static void
+ktli_mpsc_pushl(struct ktli_mpsc *q, struct kio_link *l)
+{
+	struct kio_link *prev;
+
+	__atomic_store_n(&l->kl_next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->kmq_head, l, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->kl_next, l, __ATOMIC_RELEASE);
+}
+
+void
+ktli_mpsc_push(struct ktli_mpsc *q, struct kio *kio)
+{
+	ktli_mpsc_pushl(q, &kio->kio_sqlink);
+}
+
+/* Returns the link after l, waiting for a producer that is linking it */
+static struct kio_link *
+ktli_mpsc_next(struct kio_link *l)
+{
+	struct kio_link *next;
+
+	while (!(next = __atomic_load_n(&l->kl_next, __ATOMIC_ACQUIRE)))
+		sched_yield();
+	return(next);
+}
+
+/*
+ * Step the tail past the stub. Returns the tail link, NULL when the queue
+ * is empty.
+ */
+static struct kio_link *
+ktli_mpsc_first(struct ktli_mpsc *q)
+{
+	struct kio_link *tail = q->kmq_tail;
+
+	if (tail != &q->kmq_stub)
+		return(tail);
+
+	if (__atomic_load_n(&q->kmq_head, __ATOMIC_ACQUIRE) == tail)
+		return(NULL);
+
+	tail = ktli_mpsc_next(tail);
+	q->kmq_tail = tail;
+	return(tail);
+}
+
+/* Returns the next KIO without dequeueing it, NULL if the queue is empty */
+struct kio *
+ktli_mpsc_peek(struct ktli_mpsc *q)
+{
+	struct kio_link *tail = ktli_mpsc_first(q);
+
+	return(tail ? KMQ_KIO(tail) : NULL);
+}
+
+/* Dequeues the next KIO, NULL if the queue is empty */
+struct kio *
+ktli_mpsc_pop(struct ktli_mpsc *q)
+{
+	struct kio_link *tail, *next;
+
+	tail = ktli_mpsc_first(q);
+	if (!tail)
+		return(NULL);
+
+	next = __atomic_load_n(&tail->kl_next, __ATOMIC_ACQUIRE);
+	if (!next) {
+		/*
+		 * Last one linked. If no producer is behind it, queue the
+		 * stub so that it has a successor, then wait for whichever
+		 * link lands after it.
+		 */
+		if (__atomic_load_n(&q->kmq_head, __ATOMIC_ACQUIRE) == tail)
+			ktli_mpsc_pushl(q, &q->kmq_stub);
+		next = ktli_mpsc_next(tail);
+	}
+
+	q->kmq_tail = next;
+	tail->kl_next = NULL;
+	return(KMQ_KIO(tail));
+}
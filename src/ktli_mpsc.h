@@ -0,0 +1,26 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_MPSC_H
+#define _KTLI_MPSC_H
+
+extern void ktli_mpsc_init(struct ktli_mpsc *q);
+extern int  ktli_mpsc_empty(struct ktli_mpsc *q);
+
+extern void ktli_mpsc_push(struct ktli_mpsc *q, struct kio *kio);
+extern struct kio *ktli_mpsc_peek(struct ktli_mpsc *q);
+extern struct kio *ktli_mpsc_pop(struct ktli_mpsc *q);
+
+#endif /* _KTLI_MPSC_H */
@@ -0,0 +1,349 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface Object Pools
+ * Every RPC allocates and frees the same handful of small objects: a KIO,
+ * kiovec arrays, a PDU and a packed message. With many threads issuing
+ * RPCs and the sender and receiver threads freeing what others allocated,
+ * malloc(3) arenas contend and long runs fragment the heap. So KTLI_MALLOC
+ * and KI_MALLOC are served from size classed pools instead.
+ *
+ * There are KPL_NCLASSES power of 2 size classes, 16 bytes to 64KiB,
+ * larger requests go to malloc(3). Each class carves its objects out of
+ * KPL_SLABSZ slabs that are never returned, freed objects are kept on the
+ * class free list for reuse. So the memory held by the pools is bounded by
+ * the peak number of live objects.
+ *
+ * Each thread keeps a cache of free objects per class and only takes the
+ * class lock to move KPL_TCBATCH objects at a time in or out of it. Objects
+ * freed by a thread other than the allocating one simply land in that
+ * thread's cache. A thread's cache is handed back to the classes when the
+ * thread exits.
+ *
+ * The slab map records the class of every slab, indexed by slab address.
+ * ktli_pool_free() looks the pointer up to find its class, anything not in
+ * a slab is assumed to have come from malloc(3) and is passed to free(3).
+ * So pool and malloc(3) memory may be freed through the same call. The
+ * reverse does not hold: pool memory must never be given to free(3) or to
+ * code that frees with it, like protobuf-c.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ktli_pool.h"
+
+#define KPL_MINSHIFT	4			/* Smallest class, 16 bytes */
+#define KPL_NCLASSES	13			/* 16 bytes to 64KiB */
+#define KPL_MAXSZ	((size_t)1 << (KPL_MINSHIFT + KPL_NCLASSES - 1))
+#define KPL_CLSZ(_c)	((size_t)1 << (KPL_MINSHIFT + (_c)))
+
+#define KPL_SLABSHIFT	18			/* 256KiB slabs */
+#define KPL_SLABSZ	((size_t)1 << KPL_SLABSHIFT)
+
+#define KPL_TCBATCH	32			/* Objects per cache refill */
+#define KPL_TCMAX	(2 * KPL_TCBATCH)	/* Cache flush threshold */
+
+/*
+ * Slab map, two levels indexed by slab number, covering a 48 bit address
+ * space. A leaf holds one byte per slab, 0 when the slab is not a pool
+ * slab, otherwise its class + 1. Leaves are added on demand and never
+ * removed, so lookups are not locked.
+ */
+#define KPL_ADDRBITS	48
+#define KPL_LEAFBITS	14
+#define KPL_ROOTBITS	(KPL_ADDRBITS - KPL_SLABSHIFT - KPL_LEAFBITS)
+#define KPL_LEAFSZ	((size_t)1 << KPL_LEAFBITS)
+
+static uint8_t *kpl_map[1 << KPL_ROOTBITS];
+
+struct kpl_obj {
+	struct kpl_obj	*ko_next;
+};
+
+/* A size class, its free objects and the unused part of its newest slab */
+struct kpl_class {
+	pthread_mutex_t	 kc_m;
+	struct kpl_obj	*kc_free;	/* Free list */
+	char		*kc_slab;	/* Next uncarved object */
+	char		*kc_slabend;	/* End of the newest slab */
+};
+
+static struct kpl_class kpl_classes[KPL_NCLASSES] = {
+	[0 ... KPL_NCLASSES - 1] = { .kc_m = PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* Per thread cache of free objects */
+struct kpl_tcache {
+	struct kpl_obj	*kt_free[KPL_NCLASSES];
+	uint32_t	 kt_cnt[KPL_NCLASSES];
+	int		 kt_state;	/* 0 new, 1 active, 2 thread exiting */
+};
+
+static __thread struct kpl_tcache kpl_tc;
+static pthread_key_t kpl_tckey;
+static pthread_once_t kpl_once = PTHREAD_ONCE_INIT;
+
+static inline int
+kpl_class(size_t len)
+{
+	if (len <= KPL_CLSZ(0))
+		return(0);
+	return((int)(sizeof(long) * 8 - __builtin_clzl(len - 1)) - KPL_MINSHIFT);
+}
+
+/* Returns the class of a pool object, -1 if p is not in a pool slab */
+static inline int
+kpl_owner(void *p)
+{
+	uintptr_t sn = (uintptr_t)p >> KPL_SLABSHIFT;
+	uint8_t *leaf;
+
+	if (sn >> (KPL_ROOTBITS + KPL_LEAFBITS))
+		return(-1);
+
+	leaf = __atomic_load_n(&kpl_map[sn >> KPL_LEAFBITS], __ATOMIC_ACQUIRE);
+	if (!leaf)
+		return(-1);
+
+	return((int)leaf[sn & (KPL_LEAFSZ - 1)] - 1);
+}
+
+/* Records a new slab in the slab map. Returns 0, or -1 */
+static int
+kpl_map_slab(char *slab, int c)
+{
+	uintptr_t sn = (uintptr_t)slab >> KPL_SLABSHIFT;
+	uint8_t **root, *leaf;
+
+	if (sn >> (KPL_ROOTBITS + KPL_LEAFBITS))
+		return(-1);
+
+	root = &kpl_map[sn >> KPL_LEAFBITS];
+	leaf = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+	if (!leaf) {
+		leaf = calloc(1, KPL_LEAFSZ);
+		if (!leaf)
+			return(-1);
+
+		/* Lost the race, use the winner's leaf */
+		if (!__sync_bool_compare_and_swap(root, NULL, leaf)) {
+			free(leaf);
+			leaf = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	leaf[sn & (KPL_LEAFSZ - 1)] = c + 1;
+	return(0);
+}
+
+/*
+ * Take up to cnt objects from a class, chained through ko_next, carving
+ * a new slab if the free list is empty. Returns the number taken.
+ */
+static uint32_t
+kpl_take(int c, uint32_t cnt, struct kpl_obj **head)
+{
+	struct kpl_class *kc = &kpl_classes[c];
+	struct kpl_obj *o;
+	char *slab;
+	uint32_t n;
+
+	pthread_mutex_lock(&kc->kc_m);
+
+	for (n = 0; n < cnt; n++) {
+		if (kc->kc_free) {
+			o = kc->kc_free;
+			kc->kc_free = o->ko_next;
+		} else {
+			if (kc->kc_slab == kc->kc_slabend) {
+				if (posix_memalign((void **)&slab, KPL_SLABSZ,
+						   KPL_SLABSZ))
+					break;
+				if (kpl_map_slab(slab, c) < 0) {
+					free(slab);
+					break;
+				}
+				kc->kc_slab    = slab;
+				kc->kc_slabend = slab + KPL_SLABSZ;
+			}
+			o = (struct kpl_obj *)kc->kc_slab;
+			kc->kc_slab += KPL_CLSZ(c);
+		}
+		o->ko_next = *head;
+		*head = o;
+	}
+
+	pthread_mutex_unlock(&kc->kc_m);
+	return(n);
+}
+
+/* Give cnt objects, chained through ko_next, back to a class */
+static void
+kpl_give(int c, struct kpl_obj *head, struct kpl_obj *tail)
+{
+	struct kpl_class *kc = &kpl_classes[c];
+
+	pthread_mutex_lock(&kc->kc_m);
+	tail->ko_next = kc->kc_free;
+	kc->kc_free = head;
+	pthread_mutex_unlock(&kc->kc_m);
+}
+
+/* Thread exit, hand the cache back to the classes */
+static void
+kpl_tcache_flush(void *p)
+{
+	struct kpl_tcache *tc = (struct kpl_tcache *)p;
+	struct kpl_obj *tail;
+	int c;
+
+	for (c = 0; c < KPL_NCLASSES; c++) {
+		if (!tc->kt_free[c])
+			continue;
+		for (tail = tc->kt_free[c]; tail->ko_next; tail = tail->ko_next)
+			;
+		kpl_give(c, tc->kt_free[c], tail);
+		tc->kt_free[c] = NULL;
+		tc->kt_cnt[c]  = 0;
+	}
+
+	/* Later frees on this thread bypass the cache */
+	tc->kt_state = 2;
+}
+
+static void
+kpl_init()
+{
+	(void)pthread_key_create(&kpl_tckey, kpl_tcache_flush);
+}
+
+/* Returns the calling thread's cache, NULL once the thread is exiting */
+static inline struct kpl_tcache *
+kpl_tcache()
+{
+	struct kpl_tcache *tc = &kpl_tc;
+
+	if (tc->kt_state == 1)
+		return(tc);
+	if (tc->kt_state == 2)
+		return(NULL);
+
+	/* First use on this thread, arrange for the flush at exit */
+	pthread_once(&kpl_once, kpl_init);
+	(void)pthread_setspecific(kpl_tckey, tc);
+	tc->kt_state = 1;
+	return(tc);
+}
+
+void *
+ktli_pool_alloc(size_t len)
+{
+	struct kpl_tcache *tc;
+	struct kpl_obj *o;
+	int c;
+
+	if (len > KPL_MAXSZ)
+		return(malloc(len));
+
+	c  = kpl_class(len);
+	tc = kpl_tcache();
+	if (!tc) {
+		o = NULL;
+		if (!kpl_take(c, 1, &o)) {
+			errno = ENOMEM;
+			return(NULL);
+		}
+		return(o);
+	}
+
+	if (!tc->kt_free[c]) {
+		tc->kt_cnt[c] = kpl_take(c, KPL_TCBATCH, &tc->kt_free[c]);
+		if (!tc->kt_cnt[c]) {
+			errno = ENOMEM;
+			return(NULL);
+		}
+	}
+
+	o = tc->kt_free[c];
+	tc->kt_free[c] = o->ko_next;
+	tc->kt_cnt[c]--;
+	return(o);
+}
+
+void
+ktli_pool_free(void *p)
+{
+	struct kpl_tcache *tc;
+	struct kpl_obj *o = (struct kpl_obj *)p, *tail;
+	uint32_t i;
+	int c;
+
+	if (!p)
+		return;
+
+	c = kpl_owner(p);
+	if (c < 0) {
+		free(p);
+		return;
+	}
+
+	tc = kpl_tcache();
+	if (!tc) {
+		kpl_give(c, o, o);
+		return;
+	}
+
+	o->ko_next = tc->kt_free[c];
+	tc->kt_free[c] = o;
+	if (++tc->kt_cnt[c] < KPL_TCMAX)
+		return;
+
+	/* Cache is full, give a batch back to the class */
+	for (tail = o, i = 1; i < KPL_TCBATCH; i++)
+		tail = tail->ko_next;
+	tc->kt_free[c] = tail->ko_next;
+	tc->kt_cnt[c] -= KPL_TCBATCH;
+	kpl_give(c, o, tail);
+}
+
+void *
+ktli_pool_realloc(void *p, size_t len)
+{
+	void *n;
+	int c;
+
+	if (!p)
+		return(ktli_pool_alloc(len));
+
+	c = kpl_owner(p);
+	if (c < 0)
+		return(realloc(p, len));
+
+	if (len <= KPL_CLSZ(c))
+		return(p);
+
+	n = ktli_pool_alloc(len);
+	if (!n)
+		return(NULL);
+
+	memcpy(n, p, KPL_CLSZ(c));
+	ktli_pool_free(p);
+	return(n);
+}
@@ -0,0 +1,30 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_POOL_H
+#define _KTLI_POOL_H
+#include <stddef.h>
+
+/*
+ * Size classed object pools with per thread caches, see ktli_pool.c.
+ * Backs KTLI_MALLOC and KI_MALLOC. ktli_pool_free() and
+ * ktli_pool_realloc() also accept memory from malloc(3), which is handed
+ * back to free(3) and realloc(3).
+ */
+extern void *ktli_pool_alloc(size_t len);
+extern void  ktli_pool_free(void *p);
+extern void *ktli_pool_realloc(void *p, size_t len);
+
+#endif /* _KTLI_POOL_H */
@@ -0,0 +1,307 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface Receive Buffer
+ * Rather than reading each response with one receive for the PDU and
+ * another for the message and value, the receiver reads whatever the
+ * driver has waiting into a large chunk and parses as many complete
+ * responses out of it as are present. So a burst of small responses costs
+ * a single receive.
+ *
+ * The PDU and message of each response are handed out as slices of the
+ * chunk, no copy and no allocation. A chunk is reference counted, one
+ * reference for the receive buffer and one for every message sliced out of
+ * it, and is freed when the last one is dropped, see ktli_rbuf_put(). Once
+ * the buffer has parsed everything and holds the only reference the chunk
+ * is reused from the start. A response that does not fit in the space left
+ * is moved to a new chunk, sized to fit it if it is larger than KTLI_RCHUNK.
+ *
+ * Values are never sliced, they are handed to callers who free them on
+ * their own. Each value gets a dedicated buffer, whatever part of it is
+ * already in the chunk is copied over and the rest is received directly
+ * into the value buffer, so large values are not staged in the chunk.
+ *
+ * Drivers that lack ktli_dfns_recvsome are read with ktli_dfns_receive,
+ * exactly the bytes needed and one response at a time, as before.
+ *
+ * The receive buffer is only ever touched by the session's receiver thread,
+ * or its reactor, see ktli_reactor.c, and is not locked. Chunk references are dropped from any thread.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_rbuf.h"
+
+struct ktli_rchunk {
+	uint32_t	krc_ref;	/* References, see above */
+	uint32_t	krc_size;	/* Size of krc_data */
+	char		krc_data[];
+};
+
+static struct ktli_rchunk *
+ktli_rchunk_alloc(uint32_t size)
+{
+	struct ktli_rchunk *c;
+
+	c = malloc(sizeof(struct ktli_rchunk) + size);
+	if (!c)
+		return(NULL);
+
+	c->krc_ref  = 1;
+	c->krc_size = size;
+	return(c);
+}
+
+/* Only reference left is the receive buffer's */
+static int
+ktli_rchunk_excl(struct ktli_rchunk *c)
+{
+	return(__atomic_load_n(&c->krc_ref, __ATOMIC_ACQUIRE) == 1);
+}
+
+/* Drops a reference on a chunk, NULL is ignored */
+void
+ktli_rbuf_put(void *chunk)
+{
+	struct ktli_rchunk *c = (struct ktli_rchunk *)chunk;
+
+	if (c && !__sync_sub_and_fetch(&c->krc_ref, 1))
+		free(c);
+}
+
+void
+ktli_rbuf_init(struct ktli_rbuf *rb)
+{
+	memset(rb, 0, sizeof(struct ktli_rbuf));
+}
+
+void
+ktli_rbuf_destroy(struct ktli_rbuf *rb)
+{
+	ktli_rbuf_put(rb->krb_chunk);
+	memset(rb, 0, sizeof(struct ktli_rbuf));
+}
+
+/*
+ * Make room for need contiguous bytes starting at krb_head, keeping the
+ * unparsed bytes. Returns 0, or -1 with errno set.
+ */
+static int
+ktli_rbuf_reserve(struct ktli_rbuf *rb, size_t need)
+{
+	struct ktli_rchunk *c = rb->krb_chunk, *n;
+	uint32_t avail = rb->krb_tail - rb->krb_head;
+	size_t size;
+
+	if (c && !avail && ktli_rchunk_excl(c))
+		rb->krb_head = rb->krb_tail = 0;
+
+	if (c && (c->krc_size - rb->krb_head >= need))
+		return(0);
+
+	/* Slide the unparsed bytes down if nobody else is looking */
+	if (c && (c->krc_size >= need) && ktli_rchunk_excl(c)) {
+		memmove(c->krc_data, c->krc_data + rb->krb_head, avail);
+		rb->krb_head = 0;
+		rb->krb_tail = avail;
+		return(0);
+	}
+
+	size = (need > KTLI_RCHUNK) ? need : KTLI_RCHUNK;
+	if (size > UINT32_MAX) {
+		errno = EMSGSIZE;
+		return(-1);
+	}
+
+	n = ktli_rchunk_alloc(size);
+	if (!n) {
+		errno = ENOMEM;
+		return(-1);
+	}
+
+	if (avail)
+		memcpy(n->krc_data, c->krc_data + rb->krb_head, avail);
+	ktli_rbuf_put(c);
+
+	rb->krb_chunk = n;
+	rb->krb_head  = 0;
+	rb->krb_tail  = avail;
+	return(0);
+}
+
+/*
+ * Receive until at least need bytes are unparsed, space for them must
+ * already be reserved. With ktli_dfns_recvsome, reads as much as fits
+ * and returns 0 if the driver runs dry first. Returns 1 once the bytes
+ * are in, -1 with errno set on failure.
+ */
+static int
+ktli_rbuf_fill(struct ktli_rbuf *rb, struct ktli_driver_fns *fns, void *dh,
+	       size_t need)
+{
+	struct ktli_rchunk *c = rb->krb_chunk;
+	struct kiovec kiov;
+	int rc;
+
+	while (rb->krb_tail - rb->krb_head < need) {
+		if (fns->ktli_dfns_recvsome) {
+			rc = (fns->ktli_dfns_recvsome)(dh,
+					c->krc_data + rb->krb_tail,
+					c->krc_size - rb->krb_tail);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0 &&
+			    ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				return(0);
+			if (rc == 0)
+				errno = ECONNABORTED;	/* EOF */
+		} else {
+			kiov.kiov_base = c->krc_data + rb->krb_tail;
+			kiov.kiov_len  = need - (rb->krb_tail - rb->krb_head);
+			rc = (fns->ktli_dfns_receive)(dh, &kiov, 1);
+		}
+
+		if (rc <= 0)
+			return(-1);
+
+		rb->krb_tail += rc;
+	}
+
+	return(1);
+}
+
+/*
+ * Parse the next complete response, receiving more as needed.
+ * On success msg[] is filled with KM_CNT_WITHVAL kiovecs, PDU and MSG
+ * are slices of the chunk returned in *chunk, which the caller must drop
+ * with ktli_rbuf_put() once done with them. VAL is a dedicated buffer,
+ * NULL when the value is empty, owned by the caller.
+ *
+ * Returns 1 with a response, 0 if no complete response is buffered and
+ * the driver has nothing more waiting, -1 with errno set on failure.
+ * Partially received responses stay buffered for the next call.
+ */
+int
+ktli_rbuf_next(struct ktli_rbuf *rb, struct ktli_driver_fns *fns, void *dh,
+	       struct ktli_helpers *kh, struct kiovec *msg, void **chunk)
+{
+	struct ktli_rchunk *c;
+	struct kiovec pdu, kiov[2];
+	size_t hlen, need, voff, vcopy, vdone;
+	int32_t mlen, vlen;
+	char *vbuf;
+	int rc, n;
+
+	hlen = kh->kh_recvhdr_len;
+
+	/* Get the PDU, and with it the message and value lengths */
+	if (ktli_rbuf_reserve(rb, hlen) < 0)
+		return(-1);
+	rc = ktli_rbuf_fill(rb, fns, dh, hlen);
+	if (rc <= 0)
+		return(rc);
+
+	c = rb->krb_chunk;
+	pdu.kiov_base = c->krc_data + rb->krb_head;
+	pdu.kiov_len  = hlen;
+	mlen = (kh->kh_msglen_fn)(&pdu);
+	vlen = (kh->kh_vallen_fn)(&pdu);
+	if ((mlen < 0) || (vlen < 0)) {
+		errno = EPROTO;
+		return(-1);
+	}
+
+	/* Get the rest of the message, this may move to a new chunk */
+	need = hlen + mlen;
+	if (ktli_rbuf_reserve(rb, need) < 0)
+		return(-1);
+	if (fns->ktli_dfns_recvsome) {
+		rc = ktli_rbuf_fill(rb, fns, dh, need);
+		if (rc <= 0)
+			return(rc);
+	}
+	c = rb->krb_chunk;
+
+	/*
+	 * Committed to this response now. The value goes in its own
+	 * buffer, copy what was buffered and receive the rest into it.
+	 */
+	vbuf = NULL;
+	if (vlen) {
+		vbuf = malloc(vlen);
+		if (!vbuf) {
+			errno = ENOMEM;
+			return(-1);
+		}
+	}
+
+	voff = rb->krb_head + need;
+	if (fns->ktli_dfns_recvsome) {
+		vcopy = rb->krb_tail - voff;
+		if (vcopy > (size_t)vlen)
+			vcopy = vlen;
+		memcpy(vbuf, c->krc_data + voff, vcopy);
+		vdone = vcopy;
+	} else {
+		/*
+		 * Exact reads, only the PDU is buffered. Receive the
+		 * message and the value together.
+		 */
+		n = 0;
+		if (mlen) {
+			kiov[n].kiov_base = c->krc_data + rb->krb_tail;
+			kiov[n++].kiov_len = voff - rb->krb_tail;
+		}
+		if (vlen) {
+			kiov[n].kiov_base = vbuf;
+			kiov[n++].kiov_len = vlen;
+		}
+		if (n && ((fns->ktli_dfns_receive)(dh, kiov, n) < 0)) {
+			free(vbuf);
+			return(-1);
+		}
+		rb->krb_tail = voff;
+		vcopy = 0;
+		vdone = vlen;
+	}
+
+	if (vdone < (size_t)vlen) {
+		kiov[0].kiov_base = vbuf + vdone;
+		kiov[0].kiov_len  = vlen - vdone;
+		if ((fns->ktli_dfns_receive)(dh, kiov, 1) < 0) {
+			free(vbuf);
+			return(-1);
+		}
+	}
+
+	msg[KIOV_PDU].kiov_base = c->krc_data + rb->krb_head;
+	msg[KIOV_PDU].kiov_len  = hlen;
+	msg[KIOV_MSG].kiov_base = c->krc_data + rb->krb_head + hlen;
+	msg[KIOV_MSG].kiov_len  = mlen;
+	msg[KIOV_VAL].kiov_base = vbuf;
+	msg[KIOV_VAL].kiov_len  = vlen;
+
+	__sync_add_and_fetch(&c->krc_ref, 1);
+	*chunk = c;
+
+	rb->krb_head = voff + vcopy;
+	return(1);
+}
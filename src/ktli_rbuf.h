@@ -0,0 +1,42 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_RBUF_H
+#define _KTLI_RBUF_H
+
+/* Default receive chunk size, larger messages get a chunk of their own */
+#define KTLI_RCHUNK	(64 * 1024)
+
+struct ktli_rchunk;
+
+/*
+ * Receive buffer, see ktli_rbuf.c. Owned by the receiver or reactor, bytes
+ * between krb_head and krb_tail of the current chunk are received but
+ * not yet parsed.
+ */
+struct ktli_rbuf {
+	struct ktli_rchunk *krb_chunk;	/* Current chunk, NULL if none */
+	uint32_t	 krb_head;	/* Next byte to parse */
+	uint32_t	 krb_tail;	/* Next byte to fill */
+};
+
+extern void ktli_rbuf_init(struct ktli_rbuf *rb);
+extern void ktli_rbuf_destroy(struct ktli_rbuf *rb);
+extern int  ktli_rbuf_next(struct ktli_rbuf *rb, struct ktli_driver_fns *fns,
+			   void *dh, struct ktli_helpers *kh,
+			   struct kiovec *msg, void **chunk);
+extern void ktli_rbuf_put(void *chunk);
+
+#endif /* _KTLI_RBUF_H */
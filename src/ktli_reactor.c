@@ -0,0 +1,545 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface Shared Reactors
+ * By default every session has a sender and a receiver thread of its own.
+ * A client talking to hundreds of drives ends up with hundreds of mostly
+ * idle threads, each with its own stack, all being switched in and out.
+ * Sessions opened with KCFF_REACTOR are instead serviced by a small pool
+ * of reactor threads, each servicing the sessions attached to it from a
+ * single epoll(7) loop. Only the threads change, the session queues, the
+ * state machine and the send and receive code are the same, a reactor
+ * runs the same per session passes the dedicated threads do:
+ *	o ktli_send_pass() once ktli_send() has queued KIOs
+ *	o ktli_recvmsg() when the session's driver descriptor polls readable
+ *	o ktli_timeout_pass() as often as the nearest KIO deadline requires
+ *
+ * A session is attached to the reactor with the fewest sessions when it
+ * connects and detached when it disconnects or aborts. Sessions need a
+ * driver that exports a pollable descriptor, ktli_dfns_fd, others keep
+ * their own threads.
+ *
+ * ktli_send() marks the session in the reactor's pending bitmap and only
+ * writes the reactor's eventfd when the reactor is idle in epoll_wait(2),
+ * the same handshake the dedicated sender uses with ktq_idle. A session
+ * already marked costs a single atomic or.
+ *
+ * The reactor holds kr_m while it services sessions and drops it while it
+ * waits. Attach and detach from other threads take it, so a session is
+ * never freed from under a pass. A session that aborts detaches itself
+ * from within its receive pass, it is only marked and freed once the
+ * pass is over.
+ *
+ * Sends are the driver's blocking sends, a session that can not take its
+ * data holds up the other sessions on its reactor until the driver's
+ * stall timeout, see ktli_socket_wait().
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "ktli.h"
+#include "ktli_session.h"
+#include "ktli_rbuf.h"
+#include "ktli_reactor.h"
+
+#define KTLI_REACTORS		4	/* Default pool size, at most */
+#define KTLI_MAXREACTORS	64
+#define KTLI_REACTOR_EVENTS	64	/* epoll events per wait */
+#define KTLI_REACTOR_TICK	10	/* Longest wait, in ms */
+#define KTLI_REACTOR_KICK	UINT32_MAX /* epoll data of the eventfd */
+
+/* A session attached to a reactor */
+struct ktli_rsess {
+	int			 krs_kts;
+	void			*krs_dh;	/* Driver handle */
+	struct ktli_driver_fns	*krs_fns;	/* Driver fns */
+	struct ktli_rbuf	 krs_rb;	/* Receive buffer */
+	int			 krs_more;	/* Responses left in krs_rb */
+	int			 krs_dead;	/* Detached during a pass */
+	struct ktli_rsess	*krs_next;
+	struct ktli_rsess	**krs_pprev;
+};
+
+struct ktli_reactor {
+	pthread_t		 kr_tid;
+	pthread_mutex_t		 kr_m;		/* Held while servicing */
+	int			 kr_epfd;
+	int			 kr_efd;	/* Kick eventfd */
+	int			 kr_idle;	/* In epoll_wait, kick to wake */
+	int			 kr_exit;
+	int			 kr_nsess;	/* Sessions attached, the load */
+	int			 kr_nmore;	/* Sessions with krs_more set */
+	int			 kr_ndead;	/* Sessions with krs_dead set */
+	uint64_t		 kr_sweep;	/* Next timeout pass, in ms */
+	uint64_t		*kr_pend;	/* Sessions with queued sends,
+						   one bit per kts */
+	int			 kr_npend;	/* Words in kr_pend */
+	struct ktli_rsess	**kr_byts;	/* Attached sessions, by kts */
+	struct ktli_rsess	*kr_list;	/* Attached sessions */
+	struct kiovec		*kr_biov;	/* Send gather vector */
+};
+
+static struct ktli_reactor *krs_pool;	/* The reactors, once started */
+static int krs_cnt;			/* Configured pool size, 0 default */
+static int krs_up;			/* Number of reactors running */
+static pthread_mutex_t krs_m = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+ktli_reactor_now()
+{
+	struct timespec ts;
+
+	clock_gettime(KIO_CLOCK, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Called with kr_m held */
+static void
+ktli_rsess_free(struct ktli_reactor *kr, struct ktli_rsess *rs)
+{
+	if (rs->krs_next)
+		rs->krs_next->krs_pprev = rs->krs_pprev;
+	*rs->krs_pprev = rs->krs_next;
+
+	kr->kr_byts[rs->krs_kts] = NULL;
+	if (rs->krs_more)
+		kr->kr_nmore--;
+	if (rs->krs_dead)
+		kr->kr_ndead--;
+	__atomic_sub_fetch(&kr->kr_nsess, 1, __ATOMIC_RELAXED);
+
+	ktli_rbuf_destroy(&rs->krs_rb);
+	free(rs);
+}
+
+/* Runs the send pass of every session with queued sends */
+static void
+ktli_reactor_sends(struct ktli_reactor *kr)
+{
+	struct ktli_rsess *rs;
+	uint64_t w;
+	int i, b;
+
+	for (i = 0; i < kr->kr_npend; i++) {
+		if (!__atomic_load_n(&kr->kr_pend[i], __ATOMIC_RELAXED))
+			continue;
+
+		w = __atomic_exchange_n(&kr->kr_pend[i], 0, __ATOMIC_SEQ_CST);
+		while (w) {
+			b = __builtin_ctzll(w);
+			w &= w - 1;
+
+			/* Marks can outlive a detach, skip those */
+			rs = kr->kr_byts[i * 64 + b];
+			if (rs && !rs->krs_dead)
+				ktli_send_pass(rs->krs_kts, kr->kr_biov);
+		}
+	}
+}
+
+static int
+ktli_reactor_pending(struct ktli_reactor *kr)
+{
+	int i;
+
+	for (i = 0; i < kr->kr_npend; i++)
+		if (__atomic_load_n(&kr->kr_pend[i], __ATOMIC_SEQ_CST))
+			return(1);
+	return(0);
+}
+
+/*
+ * Receive pass of one session. Unless it still has buffered responses,
+ * ask the driver first, the event may only have been zero copy
+ * notifications, which the driver poll collects.
+ */
+static void
+ktli_reactor_recv(struct ktli_reactor *kr, struct ktli_rsess *rs)
+{
+	int rc, more;
+
+	if (!rs->krs_more) {
+		rc = (rs->krs_fns->ktli_dfns_poll)(rs->krs_dh, 0);
+
+		/* A hangup is received too, the receive fails the session */
+		if (!rc || (rc < 0 && errno != ECONNABORTED))
+			return;
+	}
+
+	more = (ktli_recvmsg(rs->krs_kts, &rs->krs_rb) == 1);
+	if (more != rs->krs_more) {
+		rs->krs_more = more;
+		kr->kr_nmore += more ? 1 : -1;
+	}
+}
+
+/* Timeout pass of every session, returns the ms to the next deadline */
+static int
+ktli_reactor_timeouts(struct ktli_reactor *kr)
+{
+	struct ktli_rsess *rs;
+	int t, tmo = KTLI_REACTOR_TICK;
+
+	for (rs = kr->kr_list; rs; rs = rs->krs_next) {
+		if (rs->krs_dead)
+			continue;
+		t = ktli_timeout_pass(rs->krs_kts, KTLI_REACTOR_TICK);
+		if (t < tmo)
+			tmo = t;
+	}
+	return(tmo);
+}
+
+static void *
+ktli_reactor_run(void *p)
+{
+	struct ktli_reactor *kr = (struct ktli_reactor *)p;
+	struct epoll_event ev[KTLI_REACTOR_EVENTS];
+	struct ktli_rsess *rs, *next;
+	uint64_t now, cnt;
+	int i, n, tmo = KTLI_REACTOR_TICK;
+
+	pthread_mutex_lock(&kr->kr_m);
+	while (!kr->kr_exit) {
+		/*
+		 * Producers only kick an idle reactor, so raise kr_idle
+		 * before the last look for queued sends, see
+		 * ktli_reactor_kick(). Don't wait at all if there is work.
+		 */
+		__atomic_store_n(&kr->kr_idle, 1, __ATOMIC_SEQ_CST);
+		if (kr->kr_nmore || ktli_reactor_pending(kr))
+			tmo = 0;
+		pthread_mutex_unlock(&kr->kr_m);
+
+		n = epoll_wait(kr->kr_epfd, ev, KTLI_REACTOR_EVENTS, tmo);
+
+		__atomic_store_n(&kr->kr_idle, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&kr->kr_m);
+
+		/* Sends first, so their responses are on the way sooner */
+		ktli_reactor_sends(kr);
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.u32 == KTLI_REACTOR_KICK) {
+				(void)read(kr->kr_efd, &cnt, sizeof(cnt));
+				continue;
+			}
+
+			/* Events can outlive a detach, skip those */
+			rs = kr->kr_byts[ev[i].data.u32];
+			if (rs && !rs->krs_dead)
+				ktli_reactor_recv(kr, rs);
+		}
+
+		/* Sessions that stopped with responses still buffered */
+		if (kr->kr_nmore) {
+			for (rs = kr->kr_list; rs; rs = rs->krs_next)
+				if (rs->krs_more && !rs->krs_dead)
+					ktli_reactor_recv(kr, rs);
+		}
+
+		/* Timeouts, no more often than the next deadline needs */
+		now = ktli_reactor_now();
+		if (now >= kr->kr_sweep) {
+			tmo = ktli_reactor_timeouts(kr);
+			kr->kr_sweep = now + tmo;
+		} else {
+			tmo = kr->kr_sweep - now;
+		}
+
+		/* Sessions that detached during their own pass */
+		if (kr->kr_ndead) {
+			for (rs = kr->kr_list; rs; rs = next) {
+				next = rs->krs_next;
+				if (rs->krs_dead)
+					ktli_rsess_free(kr, rs);
+			}
+		}
+	}
+	pthread_mutex_unlock(&kr->kr_m);
+
+	return(NULL);
+}
+
+/* Stop and free the first n reactors of the pool, krs_m held */
+static void
+ktli_reactor_stop(int n)
+{
+	struct ktli_reactor *kr;
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		kr = &krs_pool[i];
+		pthread_mutex_lock(&kr->kr_m);
+		kr->kr_exit = 1;
+		pthread_mutex_unlock(&kr->kr_m);
+		(void)write(kr->kr_efd, &one, sizeof(one));
+		pthread_join(kr->kr_tid, NULL);
+	}
+
+	for (i = 0; i < KTLI_MAXREACTORS && krs_pool; i++) {
+		kr = &krs_pool[i];
+		if (kr->kr_epfd >= 0)
+			close(kr->kr_epfd);
+		if (kr->kr_efd >= 0)
+			close(kr->kr_efd);
+		free(kr->kr_pend);
+		free(kr->kr_byts);
+		free(kr->kr_biov);
+	}
+	free(krs_pool);
+	krs_pool = NULL;
+}
+
+/* Start the pool, once. Returns 0, or -1 with errno set */
+static int
+ktli_reactor_start()
+{
+	struct ktli_reactor *kr;
+	struct epoll_event ev;
+	int i, n, maxs;
+	long ncpu;
+
+	pthread_mutex_lock(&krs_m);
+	if (krs_up) {
+		pthread_mutex_unlock(&krs_m);
+		return(0);
+	}
+
+	n = krs_cnt;
+	if (!n) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (ncpu > 0 && ncpu < KTLI_REACTORS) ? ncpu : KTLI_REACTORS;
+	}
+
+	krs_pool = calloc(KTLI_MAXREACTORS, sizeof(struct ktli_reactor));
+	if (!krs_pool) {
+		pthread_mutex_unlock(&krs_m);
+		errno = ENOMEM;
+		return(-1);
+	}
+
+	maxs = kts_max_sessions();
+	for (i = 0; i < KTLI_MAXREACTORS; i++)
+		krs_pool[i].kr_epfd = krs_pool[i].kr_efd = -1;
+
+	for (i = 0; i < n; i++) {
+		kr = &krs_pool[i];
+		pthread_mutex_init(&kr->kr_m, NULL);
+		kr->kr_npend = (maxs + 63) / 64;
+		kr->kr_pend  = calloc(kr->kr_npend, sizeof(uint64_t));
+		kr->kr_byts  = calloc(maxs, sizeof(struct ktli_rsess *));
+		kr->kr_biov  = malloc(sizeof(struct kiovec) * IOV_MAX);
+		kr->kr_epfd  = epoll_create1(EPOLL_CLOEXEC);
+		kr->kr_efd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (!kr->kr_pend || !kr->kr_byts ||
+		    kr->kr_epfd < 0 || kr->kr_efd < 0) {
+			errno = ENOMEM;
+			break;
+		}
+
+		ev.events   = EPOLLIN;
+		ev.data.u32 = KTLI_REACTOR_KICK;
+		if (epoll_ctl(kr->kr_epfd, EPOLL_CTL_ADD, kr->kr_efd, &ev) < 0)
+			break;
+
+		if (pthread_create(&kr->kr_tid, NULL, ktli_reactor_run, kr)) {
+			errno = EAGAIN;
+			break;
+		}
+	}
+
+	if (i < n) {
+		ktli_reactor_stop(i);
+		pthread_mutex_unlock(&krs_m);
+		return(-1);
+	}
+
+	krs_up = n;
+	pthread_mutex_unlock(&krs_m);
+	return(0);
+}
+
+/**
+ * int ktli_reactors(int nthreads)
+ *
+ * Sets the number of shared reactor threads that service KCFF_REACTOR
+ * sessions. The pool starts with the first such session to connect and
+ * its size is fixed from then on. Without a call the pool gets one
+ * reactor per CPU, at most KTLI_REACTORS.
+ *
+ * @param nthreads Number of reactors, 1 to KTLI_MAXREACTORS.
+ */
+int
+ktli_reactors(int nthreads)
+{
+	int rc = 0;
+
+	if (nthreads < 1 || nthreads > KTLI_MAXREACTORS) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&krs_m);
+	if (!krs_up)
+		krs_cnt = nthreads;
+	else if (krs_up != nthreads) {
+		errno = EBUSY;
+		rc = -1;
+	}
+	pthread_mutex_unlock(&krs_m);
+
+	return(rc);
+}
+
+/*
+ * Attach a session to the least loaded reactor, from then on the reactor
+ * sends, receives and times out for the session. Returns 0, or -1 with
+ * errno set.
+ */
+int
+ktli_reactor_attach(int kts, struct ktli_driver_fns *fns, void *dh)
+{
+	struct ktli_reactor *kr;
+	struct ktli_rsess *rs;
+	struct epoll_event ev;
+	int i, fd;
+
+	if (!fns->ktli_dfns_fd || !fns->ktli_dfns_poll) {
+		errno = EOPNOTSUPP;
+		return(-1);
+	}
+
+	fd = (fns->ktli_dfns_fd)(dh);
+	if (fd < 0)
+		return(-1);
+
+	if (ktli_reactor_start() < 0)
+		return(-1);
+
+	rs = malloc(sizeof(struct ktli_rsess));
+	if (!rs) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	memset(rs, 0, sizeof(struct ktli_rsess));
+	rs->krs_kts = kts;
+	rs->krs_dh  = dh;
+	rs->krs_fns = fns;
+	ktli_rbuf_init(&rs->krs_rb);
+
+	/* Pick and load the reactor in one go, so attaches spread */
+	pthread_mutex_lock(&krs_m);
+	kr = &krs_pool[0];
+	for (i = 1; i < krs_up; i++)
+		if (krs_pool[i].kr_nsess < kr->kr_nsess)
+			kr = &krs_pool[i];
+	__atomic_add_fetch(&kr->kr_nsess, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&krs_m);
+
+	pthread_mutex_lock(&kr->kr_m);
+
+	ev.events   = EPOLLIN;
+	ev.data.u32 = kts;
+	if (epoll_ctl(kr->kr_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pthread_mutex_unlock(&kr->kr_m);
+		__atomic_sub_fetch(&kr->kr_nsess, 1, __ATOMIC_RELAXED);
+		free(rs);
+		return(-1);
+	}
+
+	rs->krs_next = kr->kr_list;
+	if (rs->krs_next)
+		rs->krs_next->krs_pprev = &rs->krs_next;
+	rs->krs_pprev = &kr->kr_list;
+	kr->kr_list = rs;
+	kr->kr_byts[kts] = rs;
+
+	kts_set_reactor(kts, kr);
+
+	pthread_mutex_unlock(&kr->kr_m);
+	return(0);
+}
+
+/*
+ * Detach a session from its reactor, a no-op if it has none. Once this
+ * returns the reactor no longer touches the session, unless this is
+ * called from the session's own pass on the reactor, in which case
+ * it is let go as soon as that pass returns.
+ */
+void
+ktli_reactor_detach(int kts)
+{
+	struct ktli_reactor *kr;
+	struct ktli_rsess *rs;
+	int fd;
+
+	kr = kts_reactor(kts);
+	if (!kr)
+		return;
+	kts_set_reactor(kts, NULL);
+
+	/* From a pass on the reactor itself, kr_m is already held */
+	if (pthread_equal(pthread_self(), kr->kr_tid)) {
+		rs = kr->kr_byts[kts];
+		if (rs && !rs->krs_dead) {
+			fd = (rs->krs_fns->ktli_dfns_fd)(rs->krs_dh);
+			(void)epoll_ctl(kr->kr_epfd, EPOLL_CTL_DEL, fd, NULL);
+			rs->krs_dead = 1;
+			kr->kr_ndead++;
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&kr->kr_m);
+	rs = kr->kr_byts[kts];
+	if (rs) {
+		fd = (rs->krs_fns->ktli_dfns_fd)(rs->krs_dh);
+		(void)epoll_ctl(kr->kr_epfd, EPOLL_CTL_DEL, fd, NULL);
+		ktli_rsess_free(kr, rs);
+	}
+	pthread_mutex_unlock(&kr->kr_m);
+}
+
+/*
+ * Tell a session's reactor that KIOs were queued. The reactor raises
+ * kr_idle before its last look at the pending bits, so either it sees
+ * this session's bit or this sees the flag. Only the first to see the
+ * flag writes the eventfd.
+ */
+void
+ktli_reactor_kick(struct ktli_reactor *kr, int kts)
+{
+	uint64_t bit = 1ULL << (kts & 63), one = 1;
+
+	if (__atomic_fetch_or(&kr->kr_pend[kts >> 6], bit, __ATOMIC_SEQ_CST) &
+	    bit)
+		return;		/* Already marked */
+
+	if (__atomic_load_n(&kr->kr_idle, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&kr->kr_idle, 0, __ATOMIC_SEQ_CST))
+		(void)write(kr->kr_efd, &one, sizeof(one));
+}
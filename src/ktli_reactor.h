@@ -0,0 +1,39 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_REACTOR_H
+#define _KTLI_REACTOR_H
+
+struct ktli_reactor;
+struct ktli_rbuf;
+
+/*
+ * Shared reactor threads servicing the send and receive sides of many
+ * sessions, see ktli_reactor.c.
+ */
+extern int  ktli_reactor_attach(int kts, struct ktli_driver_fns *fns,
+				void *dh);
+extern void ktli_reactor_detach(int kts);
+extern void ktli_reactor_kick(struct ktli_reactor *kr, int kts);
+
+/*
+ * Per session service passes, see ktli.c. Run by a session's own sender
+ * and receiver threads or by its reactor.
+ */
+extern void ktli_send_pass(int kts, struct kiovec *biov);
+extern int  ktli_recvmsg(int kts, struct ktli_rbuf *rb);
+extern int  ktli_timeout_pass(int kts, int maxms);
+
+#endif /* _KTLI_REACTOR_H */
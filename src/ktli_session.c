@@ -66,6 +66,9 @@ struct kts_session {
 	enum ktli_sstate	kts_state;	/* Session state */
 	int64_t			kts_sequence;	/* Next sequence # */
 	struct ktli_config 	*kts_config;	/* Session configuration*/
+	struct ktli_reactor	*kts_reactor;	/* Servicing reactor, if any */
+	struct ktli_stripe	*kts_stripe;	/* Stripe it belongs to, if any */
+	struct ktli_credits	*kts_credits;	/* Admission credits, if any */
 };
 
 static int kts_table_size = KTS_MAX_SESSIONS;
@@ -96,6 +99,7 @@ kts_alloc_slot()
 		errno = ENOMEM;
 		return(-1);
 	}
+	memset(ks, 0, sizeof(struct kts_session));
 	
 	/* 
 	 * the KTS table is a shared resource and allocations can occur
@@ -148,8 +152,9 @@ kts_clear(int kts)
 	kts_table[kts]->kts_state = KTLI_SSTATE_UNKNOWN;
 	kts_table[kts]->kts_sequence = 0;
 	kts_table[kts]->kts_config = NULL;
-	
-	
+	kts_table[kts]->kts_reactor = NULL;
+	kts_table[kts]->kts_stripe = NULL;
+	kts_table[kts]->kts_credits = NULL;
 }
 
 int
@@ -264,6 +269,27 @@ kts_set_config(int kts, struct ktli_config *cf)
 	kts_table[kts]->kts_config = cf;
 }
 
+void
+kts_set_reactor(int kts, struct ktli_reactor *kr)
+{
+	if (!kts_table[kts]) return;
+	kts_table[kts]->kts_reactor = kr;
+}
+
+void
+kts_set_stripe(int kts, struct ktli_stripe *st)
+{
+	if (!kts_table[kts]) return;
+	kts_table[kts]->kts_stripe = st;
+}
+
+void
+kts_set_credits(int kts, struct ktli_credits *kcr)
+{
+	if (!kts_table[kts]) return;
+	kts_table[kts]->kts_credits = kcr;
+}
+
 /*
  *  *** References
  */
@@ -327,12 +353,39 @@ kts_sequence(int kts)
 	return((kts_table[kts]?kts_table[kts]->kts_sequence:-1));
 }
 
+/* Atomically takes the next sequence #, for concurrent sequencing */
+int64_t
+kts_take_sequence(int kts)
+{
+	if (!kts_table[kts]) return(-1);
+	return(__atomic_fetch_add(&kts_table[kts]->kts_sequence, 1,
+				  __ATOMIC_RELAXED));
+}
+
 struct ktli_config *
 kts_config(int kts)
 {
 	return((kts_table[kts]?kts_table[kts]->kts_config:NULL));
 }
 
+struct ktli_reactor *
+kts_reactor(int kts)
+{
+	return((kts_table[kts]?kts_table[kts]->kts_reactor:NULL));
+}
+
+struct ktli_stripe *
+kts_stripe(int kts)
+{
+	return((kts_table[kts]?kts_table[kts]->kts_stripe:NULL));
+}
+
+struct ktli_credits *
+kts_credits(int kts)
+{
+	return((kts_table[kts]?kts_table[kts]->kts_credits:NULL));
+}
+
 int
 kts_max_sessions()
 {
@@ -16,6 +16,9 @@
 #ifndef _KTLI_SESSION_H
 #define _KTLI_SESSION_H
 
+struct ktli_reactor;
+struct ktli_stripe;
+struct ktli_credits;
 
 extern void kts_init();
 extern int  kts_alloc_slot();
@@ -46,6 +49,9 @@ extern void kts_set_receiver(int kts, pthread_t tid);
 extern void kts_set_state(int kts, enum ktli_sstate state);
 extern void kts_set_sequence(int kts, int64_t sequence);
 extern void kts_set_config(int kts, struct ktli_config *cf);
+extern void kts_set_reactor(int kts, struct ktli_reactor *kr);
+extern void kts_set_stripe(int kts, struct ktli_stripe *st);
+extern void kts_set_credits(int kts, struct ktli_credits *kcr);
 
 extern struct ktli_driver * kts_driver(int kts);
 extern void * kts_dhandle(int kts);
@@ -57,7 +63,11 @@ extern pthread_t kts_sender(int kts);
 extern pthread_t kts_receiver(int kts);
 extern enum ktli_sstate kts_state(int kts);
 extern int64_t kts_sequence(int kts);
+extern int64_t kts_take_sequence(int kts);
 extern struct ktli_config *kts_config(int kts);
+extern struct ktli_reactor *kts_reactor(int kts);
+extern struct ktli_stripe *kts_stripe(int kts);
+extern struct ktli_credits *kts_credits(int kts);
 
 extern int kts_max_sessions();
 extern int kts_isvalid(int kts);
@@ -33,12 +33,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <sys/uio.h>
+#include <linux/errqueue.h>
 
-//#define KTLI_ZEROCOPY 1
+/* Zero copy ABI, for headers that predate it */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY			60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY			0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+/* Busy poll ABI, likewise */
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL			46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL		69
+#endif
 
 #include "kinetic.h"
 #include "ktli.h"
+#include "ktli_socket.h"
 
 static void * ktli_socket_open();
 static int ktli_socket_close(void *dh);
@@ -47,6 +70,29 @@ static int ktli_socket_disconnect(void *dh);
 static int ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt);
 static int ktli_socket_receive(void *dh, struct kiovec *msg, int msgcnt);
 static int ktli_socket_poll(void *dh, int timeout);
+static int ktli_socket_tune(void *dh, struct ktli_config *cf);
+static int ktli_socket_recvsome(void *dh, void *buf, size_t len);
+static int ktli_socket_sendzc(void *dh, struct kiovec *msg, int msgcnt,
+			      uint64_t *zct);
+static uint64_t ktli_socket_zcdone(void *dh);
+static int ktli_socket_fd(void *dh);
+
+/*
+ * Partial transfer tuning defaults, see ktli_socket_wait().
+ * Override per session with kcfg_iospin, kcfg_iowait and kcfg_iostall.
+ */
+#define KTLI_SOCK_IOSPIN	8		/* EAGAIN retries */
+#define KTLI_SOCK_IOWAIT	10		/* ms per poll(2) */
+#define KTLI_SOCK_IOSTALL	(KIO_TIMEOUT_S * 1000) /* ms */
+
+/*
+ * Sends smaller than this are copied even with zero copy enabled, pinning
+ * pages and collecting the notification costs more than the copy.
+ */
+#define KTLI_SOCK_ZCMIN		(16 * 1024)
+
+/* us the kernel busy polls the device queue for a busy poll session */
+#define KTLI_SOCK_BUSYPOLL	50
 
 struct ktli_driver_fns socket_fns = {
 	.ktli_dfns_open		= ktli_socket_open,
@@ -56,26 +102,106 @@ struct ktli_driver_fns socket_fns = {
 	.ktli_dfns_send		= ktli_socket_send,
 	.ktli_dfns_receive	= ktli_socket_receive,
 	.ktli_dfns_poll		= ktli_socket_poll,
+	.ktli_dfns_tune		= ktli_socket_tune,
+	.ktli_dfns_recvsome	= ktli_socket_recvsome,
+	.ktli_dfns_sendzc	= ktli_socket_sendzc,
+	.ktli_dfns_zcdone	= ktli_socket_zcdone,
+	.ktli_dfns_fd		= ktli_socket_fd,
 };
 
 static void *
 ktli_socket_open()
 {
-	int *dd;
+	struct ktli_sock *sk;
 
-	dd = malloc(sizeof(int));
-	if (!dd) {
+	sk = malloc(sizeof(struct ktli_sock));
+	if (!sk) {
 		errno = ENOMEM;
 		return(NULL);
 	}
+	memset(sk, 0, sizeof(struct ktli_sock));
 
 	/*
 	 * This is just a place holder file descriptor, real work is done
 	 * in ktli_socket_connect() and dup-ed to this descriptor.
 	 * ipv4 and ipv6 are both supported.
 	 */
-	*dd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	return((void *)dd);
+	sk->ksk_fd    = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sk->ksk_spin  = KTLI_SOCK_IOSPIN;
+	sk->ksk_wait  = KTLI_SOCK_IOWAIT;
+	sk->ksk_stall = KTLI_SOCK_IOSTALL;
+	sk->ksk_zcmin = KTLI_SOCK_ZCMIN;
+	return((void *)sk);
+}
+
+static int
+ktli_socket_tune(void *dh, struct ktli_config *cf)
+{
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
+
+	if (!dh || !cf) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	if (cf->kcfg_iospin)
+		sk->ksk_spin  = cf->kcfg_iospin;
+	if (cf->kcfg_iowait)
+		sk->ksk_wait  = cf->kcfg_iowait;
+	if (cf->kcfg_iostall)
+		sk->ksk_stall = cf->kcfg_iostall;
+
+	/* Zero copy is turned on at connect, if the kernel allows */
+	sk->ksk_zc = !!(cf->kcfg_flags & KCFF_ZEROCOPY);
+
+	/* As is busy polling */
+	sk->ksk_busy = !!(cf->kcfg_flags & KCFF_BUSYPOLL);
+
+	return(0);
+}
+
+/*
+ * Called when a partial send or receive got EAGAIN. The first ksk_spin
+ * retries return straight away so that a transfer that is about to make
+ * progress does not pay for a poll(2). After that, block in poll(2) for
+ * events, ksk_wait ms at a time, instead of spinning on the socket.
+ * *spins and *stalled carry the state of the current stall, callers
+ * zero them whenever the transfer makes progress.
+ *
+ * Returns 0 to retry the transfer, -1 with errno set to ETIMEDOUT once
+ * the socket has made no progress for ksk_stall ms.
+ */
+static int
+ktli_socket_wait(struct ktli_sock *sk, short events,
+		 uint32_t *spins, uint32_t *stalled)
+{
+	struct pollfd pfd;
+	int rc;
+
+	if ((*spins)++ < sk->ksk_spin)
+		return(0);
+
+	pfd.fd = sk->ksk_fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	rc = poll(&pfd, 1, sk->ksk_wait);
+	if (rc < 0 && errno != EINTR)
+		return(-1);
+
+	if (rc == 0) {
+		*stalled += sk->ksk_wait;
+		if (*stalled >= sk->ksk_stall) {
+			errno = ETIMEDOUT;
+			return(-1);
+		}
+	}
+
+	/*
+	 * Ready, interrupted or still waiting. Errors and hangups show up
+	 * in revents too, let the retried transfer report them.
+	 */
+	return(0);
 }
 
 static int
@@ -87,7 +213,7 @@ ktli_socket_close(void *dh)
 		errno = -EINVAL;
 		return(-1);
 	}
-	dd = *(int *)dh;
+	dd = ((struct ktli_sock *)dh)->ksk_fd;
 
 	/* Ignoring close errs, could end up with a descriptor leak */
 	close(dd);
@@ -99,6 +225,7 @@ ktli_socket_close(void *dh)
 int
 ktli_socket_connect(void *dh, char *host, char *port, int usetls)
 {
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int dd, sfd, rc, on = 1, MiB, flags;
@@ -107,7 +234,7 @@ ktli_socket_connect(void *dh, char *host, char *port, int usetls)
 		errno = -EINVAL;
 		return (-1);
 	}
-	dd = *(int *)dh;
+	dd = sk->ksk_fd;
 
 	/* for now TLS not supported, may be another driver, maybe not */
 	if (usetls) {
@@ -138,17 +265,14 @@ ktli_socket_connect(void *dh, char *host, char *port, int usetls)
                if (sfd == -1)
                    continue;
 
-#ifdef KTLI_ZEROCOPY
 	       /*
 		* On some systems this must be done before
-		* the socket is connected
+		* the socket is connected. Without kernel
+		* support every send is simply copied.
 		*/
-	       /* printf("ZeroCopy: Enabled\n"); */
-	       if (setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
-		       perror("setsockopt zerocopy failed");
-#else
-	       /* printf("ZeroCopy: Disabled\n");*/
-#endif
+	       if (sk->ksk_zc &&
+		   setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
+		       sk->ksk_zc = 0;
 
                if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
                    break;                  /* Success */
@@ -217,6 +341,22 @@ ktli_socket_connect(void *dh, char *host, char *port, int usetls)
 	   if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)))
 		   printf("setsockopt tcp_nodelay");
 
+	   /*
+	    * Busy polling has receives spin on the device queue rather than
+	    * wait for the interrupt. Raising SO_BUSY_POLL past the
+	    * net.core.busy_read sysctl needs CAP_NET_ADMIN and
+	    * SO_PREFER_BUSY_POLL needs a 5.11 kernel, without them the
+	    * receiver still spins, in user space.
+	    */
+	   if (sk->ksk_busy) {
+		   int us = KTLI_SOCK_BUSYPOLL;
+
+		   (void)setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL,
+				    &us, sizeof(us));
+		   (void)setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+				    &on, sizeof(on));
+	   }
+
 	   flags = fcntl(sfd, F_GETFL, 0);
 	   if (flags == -1) {
 		   return(-1);
@@ -243,26 +383,41 @@ ktli_socket_disconnect(void *dh)
 		return(-1);
 	}
 
-	dd = *(int *)dh;
+	dd = ((struct ktli_sock *)dh)->ksk_fd;
 	rc = shutdown(dd, SHUT_RDWR);
 
 	return(rc);
 }
 
-int
-ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
+/*
+ * Zero copy send room. The notifications of at most KSK_ZCWIN sends are
+ * tracked, see ktli_socket_zcreap(), sends beyond that are copied.
+ */
+static int
+ktli_socket_zcroom(struct ktli_sock *sk)
+{
+	return((sk->ksk_zcsent -
+		__atomic_load_n(&sk->ksk_zcdone, __ATOMIC_ACQUIRE)) < KSK_ZCWIN);
+}
+
+/*
+ * Send a message, with MSG_ZEROCOPY if zc is set and the send is big
+ * enough. Each zero copy sendmsg(2) that takes data is given the next
+ * notification id by the kernel, ksk_zcsent counts them. *zct, if given,
+ * gets ksk_zcsent after the last of them, 0 when all of it was copied.
+ */
+static int
+ktli_socket_sendv(struct ktli_sock *sk, struct kiovec *msg, int msgcnt,
+		  int zc, uint64_t *zct)
 {
-#ifdef KTLI_ZEROCOPY
 	struct msghdr hdr = {NULL, 0, NULL, 0, NULL, 0, 0};
-#endif
 	struct iovec *iov;
-	int i, len, dd, iovs, curv, bw, tbw, cnt;
+	int i, len, dd, iovs, curv, bw, tbw, cnt, flags, zsent = 0;
+	uint32_t spins = 0, stalled = 0;
 
-	if (!dh || !msgcnt) {
-		errno = -EINVAL;
-		return(-1);
-	}
-	dd = *(int *)dh;
+	if (zct)
+		*zct = 0;
+	dd = sk->ksk_fd;
 
 	/*
 	 * Copy the kiov to a std iov for use with writev
@@ -283,6 +438,10 @@ ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
 	}
 	iovs = msgcnt;
 
+	/* Small sends are cheaper to copy */
+	zc = zc && __atomic_load_n(&sk->ksk_zc, __ATOMIC_RELAXED) &&
+		(len >= sk->ksk_zcmin);
+
 	/*
 	 * NONBLOCKING sockets can do partial writes, handle em
 	 * init the current vector and total bytes read,
@@ -290,13 +449,14 @@ ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
 	 * then loop until complete
 	 */
 	for (curv=0,tbw=0,cnt=1;;cnt++) {
-#ifdef KTLI_ZEROCOPY
-		hdr.msg_iov = &iov[curv];
-		hdr.msg_iovlen = iovs-curv;
-		bw = sendmsg(dd, &hdr, MSG_ZEROCOPY);
-#else
-		bw = writev(dd, &iov[curv], iovs-curv);
-#endif
+		flags = (zc && ktli_socket_zcroom(sk)) ? MSG_ZEROCOPY : 0;
+		if (flags) {
+			hdr.msg_iov = &iov[curv];
+			hdr.msg_iovlen = iovs-curv;
+			bw = sendmsg(dd, &hdr, flags);
+		} else {
+			bw = writev(dd, &iov[curv], iovs-curv);
+		}
 		if (bw <= 0) {
 			/*
 			 * Although EAGAIN and EWOULDBLOCK are equivalent,
@@ -307,21 +467,44 @@ ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
 			 * EINTR should also be handled in case the system
 			 * call is interupted by a signal
 			 */
-			if ((errno == EAGAIN)	   ||  	/* Not ready */
-			    (errno == EWOULDBLOCK) ||  	/* Not ready */
-			    (errno == EINTR)) {		/* Intr by signal */
+			if (errno == EINTR) {		/* Intr by signal */
 				bw = 0;
 				continue;
-			} else {
-				/*
-				 * Not a retry-able error break out,
-				 * we check the error outside of the loop
-				 */
-				break;
 			}
+
+			/* Out of notification memory, copy the rest */
+			if (flags && (errno == ENOBUFS)) {
+				bw = 0;
+				zc = 0;
+				continue;
+			}
+
+			if ((errno == EAGAIN)	   ||  	/* Not ready */
+			    (errno == EWOULDBLOCK)) {  	/* Not ready */
+				/* Socket buffer full, wait for room */
+				bw = 0;
+				if (!ktli_socket_wait(sk, POLLOUT,
+						      &spins, &stalled))
+					continue;
+				bw = -1;
+			}
+
+			/*
+			 * Not a retry-able error break out,
+			 * we check the error outside of the loop
+			 */
+			break;
 		}
 
 		tbw += bw;
+		spins = stalled = 0;
+
+		/* Took data, so the kernel used up a notification id */
+		if (flags) {
+			__atomic_store_n(&sk->ksk_zcsent, sk->ksk_zcsent + 1,
+					 __ATOMIC_RELEASE);
+			zsent = 1;
+		}
 
 #if KTLI_CORK && !defined(__APPLE__)
 		/* Putting this here, so that it's defined when needed,
@@ -366,23 +549,171 @@ ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
 	}
 
 	free(iov);
+	if (zct && zsent)
+		*zct = sk->ksk_zcsent;
 	return(tbw);
 }
 
+int
+ktli_socket_send(void *dh, struct kiovec *msg, int msgcnt)
+{
+	if (!dh || !msgcnt) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	return(ktli_socket_sendv((struct ktli_sock *)dh, msg, msgcnt, 0, NULL));
+}
+
+/*
+ * Send a message with MSG_ZEROCOPY, the kernel transmits straight from
+ * the message buffers, which must stay untouched until the send's token,
+ * returned in *zct, is reported done by ktli_socket_zcdone(). Sends
+ * smaller than ksk_zcmin, sends past KSK_ZCWIN outstanding ones and all
+ * sends on a socket without zero copy are copied, with a token of 0 when
+ * nothing at all went zero copy.
+ */
+static int
+ktli_socket_sendzc(void *dh, struct kiovec *msg, int msgcnt, uint64_t *zct)
+{
+	if (!dh || !msgcnt || !zct) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	return(ktli_socket_sendv((struct ktli_sock *)dh, msg, msgcnt, 1, zct));
+}
+
+/*
+ * Collect zero copy notifications from the socket error queue. Each one
+ * covers an inclusive range of 32 bit notification ids, [ee_info, ee_data].
+ * Ranges usually arrive in order but are not guaranteed to, so completed
+ * ids past ksk_zcdone are marked in the ksk_zcbits window and ksk_zcdone
+ * advances over the marked run. A notification flagged as copied means
+ * the kernel could not avoid the copy on this route, loopback for one,
+ * zero copy then only adds cost and is turned off.
+ *
+ * Only one thread collects at a time, others return straight away.
+ * Returns the number of notifications collected, or 1 if another thread
+ * is collecting.
+ */
+static int
+ktli_socket_zcreap(struct ktli_sock *sk)
+{
+	char ctl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			    sizeof(struct sockaddr_in6))];
+	struct sock_extended_err *ee;
+	struct cmsghdr *cm;
+	struct msghdr hdr;
+	uint64_t done, id, last;
+	uint32_t slot;
+	int n = 0;
+
+	if (!__atomic_load_n(&sk->ksk_zcsent, __ATOMIC_ACQUIRE))
+		return(0);
+
+	if (__sync_lock_test_and_set(&sk->ksk_zcreap, 1))
+		return(1);
+
+	done = sk->ksk_zcdone;
+	for (;;) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_control    = ctl;
+		hdr.msg_controllen = sizeof(ctl);
+		if (recvmsg(sk->ksk_fd, &hdr, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;		/* EAGAIN, queue is empty */
+		}
+
+		for (cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+			if (!(((cm->cmsg_level == SOL_IP) &&
+			       (cm->cmsg_type == IP_RECVERR)) ||
+			      ((cm->cmsg_level == SOL_IPV6) &&
+			       (cm->cmsg_type == IPV6_RECVERR))))
+				continue;
+
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if ((ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) ||
+			    ee->ee_errno)
+				continue;
+			n++;
+
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				__atomic_store_n(&sk->ksk_zc, 0,
+						 __ATOMIC_RELAXED);
+
+			/* Place the 32 bit ids relative to done */
+			id   = done + (uint32_t)(ee->ee_info - (uint32_t)done);
+			last = done + (uint32_t)(ee->ee_data - (uint32_t)done);
+			if ((last - done) >= KSK_ZCWIN)
+				continue;	/* Stale, already done */
+
+			for (; id <= last; id++) {
+				slot = id % KSK_ZCWIN;
+				sk->ksk_zcbits[slot / 64] |= 1ULL << (slot % 64);
+			}
+		}
+
+		/* Advance over the completed run */
+		for (;;) {
+			slot = done % KSK_ZCWIN;
+			if (!(sk->ksk_zcbits[slot / 64] & (1ULL << (slot % 64))))
+				break;
+			sk->ksk_zcbits[slot / 64] &= ~(1ULL << (slot % 64));
+			done++;
+		}
+	}
+
+	__atomic_store_n(&sk->ksk_zcdone, done, __ATOMIC_RELEASE);
+	__sync_lock_release(&sk->ksk_zcreap);
+	return(n);
+}
+
+/*
+ * Returns the zero copy token up to which all sends are done with their
+ * buffers, collecting any waiting notifications first.
+ */
+static uint64_t
+ktli_socket_zcdone(void *dh)
+{
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
+
+	if (__atomic_load_n(&sk->ksk_zcdone, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&sk->ksk_zcsent, __ATOMIC_ACQUIRE))
+		(void)ktli_socket_zcreap(sk);
+
+	return(__atomic_load_n(&sk->ksk_zcdone, __ATOMIC_ACQUIRE));
+}
+
+/* The socket itself, ktli_socket_poll() polls nothing else */
+static int
+ktli_socket_fd(void *dh)
+{
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	return(((struct ktli_sock *)dh)->ksk_fd);
+}
+
 /*
  * Receive a message into a pre-allocated kiovec array.
  */
 int
 ktli_socket_receive(void *dh, struct kiovec *msg, int msgcnt)
 {
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
 	struct iovec *iov;
 	int i, len, dd, iovs, curv, br, tbr, cnt;
+	uint32_t spins = 0, stalled = 0;
 
 	if (!dh || !msgcnt) {
 		errno = -EINVAL;
 		return(-1);
 	}
-	dd = *(int *) dh;
+	dd = sk->ksk_fd;
 
 	/*
 	 * Copy the kiov to a std iov for use with readv
@@ -420,22 +751,32 @@ ktli_socket_receive(void *dh, struct kiovec *msg, int msgcnt)
 			 * EINTR should also be handled in case the system
 			 * call is interupted by a signal
 			 */
-			if ((errno == EAGAIN)	   ||  	/* Not ready */
-			    (errno == EWOULDBLOCK) ||  	/* Not ready */
-			    (errno == EINTR)) {		/* Intr by signal */
+			if (br < 0 && errno == EINTR) {	/* Intr by signal */
 				br = 0;
 				continue;
-			} else {
-				/*
-				 * we check the error outside of the loop
-				 * br < 0, errno has the error,
-				 * br = 0 is EOF, Socket has been closed
-				 */
-				break;
 			}
+
+			if (br < 0 &&
+			    ((errno == EAGAIN)	   ||  	/* Not ready */
+			     (errno == EWOULDBLOCK))) { /* Not ready */
+				/* Rest of the message not here yet, wait */
+				br = 0;
+				if (!ktli_socket_wait(sk, POLLIN,
+						      &spins, &stalled))
+					continue;
+				br = -1;
+			}
+
+			/*
+			 * we check the error outside of the loop
+			 * br < 0, errno has the error,
+			 * br = 0 is EOF, Socket has been closed
+			 */
+			break;
 		}
 
 		tbr += br;
+		spins = stalled = 0;
 
 		/* run through the io vectors that can be fully consumed */
 		while ((curv < iovs) && (br >= iov[curv].iov_len))
@@ -472,9 +813,36 @@ ktli_socket_receive(void *dh, struct kiovec *msg, int msgcnt)
 	return(tbr);
 }
 
+/*
+ * Receive whatever is waiting on the socket, at most len bytes, in a
+ * single read. The socket is nonblocking, EAGAIN is returned to the caller
+ * when nothing is waiting.
+ */
+static int
+ktli_socket_recvsome(void *dh, void *buf, size_t len)
+{
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
+	ssize_t br;
+
+	if (!dh || !buf || !len) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	do {
+		br = read(sk->ksk_fd, buf, len);
+	} while (br < 0 && errno == EINTR);
+
+	return((int)br);
+}
+
 int
 ktli_socket_poll(void *dh, int timeout)
 {
+	struct ktli_sock *sk = (struct ktli_sock *)dh;
 	int rc;
 	struct pollfd pfd;
 
@@ -483,7 +851,7 @@ ktli_socket_poll(void *dh, int timeout)
 		return(-1);
 	}
 
-	pfd.fd = *(int *)dh;
+	pfd.fd = sk->ksk_fd;
 	pfd.events = POLLIN;
 
 	rc = poll(&pfd, 1, timeout);
@@ -494,6 +862,10 @@ ktli_socket_poll(void *dh, int timeout)
 		return(-1);
 	}
 
+	/* Zero copy notifications raise POLLERR, collect them */
+	if (rc && (pfd.revents & POLLERR) && (ktli_socket_zcreap(sk) > 0))
+		pfd.revents &= ~POLLERR;
+
 	/* received a hangup */
 	if (rc && pfd.revents & POLLHUP) {
 		errno = ECONNABORTED;
@@ -505,13 +877,11 @@ ktli_socket_poll(void *dh, int timeout)
 		return(1);
 
 	/* some event occurred but not one we were looking for */
-#ifdef KTLI_ZEROCOPY
-#else
-	if (rc) {
+	if (rc && pfd.revents) {
 		errno = ENOMSG;
 		return(-1);
 	}
-#endif
+
 	/* Timed out */
 	return(0);
 
@@ -0,0 +1,45 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_SOCKET_H
+#define _KTLI_SOCKET_H
+
+/*
+ * Socket driver handle. Exported so that other drivers, see ktli_uring.c,
+ * can reuse the socket driver to set up and tear down the connection and
+ * then do the I/O their own way on ksk_fd.
+ */
+/* Zero copy sends outstanding at most, see ktli_socket_sendzc() */
+#define KSK_ZCWIN	1024
+
+struct ktli_sock {
+	int		ksk_fd;		/* Socket descriptor */
+	uint32_t	ksk_spin;	/* EAGAIN retries before blocking */
+	uint32_t	ksk_wait;	/* ms per blocking readiness wait */
+	uint32_t	ksk_stall;	/* ms without progress before failing */
+	int		ksk_busy;	/* Busy poll the socket, see KCFF_BUSYPOLL */
+
+	/* Zero copy sends, zeroed when unused */
+	int		ksk_zc;		/* Zero copy enabled */
+	uint32_t	ksk_zcmin;	/* Smaller sends are copied */
+	uint64_t	ksk_zcsent;	/* Zero copy sends issued */
+	uint64_t	ksk_zcdone;	/* All sends before this one are done */
+	uint64_t	ksk_zcbits[KSK_ZCWIN / 64]; /* Done past ksk_zcdone */
+	int		ksk_zcreap;	/* Notification collection lock */
+};
+
+extern struct ktli_driver_fns socket_fns;
+
+#endif /* _KTLI_SOCKET_H */
@@ -0,0 +1,261 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * ***** Kinetic Transport Layer Interface Timing Wheel
+ * KIOs waiting on a response carry a deadline, in milliseconds of
+ * KIO_CLOCK. Rather than periodically scanning every KIO on the receive
+ * queue for exhausted deadlines, the receive queue keeps them on this
+ * hierarchical timing wheel.
+ *
+ * Level 0 has 256 one millisecond slots. Each of the 3 upper levels has 64
+ * slots, each slot covering a full turn of the level below it. So the wheel
+ * spans 2^26ms, about 18.6 hours, longer deadlines are clamped. A KIO is
+ * hung on the slot for its deadline on the lowest level that can hold it.
+ * Whenever level 0 wraps, the next slot of the level above is cascaded,
+ * its KIOs are rehung on lower levels. Insert and cancel are O(1) and
+ * expiry only visits the slots that are due.
+ *
+ * KIOs are chained through kio_twnext/kio_twpprev, a NULL kio_twpprev means
+ * the KIO is not on the wheel. The wheel is not locked, the caller must
+ * hold the receive queue mutex.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ktli.h"
+#include "ktli_twheel.h"
+
+#define KTW_L0BITS	8
+#define KTW_LNBITS	6
+#define KTW_LEVELS	4
+#define KTW_L0SIZE	(1 << KTW_L0BITS)
+#define KTW_LNSIZE	(1 << KTW_LNBITS)
+#define KTW_L0MASK	(KTW_L0SIZE - 1)
+#define KTW_LNMASK	(KTW_LNSIZE - 1)
+#define KTW_NSLOTS	(KTW_L0SIZE + (KTW_LEVELS - 1) * KTW_LNSIZE)
+
+/* Bits of the deadline below level _l */
+#define KTW_SHIFT(_l)	(KTW_L0BITS + ((_l) - 1) * KTW_LNBITS)
+
+/* Longest deadline the wheel can hold */
+#define KTW_MAXDELTA	((1ULL << KTW_SHIFT(KTW_LEVELS)) - 1)
+
+/* Slot on level _l (>=1) for deadline _e */
+#define KTW_LNSLOT(_tw, _l, _e)						\
+	(&(_tw)->ktw_slots[KTW_L0SIZE + ((_l) - 1) * KTW_LNSIZE +	\
+			   (((_e) >> KTW_SHIFT(_l)) & KTW_LNMASK)])
+
+int
+ktli_tw_init(struct ktli_twheel *tw)
+{
+	struct timespec now;
+
+	tw->ktw_slots = malloc(sizeof(struct kio *) * KTW_NSLOTS);
+	if (!tw->ktw_slots) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	memset(tw->ktw_slots, 0, sizeof(struct kio *) * KTW_NSLOTS);
+
+	clock_gettime(KIO_CLOCK, &now);
+	tw->ktw_now = KTW_TS2MS(&now);
+	tw->ktw_cnt = 0;
+	return(0);
+}
+
+void
+ktli_tw_destroy(struct ktli_twheel *tw)
+{
+	if (tw->ktw_slots)
+		free(tw->ktw_slots);
+	tw->ktw_slots = NULL;
+	tw->ktw_cnt   = 0;
+}
+
+/* Forget every KIO, used when the whole receive queue is flushed */
+void
+ktli_tw_clear(struct ktli_twheel *tw)
+{
+	int i;
+	struct kio *kio;
+
+	if (!tw->ktw_slots)
+		return;
+
+	for (i = 0; i < KTW_NSLOTS; i++) {
+		for (kio = tw->ktw_slots[i]; kio; kio = kio->kio_twnext)
+			kio->kio_twpprev = NULL;
+		tw->ktw_slots[i] = NULL;
+	}
+	tw->ktw_cnt = 0;
+}
+
+/* Hang kio on the slot for its deadline, relative to the current tick */
+static void
+ktli_tw_hang(struct ktli_twheel *tw, struct kio *kio)
+{
+	struct kio **slot;
+	uint64_t exp, delta;
+	int l;
+
+	exp = kio->kio_twexp;
+	if (exp < tw->ktw_now)
+		exp = tw->ktw_now;	/* Already due, expire next tick */
+	delta = exp - tw->ktw_now;
+	if (delta > KTW_MAXDELTA) {
+		exp = tw->ktw_now + KTW_MAXDELTA;
+		delta = KTW_MAXDELTA;
+	}
+
+	if (delta < KTW_L0SIZE) {
+		slot = &tw->ktw_slots[exp & KTW_L0MASK];
+	} else {
+		for (l = 1; delta >= (1ULL << KTW_SHIFT(l + 1)); l++)
+			;
+		slot = KTW_LNSLOT(tw, l, exp);
+	}
+
+	kio->kio_twnext = *slot;
+	if (*slot)
+		(*slot)->kio_twpprev = &kio->kio_twnext;
+	kio->kio_twpprev = slot;
+	*slot = kio;
+}
+
+static void
+ktli_tw_unhang(struct kio *kio)
+{
+	*kio->kio_twpprev = kio->kio_twnext;
+	if (kio->kio_twnext)
+		kio->kio_twnext->kio_twpprev = kio->kio_twpprev;
+	kio->kio_twnext  = NULL;
+	kio->kio_twpprev = NULL;
+}
+
+/* expires is an absolute deadline in ms of KIO_CLOCK, see KTW_TS2MS */
+void
+ktli_tw_insert(struct ktli_twheel *tw, struct kio *kio, uint64_t expires)
+{
+	if (!tw->ktw_slots)
+		return;
+
+	if (kio->kio_twpprev)
+		ktli_tw_cancel(tw, kio);
+
+	kio->kio_twexp = expires;
+	ktli_tw_hang(tw, kio);
+	tw->ktw_cnt++;
+}
+
+/* Safe to call for a KIO that is not on the wheel, or on an unused wheel */
+void
+ktli_tw_cancel(struct ktli_twheel *tw, struct kio *kio)
+{
+	if (!tw->ktw_slots || !kio->kio_twpprev)
+		return;
+
+	ktli_tw_unhang(kio);
+	tw->ktw_cnt--;
+}
+
+/* Rehang every KIO in a level _l slot, returns the slot index */
+static int
+ktli_tw_cascade(struct ktli_twheel *tw, int l)
+{
+	struct kio **slot, *kio, *next;
+	int idx;
+
+	idx  = (tw->ktw_now >> KTW_SHIFT(l)) & KTW_LNMASK;
+	slot = KTW_LNSLOT(tw, l, tw->ktw_now);
+
+	kio = *slot;
+	*slot = NULL;
+	for (; kio; kio = next) {
+		next = kio->kio_twnext;
+		kio->kio_twpprev = NULL;
+		ktli_tw_hang(tw, kio);
+	}
+	return(idx);
+}
+
+/*
+ * Advance the wheel to now, a time in ms of KIO_CLOCK. Every KIO whose
+ * deadline has passed is taken off the wheel and returned as a chain
+ * linked through kio_twnext, NULL if nothing expired.
+ */
+struct kio *
+ktli_tw_expire(struct ktli_twheel *tw, uint64_t now)
+{
+	struct kio *expired = NULL, *kio, **slot;
+	int l;
+
+	if (!tw->ktw_slots)
+		return(NULL);
+
+	while (tw->ktw_now <= now) {
+		/* Nothing pending, jump straight to now */
+		if (!tw->ktw_cnt) {
+			tw->ktw_now = now + 1;
+			break;
+		}
+
+		/* Level 0 wrapped, cascade down from the levels above */
+		if (!(tw->ktw_now & KTW_L0MASK)) {
+			for (l = 1; l < KTW_LEVELS; l++) {
+				if (ktli_tw_cascade(tw, l))
+					break;
+			}
+		}
+
+		slot = &tw->ktw_slots[tw->ktw_now & KTW_L0MASK];
+		while ((kio = *slot)) {
+			ktli_tw_unhang(kio);
+			tw->ktw_cnt--;
+			kio->kio_twnext = expired;
+			expired = kio;
+		}
+
+		tw->ktw_now++;
+	}
+
+	return(expired);
+}
+
+/*
+ * Returns the number of ms, at most max, until the next level 0 slot that
+ * holds a KIO. This lets the receiver size its poll timeout to the next
+ * deadline. A cascade may move KIOs into level 0, so never look past one.
+ */
+int
+ktli_tw_next(struct ktli_twheel *tw, int max)
+{
+	uint64_t t;
+	int ms;
+
+	if (!tw->ktw_slots || !tw->ktw_cnt)
+		return(max);
+
+	/* ktw_now is the next tick to be processed, it is due in 1ms */
+	for (ms = 1, t = tw->ktw_now; ms < max; ms++, t++) {
+		if (!(t & KTW_L0MASK) || tw->ktw_slots[t & KTW_L0MASK])
+			break;
+	}
+	return(ms);
+}
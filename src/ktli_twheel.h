@@ -0,0 +1,33 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#ifndef _KTLI_TWHEEL_H
+#define _KTLI_TWHEEL_H
+
+/* Converts a KIO_CLOCK timespec into timing wheel ticks, 1 tick = 1ms */
+#define KTW_TS2MS(_ts) \
+	((uint64_t)(_ts)->tv_sec * 1000 + (uint64_t)(_ts)->tv_nsec / 1000000)
+
+extern int  ktli_tw_init(struct ktli_twheel *tw);
+extern void ktli_tw_destroy(struct ktli_twheel *tw);
+extern void ktli_tw_clear(struct ktli_twheel *tw);
+
+extern void ktli_tw_insert(struct ktli_twheel *tw, struct kio *kio,
+			   uint64_t expires);
+extern void ktli_tw_cancel(struct ktli_twheel *tw, struct kio *kio);
+extern struct kio *ktli_tw_expire(struct ktli_twheel *tw, uint64_t now);
+extern int  ktli_tw_next(struct ktli_twheel *tw, int max);
+
+#endif /* _KTLI_TWHEEL_H */
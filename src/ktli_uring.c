@@ -0,0 +1,572 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * KTLI io_uring Driver
+ *
+ * Built only with "make URING=1", needs liburing 2.4 or later.
+ *
+ * The TCP connection itself is set up and torn down by the socket driver,
+ * this driver only replaces the data path. KTLI calls send from the
+ * sender thread and poll/receive from the receiver thread, so each side
+ * gets its own ring and no locking is needed between them.
+ *
+ * Sends: the message iovecs are split into IORING_OP_SENDMSG SQEs of at
+ * most IOV_MAX vectors each, linked so they go out in order, and the
+ * whole batch is submitted and waited for with a single syscall.
+ *
+ * Receives: one multishot IORING_OP_RECV stays armed on the socket and
+ * the kernel fills buffers picked from a provided buffer ring that is
+ * registered with the receive ring. Filled buffers are staged in arrival
+ * order, receive copies out of them into the caller's kiovecs and hands
+ * each buffer back to the ring once it is consumed. Poll is driven by
+ * receive ring completions rather than poll(2).
+ *
+ * Values are caller owned and change with every request, so they are
+ * not registered with the kernel, registering them per request would
+ * cost more than the copy it saves.
+ */
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <liburing.h>
+
+#include "kinetic.h"
+#include "ktli.h"
+#include "ktli_socket.h"
+
+static void * ktli_uring_open();
+static int ktli_uring_close(void *dh);
+static int ktli_uring_connect(void *dh, char *host, char *port, int usetls);
+static int ktli_uring_disconnect(void *dh);
+static int ktli_uring_send(void *dh, struct kiovec *msg, int msgcnt);
+static int ktli_uring_receive(void *dh, struct kiovec *msg, int msgcnt);
+static int ktli_uring_poll(void *dh, int timeout);
+static int ktli_uring_tune(void *dh, struct ktli_config *cf);
+static int ktli_uring_recvsome(void *dh, void *buf, size_t len);
+
+struct ktli_driver_fns uring_fns = {
+	.ktli_dfns_open		= ktli_uring_open,
+	.ktli_dfns_close	= ktli_uring_close,
+	.ktli_dfns_connect	= ktli_uring_connect,
+	.ktli_dfns_disconnect	= ktli_uring_disconnect,
+	.ktli_dfns_send		= ktli_uring_send,
+	.ktli_dfns_receive	= ktli_uring_receive,
+	.ktli_dfns_poll		= ktli_uring_poll,
+	.ktli_dfns_tune		= ktli_uring_tune,
+	.ktli_dfns_recvsome	= ktli_uring_recvsome,
+};
+
+#define KUR_SDEPTH	32		/* Send ring entries, SQEs per batch */
+#define KUR_RDEPTH	8		/* Receive ring entries */
+#define KUR_NBUFS	64		/* Provided receive buffers, power of 2 */
+#define KUR_BUFSZ	(32 * 1024)	/* Size of each receive buffer */
+#define KUR_BGID	0		/* Provided buffer group id */
+
+/* A filled receive buffer, staged until receive consumes it */
+struct kur_rbuf {
+	uint16_t	krb_bid;	/* Buffer id in the buffer ring */
+	uint32_t	krb_len;	/* Bytes received into it */
+	uint32_t	krb_off;	/* Bytes already consumed */
+};
+
+/* io_uring driver handle */
+struct ktli_uring {
+	struct ktli_sock	*kur_sk;	/* Socket driver handle */
+	struct io_uring		 kur_sring;	/* Send ring, sender thread */
+	struct io_uring		 kur_rring;	/* Recv ring, receiver thread */
+
+	struct io_uring_buf_ring *kur_br;	/* Provided buffer ring */
+	char			*kur_bufs;	/* KUR_NBUFS * KUR_BUFSZ */
+	int			 kur_armed;	/* Multishot recv outstanding */
+	int			 kur_err;	/* Sticky recv errno, 0 if none */
+
+	/* Staged receive buffers, a FIFO indexed modulo KUR_NBUFS */
+	struct kur_rbuf		 kur_staged[KUR_NBUFS];
+	uint32_t		 kur_shead;	/* Next to consume */
+	uint32_t		 kur_stail;	/* Next free */
+	size_t			 kur_savail;	/* Staged bytes not consumed */
+};
+
+static void *
+ktli_uring_open()
+{
+	struct ktli_uring *ur;
+	int i, rc;
+
+	ur = malloc(sizeof(struct ktli_uring));
+	if (!ur) {
+		errno = ENOMEM;
+		return(NULL);
+	}
+	memset(ur, 0, sizeof(struct ktli_uring));
+
+	ur->kur_sk = (struct ktli_sock *)(socket_fns.ktli_dfns_open)();
+	if (!ur->kur_sk) {
+		free(ur);
+		return(NULL);
+	}
+
+	if ((rc = io_uring_queue_init(KUR_SDEPTH, &ur->kur_sring, 0)) < 0)
+		goto open_err_sring;
+	if ((rc = io_uring_queue_init(KUR_RDEPTH, &ur->kur_rring, 0)) < 0)
+		goto open_err_rring;
+
+	rc = posix_memalign((void **)&ur->kur_bufs, getpagesize(),
+			    KUR_NBUFS * KUR_BUFSZ);
+	if (rc) {
+		rc = -rc;
+		goto open_err_bufs;
+	}
+
+	ur->kur_br = io_uring_setup_buf_ring(&ur->kur_rring, KUR_NBUFS,
+					     KUR_BGID, 0, &rc);
+	if (!ur->kur_br)
+		goto open_err_br;
+
+	/* Hand every buffer to the kernel */
+	for (i = 0; i < KUR_NBUFS; i++)
+		io_uring_buf_ring_add(ur->kur_br, ur->kur_bufs + i * KUR_BUFSZ,
+				      KUR_BUFSZ, i,
+				      io_uring_buf_ring_mask(KUR_NBUFS), i);
+	io_uring_buf_ring_advance(ur->kur_br, KUR_NBUFS);
+
+	return((void *)ur);
+
+ open_err_br:
+	free(ur->kur_bufs);
+ open_err_bufs:
+	io_uring_queue_exit(&ur->kur_rring);
+ open_err_rring:
+	io_uring_queue_exit(&ur->kur_sring);
+ open_err_sring:
+	(socket_fns.ktli_dfns_close)(ur->kur_sk);
+	free(ur);
+	errno = -rc;
+	return(NULL);
+}
+
+static int
+ktli_uring_close(void *dh)
+{
+	struct ktli_uring *ur = (struct ktli_uring *)dh;
+
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	io_uring_free_buf_ring(&ur->kur_rring, ur->kur_br, KUR_NBUFS,
+			       KUR_BGID);
+	io_uring_queue_exit(&ur->kur_rring);
+	io_uring_queue_exit(&ur->kur_sring);
+	free(ur->kur_bufs);
+
+	/* Closes the socket and frees its handle */
+	(socket_fns.ktli_dfns_close)(ur->kur_sk);
+	free(ur);
+
+	return(0);
+}
+
+static int
+ktli_uring_tune(void *dh, struct ktli_config *cf)
+{
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+	return((socket_fns.ktli_dfns_tune)(((struct ktli_uring *)dh)->kur_sk,
+					   cf));
+}
+
+static int
+ktli_uring_connect(void *dh, char *host, char *port, int usetls)
+{
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+	return((socket_fns.ktli_dfns_connect)(((struct ktli_uring *)dh)->kur_sk,
+					      host, port, usetls));
+}
+
+static int
+ktli_uring_disconnect(void *dh)
+{
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+	return((socket_fns.ktli_dfns_disconnect)(((struct ktli_uring *)dh)->kur_sk));
+}
+
+/* Consume n bytes from the front of an iovec array, returns new curv */
+static int
+kur_iov_advance(struct iovec *iov, int iovs, int curv, size_t n)
+{
+	while ((curv < iovs) && (n >= iov[curv].iov_len))
+		n -= iov[curv++].iov_len;
+
+	if (curv < iovs) {
+		iov[curv].iov_base = (char *)iov[curv].iov_base + n;
+		iov[curv].iov_len -= n;
+	}
+	return(curv);
+}
+
+static int
+ktli_uring_send(void *dh, struct kiovec *msg, int msgcnt)
+{
+	struct ktli_uring *ur = (struct ktli_uring *)dh;
+	struct io_uring *ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct msghdr *mh;
+	struct iovec *iov;
+	size_t mlen[KUR_SDEPTH];
+	int i, j, n, len, iovs, curv, v, nsqe, short_send;
+	ssize_t tbw, bw;
+
+	if (!dh || !msgcnt) {
+		errno = -EINVAL;
+		return(-1);
+	}
+	ring = &ur->kur_sring;
+
+	/*
+	 * Copy the kiov to a std iov, the sendmsg SQEs point into it and
+	 * partial sends modify it. msghdrs for a full batch live with it.
+	 */
+	iov = (struct iovec *)malloc(sizeof(struct iovec) * msgcnt +
+				     sizeof(struct msghdr) * KUR_SDEPTH);
+	if (!iov) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	mh = (struct msghdr *)&iov[msgcnt];
+
+	for (len=0,i=0; i<msgcnt; i++) {
+		iov[i].iov_base = msg[i].kiov_base;
+		iov[i].iov_len = msg[i].kiov_len;
+		len += msg[i].kiov_len;
+	}
+	iovs = msgcnt;
+
+	for (curv=0,tbw=0; curv < iovs;) {
+		/* One SENDMSG SQE per IOV_MAX vectors, linked in order */
+		for (nsqe=0,v=curv; v < iovs && nsqe < KUR_SDEPTH; nsqe++) {
+			n = iovs - v;
+			if (n > IOV_MAX)
+				n = IOV_MAX;
+
+			memset(&mh[nsqe], 0, sizeof(struct msghdr));
+			mh[nsqe].msg_iov    = &iov[v];
+			mh[nsqe].msg_iovlen = n;
+			for (mlen[nsqe]=0,j=0; j<n; j++)
+				mlen[nsqe] += iov[v + j].iov_len;
+			v += n;
+
+			sqe = io_uring_get_sqe(ring);
+			assert(sqe);	/* ring is idle, KUR_SDEPTH SQEs free */
+			io_uring_prep_sendmsg(sqe, ur->kur_sk->ksk_fd,
+					      &mh[nsqe], MSG_WAITALL);
+			if (v < iovs && nsqe + 1 < KUR_SDEPTH)
+				sqe->flags |= IOSQE_IO_LINK;
+		}
+
+		n = io_uring_submit_and_wait(ring, nsqe);
+		if (n < 0) {
+			errno = -n;
+			free(iov);
+			return(-1);
+		}
+
+		/*
+		 * Reap the batch. A short send breaks the link and the
+		 * rest come back -ECANCELED, so the bytes sent are exactly
+		 * the sum of the results up to the first short one.
+		 */
+		for (bw=0,short_send=0,i=0; i<nsqe; i++) {
+			io_uring_wait_cqe(ring, &cqe);
+			if (!short_send && cqe->res > 0)
+				bw += cqe->res;
+			if (!short_send &&
+			    (cqe->res < 0 ||
+			     (size_t)cqe->res != mlen[i])) {
+				short_send = 1;
+				if (cqe->res == 0)
+					errno = ECOMM;	/* No progress */
+				else if (cqe->res < 0 && cqe->res != -EINTR &&
+					 cqe->res != -EAGAIN)
+					errno = -cqe->res;
+				else
+					errno = 0;	/* Just resend */
+			}
+			io_uring_cqe_seen(ring, cqe);
+		}
+
+		if (short_send && !bw && errno) {
+			/* Hard error with no progress */
+			debug_printf("uring_send: error %d\n", errno);
+			free(iov);
+			return(-1);
+		}
+
+		tbw += bw;
+		curv = kur_iov_advance(iov, iovs, curv, bw);
+	}
+
+	free(iov);
+	return(tbw);
+}
+
+/*
+ * Arm the multishot recv, if it is not already. It stops after an error,
+ * EOF or when it runs out of provided buffers.
+ */
+static void
+kur_arm(struct ktli_uring *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ur->kur_armed || ur->kur_err)
+		return;
+
+	sqe = io_uring_get_sqe(&ur->kur_rring);
+	assert(sqe);
+	io_uring_prep_recv_multishot(sqe, ur->kur_sk->ksk_fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = KUR_BGID;
+	ur->kur_armed = 1;
+}
+
+/* Stage the buffer, or record the error, from one recv completion */
+static void
+kur_reap(struct ktli_uring *ur, struct io_uring_cqe *cqe)
+{
+	struct kur_rbuf *rb;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ur->kur_armed = 0;
+
+	if (cqe->res > 0) {
+		assert(cqe->flags & IORING_CQE_F_BUFFER);
+		assert(ur->kur_stail - ur->kur_shead < KUR_NBUFS);
+		rb = &ur->kur_staged[ur->kur_stail++ % KUR_NBUFS];
+		rb->krb_bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		rb->krb_len = cqe->res;
+		rb->krb_off = 0;
+		ur->kur_savail += cqe->res;
+	} else if (cqe->res == 0) {
+		ur->kur_err = ECONNABORTED;	/* EOF, server hung up */
+	} else if (cqe->res != -ENOBUFS && cqe->res != -EINTR &&
+		   cqe->res != -EAGAIN) {
+		ur->kur_err = -cqe->res;
+	}
+	/* ENOBUFS just needs a rearm once buffers are handed back */
+}
+
+/*
+ * Wait for receive completions, at most timeout ms, -1 waits forever.
+ * Stages everything that has completed. Returns 0, or -1 if the wait
+ * itself failed.
+ */
+static int
+kur_wait(struct ktli_uring *ur, int timeout)
+{
+	struct io_uring *ring = &ur->kur_rring;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts;
+	unsigned head, cnt;
+	int rc;
+
+	kur_arm(ur);
+
+	if (timeout < 0) {
+		rc = io_uring_submit_and_wait(ring, 1);
+	} else {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		rc = io_uring_submit_and_wait_timeout(ring, &cqe, 1, &ts, NULL);
+	}
+	if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+		errno = -rc;
+		return(-1);
+	}
+
+	cnt = 0;
+	io_uring_for_each_cqe(ring, head, cqe) {
+		kur_reap(ur, cqe);
+		cnt++;
+	}
+	io_uring_cq_advance(ring, cnt);
+
+	return(0);
+}
+
+/*
+ * Copy at most len staged bytes into buf, handing consumed buffers back
+ * to the kernel. Returns the number of bytes copied.
+ */
+static size_t
+kur_copyout(struct ktli_uring *ur, char *buf, size_t len)
+{
+	struct kur_rbuf *rb;
+	size_t n, tbr;
+	char *rbuf;
+
+	for (tbr=0; (tbr < len) && ur->kur_savail; tbr += n) {
+		rb   = &ur->kur_staged[ur->kur_shead % KUR_NBUFS];
+		rbuf = ur->kur_bufs + rb->krb_bid * KUR_BUFSZ;
+		n    = rb->krb_len - rb->krb_off;
+		if (n > len - tbr)
+			n = len - tbr;
+
+		memcpy(buf + tbr, rbuf + rb->krb_off, n);
+		rb->krb_off	+= n;
+		ur->kur_savail	-= n;
+
+		/* Consumed the buffer, give it back to the kernel */
+		if (rb->krb_off == rb->krb_len) {
+			io_uring_buf_ring_add(ur->kur_br, rbuf,
+				KUR_BUFSZ, rb->krb_bid,
+				io_uring_buf_ring_mask(KUR_NBUFS), 0);
+			io_uring_buf_ring_advance(ur->kur_br, 1);
+			ur->kur_shead++;
+		}
+	}
+
+	return(tbr);
+}
+
+/*
+ * Receive a message into a pre-allocated kiovec array, copying out of
+ * the staged receive buffers.
+ */
+static int
+ktli_uring_receive(void *dh, struct kiovec *msg, int msgcnt)
+{
+	struct ktli_uring *ur = (struct ktli_uring *)dh;
+	size_t off, tbr;
+	int i;
+
+	if (!dh || !msgcnt) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	for (tbr=0,i=0; i<msgcnt; i++) {
+		for (off=0; off < msg[i].kiov_len; ) {
+			/* Nothing staged, wait for the socket */
+			while (!ur->kur_savail) {
+				if (ur->kur_err) {
+					debug_printf("uring_receive: "
+						     "error %d\n",
+						     ur->kur_err);
+					errno = ur->kur_err;
+					return(-1);
+				}
+				if (kur_wait(ur, -1) < 0)
+					return(-1);
+			}
+
+			off += kur_copyout(ur, (char *)msg[i].kiov_base + off,
+					   msg[i].kiov_len - off);
+		}
+		tbr += off;
+	}
+
+	/* In case it stopped for lack of buffers */
+	kur_arm(ur);
+	io_uring_submit(&ur->kur_rring);
+
+	return(tbr);
+}
+
+/*
+ * Receive whatever is staged, at most len bytes, reaping any receive
+ * completions that are already in without waiting for more.
+ */
+static int
+ktli_uring_recvsome(void *dh, void *buf, size_t len)
+{
+	struct ktli_uring *ur = (struct ktli_uring *)dh;
+	size_t tbr;
+
+	if (!dh || !buf || !len) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	if (!ur->kur_savail && !ur->kur_err) {
+		if (kur_wait(ur, 0) < 0)
+			return(-1);
+	}
+
+	if (!ur->kur_savail) {
+		errno = ur->kur_err ? ur->kur_err : EAGAIN;
+		return(-1);
+	}
+
+	tbr = kur_copyout(ur, buf, len);
+
+	/* In case it stopped for lack of buffers */
+	kur_arm(ur);
+	io_uring_submit(&ur->kur_rring);
+
+	return((int)tbr);
+}
+
+static int
+ktli_uring_poll(void *dh, int timeout)
+{
+	struct ktli_uring *ur = (struct ktli_uring *)dh;
+
+	if (!dh) {
+		errno = -EINVAL;
+		return(-1);
+	}
+
+	if (!ur->kur_savail && !ur->kur_err) {
+		if (kur_wait(ur, timeout) < 0)
+			return(-1);
+	}
+
+	/* Data Waiting */
+	if (ur->kur_savail)
+		return(1);
+
+	/* received a hangup or an error */
+	if (ur->kur_err) {
+		errno = ur->kur_err;
+		return(-1);
+	}
+
+	/* Timed out */
+	return(0);
+}
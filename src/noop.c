@@ -40,7 +40,7 @@ kstatus_t extract_noop(struct kresult_message *resp_msg);
 
 
 kstatus_t
-n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
+n_noop_aio_generic(int ktd, int aio, void *cctx, kio_t **ckio)
 {
 	int rc, n;			/* return code, temps */
 	kstatus_t krc;			/* Kinetic return code */
@@ -50,9 +50,7 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	kmsghdr_t msg_hdr;		/* Unpacked message header */
 	kcmdhdr_t cmd_hdr;		/* Unpacked Command header */
 	struct ktli_config *cf;		/* KTLI configuration info */
-	struct kresult_message kmreq;	/* Intermediate resp representation */
-	kpdu_t pdu;			/* Unpacked PDU structure */
-
+	int kts;			/* KTLI session to send on */
 	struct timespec	start;		/* Temp start timestamp */
 
 	/*
@@ -104,11 +102,6 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * be used later on to calculate the actual HMAC which will then
 	 * replace the HMAC key on the kmh_hmac field.
-	 *
-	 * A reference is made to the kcfg_hkey ptr in the kmreq. This
-	 * reference needs to be removed before destroying kmreq.  The
-	 * protobuf code will try to clean up this ptr which is an outside
-	 * unfreeable ptr.  See below at nex_kmreq:
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -119,17 +112,19 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type = KMT_NOOP;
 
-	kmreq = create_noop_message(&msg_hdr, &cmd_hdr);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("noop: request message create");
-		krc = K_EINTERNAL;
-		goto nex_kio;
-	}
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, NULL, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
 
 	/* Setup the KIO */
 	kio->kio_magic	= KIO_MAGIC;
 	kio->kio_cmd	= KMT_NOOP;
+	kio->kio_pri	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
+	if (aio)
+		KIOF_SET(kio, KIOF_REAP);	/* ki_aio_reap may take it */
 
 	/* This is a normal noop, there is a response */
 	KIOF_SET(kio, KIOF_REQRESP);
@@ -155,43 +150,23 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("noop: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto nex_kmreq;
-	}
-
-	/* Hang the PDU buffer, packing occurs later */
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = KI_MALLOC(KP_PLENGTH);
-
-	if (!kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base) {
-		debug_printf("noop: sendmesg PDU alloc");
-		krc = K_ENOMEM;
-		goto nex_kmmsg;
+		goto nex_kio;
 	}
 
-	/* pack the message and hang it on the kio */
-	/* success: rc = 0; failure: rc = 1 (see enum kresult_code) */
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("noop: sendmesg msg pack");
+	/*
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_empty(cf, kio, &msg_hdr, &cmd_hdr) < 0) {
+		debug_printf("noop: request encode");
 		krc = K_EINTERNAL;
-		goto nex_kmmsg_pdu;
+		goto nex_kmmsg;
 	}
-
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-	PACK_PDU(&pdu,  (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
-	debug_printf("noop: PDU(x%2x, %d, %d)\n",
-		     pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
+	debug_printf("noop: PDU(x%2x, %lu, 0)\n",
+		     KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	/* Send the request */
-	if (ktli_send(ktd, kio) < 0) {
+	if (ktli_send(kts, kio) < 0) {
 		debug_printf("noop: kio send");
 		krc = K_EINTERNAL;
 		goto nex_kmmsg_msg;
@@ -201,20 +176,9 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	/*
 	 * Successful Exit.
 	 * Return the kio.
-	 * Cleanup before return, the only thing that needs to go
-	 * is the unpacked protobuf request message kmreq.
-	 *
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
 	 */
 	*ckio = kio;
 
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len = 0;
-
-	destroy_message(kmreq.result_message);
-
 	return(K_OK);
 
 	/* Error Exit. */
@@ -224,25 +188,11 @@ n_noop_aio_generic(int ktd, void *cctx, kio_t **ckio)
 	 */
 
  nex_kmmsg_msg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-
- nex_kmmsg_pdu:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
  nex_kmmsg:
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
- nex_kmreq:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before calling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len  = 0;
-
-	destroy_message(kmreq.result_message);
-
  nex_kio:
 	kio->kio_magic = 0; /* clear the kio magic  in case this lives on */
 	KI_FREE(kio);
@@ -349,8 +299,7 @@ n_noop_aio_complete(int ktd, struct kio *kio, void **cctx)
 	}
 
 	/* Now unpack the message */
-	kmresp = unpack_kinetic_message(kiov[KIOV_MSG].kiov_base,
-					kiov[KIOV_MSG].kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("noop: msg unpack");
 		krc = K_EINTERNAL;
@@ -360,23 +309,21 @@ n_noop_aio_complete(int ktd, struct kio *kio, void **cctx)
 	krc = extract_noop(&kmresp);
 
 	/* clean up */
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  nex:
 	/* depending on errors the recvmsg may or may not exist */
 	if (kio->kio_recvmsg.km_msg) {
 		for (i=0; i < kio->kio_recvmsg.km_cnt; i++) {
 			rl += kio->kio_recvmsg.km_msg[i].kiov_len; /* Stats */
-			KI_FREE(kio->kio_recvmsg.km_msg[i].kiov_base);
 		}
-		KI_FREE(kio->kio_recvmsg.km_msg);
+		ktli_recvmsg_free(kio, 0);
 	}
 
 	/* sendmsg always exists here but doesn't have a PDU_VAL */
-	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++) {
+	for (sl=0, i=0; i < kio->kio_sendmsg.km_cnt; i++)
 		sl += kio->kio_sendmsg.km_msg[i].kiov_len; /* Stats */
-		KI_FREE(kio->kio_sendmsg.km_msg[i].kiov_base);
-	}
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 	KI_FREE(kio->kio_sendmsg.km_msg);
 
 	if (krc == K_OK) {
@@ -438,7 +385,7 @@ n_noop_generic(int ktd)
 	kstatus_t ks;
 	kio_t *kio;
 
-	ks = n_noop_aio_generic(ktd, NULL, &kio);
+	ks = n_noop_aio_generic(ktd, 0, NULL, &kio);
 	if (ks != K_OK) {
 		return(ks);
 	}
@@ -477,7 +424,7 @@ n_noop_generic(int ktd)
 kstatus_t
 ki_aio_noop(int ktd, void *cctx, kio_t **kio)
 {
-	return(n_noop_aio_generic(ktd, cctx, kio));
+	return(n_noop_aio_generic(ktd, 1, cctx, kio));
 }
 
 
@@ -29,6 +29,28 @@
 #include "protocol_interface.h"
 #include "kinetic_internal.h"
 
+/* KTLI driver used for new sessions, io_uring if built in */
+#ifdef KTLI_URING
+#define KI_DRIVER	KTLI_DRIVER_URING
+#else
+#define KI_DRIVER	KTLI_DRIVER_SOCKET
+#endif
+
+/* Shared reactor threads for new sessions, 0 for threads per session */
+static int ki_nreactors = 0;
+
+/*
+ * Session options for new sessions, only the flags and tuning fields are
+ * used, see ki_busypoll() and the like.
+ */
+static struct ktli_config ki_ncf = {
+#ifdef KTLI_ZEROCOPY
+	.kcfg_flags	= KCFF_ZEROCOPY,	/* see ki_zerocopy() */
+#endif
+	.kcfg_sendcpu	= -1,
+	.kcfg_recvcpu	= -1,
+};
+
 static int32_t ki_msglen(struct kiovec *msg_hdr);
 static int32_t ki_vallen(struct kiovec *msg_hdr);
 
@@ -37,6 +59,7 @@ static struct ktli_helpers ki_kh = {
 	.kh_recvhdr_len = KP_PLENGTH,
 	.kh_getaseq_fn	= ki_getaseq,
 	.kh_setseq_fn	= ki_setseq,
+	.kh_stampseq_fn	= ki_stampseq,
 	.kh_msglen_fn	= ki_msglen,
 	.kh_vallen_fn	= ki_vallen,
 };
@@ -71,6 +94,323 @@ ki_vallen (struct kiovec *msg_hdr)
 	return (pdu.kp_vallen);
 }
 
+/**
+ * ki_reactors
+ * Have sessions opened from now on serviced by a pool of nthreads shared
+ * reactor threads instead of a sender and receiver thread each, which
+ * keeps the thread count flat for clients with many sessions. The pool
+ * size is fixed once the first such session connects. Sessions opened
+ * before the call keep their own threads.
+ */
+kstatus_t
+ki_reactors(int nthreads)
+{
+	if (ktli_reactors(nthreads) < 0)
+		return((errno == EBUSY) ? K_EBUSY : K_EINVAL);
+
+	ki_nreactors = nthreads;
+	return(K_OK);
+}
+
+/**
+ * ki_busypoll
+ * Trade CPU for latency on sessions opened from now on. With enable set
+ * their receivers never sleep in the driver and ki_poll spins up to spinus
+ * microseconds, 0 for the default, before sleeping. sendcpu and recvcpu
+ * pin the sender and receiver threads of each connection, -1 leaves a
+ * thread unpinned. Sessions serviced by ki_reactors() have no threads of
+ * their own, for them only the ki_poll spin applies. Sessions opened
+ * before the call keep their settings.
+ */
+kstatus_t
+ki_busypoll(int enable, uint32_t spinus, int sendcpu, int recvcpu)
+{
+	if ((sendcpu < -1) || (recvcpu < -1))
+		return(K_EINVAL);
+
+	ki_ncf.kcfg_flags &= ~(KCFF_BUSYPOLL | KCFF_PINCPU);
+	if (enable)
+		ki_ncf.kcfg_flags |= KCFF_BUSYPOLL;
+	if ((sendcpu >= 0) || (recvcpu >= 0))
+		ki_ncf.kcfg_flags |= KCFF_PINCPU;
+
+	ki_ncf.kcfg_spinus  = spinus;
+	ki_ncf.kcfg_sendcpu = sendcpu;
+	ki_ncf.kcfg_recvcpu = recvcpu;
+	return(K_OK);
+}
+
+/**
+ * ki_sendseq
+ * Have sessions opened from now on sequence and HMAC each request in the
+ * thread that submits it rather than in the session's sender thread, with
+ * enable set. Spreads the HMAC over the submitting threads, worth it when
+ * many threads submit on one session. Requests then go out in submission
+ * order, their priorities no longer reorder them. Sessions opened before
+ * the call keep their setting.
+ */
+kstatus_t
+ki_sendseq(int enable)
+{
+	if (enable)
+		ki_ncf.kcfg_flags |= KCFF_SENDSEQ;
+	else
+		ki_ncf.kcfg_flags &= ~KCFF_SENDSEQ;
+	return(K_OK);
+}
+
+/**
+ * ki_priorities
+ * How sessions opened from now on order their queued requests by
+ * priority, see kv_pri. By default each round sends up
+ * to 8 HIGH and up, 4 NORMAL and 1 LOW and below request, which keeps
+ * every priority moving. high, normal and low override those weights, 0
+ * keeps the default. With strict set the highest priority queued always
+ * goes first, the weights are unused, and a priority only gets ahead of
+ * it after being passed over many times in a row. Sessions opened before
+ * the call keep their setting.
+ */
+kstatus_t
+ki_priorities(int strict, uint32_t high, uint32_t normal, uint32_t low)
+{
+	if (strict)
+		ki_ncf.kcfg_flags |= KCFF_STRICTPRI;
+	else
+		ki_ncf.kcfg_flags &= ~KCFF_STRICTPRI;
+
+	ki_ncf.kcfg_priw[KTLI_PRI_HIGH]   = high;
+	ki_ncf.kcfg_priw[KTLI_PRI_NORMAL] = normal;
+	ki_ncf.kcfg_priw[KTLI_PRI_LOW]    = low;
+	return(K_OK);
+}
+
+/**
+ * ki_zerocopy
+ * With enable set, large puts on sessions opened from now on go out
+ * straight from the caller's value buffers instead of being copied into
+ * the socket, if the KTLI driver can. A put then completes only once the
+ * kernel is done with its buffers. Off by default, on by default in a
+ * library built with "make ZEROCOPY=1". Sessions opened before the call
+ * keep their setting.
+ */
+kstatus_t
+ki_zerocopy(int enable)
+{
+	if (enable)
+		ki_ncf.kcfg_flags |= KCFF_ZEROCOPY;
+	else
+		ki_ncf.kcfg_flags &= ~KCFF_ZEROCOPY;
+	return(K_OK);
+}
+
+/**
+ * ki_iotune
+ * How sessions opened from now on wait out a send or receive that can
+ * not make progress, say a full socket buffer. The socket is retried
+ * spins times, then waited on for readiness waitms milliseconds at a
+ * time, and the session fails once nothing has moved for stallms
+ * milliseconds. 0 keeps the default, 8 retries, 10ms and 30s, so a
+ * wait can be shortened but not turned off. Only the socket driver waits
+ * this way, io_uring sessions ignore them. Sessions opened before the
+ * call keep their setting.
+ */
+kstatus_t
+ki_iotune(uint32_t spins, uint32_t waitms, uint32_t stallms)
+{
+	ki_ncf.kcfg_iospin  = spins;
+	ki_ncf.kcfg_iowait  = waitms;
+	ki_ncf.kcfg_iostall = stallms;
+	return(K_OK);
+}
+
+/**
+ * ki_admission
+ * Keep the requests outstanding on each connection of ktd within the
+ * pending read and write limits the server gave at open, see ks_l. Gets
+ * take read credits, puts and deletes outside of batches write credits.
+ * With KADM_QUEUE requests past a limit are held and sent as earlier
+ * ones complete, callers waiting on a held request must keep completing
+ * the others. With KADM_REJECT they fail with K_EAGAIN. KADM_ADAPT holds
+ * them past a window per connection and direction that tracks the
+ * device: it grows while round trips stay near the unloaded one and
+ * shrinks when they inflate, never past the limits. KADM_NONE, the
+ * default, lifts the limits. See kstats_t for the counters.
+ */
+kstatus_t
+ki_admission(int ktd, kadmit_t policy)
+{
+	int i, flags = 0;
+	uint32_t rd = 0, wr = 0;
+	ksession_t *ses;
+	struct ktli_config *cf;
+
+	if ((policy != KADM_NONE) && (policy != KADM_QUEUE) &&
+	    (policy != KADM_REJECT) && (policy != KADM_ADAPT))
+		return(K_EINVAL);
+
+	if (ktli_config(ktd, &cf) < 0)
+		return(K_EBADSESS);
+	ses = (ksession_t *) cf->kcfg_pconf;
+
+	if (policy != KADM_NONE) {
+		rd = ses->ks_l.kl_pendrdcnt;
+		wr = ses->ks_l.kl_pendwrcnt;
+	}
+	if (policy == KADM_QUEUE)
+		flags = KTLI_CRQUEUE;
+	else if (policy == KADM_ADAPT)
+		flags = KTLI_CRQUEUE | KTLI_CRADAPT;
+
+	for (i = 0; i < ses->ks_nconn; i++) {
+		if (ktli_credits(ses->ks_conn[i].kc_ktd, rd, wr, flags) < 0)
+			return(K_EBADSESS);
+	}
+
+	return(K_OK);
+}
+
+/**
+ * ki_conn
+ * Pick the connection a request goes out on, the one with the fewest
+ * outstanding requests, and set its connection ID in the command header.
+ * Batch requests go out on the connection their batch started on, the
+ * server scopes batch IDs by connection. Sessions with one connection
+ * always use ktd.
+ */
+int
+ki_conn(int ktd, ksession_t *ses, kb_t *kb, kcmdhdr_t *ch)
+{
+	int i, kts;
+
+	if (ses->ks_nconn <= 1)
+		return(ktd);
+
+	if (kb && (kb->kb_conn >= 0))
+		kts = kb->kb_conn;
+	else
+		kts = ktli_stripe_pick(ktd);
+
+	for (i = 0; i < ses->ks_nconn; i++) {
+		if (ses->ks_conn[i].kc_ktd == kts) {
+			ch->kch_connid = ses->ks_conn[i].kc_connid;
+			break;
+		}
+	}
+
+	/* Not one of ours, ks_ch already carries ktd's connection ID */
+	if (i == ses->ks_nconn)
+		kts = ktd;
+
+	if (kb && (kb->kb_conn < 0))
+		kb->kb_conn = kts;
+
+	return(kts);
+}
+
+/**
+ * ki_sendpri
+ * The KTLI send priority of a request with wire priority pri. The nine
+ * wire priorities fold into KTLI's three, HIGH and up are sent ahead of
+ * NORMAL traffic and LOW and below behind it, see ktli_sq_next().
+ */
+int
+ki_sendpri(kpriority_t pri)
+{
+	if ((int)pri >= HIGH)
+		return(KTLI_PRI_HIGH);
+	if (pri && ((int)pri <= LOW))
+		return(KTLI_PRI_LOW);
+	return(KTLI_PRI_NORMAL);
+}
+
+/*
+ * Tear down a connection ki_open_more could not finish. It is already
+ * striped and connected, so it has to be disconnected, drained and closed,
+ * else ktli_stripe_pick would keep picking it with nothing outstanding.
+ * kio, its unsolicited status if it got one, is freed along with any
+ * other unsolicited KIO drained off it.
+ */
+static void
+ki_conn_drop(int kts, struct kio *kio)
+{
+	struct kio *dkio;
+
+	if (kio) {
+		ktli_recvmsg_free(kio, 0);
+		KI_FREE(kio);
+	}
+
+	ktli_disconnect(kts);
+	while (ktli_drain(kts, &dkio) > 0) {
+		if (KIOF_ISSET(dkio, KIOF_RESPONLY)) {
+			ktli_recvmsg_free(dkio, 0);
+			KI_FREE(dkio);
+		}
+	}
+	ktli_close(kts);
+}
+
+/*
+ * Open the connections past the first, see ki_open_conns. Each is a KTLI
+ * session striped behind ktd, with its own sequence numbers and its own
+ * unsolicited status, only its connection ID is kept. Limits, config,
+ * batch IDs and stats are those of the ktd session. Stops at the first
+ * connection that fails, the session keeps the ones it has.
+ */
+static void
+ki_open_more(int ktd, struct ktli_config *cf, ksession_t *ks, int nconn)
+{
+	int kts, rc;
+	struct kio *kio;
+	struct kresult_message kmresp;
+	kcmdhdr_t cmd_hdr;
+	kstatus_t krc;
+
+	while (ks->ks_nconn < nconn) {
+		kts = ktli_open(KI_DRIVER, cf, &ki_kh);
+		if (kts < 0)
+			return;
+
+		if ((ktli_stripe(ktd, kts) < 0) || (ktli_connect(kts) < 0)) {
+			ktli_close(kts);
+			return;
+		}
+
+		/* Wait for this connection's unsolicited status */
+		do {
+			ktli_poll(kts, 0);
+			rc = ktli_receive_unsolicited(kts, &kio);
+		} while ((rc < 0) && (errno == ENOENT));
+
+		if (rc < 0) {
+			ki_conn_drop(kts, NULL);
+			return;
+		}
+
+		kmresp = unpack_response_message(kio);
+		if (kmresp.result_code == FAILURE) {
+			ki_conn_drop(kts, kio);
+			return;
+		}
+
+		memset(&cmd_hdr, 0, sizeof(kcmdhdr_t));
+		krc = extract_cmdhdr(&kmresp, &cmd_hdr);
+		destroy_response_message(kio, kmresp.result_message);
+		if (krc != K_OK) {
+			ki_conn_drop(kts, kio);
+			return;
+		}
+
+		/* Only its connection ID was needed */
+		ktli_recvmsg_free(kio, 0);
+		KI_FREE(kio);
+
+		ks->ks_conn[ks->ks_nconn].kc_ktd    = kts;
+		ks->ks_conn[ks->ks_nconn].kc_connid = cmd_hdr.kch_connid;
+		ks->ks_nconn++;
+	}
+}
+
 /**
  * ki_open
  * Need to open and connect a session here.
@@ -88,18 +428,39 @@ ki_vallen (struct kiovec *msg_hdr)
  */
 int
 ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
+{
+	return(ki_open_conns(host, port, usetls, id, hkey, 1));
+}
+
+/**
+ * ki_open_conns
+ * ki_open with nconn connections to the server behind the one descriptor.
+ * Requests are spread over the connections by fewest outstanding, each
+ * connection has its own sequence numbers and its own sender and receiver,
+ * the limits, config, batch IDs and stats are shared. A batch stays on the
+ * connection it started on. Completions of all connections are received
+ * through the descriptor, as with a single connection. If not all of the
+ * extra connections can be made the descriptor carries on with fewer.
+ */
+int
+ki_open_conns(char *host, char *port, uint32_t usetls, int64_t id,
+	      char *hkey, int nconn)
 {
 	int ktd, rc;
 
 	struct ktli_config     *cf;
 	struct kio             *kio;
-	struct kiovec          *kiov;
 	struct kresult_message  kmresp;
 	kstatus_t		krc;
 	ksession_t		*ks;
 	kgetlog_t		glog;
 	kcmdhdr_t		cmd_hdr;
 
+	if ((nconn < 1) || (nconn > KI_MAXCONN)) {
+		errno = EINVAL;
+		return(-1);
+	}
+
 	/*
 	 * these ktli and session configs get hung on the ktli session
 	 * so need to allocate these structures.
@@ -118,10 +479,29 @@ ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
 	cf->kcfg_port  = strdup(port);
 	cf->kcfg_id    = id;
 	cf->kcfg_hkey  = strdup(hkey);
-	cf->kcfg_flags = KCFF_NOFLAGS;
+	cf->kcfg_flags = KCFF_SEQSLOT;
+
+	/* Key the session's HMAC once, each request copies the keyed state */
+	cf->kcfg_hctx  = ki_hmac_prekey(cf->kcfg_hkey, strlen(cf->kcfg_hkey));
 
 	if (usetls) { cf->kcfg_flags |= KCFF_TLS; }
 
+	/* Serviced by the shared reactors, see ki_reactors() */
+	if (ki_nreactors) { cf->kcfg_flags |= KCFF_REACTOR; }
+
+	/*
+	 * Options set for new sessions, see ki_busypoll(), ki_sendseq(),
+	 * ki_priorities(), ki_zerocopy() and ki_iotune()
+	 */
+	cf->kcfg_flags  |= ki_ncf.kcfg_flags;
+	cf->kcfg_iospin  = ki_ncf.kcfg_iospin;
+	cf->kcfg_iowait  = ki_ncf.kcfg_iowait;
+	cf->kcfg_iostall = ki_ncf.kcfg_iostall;
+	memcpy(cf->kcfg_priw, ki_ncf.kcfg_priw, sizeof(cf->kcfg_priw));
+	cf->kcfg_spinus  = ki_ncf.kcfg_spinus;
+	cf->kcfg_sendcpu = ki_ncf.kcfg_sendcpu;
+	cf->kcfg_recvcpu = ki_ncf.kcfg_recvcpu;
+
 	/*
 	 * Nothing to setup on the command header as yet. But setup some
 	 * signals (-1) that will allow lower level code to fillout this
@@ -138,7 +518,7 @@ ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
 	/* Hang it on the KTLI session confg*/
 	cf->kcfg_pconf = (void *) ks;
 
-	ktd = ktli_open(KTLI_DRIVER_SOCKET, cf, &ki_kh);
+	ktd = ktli_open(KI_DRIVER, cf, &ki_kh);
 	if (ktd < 0 ) {
 		return(-1);
 	}
@@ -176,8 +556,7 @@ ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
 		else { break; }
 	} while (1);
 
-	kiov   = &kio->kio_recvmsg.km_msg[KIOV_MSG];
-	kmresp = unpack_kinetic_message(kiov->kiov_base, kiov->kiov_len);
+	kmresp = unpack_response_message(kio);
 
 	/* cleanup and return error */
 	if (kmresp.result_code == FAILURE) {
@@ -208,6 +587,11 @@ ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
 	}
 	memcpy(&ks->ks_ch, &cmd_hdr, sizeof(kcmdhdr_t));
 
+	/* The descriptor's own connection is the first */
+	ks->ks_conn[0].kc_ktd    = ktd;
+	ks->ks_conn[0].kc_connid = cmd_hdr.kch_connid;
+	ks->ks_nconn = 1;
+
 	/* Init session next batch id counter and active batches */
 	ks->ks_bid  = KFIRSTBID;
 	ks->ks_bats = 0;
@@ -218,9 +602,13 @@ ki_open(char *host, char *port, uint32_t usetls, int64_t id, char *hkey)
 	glog.destroy_protobuf(&glog);
 
 	// destroy the protobuf message itself
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  oex2:
+	/* The other connections share cf and ks, see ki_open_more */
+	if (!rc && (nconn > 1))
+		ki_open_more(ktd, cf, ks, nconn);
+
 	return(ktd);
 }
 
@@ -0,0 +1,636 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "kio.h"
+#include "ktli.h"
+#include "kinetic.h"
+#include "kinetic_internal.h"
+#include "protocol_interface.h"
+
+/*
+ * Direct request encoding.
+ *
+ * Building a request through protobuf-c takes a malloc for the gathered
+ * key, the packed command bytes, the Message and its auth structure, and
+ * then another for the packed message and one for the PDU. The encoders
+ * here write the same bytes straight from the caller's kv, range, getlog
+ * and header structures. Each message is walked twice: a sizing pass
+ * that only adds up lengths, inside out, and a write pass that emits
+ * the PDU, the Message and its Command front to back into a single
+ * KI_MALLOC buffer. Nothing else is allocated.
+ *
+ * The output is byte for byte what create_*_message() followed by
+ * pack_kinetic_message() and PACK_PDU produce for the same request:
+ * fields in field number order, the same optional fields set, varints in
+ * their minimal form and negative enums sign extended to 10 bytes. The
+ * create_*_message() builders are kept as the reference for this, see
+ * test/src/test_wire.c.
+ *
+ * The PDU sits at the start of the buffer and the message follows it,
+ * KIOV_PDU and KIOV_MSG both point into it and the buffer is released
+ * with ki_encode_free(). When the session reserves sequence slots the
+ * encoder records where they landed as it writes them, standing in for
+ * ki_seqslot_locate().
+ */
+
+/* Encoding cursor, kpe_p is NULL for the sizing pass */
+struct kpe {
+	uint8_t		*kpe_p;		/* Next byte to write */
+	size_t		 kpe_len;	/* Bytes sized or written */
+	uint8_t		*kpe_seq;	/* Where Header.sequence went */
+	uint8_t		*kpe_hmac;	/* Where HMACauth.hmac went */
+	uint8_t		*kpe_cmd;	/* Where commandBytes went */
+};
+
+/* Writes the contents of a Command.Body member */
+typedef void (kpe_body_t)(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg);
+
+/* A request, and its part lengths once sized */
+struct kpe_req {
+	uint32_t	 kr_num;	/* Body field number, 0 if empty */
+	kpe_body_t	*kr_fn;		/* Body member writer */
+	void		*kr_arg;
+	size_t		 kr_hl;		/* Header */
+	size_t		 kr_il;		/* Body member */
+	size_t		 kr_bl;		/* Body */
+	uint32_t	 kr_anum;	/* Auth field number */
+	size_t		 kr_al;		/* HMACauth or PINauth */
+	size_t		 kr_cl;		/* Command bytes */
+};
+
+static void
+kpe_init(struct kpe *e, uint8_t *p)
+{
+	memset(e, 0, sizeof(*e));
+	e->kpe_p = p;
+}
+
+/* Encoded length of a varint */
+static size_t
+kpe_vlen(uint64_t v)
+{
+	size_t n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return(n);
+}
+
+/* Encoded length of a LEN field holding len bytes */
+static size_t
+kpe_flen(uint32_t num, size_t len)
+{
+	return(kpe_vlen(((uint64_t)num << 3) | KPW_LEN) + kpe_vlen(len) + len);
+}
+
+static void
+kpe_varint(struct kpe *e, uint64_t v)
+{
+	e->kpe_len += kpe_vlen(v);
+	if (!e->kpe_p)
+		return;
+
+	while (v >= 0x80) {
+		*e->kpe_p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*e->kpe_p++ = (uint8_t)v;
+}
+
+static void
+kpe_raw(struct kpe *e, const void *buf, size_t len)
+{
+	e->kpe_len += len;
+	if (!e->kpe_p || !len)
+		return;
+
+	memcpy(e->kpe_p, buf, len);
+	e->kpe_p += len;
+}
+
+/* Account for len bytes that another pass sized, sizing pass only */
+static void
+kpe_skip(struct kpe *e, size_t len)
+{
+	e->kpe_len += len;
+}
+
+static void
+kpe_tag(struct kpe *e, uint32_t num, uint32_t wtype)
+{
+	kpe_varint(e, ((uint64_t)num << 3) | wtype);
+}
+
+/* int64, uint64 and uint32 fields */
+static void
+kpe_u64(struct kpe *e, uint32_t num, uint64_t v)
+{
+	kpe_tag(e, num, KPW_VARINT);
+	kpe_varint(e, v);
+}
+
+/* int32 and enum fields, negatives take all 10 bytes */
+static void
+kpe_i32(struct kpe *e, uint32_t num, int32_t v)
+{
+	kpe_u64(e, num, (uint64_t)(int64_t)v);
+}
+
+static void
+kpe_bool(struct kpe *e, uint32_t num, int v)
+{
+	kpe_u64(e, num, v ? 1 : 0);
+}
+
+/* The tag and length of a LEN field, its len bytes follow */
+static void
+kpe_sub(struct kpe *e, uint32_t num, size_t len)
+{
+	kpe_tag(e, num, KPW_LEN);
+	kpe_varint(e, len);
+}
+
+static void
+kpe_bytes(struct kpe *e, uint32_t num, const void *buf, size_t len)
+{
+	kpe_sub(e, num, len);
+	kpe_raw(e, buf, len);
+}
+
+/*
+ * A key held as a kiovec array, gathered straight into the buffer in one
+ * copy. The fragments cannot go out as send vectors of their own, the key
+ * sits inside commandBytes, which the HMAC and the seq slot stamping
+ * need contiguous.
+ */
+static void
+kpe_key(struct kpe *e, uint32_t num, struct kiovec *key, size_t keycnt)
+{
+	size_t i, len;
+
+	for (len = 0, i = 0; i < keycnt; i++)
+		len += key[i].kiov_len;
+
+	kpe_sub(e, num, len);
+	for (i = 0; i < keycnt; i++)
+		kpe_raw(e, key[i].kiov_base, key[i].kiov_len);
+}
+
+/* Command.Header, the fields extract_to_command_header() sets */
+static void
+kpe_header(struct kpe *e, kcmdhdr_t *cmd_hdr)
+{
+	kpe_u64(e, KPW_HDR_CLUSTVERS, (uint64_t)cmd_hdr->kch_clustvers);
+	kpe_u64(e, KPW_HDR_CONNID, (uint64_t)cmd_hdr->kch_connid);
+
+	kpe_tag(e, KPW_HDR_SEQ, KPW_VARINT);
+	e->kpe_seq = e->kpe_p;
+	kpe_varint(e, cmd_hdr->kch_seq);
+
+	kpe_i32(e, KPW_HDR_TYPE, cmd_hdr->kch_type);
+
+	if (cmd_hdr->kch_timeout)
+		kpe_u64(e, KPW_HDR_TIMEOUT, cmd_hdr->kch_timeout);
+	if (cmd_hdr->kch_pri)
+		kpe_i32(e, KPW_HDR_PRI, cmd_hdr->kch_pri);
+	if (cmd_hdr->kch_quanta)
+		kpe_u64(e, KPW_HDR_QUANTA, cmd_hdr->kch_quanta);
+	if (cmd_hdr->kch_bid)
+		kpe_u64(e, KPW_HDR_BID, cmd_hdr->kch_bid);
+}
+
+/* Command, the header and the body, or their lengths when sizing */
+static void
+kpe_command(struct kpe *e, kcmdhdr_t *cmd_hdr, struct kpe_req *r)
+{
+	kpe_sub(e, KPW_CMD_HEADER, r->kr_hl);
+	if (e->kpe_p)
+		kpe_header(e, cmd_hdr);
+	else
+		kpe_skip(e, r->kr_hl);
+
+	/* protobuf-c always emits the body, even when it is empty */
+	kpe_sub(e, KPW_CMD_BODY, r->kr_bl);
+	if (!r->kr_num)
+		return;
+
+	kpe_sub(e, r->kr_num, r->kr_il);
+	if (e->kpe_p)
+		(r->kr_fn)(e, cmd_hdr, r->kr_arg);
+	else
+		kpe_skip(e, r->kr_il);
+}
+
+/* Message.HMACauth or Message.PINauth, as create_message() sets them */
+static void
+kpe_auth(struct kpe *e, kmsghdr_t *msg_hdr)
+{
+	size_t len;
+
+	switch (msg_hdr->kmh_atype) {
+	case KAT_HMAC:
+		len = (msg_hdr->kmh_hmaclen ? msg_hdr->kmh_hmaclen :
+		       strlen(msg_hdr->kmh_hmac));
+
+		kpe_u64(e, KPW_HMACAUTH_ID, (uint64_t)msg_hdr->kmh_id);
+		kpe_sub(e, KPW_HMACAUTH_HMAC, len);
+		e->kpe_hmac = e->kpe_p;
+		kpe_raw(e, msg_hdr->kmh_hmac, len);
+		break;
+
+	case KAT_PIN:
+		kpe_bytes(e, KPW_PINAUTH_PIN,
+			  msg_hdr->kmh_pin, msg_hdr->kmh_pinlen);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void
+kpe_message(struct kpe *e, kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr,
+	    struct kpe_req *r)
+{
+	kpe_i32(e, KPW_MSG_AUTHTYPE, msg_hdr->kmh_atype);
+	kpe_sub(e, r->kr_anum, r->kr_al);
+	kpe_auth(e, msg_hdr);
+
+	kpe_sub(e, KPW_MSG_CMDBYTES, r->kr_cl);
+	e->kpe_cmd = e->kpe_p;
+	kpe_command(e, cmd_hdr, r);
+}
+
+/*
+ * Size and write a request into a new buffer hung on the kio's KIOV_PDU
+ * and KIOV_MSG vectors. kio_sendmsg must already be allocated, with any
+ * value vectors in place, the PDU value length is taken from them.
+ * Returns 0 on success, -1 if the request cannot be encoded or the
+ * reserved slots are not usable.
+ */
+static int
+kpe_request(struct ktli_config *cf, struct kio *kio,
+	    kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, struct kpe_req *r)
+{
+	struct kio_seqslot *ss = &kio->kio_ss;
+	struct kiovec *msg = kio->kio_sendmsg.km_msg;
+	struct kpe e;
+	kpdu_t pdu;
+	uint8_t *buf;
+	size_t ml;
+	int i;
+
+	switch (msg_hdr->kmh_atype) {
+	case KAT_HMAC:
+		r->kr_anum = KPW_MSG_HMACAUTH;
+		break;
+
+	case KAT_PIN:
+		r->kr_anum = KPW_MSG_PINAUTH;
+		break;
+
+	default:
+		return(-1);
+	}
+
+	/* Sizing pass, inside out */
+	kpe_init(&e, NULL);
+	kpe_header(&e, cmd_hdr);
+	r->kr_hl = e.kpe_len;
+
+	if (r->kr_num) {
+		kpe_init(&e, NULL);
+		(r->kr_fn)(&e, cmd_hdr, r->kr_arg);
+		r->kr_il = e.kpe_len;
+		r->kr_bl = kpe_flen(r->kr_num, r->kr_il);
+	}
+
+	kpe_init(&e, NULL);
+	kpe_auth(&e, msg_hdr);
+	r->kr_al = e.kpe_len;
+
+	kpe_init(&e, NULL);
+	kpe_command(&e, cmd_hdr, r);
+	r->kr_cl = e.kpe_len;
+
+	kpe_init(&e, NULL);
+	kpe_message(&e, msg_hdr, cmd_hdr, r);
+	ml = e.kpe_len;
+
+	/* Write pass, the PDU then the message */
+	buf = (uint8_t *) KI_MALLOC(KP_PLENGTH + ml);
+	if (!buf)
+		return(-1);
+
+	pdu.kp_magic  = KP_MAGIC;
+	pdu.kp_msglen = ml;
+	pdu.kp_vallen = 0;
+	for (i = KIOV_VAL; i < kio->kio_sendmsg.km_cnt; i++)
+		pdu.kp_vallen += msg[i].kiov_len;
+	PACK_PDU(&pdu, buf);
+
+	kpe_init(&e, buf + KP_PLENGTH);
+	kpe_message(&e, msg_hdr, cmd_hdr, r);
+
+	if (e.kpe_len != ml) {
+		debug_fprintf(stderr,
+			      "Unexpected amount of bytes encoded. %ld bytes encoded, expected %ld\n",
+			      e.kpe_len, ml);
+		KI_FREE(buf);
+		return(-1);
+	}
+
+	msg[KIOV_PDU].kiov_base = buf;
+	msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
+	msg[KIOV_MSG].kiov_base = buf + KP_PLENGTH;
+	msg[KIOV_MSG].kiov_len  = ml;
+
+	if (!(cf->kcfg_flags & KCFF_SEQSLOT))
+		return(0);
+
+	/* Reserved slots, the same checks as ki_seqslot_locate() */
+	if ((r->kr_anum != KPW_MSG_HMACAUTH) ||
+	    (msg_hdr->kmh_hmaclen != SHA_DIGEST_LENGTH) ||
+	    (kpe_vlen(cmd_hdr->kch_seq) != KP_SEQSLOT_LEN)) {
+		ki_encode_free(msg);
+		return(-1);
+	}
+
+	buf += KP_PLENGTH;
+	ss->kss_seqoff  = e.kpe_seq - buf;
+	ss->kss_cmdoff  = e.kpe_cmd - buf;
+	ss->kss_cmdlen  = r->kr_cl;
+	ss->kss_hmacoff = e.kpe_hmac - buf;
+	ss->kss_hkey    = cf->kcfg_hkey;
+	ss->kss_hkeylen = strlen(cf->kcfg_hkey);
+	ss->kss_hctx    = cf->kcfg_hctx;
+
+	KIOF_SET(kio, KIOF_SEQSLOT);
+	return(0);
+}
+
+/* Command.KeyValue for GET*, PUT and DELETE */
+struct kpe_kv {
+	kv_t	*kpk_kv;
+	int	 kpk_force;
+};
+
+static void
+kpe_kv(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg)
+{
+	struct kpe_kv *k = (struct kpe_kv *)arg;
+	kv_t *kv = k->kpk_kv;
+	int vers;
+
+	switch (cmd_hdr->kch_type) {
+	case KMT_PUT:
+		/* As create_put_message(), versions go as a pair or not at all */
+		vers = (kv->kv_newver != NULL || kv->kv_ver != NULL);
+		if (vers)
+			kpe_bytes(e, KPW_KV_NEWVER, kv->kv_newver, kv->kv_newverlen);
+		kpe_key(e, KPW_KV_KEY, kv->kv_key, kv->kv_keycnt);
+		if (vers)
+			kpe_bytes(e, KPW_KV_DBVER, kv->kv_ver, kv->kv_verlen);
+		kpe_bytes(e, KPW_KV_TAG, kv->kv_disum, kv->kv_disumlen);
+		kpe_i32(e, KPW_KV_ALGO, kv->kv_ditype);
+		kpe_bool(e, KPW_KV_FORCE, k->kpk_force);
+		kpe_i32(e, KPW_KV_SYNC, kv->kv_cpolicy);
+		break;
+
+	case KMT_DEL:
+		if (kv->kv_key)
+			kpe_key(e, KPW_KV_KEY, kv->kv_key, kv->kv_keycnt);
+		kpe_bytes(e, KPW_KV_DBVER, kv->kv_ver, kv->kv_verlen);
+		kpe_bool(e, KPW_KV_FORCE, k->kpk_force);
+		kpe_i32(e, KPW_KV_SYNC, kv->kv_cpolicy);
+		break;
+
+	default:
+		/* GET, GETVERS, GETNEXT and GETPREV */
+		kpe_key(e, KPW_KV_KEY, kv->kv_key, kv->kv_keycnt);
+		kpe_bool(e, KPW_KV_METAONLY, kv->kv_metaonly);
+		break;
+	}
+}
+
+int
+ki_encode_kv(struct ktli_config *cf, struct kio *kio,
+	     kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kv_t *kv, int force)
+{
+	struct kpe_kv k = { .kpk_kv = kv, .kpk_force = force };
+	struct kpe_req r = { .kr_num = KPW_BODY_KV, .kr_fn = kpe_kv,
+			     .kr_arg = &k };
+
+	switch (cmd_hdr->kch_type) {
+	case KMT_GET:
+	case KMT_GETVERS:
+	case KMT_GETNEXT:
+	case KMT_GETPREV:
+	case KMT_PUT:
+		if (!kv->kv_key)
+			return(-1);
+		break;
+
+	case KMT_DEL:
+		break;
+
+	default:
+		return(-1);
+	}
+
+	return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+}
+
+/* Command.Range for GETKEYRANGE */
+static void
+kpe_range(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg)
+{
+	krange_t *kr = (krange_t *)arg;
+
+	if (kr->kr_start)
+		kpe_key(e, KPW_RANGE_START, kr->kr_start, kr->kr_startcnt);
+	if (kr->kr_end)
+		kpe_key(e, KPW_RANGE_END, kr->kr_end, kr->kr_endcnt);
+	kpe_bool(e, KPW_RANGE_ISTART, KR_ISTART(kr));
+	kpe_bool(e, KPW_RANGE_IEND, KR_IEND(kr));
+	kpe_i32(e, KPW_RANGE_MAX, kr->kr_count);
+	kpe_bool(e, KPW_RANGE_REVERSE, KR_REVERSE(kr));
+}
+
+int
+ki_encode_range(struct ktli_config *cf, struct kio *kio,
+		kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, krange_t *kr)
+{
+	struct kpe_req r = { .kr_num = KPW_BODY_RANGE, .kr_fn = kpe_range,
+			     .kr_arg = kr };
+
+	switch (cmd_hdr->kch_type) {
+	case KMT_GETRANGE:
+		return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+
+	default:
+		return(-1);
+	}
+}
+
+/* Command.GetLog for GETLOG */
+static void
+kpe_getlog(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg)
+{
+	kgetlog_t *glog = (kgetlog_t *)arg;
+	char *name = glog->kgl_log.kdl_name;
+	size_t i, len;
+
+	for (i = 0; i < glog->kgl_typecnt; i++)
+		kpe_i32(e, KPW_GETLOG_TYPE, glog->kgl_type[i]);
+
+	if (name) {
+		len = strlen(name);
+		kpe_sub(e, KPW_GETLOG_DEVICE, kpe_flen(KPW_DEVICE_NAME, len));
+		kpe_bytes(e, KPW_DEVICE_NAME, name, len);
+	}
+}
+
+int
+ki_encode_getlog(struct ktli_config *cf, struct kio *kio,
+		 kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kgetlog_t *glog)
+{
+	struct kpe_req r = { .kr_num = KPW_BODY_GETLOG, .kr_fn = kpe_getlog,
+			     .kr_arg = glog };
+
+	switch (cmd_hdr->kch_type) {
+	case KMT_GETLOG:
+		return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+
+	default:
+		return(-1);
+	}
+}
+
+/* Command.Batch for START_BATCH and END_BATCH */
+static void
+kpe_batch(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg)
+{
+	kpe_i32(e, KPW_BATCH_COUNT, *(uint32_t *)arg);
+}
+
+int
+ki_encode_batch(struct ktli_config *cf, struct kio *kio,
+		kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, uint32_t ops)
+{
+	struct kpe_req r = { .kr_num = KPW_BODY_BATCH, .kr_fn = kpe_batch,
+			     .kr_arg = &ops };
+
+	/* As create_command_bytes(), other batch commands have no body */
+	switch (cmd_hdr->kch_type) {
+	case KMT_STARTBAT:
+	case KMT_ENDBAT:
+		break;
+
+	default:
+		r.kr_num = 0;
+		break;
+	}
+
+	return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+}
+
+/*
+ * Command.ManageApplet for MANAGE_APPLET.
+ * ManageApplet is an extension to kinetic.proto and its layout is only
+ * known to the generated code, so its body field number is looked up in
+ * the Body descriptor and the member itself is packed by protobuf-c,
+ * straight into the buffer.
+ */
+static uint32_t
+kpe_appletnum(void)
+{
+	const ProtobufCMessageDescriptor *d =
+		&com__seagate__kinetic__proto__command__body__descriptor;
+	unsigned i;
+
+	for (i = 0; i < d->n_fields; i++)
+		if (d->fields[i].offset == offsetof(kproto_body_t, manageapplet))
+			return(d->fields[i].id);
+	return(0);
+}
+
+static void
+kpe_applet(struct kpe *e, kcmdhdr_t *cmd_hdr, void *arg)
+{
+	const ProtobufCMessage *app = (const ProtobufCMessage *)arg;
+	size_t len;
+
+	if (!e->kpe_p) {
+		kpe_skip(e, protobuf_c_message_get_packed_size(app));
+		return;
+	}
+
+	len = protobuf_c_message_pack(app, e->kpe_p);
+	e->kpe_p   += len;
+	e->kpe_len += len;
+}
+
+int
+ki_encode_applet(struct ktli_config *cf, struct kio *kio,
+		 kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kproto_kapplet_t *app)
+{
+	struct kpe_req r = { .kr_num = kpe_appletnum(), .kr_fn = kpe_applet,
+			     .kr_arg = app };
+
+	switch (cmd_hdr->kch_type) {
+	case KMT_APPLET:
+		if (!r.kr_num)
+			return(-1);
+		return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+
+	default:
+		return(-1);
+	}
+}
+
+/* NOOP and FLUSHALLDATA, an empty body */
+int
+ki_encode_empty(struct ktli_config *cf, struct kio *kio,
+		kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr)
+{
+	struct kpe_req r = { .kr_num = 0 };
+
+	return(kpe_request(cf, kio, msg_hdr, cmd_hdr, &r));
+}
+
+/*
+ * Release an encoded request's buffer. The message normally shares the
+ * PDU's buffer, unless ki_setseq() has since repacked it into its own.
+ */
+void
+ki_encode_free(struct kiovec *msg)
+{
+	uint8_t *buf = (uint8_t *)msg[KIOV_PDU].kiov_base;
+
+	if ((uint8_t *)msg[KIOV_MSG].kiov_base != buf + KP_PLENGTH)
+		KI_FREE(msg[KIOV_MSG].kiov_base);
+	KI_FREE(buf);
+}
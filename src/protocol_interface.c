@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
 #include <openssl/hmac.h>
@@ -66,20 +67,199 @@ typedef Com__Seagate__Kinetic__Proto__Message__HMACauth kauth_hmac;
 typedef Com__Seagate__Kinetic__Proto__Message__PINauth	kauth_pin;
 
 
+/* ------------------------------
+ * Unpack arenas
+ */
+
+/*
+ * Every unpacked Message and Command is decoded into an arena of its own,
+ * a bump allocator over KI_MALLOC chunks, rather than with a malloc per
+ * field, key and string. protobuf-c frees nothing from an arena, the
+ * destroy functions hand the whole arena back at once. Allocations of
+ * the root structure size are preceded by a pointer to their arena, so
+ * the destroy functions can find the arena from the unpacked structure.
+ *
+ * The first chunk is sized from the encoded length, decoding rarely
+ * takes more than twice that, so most unpacks make a single allocation.
+ * Further chunks double, starting at KPA_MIN.
+ */
+#define KPA_MIN		1024			/* Least chunk size */
+#define KPA_ALIGN	8			/* Allocation alignment */
+#define KPA_ROUND(_l)	(((_l) + KPA_ALIGN - 1) & ~((size_t)KPA_ALIGN - 1))
+
+struct kpa_chunk {
+	struct kpa_chunk	*kpc_next;
+	uint64_t		 kpc_data[];
+};
+
+struct kpa_arena {
+	ProtobufCAllocator	 kpa_alloc;	/* Handed to protobuf-c */
+	size_t			 kpa_root;	/* Root structure size */
+	char			*kpa_cur;	/* Free space in the newest chunk */
+	char			*kpa_end;
+	size_t			 kpa_next;	/* Size of the next chunk */
+	struct kpa_chunk	*kpa_chunks;	/* Added chunks, newest first */
+	uint64_t		 kpa_data[];	/* The first chunk */
+};
+
+static void *kpa_alloc(void *ad, size_t len) {
+	struct kpa_arena *a = (struct kpa_arena *) ad;
+	struct kpa_chunk *c;
+	size_t pre, need, clen;
+	char *p;
+
+	// Room for the arena pointer ahead of a root structure
+	pre  = (len == a->kpa_root) ? KPA_ALIGN : 0;
+	need = pre + KPA_ROUND(len);
+
+	if (need > (size_t)(a->kpa_end - a->kpa_cur)) {
+		clen = a->kpa_next;
+		while (clen < need) { clen *= 2; }
+
+		c = (struct kpa_chunk *) KI_MALLOC(sizeof(*c) + clen);
+		if (!c) { return NULL; }
+
+		c->kpc_next   = a->kpa_chunks;
+		a->kpa_chunks = c;
+		a->kpa_cur    = (char *) c->kpc_data;
+		a->kpa_end    = a->kpa_cur + clen;
+		a->kpa_next   = clen * 2;
+	}
+
+	p = a->kpa_cur + pre;
+	a->kpa_cur += need;
+
+	if (pre) { ((struct kpa_arena **) p)[-1] = a; }
+
+	return p;
+}
+
+static void kpa_free(void *ad, void *p) {
+	// Released with the arena, see kpa_destroy()
+}
+
+static struct kpa_arena *kpa_create(size_t root, size_t enclen) {
+	struct kpa_arena *a;
+	size_t len = KPA_ROUND(2 * enclen + KPA_MIN);
+
+	a = (struct kpa_arena *) KI_MALLOC(sizeof(*a) + len);
+	if (!a) { return NULL; }
+
+	a->kpa_alloc.alloc          = kpa_alloc;
+	a->kpa_alloc.free           = kpa_free;
+	a->kpa_alloc.allocator_data = a;
+	a->kpa_root   = root;
+	a->kpa_cur    = (char *) a->kpa_data;
+	a->kpa_end    = a->kpa_cur + len;
+	a->kpa_next   = KPA_MIN;
+	a->kpa_chunks = NULL;
+
+	return a;
+}
+
+static void kpa_destroy(struct kpa_arena *a) {
+	struct kpa_chunk *c;
+
+	while ((c = a->kpa_chunks)) {
+		a->kpa_chunks = c->kpc_next;
+		KI_FREE(c);
+	}
+	KI_FREE(a);
+}
+
+// The arena an unpacked root structure was decoded into
+static struct kpa_arena *kpa_of(void *root) {
+	return ((struct kpa_arena **) root)[-1];
+}
+
+
 /* ------------------------------
  * Auth Functions
  */
 
-int compute_hmac(kproto_msg_t *msg_data, char *key, uint32_t key_len) {
-	int result_status;
+/*
+ * Each thread keeps its own HMAC context so that computing an HMAC does
+ * not allocate one. It is released when the thread exits.
+ */
+static pthread_key_t  ki_hctx_key;
+static pthread_once_t ki_hctx_once = PTHREAD_ONCE_INIT;
+
+static void
+ki_hctx_free(void *hctx)
+{
+	HMAC_CTX_free((HMAC_CTX *)hctx);
+}
+
+static void
+ki_hctx_keyinit(void)
+{
+	(void)pthread_key_create(&ki_hctx_key, ki_hctx_free);
+}
 
-	HMAC_CTX *hmac_context = HMAC_CTX_new();
+static HMAC_CTX *
+ki_hctx(void)
+{
+	HMAC_CTX *hctx;
+
+	(void)pthread_once(&ki_hctx_once, ki_hctx_keyinit);
+
+	hctx = (HMAC_CTX *)pthread_getspecific(ki_hctx_key);
+	if (!hctx) {
+		if (!(hctx = HMAC_CTX_new()))
+			return(NULL);
+		(void)pthread_setspecific(ki_hctx_key, hctx);
+	}
+	return(hctx);
+}
+
+/*
+ * Key an HMAC context once for a session's key. Keying hashes the inner
+ * and outer padded key, two SHA1 blocks plus digest setup, so each message
+ * copies this keyed state instead, see ki_hmac_init(). Returns NULL on
+ * failure, messages are then keyed one at a time.
+ */
+void *
+ki_hmac_prekey(char *key, uint32_t key_len)
+{
+	HMAC_CTX *pkey;
+
+	if (!(pkey = HMAC_CTX_new()))
+		return(NULL);
+
+	if (!HMAC_Init_ex(pkey, key, key_len, EVP_sha1(), NULL)) {
+		HMAC_CTX_free(pkey);
+		return(NULL);
+	}
+	return(pkey);
+}
+
+/*
+ * Ready this thread's HMAC context for a message, from the pre-keyed
+ * state if there is one, else from the key.
+ */
+static HMAC_CTX *
+ki_hmac_init(void *pkey, char *key, uint32_t key_len)
+{
+	HMAC_CTX *hctx;
+
+	if (!(hctx = ki_hctx()))
+		return(NULL);
 
-	// to self-document that we are using the default ENGINE (or whatever this param is used for)
-	ENGINE *hash_impl = NULL;
+	if (pkey) {
+		if (!HMAC_CTX_copy(hctx, (HMAC_CTX *)pkey))
+			return(NULL);
+	} else if (!HMAC_Init_ex(hctx, key, key_len, EVP_sha1(), NULL)) {
+		return(NULL);
+	}
+	return(hctx);
+}
+
+int compute_hmac(kproto_msg_t *msg_data, char *key, uint32_t key_len) {
+	int result_status;
 
-	result_status = HMAC_Init_ex(hmac_context, key, key_len, EVP_sha1(), hash_impl);
-	if (!result_status) { return -1; }
+	// this thread's context, keyed for this message
+	HMAC_CTX *hmac_context = ki_hmac_init(NULL, key, key_len);
+	if (!hmac_context) { return -1; }
 
 	// TODO: what if the message has no command bytes?
 	if (msg_data->has_commandbytes) {
@@ -101,16 +281,19 @@ int compute_hmac(kproto_msg_t *msg_data, char *key, uint32_t key_len) {
 	}
 
 	// finalize the digest into a string (allocated)
-	void *hmac_digest = KI_MALLOC(sizeof(char) * SHA_DIGEST_LENGTH);
+	// malloc, not KI_MALLOC, protobuf-c frees it with the message
+	void *hmac_digest = malloc(sizeof(char) * SHA_DIGEST_LENGTH);
+	if (!hmac_digest) { return -1; }
+
 	result_status = HMAC_Final(
 		hmac_context,
 		(unsigned char *) hmac_digest,
 		(unsigned int *) &(msg_data->hmacauth->hmac.len)
 	);
-	if (!result_status) { return -1; }
-
-	// free the HMAC context (leaves the result intact)
-	HMAC_CTX_free(hmac_context);
+	if (!result_status) {
+		free(hmac_digest);
+		return -1;
+	}
 
 	// set the hmac auth to the result
 	msg_data->hmacauth->has_hmac = 1;
@@ -127,7 +310,7 @@ char *helper_bytes_to_str(ProtobufCBinaryData proto_bytes) {
 	size_t proto_len = proto_bytes.len;
 
 	// allocate and copy byte data
-	char *str_buffer = (char *) KI_MALLOC(sizeof(char) * (proto_len + 1));
+	char *str_buffer = (char *) malloc(sizeof(char) * (proto_len + 1));
 	if (!str_buffer) { return NULL; }
 
 	memcpy(str_buffer, proto_bytes.data, proto_len);
@@ -167,8 +350,9 @@ struct kresult_message unpack_response(struct kbuffer response_buffer) {
 
 ProtobufCBinaryData pack_kinetic_command(kproto_cmd_t *cmd_data) {
 	// Get size for command and allocate buffer
+	// malloc, not KI_MALLOC, protobuf-c frees it with the message
 	size_t	 command_size	= com__seagate__kinetic__proto__command__get_packed_size(cmd_data);
-	uint8_t *command_buffer = (uint8_t *) KI_MALLOC(sizeof(uint8_t) * command_size);
+	uint8_t *command_buffer = (uint8_t *) malloc(sizeof(uint8_t) * command_size);
 
 	if (command_buffer == NULL) { goto pack_failure; }
 
@@ -192,13 +376,16 @@ ProtobufCBinaryData pack_kinetic_command(kproto_cmd_t *cmd_data) {
 }
 
 kproto_cmd_t *unpack_kinetic_command(ProtobufCBinaryData commandbytes) {
-	// a NULL allocator defaults to system allocator (malloc)
-	ProtobufCAllocator *mem_allocator = NULL;
+	// decoded into an arena, released by destroy_command()
+	struct kpa_arena *arena = kpa_create(sizeof(kproto_cmd_t), commandbytes.len);
+	if (!arena) { return NULL; }
 
 	kproto_cmd_t *unpacked_cmd = com__seagate__kinetic__proto__command__unpack(
-		mem_allocator, commandbytes.len, (uint8_t *) commandbytes.data
+		&arena->kpa_alloc, commandbytes.len, (uint8_t *) commandbytes.data
 	);
 
+	if (!unpacked_cmd) { kpa_destroy(arena); }
+
 	return unpacked_cmd;
 }
 
@@ -230,12 +417,17 @@ enum kresult_code pack_kinetic_message(kproto_msg_t *msg_data, void **result_buf
 }
 
 struct kresult_message unpack_kinetic_message(void *response_buffer, size_t response_size) {
-	// a NULL allocator defaults to system allocator (malloc)
-	ProtobufCAllocator *mem_allocator = NULL;
+	// decoded into an arena, released by destroy_unpacked_message()
+	kproto_msg_t *unpacked_msg = NULL;
+	struct kpa_arena *arena = kpa_create(sizeof(kproto_msg_t), response_size);
 
-	kproto_msg_t *unpacked_msg = com__seagate__kinetic__proto__message__unpack(
-		mem_allocator, response_size, (const uint8_t *) response_buffer
-	);
+	if (arena) {
+		unpacked_msg = com__seagate__kinetic__proto__message__unpack(
+			&arena->kpa_alloc, response_size, (const uint8_t *) response_buffer
+		);
+
+		if (!unpacked_msg) { kpa_destroy(arena); }
+	}
 
 	return (struct kresult_message) {
 		.result_code    = unpacked_msg == NULL ? FAILURE : SUCCESS,
@@ -301,7 +493,8 @@ ProtobufCBinaryData create_command_bytes(kcmdhdr_t *cmd_hdr, void *proto_cmd_dat
 }
 
 struct kresult_message create_message(kmsghdr_t *msg_hdr, ProtobufCBinaryData cmd_bytes) {
-	kproto_msg_t *kinetic_msg = (kproto_msg_t *) KI_MALLOC(sizeof(kproto_msg_t));
+	// The message is freed by protobuf-c, destroy_message(), so use malloc
+	kproto_msg_t *kinetic_msg = (kproto_msg_t *) malloc(sizeof(kproto_msg_t));
 	if (kinetic_msg == NULL) {
 		goto create_failure;
 	}
@@ -318,7 +511,7 @@ struct kresult_message create_message(kmsghdr_t *msg_hdr, ProtobufCBinaryData cm
 			kinetic_msg->has_authtype = 1;
 			kinetic_msg->authtype	  = KAT_HMAC;
 
-			kauth_hmac *msg_auth_hmac = (kauth_hmac *) KI_MALLOC(sizeof(kauth_hmac));
+			kauth_hmac *msg_auth_hmac = (kauth_hmac *) malloc(sizeof(kauth_hmac));
 			if (!msg_auth_hmac) { goto create_failure; }
 
 			com__seagate__kinetic__proto__message__hmacauth__init(msg_auth_hmac);
@@ -330,7 +523,9 @@ struct kresult_message create_message(kmsghdr_t *msg_hdr, ProtobufCBinaryData cm
 
 			kinetic_msg->hmacauth->has_hmac = 1;
 			kinetic_msg->hmacauth->hmac.data = msg_hdr->kmh_hmac;
-			kinetic_msg->hmacauth->hmac.len  = strlen(msg_hdr->kmh_hmac);
+			kinetic_msg->hmacauth->hmac.len  = (msg_hdr->kmh_hmaclen ?
+							    msg_hdr->kmh_hmaclen :
+							    strlen(msg_hdr->kmh_hmac));
 #if 0
 			int hmac_result = compute_hmac(kinetic_msg, (char *) msg_hdr->kmh_hmac, msg_hdr->kmh_hmaclen);
 #endif
@@ -340,7 +535,7 @@ struct kresult_message create_message(kmsghdr_t *msg_hdr, ProtobufCBinaryData cm
 			kinetic_msg->has_authtype = 1;
 			kinetic_msg->authtype	  = KAT_PIN;
 
-			kauth_pin *msg_auth_pin = (kauth_pin *) KI_MALLOC(sizeof(kauth_pin));
+			kauth_pin *msg_auth_pin = (kauth_pin *) malloc(sizeof(kauth_pin));
 			if (!msg_auth_pin) { goto create_failure; }
 
 			com__seagate__kinetic__proto__message__pinauth__init(msg_auth_pin);
@@ -433,7 +628,7 @@ extract_cmdstatus_msg(kproto_cmd_t *protobuf_command, char **msg, size_t *len)
 
 	// copy protobuf string (strlen + 1 accounts for a null byte)
 	*len	= strlen(response_status->statusmessage) + 1;
-	*msg	= (char *) KI_MALLOC(*len);
+	*msg	= (char *) malloc(*len);
 	if (!(*msg)) {
 		debug_printf("extract_getstatus_msg: msg alloc");
 		return(K_EINTERNAL);
@@ -462,7 +657,7 @@ extract_cmdstatus_dmsg(kproto_cmd_t *protobuf_command, char **msg, size_t *len)
 		
 	// copy protobuf string (strlen + 1 accounts for a null byte)
 	*len	= response_status->detailedmessage.len + 1;
-	*msg	= (char *) KI_MALLOC(*len);
+	*msg	= (char *) malloc(*len);
 	if (!(*msg)) {
 		debug_printf("extract_getstatus_msg: msg alloc");
 		return(K_EINTERNAL);
@@ -531,7 +726,7 @@ int keyname_to_proto(ProtobufCBinaryData *proto_keyname, struct kiovec *keynames
 	}
 
 	// create a buffer containing the key name
-	char *key_buffer = (char *) KI_MALLOC(sizeof(char) * total_keylen);
+	char *key_buffer = (char *) malloc(sizeof(char) * total_keylen);
 	if (key_buffer == NULL) { return 0; }
 
 	// gather key name fragments into key buffer
@@ -546,7 +741,7 @@ int keyname_to_proto(ProtobufCBinaryData *proto_keyname, struct kiovec *keynames
 		key_buffer_alias += keynames[key_ndx].kiov_len;
 	}
 
-	// key_buffer eventually needs to be `free`d
+	// key_buffer eventually needs to be `free`d, so it is malloc-ed
 	*proto_keyname = (ProtobufCBinaryData) {
 		.data = (uint8_t *) key_buffer,
 		.len  =             total_keylen,
@@ -560,45 +755,242 @@ int keyname_to_proto(ProtobufCBinaryData *proto_keyname, struct kiovec *keynames
  * Helper functions for ktli
  */
 
-// TODO: remove unnecessary allocations later
-uint64_t ki_getaseq(struct kiovec *msg, int msgcnt) {
-	uint64_t ack_seq = -1;
-	kpdu_t pdu;
+/*
+ * Protobuf wire format scanning.
+ * These walk packed protobuf bytes in place, decoding only the tags and
+ * lengths needed to locate a field. Nothing is allocated.
+ */
+/* Wire types and field numbers are in protocol_interface.h */
+struct kpw_field {
+	uint32_t	 kpf_num;	/* Field number */
+	uint32_t	 kpf_wtype;	/* Wire type */
+	uint64_t	 kpf_val;	/* Varint value or LEN length */
+	uint8_t		*kpf_data;	/* First byte of the field value */
+	size_t		 kpf_len;	/* Encoded length of the field value */
+};
+
+/* Decode a varint at p, returns the byte past it or NULL if malformed */
+static uint8_t *
+kpw_varint(uint8_t *p, uint8_t *end, uint64_t *v)
+{
+	uint64_t r = 0;
+	int s;
+
+	for (s = 0; (p < end) && (s < 64); s += 7, p++) {
+		r |= (uint64_t)(*p & 0x7f) << s;
+		if (!(*p & 0x80)) {
+			*v = r;
+			return(p + 1);
+		}
+	}
+	return(NULL);
+}
 
-	//ERROR: not enough messages
-	if (KIOV_MSG >= msgcnt) { return 0; }
+/* Decode the field at p, returns the byte past it or NULL if malformed */
+static uint8_t *
+kpw_next(uint8_t *p, uint8_t *end, struct kpw_field *f)
+{
+	uint64_t tag;
+
+	if (!(p = kpw_varint(p, end, &tag)))
+		return(NULL);
+
+	f->kpf_num   = (uint32_t)(tag >> 3);
+	f->kpf_wtype = (uint32_t)(tag & 0x7);
+	f->kpf_data  = p;
+
+	switch (f->kpf_wtype) {
+	case KPW_VARINT:
+		if (!(p = kpw_varint(p, end, &f->kpf_val)))
+			return(NULL);
+		f->kpf_len = p - f->kpf_data;
+		return(p);
+
+	case KPW_LEN:
+		if (!(p = kpw_varint(p, end, &f->kpf_val)))
+			return(NULL);
+		if (f->kpf_val > (uint64_t)(end - p))
+			return(NULL);
+		f->kpf_data = p;
+		f->kpf_len  = f->kpf_val;
+		return(p + f->kpf_len);
+
+	case KPW_I64:
+		f->kpf_len = 8;
+		break;
+
+	case KPW_I32:
+		f->kpf_len = 4;
+		break;
+
+	default:
+		return(NULL);
+	}
 
-	/* 
-	 * Now unpack the message remember KIOV_MSG 
-	 * may contain both msg and value
-	 */
-	UNPACK_PDU(&pdu, (uint8_t *)msg[KIOV_PDU].kiov_base);
-	// walk the message first
-	struct kresult_message unpack_result = unpack_kinetic_message(
-		msg[KIOV_MSG].kiov_base, pdu.kp_msglen 
-	);
+	if (f->kpf_len > (size_t)(end - p))
+		return(NULL);
+	return(p + f->kpf_len);
+}
 
-	if (unpack_result.result_code == FAILURE) {
-		//TODO: we won't allocate in the future, but we should figure out what to do for errors
-		return 0;
+/* Find the first field num of type wtype in buf, 0 on success -1 if not */
+static int
+kpw_find(uint8_t *buf, size_t len, uint32_t num, uint32_t wtype,
+	 struct kpw_field *f)
+{
+	uint8_t *p = buf, *end = buf + len;
+
+	while (p < end) {
+		if (!(p = kpw_next(p, end, f)))
+			return(-1);
+		if (f->kpf_num == num)
+			return((f->kpf_wtype == wtype) ? 0 : -1);
 	}
+	return(-1);
+}
 
-	kproto_msg_t *tmp_msg = (kproto_msg_t *) unpack_result.result_message;
+/*
+ * Reserved sequence slot encoding.
+ * ki_setseq() below has to unpack, modify and repack a request to set its
+ * sequence, then recompute the HMAC and repack again. When the session
+ * has KCFF_SEQSLOT set, requests are instead built with a placeholder
+ * sequence of KP_SEQSLOT, which always encodes as a KP_SEQSLOT_LEN byte
+ * varint, and a SHA_DIGEST_LENGTH placeholder HMAC. After packing,
+ * ki_seqslot_locate() records where these live in the packed message, and
+ * ki_stampseq() can then overwrite both in place from the sender thread.
+ * Only HMAC authenticated requests may be reserved.
+ *
+ * The stamped sequence is written as a padded, non-minimal varint of
+ * KP_SEQSLOT_LEN bytes which is valid protobuf and decodes to the same
+ * value.
+ */
+static uint8_t ki_hmacslot[SHA_DIGEST_LENGTH];
 
+void
+ki_seqslot_reserve(struct ktli_config *cf,
+		   kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr)
+{
+	if (!(cf->kcfg_flags & KCFF_SEQSLOT))
+		return;
 
-	// then walk the command
-	kproto_cmd_t *tmp_cmd = unpack_kinetic_command(tmp_msg->commandbytes);
+	msg_hdr->kmh_hmac    = ki_hmacslot;
+	msg_hdr->kmh_hmaclen = SHA_DIGEST_LENGTH;
+	cmd_hdr->kch_seq     = KP_SEQSLOT;
+}
 
-	// extract the ack sequence field
-	if (tmp_cmd->header->has_acksequence) {
-		ack_seq = tmp_cmd->header->acksequence;
+int
+ki_seqslot_locate(struct ktli_config *cf, struct kio *kio)
+{
+	struct kio_seqslot *ss = &kio->kio_ss;
+	struct kpw_field f, sf;
+	uint8_t *msg;
+	size_t len;
+
+	if (!(cf->kcfg_flags & KCFF_SEQSLOT))
+		return(0);
+
+	msg = (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base;
+	len = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
+
+	/* Message.hmacAuth.hmac, must be the placeholder */
+	if ((kpw_find(msg, len, KPW_MSG_HMACAUTH, KPW_LEN, &f) < 0) ||
+	    (kpw_find(f.kpf_data, f.kpf_len,
+		      KPW_HMACAUTH_HMAC, KPW_LEN, &sf) < 0) ||
+	    (sf.kpf_len != SHA_DIGEST_LENGTH))
+		return(-1);
+	ss->kss_hmacoff = sf.kpf_data - msg;
+
+	/* Message.commandBytes */
+	if (kpw_find(msg, len, KPW_MSG_CMDBYTES, KPW_LEN, &f) < 0)
+		return(-1);
+	ss->kss_cmdoff = f.kpf_data - msg;
+	ss->kss_cmdlen = f.kpf_len;
+
+	/* Command.header.sequence, must be the full width slot */
+	if ((kpw_find(f.kpf_data, f.kpf_len,
+		      KPW_CMD_HEADER, KPW_LEN, &sf) < 0) ||
+	    (kpw_find(sf.kpf_data, sf.kpf_len,
+		      KPW_HDR_SEQ, KPW_VARINT, &f) < 0) ||
+	    (f.kpf_len != KP_SEQSLOT_LEN))
+		return(-1);
+	ss->kss_seqoff = f.kpf_data - msg;
+
+	ss->kss_hkey    = cf->kcfg_hkey;
+	ss->kss_hkeylen = strlen(cf->kcfg_hkey);
+	ss->kss_hctx    = cf->kcfg_hctx;
+
+	KIOF_SET(kio, KIOF_SEQSLOT);
+	return(0);
+}
+
+int
+ki_stampseq(struct kio *kio, uint64_t seq)
+{
+	struct kio_seqslot *ss = &kio->kio_ss;
+	HMAC_CTX *hctx;
+	uint8_t *msg, *p;
+	uint32_t cmdlen_be;
+	unsigned int hlen;
+	int i;
+
+	msg = (uint8_t *)kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base;
+
+	/* Stamp the seq, 7 bits at a time, as a KP_SEQSLOT_LEN byte varint */
+	p = msg + ss->kss_seqoff;
+	for (i = 0; i < KP_SEQSLOT_LEN - 1; i++, seq >>= 7)
+		p[i] = (uint8_t)((seq & 0x7f) | 0x80);
+	p[i] = (uint8_t)(seq & 0x7f);
+
+	/* HMAC the command bytes straight into the reserved HMAC field */
+	if (!(hctx = ki_hmac_init(ss->kss_hctx, ss->kss_hkey, ss->kss_hkeylen))) {
+		debug_printf("stampseq: HMAC init failed\n");
+		return(-1);
 	}
 
-	// TODO: since we allocate currently, we need to clean up
-	destroy_command(tmp_cmd);
-	destroy_message(tmp_msg);
+	cmdlen_be = htonl(ss->kss_cmdlen);
+	if (!HMAC_Update(hctx, (unsigned char *)&cmdlen_be, sizeof(uint32_t)) ||
+	    !HMAC_Update(hctx, msg + ss->kss_cmdoff, ss->kss_cmdlen) ||
+	    !HMAC_Final(hctx, msg + ss->kss_hmacoff, &hlen)) {
+		debug_printf("stampseq: HMAC failed\n");
+		return(-1);
+	}
+	return(0);
+}
 
-	return ack_seq;
+/*
+ * Extract the ackSequence from a received message without unpacking it.
+ * Walks Message.commandBytes -> Command.header -> Header.ackSequence in
+ * place. The location of the command bytes is left in rs so that the
+ * completion path can skip decoding the outer message, see
+ * unpack_response_message().
+ * Returns the ackSequence, -1 if the message has none (unsolicited) and 0
+ * if the message could not be scanned.
+ */
+uint64_t ki_getaseq(struct kiovec *msg, int msgcnt, struct kio_rscan *rs) {
+	struct kpw_field f, hf;
+	uint8_t *buf;
+	size_t len;
+
+	// ERROR: not enough messages
+	if (KIOV_MSG >= msgcnt) { return 0; }
+
+	buf = (uint8_t *)msg[KIOV_MSG].kiov_base;
+	len = msg[KIOV_MSG].kiov_len;
+
+	if (kpw_find(buf, len, KPW_MSG_CMDBYTES, KPW_LEN, &f) < 0)
+		return 0;
+
+	if (rs) {
+		rs->krs_cmdoff = f.kpf_data - buf;
+		rs->krs_cmdlen = f.kpf_len;
+	}
+
+	if (kpw_find(f.kpf_data, f.kpf_len, KPW_CMD_HEADER, KPW_LEN, &hf) < 0)
+		return 0;
+
+	if (kpw_find(hf.kpf_data, hf.kpf_len, KPW_HDR_ACKSEQ, KPW_VARINT, &f) < 0)
+		return -1;
+
+	return f.kpf_val;
 }
 
 // TODO: remove unnecessary allocations later
@@ -629,20 +1021,23 @@ void ki_setseq(struct kiovec *msg, int msgcnt, uint64_t seq) {
 	tmp_cmd->header->sequence     = seq;
 
 	// pack field
-	// Free the previous commandbytes and then set it to the newly packed commandbytes
+	// The previous commandbytes go with the arena, the newly packed ones are ours
 	// TODO: we eventually want to only have to pack the new field
-	KI_FREE(tmp_msg->commandbytes.data);
 	tmp_msg->commandbytes = pack_kinetic_command(tmp_cmd);
 
     // TODO: figure out if there's a better way to fail if hmac or repack fail
+	uint8_t *hmac_key = tmp_msg->hmacauth->hmac.data;
 	compute_hmac(
 		tmp_msg,
-		(char *) tmp_msg->hmacauth->hmac.data,
+		(char *) hmac_key,
 		tmp_msg->hmacauth->hmac.len
 	);
 
 	// Free the previous packed message and then set it to the newly packed message
-	KI_FREE(msg[KIOV_MSG].kiov_base);
+	// An encoded request's message shares the PDU buffer, see ki_encode_free()
+	if ((uint8_t *) msg[KIOV_MSG].kiov_base != (uint8_t *) msg[KIOV_PDU].kiov_base + KP_PLENGTH) {
+		KI_FREE(msg[KIOV_MSG].kiov_base);
+	}
 	pack_kinetic_message(
 		tmp_msg,
 		&(msg[KIOV_MSG].kiov_base),
@@ -658,16 +1053,58 @@ void ki_setseq(struct kiovec *msg, int msgcnt, uint64_t seq) {
 	PACK_PDU(&pdu, (uint8_t *) msg[KIOV_PDU].kiov_base);
 
 	// TODO: since we allocate currently, we need to clean up
+	// The repacked commandbytes and the new HMAC are not in the arena
+	free(tmp_msg->commandbytes.data);
+	if (tmp_msg->hmacauth->hmac.data != hmac_key) {
+		free(tmp_msg->hmacauth->hmac.data);
+	}
 	destroy_command(tmp_cmd);
-	destroy_message(unpack_result.result_message);
+	destroy_unpacked_message(unpack_result.result_message);
 }
 
 /* ------------------------------
  * Resource management functions
  */
 
+/*
+ * Unpack the response message hung on a received kio. When the receiver
+ * has already scanned the message (KIOF_RSCAN) the outer Message is not
+ * decoded again; a shell message held in the kio, whose commandbytes point
+ * directly into the received buffer, is returned instead. Either way the
+ * result must be released with destroy_response_message() before the kio
+ * or its receive buffers are freed.
+ */
+struct kresult_message unpack_response_message(struct kio *kio) {
+	struct kiovec *kiov = &kio->kio_recvmsg.km_msg[KIOV_MSG];
+	struct kio_rscan *rs = &kio->kio_rs;
+
+	if (!KIOF_ISSET(kio, KIOF_RSCAN) ||
+	    ((size_t)rs->krs_cmdoff + rs->krs_cmdlen > kiov->kiov_len)) {
+		return unpack_kinetic_message(kiov->kiov_base, kiov->kiov_len);
+	}
+
+	com__seagate__kinetic__proto__message__init(&rs->krs_msg);
+	rs->krs_msg.has_commandbytes = 1;
+	rs->krs_msg.commandbytes     = (ProtobufCBinaryData) {
+		.len  =              rs->krs_cmdlen,
+		.data = (uint8_t *) kiov->kiov_base + rs->krs_cmdoff,
+	};
+
+	return (struct kresult_message) {
+		.result_code    = SUCCESS,
+		.result_message = (void *) &rs->krs_msg,
+	};
+}
+
+void destroy_response_message(struct kio *kio, void *unpacked_msg) {
+	// The shell message owns nothing
+	if (unpacked_msg == (void *) &kio->kio_rs.krs_msg) { return; }
+
+	destroy_unpacked_message(unpacked_msg);
+}
+
+// For messages built by create_message(), their parts come from malloc(3)
 void destroy_message(void *unpacked_msg) {
-	// At some point, it would be best to make sure the allocator used in `unpack` is used here
 	ProtobufCAllocator *mem_allocator = NULL;
 
 	com__seagate__kinetic__proto__message__free_unpacked(
@@ -676,12 +1113,16 @@ void destroy_message(void *unpacked_msg) {
 	);
 }
 
+// For messages from unpack_kinetic_message(), releases their arena
+void destroy_unpacked_message(void *unpacked_msg) {
+	if (!unpacked_msg) { return; }
+
+	kpa_destroy(kpa_of(unpacked_msg));
+}
+
+// Commands only come from unpack_kinetic_command(), releases their arena
 void destroy_command(void *unpacked_cmd) {
-	// At some point, it would be best to make sure the allocator used in `unpack` is used here
-	ProtobufCAllocator *mem_allocator = NULL;
+	if (!unpacked_cmd) { return; }
 
-	com__seagate__kinetic__proto__command__free_unpacked(
-		(kproto_cmd_t *) unpacked_cmd,
-		mem_allocator
-	);
+	kpa_destroy(kpa_of(unpacked_cmd));
 }
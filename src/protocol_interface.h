@@ -20,6 +20,10 @@
 
 #include "kinetic_types.h"
 
+struct kio;
+struct kio_rscan;
+struct ktli_config;
+
 
 // ------------------------------
 // Macros for PDU (Protocol Data Unit) Structure
@@ -62,6 +66,70 @@
 	} while(0);
 
 
+// Reserved sequence slot, see ki_seqslot_reserve()
+#define KP_SEQSLOT	((kseq_t) -1)	// Placeholder seq, encodes full width
+#define KP_SEQSLOT_LEN	10		// Bytes in a full width varint
+
+
+// ------------------------------
+// Protobuf wire format, for the scanners and the request encoder
+
+// Wire types
+#define KPW_VARINT	0
+#define KPW_I64		1
+#define KPW_LEN		2
+#define KPW_I32		5
+
+// kinetic.proto field numbers
+#define KPW_MSG_AUTHTYPE	4	// Message.authType
+#define KPW_MSG_HMACAUTH	5	// Message.hmacAuth
+#define KPW_MSG_PINAUTH		6	// Message.pinAuth
+#define KPW_MSG_CMDBYTES	7	// Message.commandBytes
+#define KPW_HMACAUTH_ID		1	// Message.HMACauth.identity
+#define KPW_HMACAUTH_HMAC	2	// Message.HMACauth.hmac
+#define KPW_PINAUTH_PIN		1	// Message.PINauth.pin
+
+#define KPW_CMD_HEADER		1	// Command.header
+#define KPW_CMD_BODY		2	// Command.body
+
+#define KPW_HDR_CLUSTVERS	1	// Command.Header.clusterVersion
+#define KPW_HDR_CONNID		3	// Command.Header.connectionID
+#define KPW_HDR_SEQ		4	// Command.Header.sequence
+#define KPW_HDR_ACKSEQ		6	// Command.Header.ackSequence
+#define KPW_HDR_TYPE		7	// Command.Header.messageType
+#define KPW_HDR_TIMEOUT		9	// Command.Header.timeout
+#define KPW_HDR_PRI		12	// Command.Header.priority
+#define KPW_HDR_QUANTA		13	// Command.Header.TimeQuanta
+#define KPW_HDR_BID		14	// Command.Header.batchID
+
+#define KPW_BODY_KV		1	// Command.Body.keyValue
+#define KPW_BODY_RANGE		2	// Command.Body.range
+#define KPW_BODY_GETLOG		6	// Command.Body.getLog
+#define KPW_BODY_BATCH		9	// Command.Body.batch
+
+#define KPW_KV_NEWVER		2	// Command.KeyValue.newVersion
+#define KPW_KV_KEY		3	// Command.KeyValue.key
+#define KPW_KV_DBVER		4	// Command.KeyValue.dbVersion
+#define KPW_KV_TAG		5	// Command.KeyValue.tag
+#define KPW_KV_ALGO		6	// Command.KeyValue.algorithm
+#define KPW_KV_METAONLY		7	// Command.KeyValue.metadataOnly
+#define KPW_KV_FORCE		8	// Command.KeyValue.force
+#define KPW_KV_SYNC		9	// Command.KeyValue.synchronization
+
+#define KPW_RANGE_START		1	// Command.Range.startKey
+#define KPW_RANGE_END		2	// Command.Range.endKey
+#define KPW_RANGE_ISTART	3	// Command.Range.startKeyInclusive
+#define KPW_RANGE_IEND		4	// Command.Range.endKeyInclusive
+#define KPW_RANGE_MAX		5	// Command.Range.maxReturned
+#define KPW_RANGE_REVERSE	6	// Command.Range.reverse
+
+#define KPW_GETLOG_TYPE		1	// Command.GetLog.types
+#define KPW_GETLOG_DEVICE	9	// Command.GetLog.device
+#define KPW_DEVICE_NAME		1	// Command.GetLog.Device.name
+
+#define KPW_BATCH_COUNT		1	// Command.Batch.count
+
+
 // ------------------------------
 // conversion to and from protobuf structures
 int keyname_to_proto(ProtobufCBinaryData *proto_keyval, struct kiovec *keynames, size_t keycnt);
@@ -104,21 +172,49 @@ struct kresult_message create_message(kmsghdr_t *msg_hdr, ProtobufCBinaryData cm
 struct kresult_message create_getlog_message(kmsghdr_t *, kcmdhdr_t *, kgetlog_t *);
 
 
+// ------------------------------
+// direct request encoding, see protocol_encode.c
+int  ki_encode_kv(struct ktli_config *cf, struct kio *kio,
+		  kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kv_t *kv, int force);
+int  ki_encode_range(struct ktli_config *cf, struct kio *kio,
+		     kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, krange_t *kr);
+int  ki_encode_getlog(struct ktli_config *cf, struct kio *kio,
+		      kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, kgetlog_t *glog);
+int  ki_encode_batch(struct ktli_config *cf, struct kio *kio,
+		     kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr, uint32_t ops);
+int  ki_encode_applet(struct ktli_config *cf, struct kio *kio,
+		      kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr,
+		      kproto_kapplet_t *app);
+int  ki_encode_empty(struct ktli_config *cf, struct kio *kio,
+		     kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr);
+void ki_encode_free(struct kiovec *msg);
+
+
 // ------------------------------
 // resource management
 void destroy_command(void *unpacked_cmd);
 void destroy_message(void *unpacked_msg);
+void destroy_unpacked_message(void *unpacked_msg);
+
+struct kresult_message unpack_response_message(struct kio *kio);
+void destroy_response_message(struct kio *kio, void *unpacked_msg);
 
 
 // ------------------------------
 // helpers for ktli (transport layer) to access specific message fields
-uint64_t ki_getaseq(struct kiovec *msg, int msgcnt);
+uint64_t ki_getaseq(struct kiovec *msg, int msgcnt, struct kio_rscan *rs);
 void     ki_setseq(struct kiovec *msg, int msgcnt, uint64_t seq);
+int      ki_stampseq(struct kio *kio, uint64_t seq);
+
+void ki_seqslot_reserve(struct ktli_config *cf,
+			kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr);
+int  ki_seqslot_locate(struct ktli_config *cf, struct kio *kio);
 
 
 // ------------------------------
 // helpers for data processing
-int compute_hmac(kproto_msg_t *msg_data, char *key, uint32_t key_len);
+int   compute_hmac(kproto_msg_t *msg_data, char *key, uint32_t key_len);
+void *ki_hmac_prekey(char *key, uint32_t key_len);
 
 
 #endif // __PROTOCOL_INTERFACE_H
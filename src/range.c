@@ -60,13 +60,12 @@ ki_getrange(int ktd, krange_t *kr)
 	struct kio *kio;          // KTLI compliant req and resp
 	struct kiovec *kiov;      // shortcut var to reduce line lengths
 	struct ktli_config *cf;   // connection configuration
-	uint8_t ppdu[KP_PLENGTH]; // packed PDU (protocol data unit)
-	kpdu_t pdu;		  // req PDU
+	int kts;                  // connection to send on
 	kpdu_t rpdu;              // response PDU
 	kmsghdr_t msg_hdr;        // header of a kinetic `Message`
 	kcmdhdr_t cmd_hdr;        // header of a kinetic `Command`
 	ksession_t *ses;          // reference to the kinetic session
-	struct kresult_message kmreq, kmresp;
+	struct kresult_message kmresp;
 
 	#if LOGLEVEL >= LOGLEVEL_DEBUG
 	clock_t clock_rangestart = clock();
@@ -119,9 +118,7 @@ ki_getrange(int ktd, krange_t *kr)
 	 * bytes don't actually get finalized until a ktli_send is initiated.
 	 * So for now the HMAC key is hung onto the kmh_hmac field. It will
 	 * used later on to calculate the actual HMAC which will then be hung
-	 * of the kmh_hmac field. A reference is made to the kcfg_hkey ptr
-	 * in the kmreq. This reference needs to be removed before freeing
-	 * kmreq. See below at rex2:
+	 * of the kmh_hmac field.
 	 */
 	memset((void *) &msg_hdr, 0, sizeof(msg_hdr));
 	msg_hdr.kmh_atype = KAT_HMAC;
@@ -132,17 +129,17 @@ ki_getrange(int ktd, krange_t *kr)
 	memcpy((void *) &cmd_hdr, (void *) &ses->ks_ch, sizeof(cmd_hdr));
 	cmd_hdr.kch_type = KMT_GETRANGE;
 
+	/* Pick the connection to send on, it sets the connection ID */
+	kts = ki_conn(ktd, ses, NULL, &cmd_hdr);
+
+	/* Reserve the seq and HMAC slots for in place stamping */
+	ki_seqslot_reserve(cf, &msg_hdr, &cmd_hdr);
+
 	/* sequence number gets set during the send */
-	
-	kmreq = create_rangekey_message(&msg_hdr, &cmd_hdr, kr);
-	if (kmreq.result_code == FAILURE) {
-		debug_printf("range: request message create");
-		krc = K_EINTERNAL;
-		goto rex_kio;
-	}
 
 	/* Setup the KIO */
 	kio->kio_cmd 	= KMT_GETRANGE;
+	kio->kio_pri 	= ki_sendpri(cmd_hdr.kch_pri);
 	kio->kio_flags	= KIOF_INIT;
 	KIOF_SET(kio, KIOF_REQRESP);		/* Normal RPC */
 
@@ -157,57 +154,36 @@ ki_getrange(int ktd, krange_t *kr)
 	if (!kio->kio_sendmsg.km_msg) {
 		debug_printf("range: sendmesg alloc");
 		krc = K_ENOMEM;
-		goto rex_req;
+		goto rex_kio;
 	}
 
-	// hang the Packed PDU buffer, packing occurs later
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_base = (void *) &ppdu;
-	kio->kio_sendmsg.km_msg[KIOV_PDU].kiov_len  = KP_PLENGTH;
-
 	#if LOGLEVEL >= LOGLEVEL_DEBUG
 	clock_t clock_reqstart = clock();
 	#endif
 
-	#if LOGLEVEL >= LOGLEVEL_DEBUG
-	clock_t clock_reqend = clock();
-	#endif
-
-	// pack the message and hang it on the kio
-	// PAK: Error handling
-	// success: rc = 0; failure: rc = 1 (see enum kresult_code)
-	enum kresult_code pack_result = pack_kinetic_message(
-		(kproto_msg_t *) kmreq.result_message,
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base),
-		&(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len)
-	);
-
-	if (pack_result == FAILURE) {
-		debug_printf("range: sendmesg msg pack");
+	/*
+	 * Encode the PDU and message into one buffer hung on the
+	 * PDU and msg vectors, recording any reserved slots.
+	 */
+	if (ki_encode_range(cf, kio, &msg_hdr, &cmd_hdr, kr) < 0) {
+		debug_printf("range: request encode");
 		krc = K_EINTERNAL;
-		goto rex_sendmsg;
+		goto rex_kmmsg;
 	}
 
 	#if LOGLEVEL >= LOGLEVEL_DEBUG
-	clock_t clock_packend = clock();
+	clock_t clock_reqend = clock();
 	#endif
 
-	// now that the message length is known, setup the PDU
-	/* Now that the message length is known, setup the PDU */
-	pdu.kp_magic  = KP_MAGIC;
-	pdu.kp_msglen = kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len;
-	pdu.kp_vallen = 0;
-
-	PACK_PDU(&pdu, ppdu);
-	
-	debug_printf("ki_range: PDU(x%2x, %d, %d)\n",
-	       pdu.kp_magic, pdu.kp_msglen, pdu.kp_vallen);
+	debug_printf("ki_range: PDU(x%2x, %lu, 0)\n",
+	       KP_MAGIC, kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_len);
 
 	#if LOGLEVEL >= LOGLEVEL_DEBUG
 	clock_t clock_send = clock();
 	#endif
 
 	/* Send the request */
-	ktli_send(ktd, kio);
+	ktli_send(kts, kio);
 	debug_printf("Sent Kio: %p\n", kio);
 
 	// Wait for the response
@@ -270,7 +246,7 @@ ki_getrange(int ktd, krange_t *kr)
 	}
 
 	/* Now unpack the message */
-	kmresp = unpack_kinetic_message(kiov->kiov_base, kiov->kiov_len);
+	kmresp = unpack_response_message(kio);
 	if (kmresp.result_code == FAILURE) {
 		debug_printf("range: msg unpack");
 		krc = K_EINTERNAL;
@@ -289,28 +265,16 @@ ki_getrange(int ktd, krange_t *kr)
 
 	/* clean up */
  rex_resp:
-	destroy_message(kmresp.result_message);
+	destroy_response_message(kio, kmresp.result_message);
 
  rex_recvmsg:
-	KI_FREE(kio->kio_recvmsg.km_msg[KIOV_PDU].kiov_base);
-	KI_FREE(kio->kio_recvmsg.km_msg[KIOV_MSG].kiov_base);
-	KI_FREE(kio->kio_recvmsg.km_msg);
+	ktli_recvmsg_free(kio, 0);
 
  rex_sendmsg:
-	KI_FREE(kio->kio_sendmsg.km_msg[KIOV_MSG].kiov_base);
-	KI_FREE(kio->kio_sendmsg.km_msg);
-
- rex_req:
-	/*
-	 * Tad bit hacky. Need to remove a reference to kcfg_hkey that
-	 * was made in kmreq before freeingcalling destroy.
-	 * See 'Setup msg_hdr' comment above for details.
-	 */
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.data = NULL;
-	((kproto_msg_t *) kmreq.result_message)->hmacauth->hmac.len  = 0;
-
-	destroy_message(kmreq.result_message);
+	ki_encode_free(kio->kio_sendmsg.km_msg);
 
+ rex_kmmsg:
+	KI_FREE(kio->kio_sendmsg.km_msg);
 
  rex_kio:
 	KI_FREE(kio);
@@ -331,8 +295,7 @@ ki_getrange(int ktd, krange_t *kr)
 	debug_printf("Times for ki_range:\n");
 	debug_printf("\tTotal           : %lu\n", clock_extract - clock_rangestart);
 	debug_printf("\tValidation      : %lu\n", clock_validateend - clock_validatestart);
-	debug_printf("\tCreate request  : %lu\n", clock_reqend - clock_reqstart);
-	debug_printf("\tPack request    : %lu\n", clock_packend - clock_reqend);
+	debug_printf("\tEncode request  : %lu\n", clock_reqend - clock_reqstart);
 	debug_printf("\tKTLI (send/recv): %lu\n", clock_recv - clock_send);
 	debug_printf("\tUnpack response : %lu\n", clock_unpack - clock_recv);
 	debug_printf("\tExtract response: %lu\n", clock_extract - clock_unpack);
@@ -21,8 +21,26 @@
  * Session details user does not need to see
  */
 
+#include <pthread.h>
 #include "protocol_types.h"
 
+/* Completion callback thread pool, see ki_aio_callback */
+typedef struct kcbpool {
+	int		 kcp_ktd;
+	kaio_cb_t	 kcp_cb;	// Caller's completion callback
+	int		 kcp_stop;	// Set to retire the threads
+	int		 kcp_nthr;
+	pthread_t	 kcp_tid[];
+} kcbpool_t;
+
+/* Connections of a session, see ki_open_conns */
+#define KI_MAXCONN	16
+
+typedef struct kconn {
+	int		 kc_ktd;	// KTLI session of the connection
+	int64_t		 kc_connid;	// Its server connection ID
+} kconn_t;
+
 typedef struct ksession {
 	kbid_t           ks_bid;	// Next Session Batch ID
 	uint32_t         ks_bats;	// Active Batches
@@ -30,6 +48,9 @@ typedef struct ksession {
 	kconfiguration_t ks_conf;
 	kcmdhdr_t        ks_ch;		// Preserved cmdhdr limits
 	kstats_t	 ks_stats;	// Session stats
+	kcbpool_t	*ks_cbp;	// Completion threads, NULL if none
+	int		 ks_nconn;	// Connections, ks_conn[0] is the ktd
+	kconn_t		 ks_conn[KI_MAXCONN];
 } ksession_t;
 
 #endif // _SESSION_H
@@ -41,9 +41,10 @@ int s_stat_updatekop(kopstat_t *kop);
 kstatus_t
 ki_getstats(int ktd, kstats_t *kst)
 {
-	int rc;
+	int rc, i, rdn, wrn;
 	ksession_t *ses;		/* KTLI Session info */
 	struct ktli_config *cf;		/* KTLI configuration info */
+	struct ktli_crstats cs;		/* KTLI admission counters */
 
 	if (!kst) {
 		debug_printf("stat: bad param");
@@ -59,6 +60,36 @@ ki_getstats(int ktd, kstats_t *kst)
 	ses = (ksession_t *) cf->kcfg_pconf;
 	*kst = ses->ks_stats;
 
+	/* Admission control counters live in KTLI, one set per connection */
+	kst->kst_crwaits = kst->kst_crrejects = 0;
+	kst->kst_crwaitus = kst->kst_crwaitmax = 0;
+	kst->kst_rdwin = kst->kst_wrwin = 0;
+	kst->kst_rdrtt = kst->kst_wrrtt = 0;
+	for (i = 0, rdn = 0, wrn = 0; i < ses->ks_nconn; i++) {
+		if (ktli_crstats(ses->ks_conn[i].kc_ktd, &cs) < 0)
+			continue;
+		kst->kst_crwaits   += cs.kcs_waits;
+		kst->kst_crrejects += cs.kcs_rejects;
+		kst->kst_crwaitus  += cs.kcs_waitus;
+		if (cs.kcs_waitmax > kst->kst_crwaitmax)
+			kst->kst_crwaitmax = cs.kcs_waitmax;
+
+		kst->kst_rdwin += cs.kcs_win[KTLI_CR_READ];
+		kst->kst_wrwin += cs.kcs_win[KTLI_CR_WRITE];
+		if (cs.kcs_rtt[KTLI_CR_READ]) {
+			kst->kst_rdrtt += cs.kcs_rtt[KTLI_CR_READ];
+			rdn++;
+		}
+		if (cs.kcs_rtt[KTLI_CR_WRITE]) {
+			kst->kst_wrrtt += cs.kcs_rtt[KTLI_CR_WRITE];
+			wrn++;
+		}
+	}
+	if (rdn)
+		kst->kst_rdrtt /= rdn;
+	if (wrn)
+		kst->kst_wrrtt /= wrn;
+
 	/* Finish the Sample Var and Stddev calculations */
 	s_stat_updatekop(&kst->kst_puts);
 	s_stat_updatekop(&kst->kst_gets);
@@ -0,0 +1,475 @@
+/**
+ * Copyright 2020-2021 Seagate Technology LLC.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License, v. 2.0. If a copy of the MPL was not
+ * distributed with this file, You can obtain one at
+ * https://mozilla.org/MP:/2.0/.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but is provided AS-IS, WITHOUT ANY WARRANTY; including without
+ * the implied warranty of MERCHANTABILITY, NON-INFRINGEMENT or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the Mozilla Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Request encoder wire test.
+ *
+ * Builds each request type both ways, through create_*_message(),
+ * pack_kinetic_message() and PACK_PDU as the library used to, and through
+ * the direct ki_encode_*() encoders, and checks the PDU and message bytes
+ * match. Sessions with reserved sequence slots are checked the same way,
+ * along with where the encoder recorded the slots against
+ * ki_seqslot_locate() on the reference bytes. No server is needed.
+ *
+ * Usage: test_wire
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "kio.h"
+#include "ktli.h"
+#include "kinetic.h"
+#include "kinetic_internal.h"
+#include "protocol_interface.h"
+
+/* The reference builders, internal to their op files */
+extern struct kresult_message
+create_getkey_message(kmsghdr_t *, kcmdhdr_t *, kv_t *);
+extern struct kresult_message
+create_put_message(kmsghdr_t *, kcmdhdr_t *, kv_t *, int);
+extern struct kresult_message
+create_delkey_message(kmsghdr_t *, kcmdhdr_t *, kv_t *, int);
+extern struct kresult_message
+create_rangekey_message(kmsghdr_t *, kcmdhdr_t *, krange_t *);
+extern struct kresult_message
+create_getlog_message(kmsghdr_t *, kcmdhdr_t *, kgetlog_t *);
+extern struct kresult_message
+create_batch_message(kmsghdr_t *, kcmdhdr_t *, uint32_t);
+extern struct kresult_message
+create_noop_message(kmsghdr_t *, kcmdhdr_t *);
+extern struct kresult_message
+create_flush_message(kmsghdr_t *, kcmdhdr_t *);
+extern struct kresult_message
+create_exec_message(kmsghdr_t *, kcmdhdr_t *, kapplet_t *);
+
+/* One request, the members its type uses are set */
+struct tw_case {
+	const char	*tc_name;
+	kmtype_t	 tc_type;
+	kv_t		*tc_kv;
+	int		 tc_force;
+	krange_t	*tc_kr;
+	kgetlog_t	*tc_glog;
+	uint32_t	 tc_ops;
+	kapplet_t	*tc_app;
+};
+
+static int tw_run, tw_failed;
+
+static struct kresult_message
+tw_create(kmsghdr_t *mh, kcmdhdr_t *ch, struct tw_case *tc)
+{
+	switch (tc->tc_type) {
+	case KMT_GET:
+	case KMT_GETVERS:
+	case KMT_GETNEXT:
+	case KMT_GETPREV:
+		return(create_getkey_message(mh, ch, tc->tc_kv));
+	case KMT_PUT:
+		return(create_put_message(mh, ch, tc->tc_kv, tc->tc_force));
+	case KMT_DEL:
+		return(create_delkey_message(mh, ch, tc->tc_kv, tc->tc_force));
+	case KMT_GETRANGE:
+		return(create_rangekey_message(mh, ch, tc->tc_kr));
+	case KMT_GETLOG:
+		return(create_getlog_message(mh, ch, tc->tc_glog));
+	case KMT_STARTBAT:
+	case KMT_ENDBAT:
+	case KMT_ABORTBAT:
+		return(create_batch_message(mh, ch, tc->tc_ops));
+	case KMT_NOOP:
+		return(create_noop_message(mh, ch));
+	case KMT_FLUSH:
+		return(create_flush_message(mh, ch));
+	case KMT_APPLET:
+		return(create_exec_message(mh, ch, tc->tc_app));
+	default:
+		return((struct kresult_message) { .result_code = FAILURE });
+	}
+}
+
+/* Builds the applet body as exec.c does, by way of the reference */
+static int
+tw_encode_applet(struct ktli_config *cf, struct kio *kio,
+		 kmsghdr_t *mh, kcmdhdr_t *ch, kapplet_t *app)
+{
+	struct kresult_message km;
+	kproto_msg_t *msg;
+	kproto_cmd_t *cmd;
+	int rc = -1;
+
+	/*
+	 * exec.c's body builder is static, so the body is taken back out
+	 * of a reference command instead.
+	 */
+	km = create_exec_message(mh, ch, app);
+	if (km.result_code == FAILURE)
+		return(-1);
+	msg = (kproto_msg_t *)km.result_message;
+
+	cmd = com__seagate__kinetic__proto__command__unpack(NULL,
+		msg->commandbytes.len, msg->commandbytes.data);
+	if (cmd && cmd->body && cmd->body->manageapplet)
+		rc = ki_encode_applet(cf, kio, mh, ch,
+				      cmd->body->manageapplet);
+	if (cmd)
+		com__seagate__kinetic__proto__command__free_unpacked(cmd, NULL);
+
+	if (msg->hmacauth)
+		msg->hmacauth->hmac.data = NULL;
+	if (msg->pinauth)
+		msg->pinauth->pin.data = NULL;
+	destroy_message(msg);
+	return(rc);
+}
+
+static int
+tw_encode(struct ktli_config *cf, struct kio *kio,
+	  kmsghdr_t *mh, kcmdhdr_t *ch, struct tw_case *tc)
+{
+	switch (tc->tc_type) {
+	case KMT_GET:
+	case KMT_GETVERS:
+	case KMT_GETNEXT:
+	case KMT_GETPREV:
+	case KMT_PUT:
+	case KMT_DEL:
+		return(ki_encode_kv(cf, kio, mh, ch, tc->tc_kv, tc->tc_force));
+	case KMT_GETRANGE:
+		return(ki_encode_range(cf, kio, mh, ch, tc->tc_kr));
+	case KMT_GETLOG:
+		return(ki_encode_getlog(cf, kio, mh, ch, tc->tc_glog));
+	case KMT_STARTBAT:
+	case KMT_ENDBAT:
+	case KMT_ABORTBAT:
+		return(ki_encode_batch(cf, kio, mh, ch, tc->tc_ops));
+	case KMT_NOOP:
+	case KMT_FLUSH:
+		return(ki_encode_empty(cf, kio, mh, ch));
+	case KMT_APPLET:
+		return(tw_encode_applet(cf, kio, mh, ch, tc->tc_app));
+	default:
+		return(-1);
+	}
+}
+
+/* Hangs the PDU and msg vectors, plus any PUT value vectors */
+static int
+tw_sendmsg(struct kio *kio, struct tw_case *tc)
+{
+	size_t i, valcnt = 0;
+
+	switch (tc->tc_type) {
+	case KMT_PUT:
+		if (tc->tc_kv->kv_val)
+			valcnt = tc->tc_kv->kv_valcnt;
+		break;
+	default:
+		break;
+	}
+
+	memset(kio, 0, sizeof(*kio));
+	kio->kio_sendmsg.km_cnt = KM_CNT_NOVAL + valcnt;
+	kio->kio_sendmsg.km_msg = (struct kiovec *)
+		calloc(kio->kio_sendmsg.km_cnt, sizeof(struct kiovec));
+	if (!kio->kio_sendmsg.km_msg)
+		return(-1);
+
+	for (i = 0; i < valcnt; i++)
+		kio->kio_sendmsg.km_msg[KIOV_VAL + i] = tc->tc_kv->kv_val[i];
+	return(0);
+}
+
+static void
+tw_fail(struct ktli_config *cf, kmsghdr_t *mh, kcmdhdr_t *ch,
+	struct tw_case *tc, const char *why)
+{
+	printf("FAIL %-20s %s%s%s\n", tc->tc_name,
+	       mh->kmh_pin ? "pin " : "",
+	       (cf->kcfg_flags & KCFF_SEQSLOT) ? "seqslot " : "", why);
+	tw_failed++;
+}
+
+static void
+tw_check(struct ktli_config *cf, kmsghdr_t *msg_hdr, kcmdhdr_t *cmd_hdr,
+	 struct tw_case *tc)
+{
+	struct kresult_message km;
+	struct kio rk, ek;
+	struct kiovec *r, *e;
+	uint8_t ppdu[KP_PLENGTH];
+	kproto_msg_t *msg;
+	kmsghdr_t mh;
+	kcmdhdr_t ch;
+	kpdu_t pdu;
+	size_t i;
+
+	tw_run++;
+
+	mh = *msg_hdr;
+	ch = *cmd_hdr;
+	ch.kch_type = tc->tc_type;
+	ki_seqslot_reserve(cf, &mh, &ch);
+
+	/* The reference, as the ops built requests before */
+	if (tw_sendmsg(&rk, tc) < 0) {
+		tw_fail(cf, &mh, &ch, tc, "alloc");
+		return;
+	}
+	r = rk.kio_sendmsg.km_msg;
+
+	km = tw_create(&mh, &ch, tc);
+	if (km.result_code == FAILURE) {
+		tw_fail(cf, &mh, &ch, tc, "create");
+		free(r);
+		return;
+	}
+	msg = (kproto_msg_t *)km.result_message;
+
+	if (pack_kinetic_message(msg, &r[KIOV_MSG].kiov_base,
+				 &r[KIOV_MSG].kiov_len) == FAILURE) {
+		tw_fail(cf, &mh, &ch, tc, "pack");
+		goto tw_msg;
+	}
+
+	pdu.kp_magic  = KP_MAGIC;
+	pdu.kp_msglen = r[KIOV_MSG].kiov_len;
+	pdu.kp_vallen = 0;
+	for (i = KIOV_VAL; i < rk.kio_sendmsg.km_cnt; i++)
+		pdu.kp_vallen += r[i].kiov_len;
+	PACK_PDU(&pdu, ppdu);
+	r[KIOV_PDU].kiov_base = ppdu;
+	r[KIOV_PDU].kiov_len  = KP_PLENGTH;
+
+	if (ki_seqslot_locate(cf, &rk) < 0) {
+		tw_fail(cf, &mh, &ch, tc, "locate");
+		goto tw_packed;
+	}
+
+	/* The direct encoding */
+	if (tw_sendmsg(&ek, tc) < 0) {
+		tw_fail(cf, &mh, &ch, tc, "alloc");
+		goto tw_packed;
+	}
+	e = ek.kio_sendmsg.km_msg;
+
+	if (tw_encode(cf, &ek, &mh, &ch, tc) < 0) {
+		tw_fail(cf, &mh, &ch, tc, "encode");
+		goto tw_enc;
+	}
+
+	if ((e[KIOV_PDU].kiov_len != KP_PLENGTH) ||
+	    memcmp(e[KIOV_PDU].kiov_base, ppdu, KP_PLENGTH))
+		tw_fail(cf, &mh, &ch, tc, "PDU differs");
+	else if ((e[KIOV_MSG].kiov_len != r[KIOV_MSG].kiov_len) ||
+		 memcmp(e[KIOV_MSG].kiov_base, r[KIOV_MSG].kiov_base,
+			r[KIOV_MSG].kiov_len))
+		tw_fail(cf, &mh, &ch, tc, "message differs");
+	else if ((ek.kio_flags & KIOF_SEQSLOT) !=
+		 (rk.kio_flags & KIOF_SEQSLOT))
+		tw_fail(cf, &mh, &ch, tc, "seqslot flag differs");
+	else if ((rk.kio_flags & KIOF_SEQSLOT) &&
+		 ((ek.kio_ss.kss_seqoff  != rk.kio_ss.kss_seqoff)  ||
+		  (ek.kio_ss.kss_cmdoff  != rk.kio_ss.kss_cmdoff)  ||
+		  (ek.kio_ss.kss_cmdlen  != rk.kio_ss.kss_cmdlen)  ||
+		  (ek.kio_ss.kss_hmacoff != rk.kio_ss.kss_hmacoff)))
+		tw_fail(cf, &mh, &ch, tc, "seqslot offsets differ");
+
+	ki_encode_free(e);
+
+ tw_enc:
+	free(e);
+
+ tw_packed:
+	KI_FREE(r[KIOV_MSG].kiov_base);
+
+ tw_msg:
+	/* The auth data is ours, not the message's */
+	if (msg->hmacauth)
+		msg->hmacauth->hmac.data = NULL;
+	if (msg->pinauth)
+		msg->pinauth->pin.data = NULL;
+	destroy_message(msg);
+	free(r);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char key1[] = "wire", key2[] = "-test-key", val[] = "value!";
+	static char ver[] = "v1", newver[] = "v2", tag[] = "tagtagtag";
+	static char fnkey[] = "applet.so", outkey[] = "applet.out";
+	static char *args[] = { "applet", "-x" };
+	struct kiovec key[2] = {
+		{ .kiov_base = key1, .kiov_len = sizeof(key1) - 1 },
+		{ .kiov_base = key2, .kiov_len = sizeof(key2) - 1 },
+	};
+	struct kiovec vals[2] = {
+		{ .kiov_base = val, .kiov_len = sizeof(val) - 1 },
+		{ .kiov_base = val, .kiov_len = 3 },
+	};
+	struct kiovec fnk = { .kiov_base = fnkey, .kiov_len = sizeof(fnkey) - 1 };
+	struct kiovec ok  = { .kiov_base = outkey, .kiov_len = sizeof(outkey) - 1 };
+	kgltype_t gltypes[] = { KGLT_UTILIZATIONS, KGLT_CAPACITIES, KGLT_LIMITS };
+	kv_t kv, kvv, kvd, fnkv, outkv, *fnkvp = &fnkv;
+	krange_t kr, krk;
+	kgetlog_t gl, gld;
+	kapplet_t app;
+	struct ktli_config cf;
+	kmsghdr_t mh;
+	kcmdhdr_t ch;
+	size_t i, j, k;
+
+	/* A plain key, then one with versions, tag and a value */
+	memset(&kv, 0, sizeof(kv));
+	kv.kv_key     = key;
+	kv.kv_keycnt  = 2;
+
+	memset(&kvv, 0, sizeof(kvv));
+	kvv.kv_key       = key;
+	kvv.kv_keycnt    = 2;
+	kvv.kv_val       = vals;
+	kvv.kv_valcnt    = 2;
+	kvv.kv_ver       = ver;
+	kvv.kv_verlen    = sizeof(ver) - 1;
+	kvv.kv_newver    = newver;
+	kvv.kv_newverlen = sizeof(newver) - 1;
+	kvv.kv_disum     = tag;
+	kvv.kv_disumlen  = sizeof(tag) - 1;
+	kvv.kv_ditype    = KDI_SHA1;
+	kvv.kv_cpolicy   = KC_FLUSH;
+	kvv.kv_metaonly  = 1;
+
+	/* A key range delete, no key */
+	memset(&kvd, 0, sizeof(kvd));
+	kvd.kv_ver    = ver;
+	kvd.kv_verlen = sizeof(ver) - 1;
+
+	/* Unbounded, then a bounded reversed range */
+	memset(&kr, 0, sizeof(kr));
+	kr.kr_count = 200;
+
+	memset(&krk, 0, sizeof(krk));
+	krk.kr_start    = &key[0];
+	krk.kr_startcnt = 1;
+	krk.kr_end      = key;
+	krk.kr_endcnt   = 2;
+	krk.kr_count    = -1;
+	krk.kr_flags    = KRF_ISTART | KRF_IEND | KRF_REVERSE;
+
+	memset(&gl, 0, sizeof(gl));
+	gl.kgl_type    = gltypes;
+	gl.kgl_typecnt = 3;
+
+	memset(&gld, 0, sizeof(gld));
+	gld.kgl_type         = gltypes;
+	gld.kgl_typecnt      = 1;
+	gld.kgl_log.kdl_name = "com.example.log";
+
+	memset(&fnkv, 0, sizeof(fnkv));
+	fnkv.kv_key    = &fnk;
+	fnkv.kv_keycnt = 1;
+	memset(&outkv, 0, sizeof(outkv));
+	outkv.kv_key    = &ok;
+	outkv.kv_keycnt = 1;
+
+	memset(&app, 0, sizeof(app));
+	app.ka_fnkey    = &fnkvp;
+	app.ka_fnkeycnt = 1;
+	app.ka_fntype   = KF_NATIVE;
+	app.ka_argv     = args;
+	app.ka_argc     = 2;
+	app.ka_outkey   = &outkv;
+
+	struct tw_case cases[] = {
+		{ "get",		KMT_GET,	.tc_kv = &kv },
+		{ "get metaonly",	KMT_GET,	.tc_kv = &kvv },
+		{ "getvers",		KMT_GETVERS,	.tc_kv = &kv },
+		{ "getnext",		KMT_GETNEXT,	.tc_kv = &kv },
+		{ "getprev",		KMT_GETPREV,	.tc_kv = &kv },
+		{ "put",		KMT_PUT,	.tc_kv = &kv },
+		{ "put versions",	KMT_PUT,	.tc_kv = &kvv },
+		{ "put force",		KMT_PUT,	.tc_kv = &kvv,
+		  .tc_force = 1 },
+		{ "del",		KMT_DEL,	.tc_kv = &kv },
+		{ "del force",		KMT_DEL,	.tc_kv = &kvv,
+		  .tc_force = 1 },
+		{ "del nokey",		KMT_DEL,	.tc_kv = &kvd },
+		{ "range",		KMT_GETRANGE,	.tc_kr = &kr },
+		{ "range keys",		KMT_GETRANGE,	.tc_kr = &krk },
+		{ "getlog",		KMT_GETLOG,	.tc_glog = &gl },
+		{ "getlog device",	KMT_GETLOG,	.tc_glog = &gld },
+		{ "startbat",		KMT_STARTBAT,	.tc_ops = 0 },
+		{ "endbat",		KMT_ENDBAT,	.tc_ops = 300 },
+		{ "abortbat",		KMT_ABORTBAT,	.tc_ops = 7 },
+		{ "noop",		KMT_NOOP },
+		{ "flush",		KMT_FLUSH },
+		{ "applet",		KMT_APPLET,	.tc_app = &app },
+	};
+
+	/* Plain headers, then one with every optional field set */
+	kcmdhdr_t hdrs[2];
+
+	memset(&hdrs[0], 0, sizeof(kcmdhdr_t));
+	hdrs[0].kch_clustvers = 0;
+	hdrs[0].kch_connid    = 1234567;
+	hdrs[0].kch_seq       = 42;
+
+	memset(&hdrs[1], 0, sizeof(kcmdhdr_t));
+	hdrs[1].kch_clustvers = -1;
+	hdrs[1].kch_connid    = 0x7fffffffffffLL;
+	hdrs[1].kch_seq       = 1ULL << 40;
+	hdrs[1].kch_timeout   = 5000;
+	hdrs[1].kch_pri       = HIGHEST;
+	hdrs[1].kch_quanta    = 10;
+	hdrs[1].kch_bid       = 99;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.kcfg_hkey = "asdfasdf";
+
+	for (i = 0; i < sizeof(hdrs) / sizeof(hdrs[0]); i++) {
+		for (j = 0; j < sizeof(cases) / sizeof(cases[0]); j++) {
+			/* HMAC, with and without reserved slots */
+			memset(&mh, 0, sizeof(mh));
+			mh.kmh_atype = KAT_HMAC;
+			mh.kmh_id    = 1;
+			mh.kmh_hmac  = cf.kcfg_hkey;
+
+			for (k = 0; k < 2; k++) {
+				cf.kcfg_flags = (k ? KCFF_SEQSLOT : 0);
+				ch = hdrs[i];
+				tw_check(&cf, &mh, &ch, &cases[j]);
+			}
+
+			/* PIN */
+			memset(&mh, 0, sizeof(mh));
+			mh.kmh_atype  = KAT_PIN;
+			mh.kmh_pin    = "1234";
+			mh.kmh_pinlen = 4;
+
+			cf.kcfg_flags = 0;
+			ch = hdrs[i];
+			tw_check(&cf, &mh, &ch, &cases[j]);
+		}
+	}
+
+	printf("%d of %d requests encoded identically\n",
+	       tw_run - tw_failed, tw_run);
+	return(tw_failed ? 1 : 0);
+}
@@ -133,6 +133,12 @@ ki_validate_kv(kv_t *kv, int verck, int valck, klimits_t *lim)
 		}
 	}
 
+	/* check the priority, 0 is the session's */
+	if (kv->kv_pri &&
+	    (((int)kv->kv_pri < LOWEST) || ((int)kv->kv_pri > HIGHEST))) {
+		return (-1);
+	}
+
 	return (0);
 }
 